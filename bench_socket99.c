@@ -0,0 +1,3046 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "socket99.h"
+
+/* Benchmarks for socket99. Each run prints one line per measurement,
+ * as space-separated key=value pairs, so results can be collected and
+ * compared between releases with ordinary text tools. All servers bind
+ * to an ephemeral port on 127.0.0.1. */
+
+typedef bool (bench_fun)(int argc, char **argv);
+
+#define MAX_NAME 40
+typedef struct {
+    bench_fun *fun;
+    char name[MAX_NAME];
+    char *descr;
+} bench_case_info;
+
+bool accept_group(int argc, char **argv);
+bool open_syscalls(int argc, char **argv);
+bool resolve_cached(int argc, char **argv);
+bool pool_checkout(int argc, char **argv);
+bool loop_events(int argc, char **argv);
+bool io_rpc(int argc, char **argv);
+bool udp_batch(int argc, char **argv);
+bool zerocopy_send(int argc, char **argv);
+bool relay(int argc, char **argv);
+bool profiles(int argc, char **argv);
+bool fastopen(int argc, char **argv);
+bool busy_poll(int argc, char **argv);
+bool accept_burst(int argc, char **argv);
+bool open_latency(int argc, char **argv);
+bool connect_accept(int argc, char **argv);
+bool rtt(int argc, char **argv);
+bool throughput(int argc, char **argv);
+bool bufpool(int argc, char **argv);
+bool framer(int argc, char **argv);
+bool outq(int argc, char **argv);
+bool server(int argc, char **argv);
+bool open_many(int argc, char **argv);
+bool shm(int argc, char **argv);
+
+#define F(X) X, #X
+static bench_case_info info[] = {
+    { F(accept_group),
+      "[THREADS] [CONNS]: accept rate, one shared listener vs. SO_REUSEPORT group" },
+    { F(open_syscalls),
+      ": system calls made by each kind of open (needs SOCKET99_COUNT_SYSCALLS)" },
+    { F(resolve_cached),
+      "[LOOKUPS] [HOST]: name lookup rate, getaddrinfo vs. caching resolver" },
+    { F(pool_checkout),
+      "[REQUESTS]: connection setup per request, new connections vs. pool" },
+    { F(loop_events),
+      "[IDLE] [ACTIVE] [SECS]: event loop throughput with idle and ping-pong connections" },
+    { F(io_rpc),
+      "[CONNS] [SECS] [MSG_SIZE]: echo RPC rate, epoll loop vs. I/O engine (io_uring and fallback)" },
+    { F(udp_batch),
+      "[MAX_BATCH] [SECS] [MSG_SIZE]: UDP packet rate by batch size, 1 to MAX_BATCH" },
+    { F(zerocopy_send),
+      "[CHUNK_KB] [SECS]: TCP send throughput, copied vs. MSG_ZEROCOPY" },
+    { F(relay),
+      "[SECS] [FILE_MB]: proxy and file send throughput, copying vs. splice/sendfile" },
+    { F(profiles),
+      "[SECS] [MSG_SIZE]: RPC latency and bulk throughput for each tuning profile" },
+    { F(fastopen),
+      "[CONNS]: one-request connection latency, connect then send vs. TCP Fast Open" },
+    { F(busy_poll),
+      "[SECS] [MSG_SIZE] [USEC]: UDP ping-pong latency, interrupt-driven vs. busy poll" },
+    { F(accept_burst),
+      "[CONNS] [MAX_BURST] [THREADS]: accept rate by burst size, 1 to MAX_BURST" },
+    { F(open_latency),
+      "[ITERS]: socket99_open latency for TCP, UDP, and Unix clients and servers" },
+    { F(connect_accept),
+      "[CONNS]: connect and accept rate and latency on one thread" },
+    { F(rtt),
+      "[SECS] [MSG_SIZE]: round trip latency over TCP, UDP, and Unix sockets" },
+    { F(throughput),
+      "[SECS] [CHUNK_KB]: bulk throughput over TCP and Unix sockets" },
+    { F(bufpool),
+      "[ROUNDS] [ACTIVE_PCT] [MSG_SIZE]: receive buffer footprint and alloc rate at 10k/100k conns" },
+    { F(framer),
+      "[SECS]: frame rate for small and mixed frames, memmove framer vs. ring framer" },
+    { F(outq),
+      "[SECS] [PIECES]: syscalls and segments per response, send per piece vs. coalesced" },
+    { F(server),
+      "[SECS] [MAX_WORKERS] [CONNS]: echo rate and latency for 1..MAX_WORKERS workers, shared vs. per-worker listeners" },
+    { F(open_many),
+      "[CONNS] [STUCK] [DEADLINE_MSEC]: time to open CONNS connections, one at a time vs. all at once" },
+    { F(shm),
+      "[ITERS] [SECS]: ping-pong latency and throughput, Unix stream socket vs. shared memory channel" },
+};
+#undef F
+
+#define BENCH_CASE_COUNT (sizeof(info) / sizeof(info[0]))
+
+static void usage(char *name) __attribute__ ((noreturn));
+
+static void usage(char *name) {
+    printf("Benchmarks for socket library.\n");
+    printf("Usage:\n    %s BENCH_NAME [ARGS...]\n", name);
+    printf("where BENCH_NAME is one of:\n");
+    for (size_t i = 0; i < BENCH_CASE_COUNT; i++) {
+        printf("'%s' %s\n", info[i].name, info[i].descr);
+    }
+    exit(1);
+}
+
+static bench_case_info *lookup(char *name) {
+    for (size_t i = 0; i < BENCH_CASE_COUNT; i++) {
+        if (0 == strncmp(name, info[i].name, MAX_NAME)) {
+            return &info[i];
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) { usage(argv[0]); }
+
+    bench_case_info *bc = lookup(argv[1]);
+    if (bc == NULL) { usage(argv[0]); }
+    return bc->fun(argc - 2, argv + 2) ? 0 : 1;
+}
+
+
+/* Helpers */
+
+static long arg_or(int argc, char **argv, int i, long def) {
+    if (i < argc) { return strtol(argv[i], NULL, 10); }
+    return def;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Allow as many open files as the hard limit permits. */
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        (void)setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static int local_port(int fd) {
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    if (getsockname(fd, (struct sockaddr *)&sin, &len) == -1) { return -1; }
+    return ntohs(sin.sin_port);
+}
+
+
+/* Accept rate: one shared listener vs. a SO_REUSEPORT group */
+
+typedef struct {
+    pthread_mutex_t lock;
+    long accepted;
+    long total;
+} accept_state;
+
+typedef struct {
+    accept_state *st;
+    int fd;
+    int port;
+    long conns;
+} accept_thread_info;
+
+static void *accept_loop(void *arg) {
+    accept_thread_info *ti = (accept_thread_info *)arg;
+    accept_state *st = ti->st;
+    struct pollfd pfd = { ti->fd, POLLIN, 0 };
+
+    for (;;) {
+        pthread_mutex_lock(&st->lock);
+        bool done = st->accepted >= st->total;
+        pthread_mutex_unlock(&st->lock);
+        if (done) { break; }
+
+        if (poll(&pfd, 1, 50 /* msec */) <= 0) { continue; }
+
+        long count = 0;
+        for (;;) {
+            int client_fd = accept(ti->fd, NULL, NULL);
+            if (client_fd == -1) { break; }
+            close(client_fd);
+            count++;
+        }
+
+        pthread_mutex_lock(&st->lock);
+        st->accepted += count;
+        pthread_mutex_unlock(&st->lock);
+    }
+    return NULL;
+}
+
+static void *connect_loop(void *arg) {
+    accept_thread_info *ti = (accept_thread_info *)arg;
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .port = ti->port,
+    };
+
+    for (long i = 0; i < ti->conns; i++) {
+        socket99_result res;
+        if (!socket99_open(&cfg, &res)) {
+            socket99_fprintf(stderr, &res);
+            continue;
+        }
+        /* Wait for the server to close first, so the TIME_WAIT
+         * state doesn't use up client ports. */
+        char c;
+        (void)recv(res.fd, &c, 1, 0);
+        close(res.fd);
+    }
+    return NULL;
+}
+
+static bool run_accept(const char *mode, socket99_result *res,
+        int listeners, int threads, long conns) {
+    accept_state st = { .accepted = 0, .total = conns };
+    pthread_mutex_init(&st.lock, NULL);
+
+    int port = local_port(res[0].fd);
+    accept_thread_info servers[threads];
+    accept_thread_info clients[threads];
+    pthread_t server_ids[threads];
+    pthread_t client_ids[threads];
+
+    for (int i = 0; i < threads; i++) {
+        servers[i] = (accept_thread_info){
+            .st = &st, .fd = res[i % listeners].fd,
+        };
+        clients[i] = (accept_thread_info){
+            .st = &st, .port = port,
+            .conns = conns / threads + (i < conns % threads ? 1 : 0),
+        };
+        pthread_create(&server_ids[i], NULL, accept_loop, &servers[i]);
+    }
+
+    double start = now_sec();
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&client_ids[i], NULL, connect_loop, &clients[i]);
+    }
+    for (int i = 0; i < threads; i++) { pthread_join(client_ids[i], NULL); }
+    double elapsed = now_sec() - start;
+
+    /* Wake any server threads still waiting on a connection. */
+    pthread_mutex_lock(&st.lock);
+    long accepted = st.accepted;
+    st.total = 0;
+    pthread_mutex_unlock(&st.lock);
+    for (int i = 0; i < threads; i++) { pthread_join(server_ids[i], NULL); }
+    pthread_mutex_destroy(&st.lock);
+
+    printf("bench=accept_group mode=%s threads=%d conns=%ld accepted=%ld"
+        " secs=%.3f conns_per_sec=%.0f\n",
+        mode, threads, conns, accepted, elapsed, accepted / elapsed);
+    return accepted == conns;
+}
+
+bool accept_group(int argc, char **argv) {
+    int threads = (int)arg_or(argc, argv, 0, 4);
+    long conns = arg_or(argc, argv, 1, 20000);
+    if (threads < 1 || conns < 1) { return false; }
+
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .server = true,
+        .nonblocking = true,
+    };
+
+    socket99_result shared;
+    if (!socket99_open(&cfg, &shared)) {
+        socket99_fprintf(stderr, &shared);
+        return false;
+    }
+    bool ok = run_accept("shared", &shared, 1, threads, conns);
+    close(shared.fd);
+
+    socket99_result group[threads];
+#ifdef __linux__
+    bool steer = true;
+#else
+    bool steer = false;
+#endif
+    if (!socket99_open_group(&cfg, group, threads, steer)) {
+        for (int i = 0; i < threads; i++) {
+            if (group[i].status != SOCKET99_OK) {
+                socket99_fprintf(stderr, &group[i]);
+                break;
+            }
+        }
+        return false;
+    }
+    ok = run_accept("group", group, threads, threads, conns) && ok;
+    for (int i = 0; i < threads; i++) { close(group[i].fd); }
+
+    return ok;
+}
+
+
+/* System calls per open */
+
+#define BENCH_PATH "bench_sock"
+
+static void report_syscalls(const char *variant, socket99_config *cfg) {
+    socket99_result res;
+    if (!socket99_open(cfg, &res)) {
+        socket99_fprintf(stderr, &res);
+        return;
+    }
+#ifdef SOCKET99_COUNT_SYSCALLS
+    printf("bench=open_syscalls variant=%s syscalls=%d\n",
+        variant, res.syscalls);
+#else
+    printf("bench=open_syscalls variant=%s syscalls=n/a\n", variant);
+#endif
+    close(res.fd);
+}
+
+bool open_syscalls(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    int v_true = 1;
+
+    socket99_config server_cfg = {
+        .host = "127.0.0.1",
+        .server = true,
+        .nonblocking = true,
+        .sockopts = {
+            {SO_REUSEADDR, &v_true, sizeof(v_true)},
+        },
+    };
+    socket99_result server;
+    if (!socket99_open(&server_cfg, &server)) {
+        socket99_fprintf(stderr, &server);
+        return false;
+    }
+    int port = local_port(server.fd);
+
+    struct {
+        const char *variant;
+        socket99_config cfg;
+    } variants[] = {
+        { "tcp_server", { .host = "127.0.0.1", .server = true } },
+        { "tcp_server_nonblocking_cloexec", { .host = "127.0.0.1",
+              .server = true, .nonblocking = true, .cloexec = true } },
+        { "tcp_server_reuseaddr", { .host = "127.0.0.1", .server = true,
+              .sockopts = { {SO_REUSEADDR, &v_true, sizeof(v_true)} } } },
+        { "tcp_client", { .host = "127.0.0.1", .port = port } },
+        { "tcp_client_nonblocking_cloexec", { .host = "127.0.0.1",
+              .port = port, .nonblocking = true, .cloexec = true } },
+        { "udp_server_nonblocking", { .host = "127.0.0.1", .server = true,
+              .datagram = true, .nonblocking = true } },
+        { "udp_client", { .host = "127.0.0.1", .port = port,
+              .datagram = true } },
+        { "unix_server_nonblocking_cloexec", { .path = BENCH_PATH,
+              .server = true, .nonblocking = true, .cloexec = true } },
+    };
+
+    for (size_t i = 0; i < sizeof(variants) / sizeof(variants[0]); i++) {
+        unlink(BENCH_PATH);
+        report_syscalls(variants[i].variant, &variants[i].cfg);
+    }
+    unlink(BENCH_PATH);
+
+    /* Reap the connections made by the client variants. */
+    int client_fd;
+    while ((client_fd = accept(server.fd, NULL, NULL)) != -1) {
+        close(client_fd);
+    }
+    close(server.fd);
+    return true;
+}
+
+
+/* Name lookups: getaddrinfo vs. the caching resolver */
+
+bool resolve_cached(int argc, char **argv) {
+    long lookups = arg_or(argc, argv, 0, 100000);
+    char *host = argc > 1 ? argv[1] : "localhost";
+    if (lookups < 1) { return false; }
+
+    socket99_config cfg = {
+        .host = host,
+        .port = 80,
+    };
+    struct addrinfo hints;
+    socket99_set_hints(&cfg, &hints);
+
+    double start = now_sec();
+    for (long i = 0; i < lookups; i++) {
+        struct addrinfo *res = NULL;
+        if (getaddrinfo(host, "80", &hints, &res) != 0) { return false; }
+        freeaddrinfo(res);
+    }
+    double elapsed = now_sec() - start;
+    printf("bench=resolve_cached mode=getaddrinfo host=%s lookups=%ld"
+        " secs=%.3f lookups_per_sec=%.0f\n",
+        host, lookups, elapsed, lookups / elapsed);
+
+    socket99_resolver *r = socket99_resolver_new(NULL);
+    if (r == NULL) { return false; }
+    start = now_sec();
+    for (long i = 0; i < lookups; i++) {
+        struct addrinfo *res = NULL;
+        if (socket99_resolver_getaddrinfo(r, host, "80", &hints, &res) != 0) {
+            socket99_resolver_free(r);
+            return false;
+        }
+        socket99_resolver_freeaddrinfo(r, res);
+    }
+    elapsed = now_sec() - start;
+
+    socket99_resolver_stats stats;
+    socket99_resolver_get_stats(r, &stats);
+    printf("bench=resolve_cached mode=resolver host=%s lookups=%ld"
+        " secs=%.3f lookups_per_sec=%.0f hits=%llu misses=%llu\n",
+        host, lookups, elapsed, lookups / elapsed,
+        (unsigned long long)stats.hits, (unsigned long long)stats.misses);
+    socket99_resolver_free(r);
+    return true;
+}
+
+
+/* Connection setup per request: a new connection each time vs. a pool */
+
+static bool run_checkout(const char *mode, socket99_pool *pool,
+        int listen_fd, long requests) {
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .port = local_port(listen_fd),
+    };
+
+    double start = now_sec();
+    for (long i = 0; i < requests; i++) {
+        socket99_result res;
+        bool ok = pool ? socket99_pool_checkout(pool, &cfg, &res)
+            : socket99_open(&cfg, &res);
+        if (!ok) {
+            socket99_fprintf(stderr, &res);
+            return false;
+        }
+
+        /* The server keeps connections open until the client closes
+         * them. Reused connections have nothing new to accept. */
+        int server_fd = accept(listen_fd, NULL, NULL);
+
+        if (pool) {
+            socket99_pool_checkin(pool, &cfg, res.fd);
+        } else {
+            close(res.fd);
+            if (server_fd != -1) { close(server_fd); }
+        }
+    }
+    double elapsed = now_sec() - start;
+
+    printf("bench=pool_checkout mode=%s requests=%ld secs=%.3f"
+        " usec_per_request=%.2f", mode, requests, elapsed,
+        1e6 * elapsed / requests);
+    if (pool) {
+        socket99_pool_stats stats;
+        socket99_pool_get_stats(pool, &stats);
+        printf(" hit_rate=%.3f checkout_usec=%.2f",
+            (double)stats.hits / stats.checkouts,
+            stats.checkout_nsec / 1e3 / stats.checkouts);
+    }
+    printf("\n");
+    return true;
+}
+
+bool pool_checkout(int argc, char **argv) {
+    long requests = arg_or(argc, argv, 0, 2000);
+    if (requests < 1) { return false; }
+
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .server = true,
+        .nonblocking = true,
+    };
+    socket99_result server;
+    if (!socket99_open(&cfg, &server)) {
+        socket99_fprintf(stderr, &server);
+        return false;
+    }
+
+    bool ok = run_checkout("open", NULL, server.fd, requests);
+
+    socket99_pool *pool = socket99_pool_new(NULL);
+    ok = ok && pool != NULL
+        && run_checkout("pool", pool, server.fd, requests);
+    socket99_pool_free(pool);
+
+    /* Exiting closes the server's side of every connection. */
+    close(server.fd);
+    return ok;
+}
+
+
+/* Event loop throughput: many idle connections, some active ones */
+
+static long loop_reads;
+
+static void loop_bench_read(socket99_loop *loop, int fd, const char *buf,
+        size_t len, void *udata) {
+    (void)loop;
+    (void)udata;
+    loop_reads++;
+    /* Both ends echo, so each active pair ping-pongs forever. */
+    (void)send(fd, buf, len, 0);
+}
+
+bool loop_events(int argc, char **argv) {
+    long idle = arg_or(argc, argv, 0, 1000);
+    long active = arg_or(argc, argv, 1, 100);
+    double secs = (double)arg_or(argc, argv, 2, 2);
+    if (idle < 0 || active < 1 || secs <= 0) { return false; }
+    raise_fd_limit();
+
+    socket99_loop_callbacks cbs = {
+        .on_read = loop_bench_read,
+    };
+    socket99_loop *loop = socket99_loop_new(&cbs, 4096);
+    if (loop == NULL) {
+        fprintf(stderr, "socket99_loop_new: %s\n", strerror(errno));
+        return false;
+    }
+
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .server = true,
+    };
+    socket99_result server;
+    if (!socket99_loop_listen(loop, &cfg, &server, NULL)) {
+        socket99_fprintf(stderr, &server);
+        socket99_loop_free(loop);
+        return false;
+    }
+
+    socket99_config client_cfg = {
+        .host = "127.0.0.1",
+        .port = local_port(server.fd),
+    };
+
+    /* Both ends of every connection are in the loop. */
+    long conns = 0;
+    for (long i = 0; i < idle + active; i++) {
+        socket99_result res;
+        if (!socket99_open(&client_cfg, &res)) {
+            socket99_fprintf(stderr, &res);
+            break;
+        }
+        if (!socket99_loop_add(loop, res.fd, NULL)) {
+            close(res.fd);
+            break;
+        }
+        if (i >= idle) { (void)send(res.fd, "x", 1, 0); }
+        conns++;
+        if (i % 64 == 0) { socket99_loop_run_once(loop, 0); }
+    }
+    if (conns < idle + active) {
+        fprintf(stderr, "only opened %ld connections: %s\n",
+            conns, strerror(errno));
+    }
+
+    loop_reads = 0;
+    long events = 0;
+    double start = now_sec();
+    double elapsed = 0;
+    while (elapsed < secs) {
+        int count = socket99_loop_run_once(loop, 100);
+        if (count > 0) { events += count; }
+        elapsed = now_sec() - start;
+    }
+
+    printf("bench=loop_events idle=%ld active=%ld conns=%ld secs=%.3f"
+        " events_per_sec=%.0f reads_per_sec=%.0f\n",
+        idle, active, conns, elapsed, events / elapsed,
+        loop_reads / elapsed);
+
+    /* Exiting closes the remaining connections. */
+    socket99_loop_free(loop);
+    close(server.fd);
+    return conns == idle + active;
+}
+
+
+/* Small-message RPC rate: epoll loop vs. the I/O engine */
+
+typedef struct {
+    int port;
+    long conns;
+    double secs;
+    size_t msg_size;
+    long rpcs;
+    volatile bool done;
+} rpc_client_info;
+
+static bool recv_all(int fd, char *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t res = recv(fd, buf + got, len - got, 0);
+        if (res <= 0) { return false; }
+        got += (size_t)res;
+    }
+    return true;
+}
+
+/* Each connection has one request in flight at a time. */
+static void *rpc_client(void *arg) {
+    rpc_client_info *ci = (rpc_client_info *)arg;
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .port = ci->port,
+    };
+    int *fds = calloc((size_t)ci->conns, sizeof(int));
+    char *buf = calloc(1, ci->msg_size);
+    long opened = 0;
+    for (; fds && buf && opened < ci->conns; opened++) {
+        socket99_result res;
+        if (!socket99_open(&cfg, &res)) {
+            socket99_fprintf(stderr, &res);
+            break;
+        }
+        fds[opened] = res.fd;
+    }
+
+    double start = now_sec();
+    bool ok = opened == ci->conns;
+    while (ok && now_sec() - start < ci->secs) {
+        for (long i = 0; i < opened; i++) {
+            if (send(fds[i], buf, ci->msg_size, 0) == -1) { ok = false; }
+        }
+        for (long i = 0; ok && i < opened; i++) {
+            ok = recv_all(fds[i], buf, ci->msg_size);
+        }
+        if (ok) { ci->rpcs += opened; }
+    }
+    ci->secs = now_sec() - start;
+
+    for (long i = 0; i < opened; i++) { close(fds[i]); }
+    free(fds);
+    free(buf);
+    ci->done = true;
+    return NULL;
+}
+
+static void rpc_loop_read(socket99_loop *loop, int fd, const char *buf,
+        size_t len, void *udata) {
+    (void)loop;
+    (void)udata;
+    (void)send(fd, buf, len, 0);
+}
+
+static void serve_loop(int fd, rpc_client_info *ci) {
+    socket99_loop_callbacks cbs = {
+        .on_read = rpc_loop_read,
+    };
+    socket99_loop *loop = socket99_loop_new(&cbs, 4096);
+    if (loop == NULL) {
+        fprintf(stderr, "socket99_loop_new: %s\n", strerror(errno));
+        return;
+    }
+    /* Accept by hand, so every mode shares the same listener. The
+     * clients all connect before the first request. */
+    while (!ci->done) {
+        int client_fd;
+        while ((client_fd = accept(fd, NULL, NULL)) != -1) {
+            socket99_loop_add(loop, client_fd, NULL);
+        }
+        socket99_loop_run_once(loop, 10);
+    }
+    socket99_loop_free(loop);
+}
+
+/* Echo straight out of the engine's receive buffers. */
+static void serve_io(int fd, bool no_uring, rpc_client_info *ci,
+        const char **engine) {
+    socket99_io_config cfg = { .no_uring = no_uring };
+    socket99_io *io = socket99_io_new(&cfg);
+    if (io == NULL) {
+        fprintf(stderr, "socket99_io_new: %s\n", strerror(errno));
+        return;
+    }
+    *engine = socket99_io_uses_uring(io) ? "io_uring" : "io_epoll";
+    socket99_io_accept(io, fd, NULL);
+
+    socket99_io_completion done[64];
+    while (!ci->done) {
+        int count = socket99_io_reap(io, done, 64, 10);
+        for (int i = 0; i < count; i++) {
+            socket99_io_completion *c = &done[i];
+            if (c->op == SOCKET99_IO_ACCEPT && c->res >= 0) {
+                socket99_io_recv(io, c->res, NULL);
+            } else if (c->op == SOCKET99_IO_RECV && c->res > 0) {
+                socket99_io_send(io, c->fd, c->buf, (size_t)c->res,
+                    (void *)(intptr_t)c->buf_id);
+            } else if (c->op == SOCKET99_IO_RECV && !c->more) {
+                if (c->res == -ENOBUFS) {
+                    socket99_io_recv(io, c->fd, NULL);
+                } else {
+                    close(c->fd);
+                }
+            } else if (c->op == SOCKET99_IO_SEND) {
+                socket99_io_completion sent = *c;
+                sent.buf_id = (int)(intptr_t)c->udata;
+                socket99_io_release(io, &sent);
+            }
+        }
+    }
+    socket99_io_cancel(io, fd);
+    socket99_io_submit(io);
+    socket99_io_free(io);
+}
+
+static bool run_rpc(const char *mode, long conns, double secs,
+        size_t msg_size) {
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .server = true,
+        .nonblocking = true,
+    };
+    socket99_result server;
+    if (!socket99_open(&cfg, &server)) {
+        socket99_fprintf(stderr, &server);
+        return false;
+    }
+
+    rpc_client_info ci = {
+        .port = local_port(server.fd),
+        .conns = conns,
+        .secs = secs,
+        .msg_size = msg_size,
+    };
+    pthread_t client;
+    if (pthread_create(&client, NULL, rpc_client, &ci) != 0) {
+        close(server.fd);
+        return false;
+    }
+
+    const char *engine = mode;
+    if (0 == strcmp(mode, "epoll")) {
+        serve_loop(server.fd, &ci);
+    } else {
+        serve_io(server.fd, 0 == strcmp(mode, "io_epoll"), &ci, &engine);
+    }
+    /* If the server failed, its exit ends the client's recv. */
+    close(server.fd);
+    pthread_join(client, NULL);
+
+    printf("bench=io_rpc mode=%s engine=%s conns=%ld msg_size=%zu"
+        " secs=%.3f rpcs=%ld rpcs_per_sec=%.0f\n",
+        mode, engine, conns, msg_size, ci.secs, ci.rpcs,
+        ci.rpcs / ci.secs);
+    return ci.rpcs > 0;
+}
+
+bool io_rpc(int argc, char **argv) {
+    long conns = arg_or(argc, argv, 0, 32);
+    double secs = (double)arg_or(argc, argv, 1, 2);
+    long msg_size = arg_or(argc, argv, 2, 64);
+    if (conns < 1 || secs <= 0 || msg_size < 1) { return false; }
+    raise_fd_limit();
+
+    return run_rpc("epoll", conns, secs, (size_t)msg_size)
+        && run_rpc("io_epoll", conns, secs, (size_t)msg_size)
+        && run_rpc("uring", conns, secs, (size_t)msg_size);
+}
+
+
+/* UDP packet rate by batch size */
+
+/* Send a batch of BATCH datagrams, then receive them all, for SECS. */
+static bool run_udp_batch(int server_fd, int client_fd, size_t batch,
+        double secs, size_t msg_size) {
+    socket99_batch *out = socket99_batch_new(batch, msg_size);
+    socket99_batch *in = socket99_batch_new(batch, msg_size);
+    if (out == NULL || in == NULL) {
+        socket99_batch_free(out);
+        socket99_batch_free(in);
+        return false;
+    }
+
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    (void)getsockname(server_fd, (struct sockaddr *)&addr, &addr_len);
+    socket99_dgram *od = socket99_batch_dgrams(out, NULL);
+    for (size_t i = 0; i < batch; i++) {
+        memset(od[i].buf, 'x', msg_size);
+        od[i].len = msg_size;
+        od[i].addr = addr;
+        od[i].addr_len = addr_len;
+    }
+
+    bool ok = true;
+    long packets = 0;
+    long calls = 0;
+    double start = now_sec();
+    double elapsed = 0;
+    while (ok && elapsed < secs) {
+        for (size_t sent = 0; ok && sent < batch; calls++) {
+            int res = socket99_batch_send(out, client_fd, sent,
+                batch - sent);
+            if (res == -1) { ok = false; } else { sent += (size_t)res; }
+        }
+        for (size_t got = 0; ok && got < batch; calls++) {
+            int res = socket99_batch_recv(in, server_fd, batch - got, 1000);
+            if (res <= 0) { ok = false; } else { got += (size_t)res; }
+        }
+        packets += (long)batch;
+        elapsed = now_sec() - start;
+    }
+
+    if (ok) {
+        printf("bench=udp_batch batch=%zu msg_size=%zu secs=%.3f"
+            " packets=%ld calls=%ld pps=%.0f\n",
+            batch, msg_size, elapsed, packets, calls, packets / elapsed);
+    } else {
+        fprintf(stderr, "udp_batch: %s\n", strerror(errno));
+    }
+    socket99_batch_free(out);
+    socket99_batch_free(in);
+    return ok;
+}
+
+bool udp_batch(int argc, char **argv) {
+    long max_batch = arg_or(argc, argv, 0, 64);
+    double secs = (double)arg_or(argc, argv, 1, 1);
+    long msg_size = arg_or(argc, argv, 2, 64);
+    if (max_batch < 1 || secs <= 0 || msg_size < 1) { return false; }
+
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .server = true,
+        .datagram = true,
+    };
+    socket99_result server;
+    if (!socket99_open(&cfg, &server)) {
+        socket99_fprintf(stderr, &server);
+        return false;
+    }
+    socket99_config client_cfg = {
+        .host = "127.0.0.1",
+        .port = local_port(server.fd),
+        .datagram = true,
+    };
+    socket99_result client;
+    if (!socket99_open(&client_cfg, &client)) {
+        socket99_fprintf(stderr, &client);
+        close(server.fd);
+        return false;
+    }
+
+    bool ok = true;
+    for (long batch = 1; ok && batch <= max_batch; batch *= 2) {
+        ok = run_udp_batch(server.fd, client.fd, (size_t)batch, secs,
+            (size_t)msg_size);
+    }
+
+    close(client.fd);
+    close(server.fd);
+    return ok;
+}
+
+
+/* TCP send throughput: copied vs. MSG_ZEROCOPY */
+
+#define ZC_BUFFERS 8
+
+typedef struct {
+    int fd;
+    long long received;
+} drain_info;
+
+static void *drain_loop(void *arg) {
+    drain_info *di = (drain_info *)arg;
+    static char buf[256 * 1024];
+    for (;;) {
+        ssize_t got = recv(di->fd, buf, sizeof(buf), 0);
+        if (got <= 0) { break; }
+        di->received += got;
+    }
+    return NULL;
+}
+
+static bool run_zerocopy(const char *mode, int server_fd, size_t chunk,
+        double secs) {
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .port = local_port(server_fd),
+        .zerocopy = true,
+    };
+    socket99_result client;
+    if (!socket99_open(&cfg, &client)) {
+        socket99_fprintf(stderr, &client);
+        return false;
+    }
+    drain_info di = { .fd = accept(server_fd, NULL, NULL) };
+    pthread_t drainer;
+    if (di.fd == -1 || pthread_create(&drainer, NULL, drain_loop, &di)) {
+        close(client.fd);
+        return false;
+    }
+
+    /* Copy mode just sets a threshold no send reaches. */
+    bool copy = 0 == strcmp(mode, "copy");
+    socket99_zc *zc = socket99_zc_new(client.fd, copy ? SIZE_MAX : chunk);
+    char *bufs[ZC_BUFFERS];
+    bool busy[ZC_BUFFERS];
+    for (int i = 0; i < ZC_BUFFERS; i++) {
+        bufs[i] = malloc(chunk);
+        if (bufs[i]) { memset(bufs[i], 'x', chunk); }
+        busy[i] = false;
+    }
+
+    /* Cycle through the buffers, waiting for one to be released
+     * whenever all of them are pinned. */
+    bool ok = zc != NULL;
+    long long sent = 0;
+    double start = now_sec();
+    double elapsed = 0;
+    for (int i = 0; ok && elapsed < secs; i = (i + 1) % ZC_BUFFERS) {
+        while (ok && busy[i]) {
+            struct pollfd pfd = { client.fd, 0, 0 };
+            (void)poll(&pfd, 1, 100);
+            void *tags[ZC_BUFFERS];
+            int count = socket99_zc_reap(zc, tags, ZC_BUFFERS);
+            if (count == -1) { ok = false; }
+            for (int j = 0; j < count; j++) {
+                busy[(char **)tags[j] - bufs] = false;
+            }
+        }
+        for (size_t off = 0; ok && off < chunk; ) {
+            bool pinned = false;
+            ssize_t res = socket99_zc_send(zc, bufs[i] + off, chunk - off,
+                &bufs[i], &pinned);
+            if (res == -1) { ok = false; break; }
+            off += (size_t)res;
+            if (pinned) { busy[i] = true; }
+        }
+        if (ok) { sent += (long long)chunk; }
+        elapsed = now_sec() - start;
+    }
+
+    /* Drain before freeing the buffers, as some may still be pinned. */
+    shutdown(client.fd, SHUT_WR);
+    pthread_join(drainer, NULL);
+    close(client.fd);
+    close(di.fd);
+
+    socket99_zc_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    socket99_zc_get_stats(zc, &stats);
+    printf("bench=zerocopy_send mode=%s chunk=%zu secs=%.3f bytes=%lld"
+        " mb_per_sec=%.1f zerocopy_sends=%llu kernel_copies=%llu\n",
+        mode, chunk, elapsed, sent, sent / elapsed / (1024 * 1024),
+        (unsigned long long)stats.zerocopy_sends,
+        (unsigned long long)stats.kernel_copies);
+
+    socket99_zc_free(zc);
+    for (int i = 0; i < ZC_BUFFERS; i++) { free(bufs[i]); }
+    return ok;
+}
+
+bool zerocopy_send(int argc, char **argv) {
+    long chunk_kb = arg_or(argc, argv, 0, 256);
+    double secs = (double)arg_or(argc, argv, 1, 2);
+    if (chunk_kb < 1 || secs <= 0) { return false; }
+
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .server = true,
+    };
+    socket99_result server;
+    if (!socket99_open(&cfg, &server)) {
+        socket99_fprintf(stderr, &server);
+        return false;
+    }
+
+    size_t chunk = (size_t)chunk_kb * 1024;
+    bool ok = run_zerocopy("copy", server.fd, chunk, secs)
+        && run_zerocopy("zerocopy", server.fd, chunk, secs);
+    close(server.fd);
+    return ok;
+}
+
+
+/* Relay throughput: copying through userspace vs. splice and sendfile */
+
+#define RELAY_BUFSZ (64 * 1024)
+
+typedef struct {
+    int fd;
+    double secs;
+} source_info;
+
+static void *source_loop(void *arg) {
+    source_info *si = (source_info *)arg;
+    static char buf[RELAY_BUFSZ];
+    memset(buf, 'x', sizeof(buf));
+    double start = now_sec();
+    while (now_sec() - start < si->secs) {
+        if (send(si->fd, buf, sizeof(buf), 0) == -1) { break; }
+    }
+    shutdown(si->fd, SHUT_WR);
+    return NULL;
+}
+
+static double thread_cpu_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Relay IN_FD to OUT_FD until EOF, adding up bytes and syscalls. */
+static bool relay_copy(int in_fd, int out_fd, socket99_relay_stats *stats) {
+    static char buf[RELAY_BUFSZ];
+    for (;;) {
+        stats->syscalls++;
+        ssize_t got = recv(in_fd, buf, sizeof(buf), 0);
+        if (got == 0) { return true; }
+        if (got == -1) { return false; }
+        for (ssize_t off = 0; off < got; ) {
+            stats->syscalls++;
+            ssize_t res = send(out_fd, buf + off, (size_t)(got - off), 0);
+            if (res == -1) { return false; }
+            off += res;
+        }
+        stats->bytes += (uint64_t)got;
+    }
+}
+
+static bool relay_splice_all(int in_fd, int out_fd,
+        socket99_relay_stats *stats) {
+    socket99_relay *r = socket99_relay_new(in_fd, out_fd);
+    if (r == NULL) { return false; }
+    bool ok = true;
+    for (;;) {
+        ssize_t res = socket99_relay_step(r, SIZE_MAX);
+        if (res == 0) { break; }
+        if (res == -1) {
+            if (errno != EAGAIN) { ok = false; break; }
+            bool out = socket99_relay_pending(r) > 0;
+            struct pollfd pfd = { out ? out_fd : in_fd,
+                                  out ? POLLOUT : POLLIN, 0 };
+            (void)poll(&pfd, 1, -1);
+        }
+    }
+    socket99_relay_get_stats(r, stats);
+    socket99_relay_free(r);
+    return ok;
+}
+
+/* Proxy: a source thread -> this thread -> a draining thread. */
+static bool run_proxy(const char *mode, int server_fd, double secs) {
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .port = local_port(server_fd),
+    };
+    socket99_result src, dst;
+    if (!socket99_open(&cfg, &src)) {
+        socket99_fprintf(stderr, &src);
+        return false;
+    }
+    int src_peer = accept(server_fd, NULL, NULL);
+    if (!socket99_open(&cfg, &dst)) {
+        socket99_fprintf(stderr, &dst);
+        close(src.fd);
+        return false;
+    }
+    drain_info di = { .fd = accept(server_fd, NULL, NULL) };
+    source_info si = { .fd = src.fd, .secs = secs };
+
+    pthread_t source, drainer;
+    bool ok = src_peer != -1 && di.fd != -1
+        && 0 == pthread_create(&drainer, NULL, drain_loop, &di);
+    if (ok && pthread_create(&source, NULL, source_loop, &si)) {
+        shutdown(dst.fd, SHUT_WR);
+        pthread_join(drainer, NULL);
+        ok = false;
+    }
+
+    socket99_relay_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    double start = now_sec(), cpu_start = thread_cpu_sec();
+    if (ok) {
+        if (0 == strcmp(mode, "splice")) {
+            ok = relay_splice_all(src_peer, dst.fd, &stats);
+        } else {
+            ok = relay_copy(src_peer, dst.fd, &stats);
+        }
+        shutdown(dst.fd, SHUT_WR);
+        pthread_join(source, NULL);
+        pthread_join(drainer, NULL);
+    }
+    double elapsed = now_sec() - start, cpu = thread_cpu_sec() - cpu_start;
+
+    double gb = stats.bytes / (1024.0 * 1024 * 1024);
+    printf("bench=relay kind=proxy mode=%s secs=%.3f bytes=%llu"
+        " mb_per_sec=%.1f cpu_sec_per_gb=%.3f syscalls=%llu\n",
+        mode, elapsed, (unsigned long long)stats.bytes,
+        stats.bytes / elapsed / (1024 * 1024), gb > 0 ? cpu / gb : 0,
+        (unsigned long long)stats.syscalls);
+
+    if (src_peer != -1) { close(src_peer); }
+    if (di.fd != -1) { close(di.fd); }
+    close(src.fd);
+    close(dst.fd);
+    return ok && di.received == (long long)stats.bytes;
+}
+
+/* Send FILE_FD (SIZE bytes) from the start with read(2) and send(2). */
+static bool send_file_copy(int out_fd, int file_fd, size_t size,
+        socket99_relay_stats *stats) {
+    static char buf[RELAY_BUFSZ];
+    stats->syscalls++;
+    if (lseek(file_fd, 0, SEEK_SET) == -1) { return false; }
+    for (size_t sent = 0; sent < size; ) {
+        stats->syscalls++;
+        ssize_t got = read(file_fd, buf, sizeof(buf));
+        if (got <= 0) { return false; }
+        for (ssize_t off = 0; off < got; ) {
+            stats->syscalls++;
+            ssize_t res = send(out_fd, buf + off, (size_t)(got - off), 0);
+            if (res == -1) { return false; }
+            off += res;
+        }
+        sent += (size_t)got;
+        stats->bytes += (uint64_t)got;
+    }
+    return true;
+}
+
+static bool run_file(const char *mode, int server_fd, int file_fd,
+        size_t size, double secs) {
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .port = local_port(server_fd),
+    };
+    socket99_result client;
+    if (!socket99_open(&cfg, &client)) {
+        socket99_fprintf(stderr, &client);
+        return false;
+    }
+    drain_info di = { .fd = accept(server_fd, NULL, NULL) };
+    pthread_t drainer;
+    if (di.fd == -1 || pthread_create(&drainer, NULL, drain_loop, &di)) {
+        close(client.fd);
+        return false;
+    }
+
+    bool use_sendfile = 0 == strcmp(mode, "sendfile");
+    socket99_relay_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    bool ok = true;
+    long files = 0;
+    double start = now_sec(), cpu_start = thread_cpu_sec();
+    double elapsed = 0;
+    while (ok && elapsed < secs) {
+        if (use_sendfile) {
+            off_t offset = 0;
+            ok = socket99_sendfile(client.fd, file_fd, &offset, size,
+                &stats) == (ssize_t)size;
+        } else {
+            ok = send_file_copy(client.fd, file_fd, size, &stats);
+        }
+        files++;
+        elapsed = now_sec() - start;
+    }
+    double cpu = thread_cpu_sec() - cpu_start;
+
+    shutdown(client.fd, SHUT_WR);
+    pthread_join(drainer, NULL);
+    close(client.fd);
+    close(di.fd);
+
+    double gb = stats.bytes / (1024.0 * 1024 * 1024);
+    printf("bench=relay kind=file mode=%s secs=%.3f files=%ld bytes=%llu"
+        " mb_per_sec=%.1f cpu_sec_per_gb=%.3f syscalls=%llu\n",
+        mode, elapsed, files, (unsigned long long)stats.bytes,
+        stats.bytes / elapsed / (1024 * 1024), gb > 0 ? cpu / gb : 0,
+        (unsigned long long)stats.syscalls);
+    return ok;
+}
+
+bool relay(int argc, char **argv) {
+    double secs = (double)arg_or(argc, argv, 0, 2);
+    long file_mb = arg_or(argc, argv, 1, 16);
+    if (secs <= 0 || file_mb < 1) { return false; }
+
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .server = true,
+    };
+    socket99_result server;
+    if (!socket99_open(&cfg, &server)) {
+        socket99_fprintf(stderr, &server);
+        return false;
+    }
+
+    size_t size = (size_t)file_mb * 1024 * 1024;
+    FILE *f = tmpfile();
+    bool ok = f != NULL;
+    static char buf[RELAY_BUFSZ];
+    memset(buf, 'x', sizeof(buf));
+    for (size_t off = 0; ok && off < size; off += sizeof(buf)) {
+        ok = fwrite(buf, 1, sizeof(buf), f) == sizeof(buf);
+    }
+    ok = ok && fflush(f) == 0;
+
+    ok = ok && run_proxy("copy", server.fd, secs)
+        && run_proxy("splice", server.fd, secs)
+        && run_file("copy", server.fd, fileno(f), size, secs)
+        && run_file("sendfile", server.fd, fileno(f), size, secs);
+    if (f) { fclose(f); }
+    close(server.fd);
+    return ok;
+}
+
+
+/* Tuning profiles: RPC latency and bulk throughput */
+
+#define PROFILE_HEADER 16
+
+/* Echo everything received on FD until EOF. */
+static void *echo_loop(void *arg) {
+    int fd = *(int *)arg;
+    static char buf[64 * 1024];
+    for (;;) {
+        ssize_t got = recv(fd, buf, sizeof(buf), 0);
+        if (got <= 0) { break; }
+        if (send(fd, buf, (size_t)got, 0) != got) { break; }
+    }
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double da = *(const double *)a, db = *(const double *)b;
+    return da < db ? -1 : da > db ? 1 : 0;
+}
+
+/* Open a server and a client connected to it, both with PROFILE.
+ * The connection isn't accepted yet. Returns 0, or -1 on failure. */
+static int open_profile_pair(enum socket99_profile profile,
+        int *server_fd, int *client_fd) {
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .server = true,
+        .profile = profile,
+    };
+    socket99_result server, client;
+    if (!socket99_open(&cfg, &server)) {
+        socket99_fprintf(stderr, &server);
+        return -1;
+    }
+    socket99_config client_cfg = {
+        .host = "127.0.0.1",
+        .port = local_port(server.fd),
+        .profile = profile,
+    };
+    if (!socket99_open(&client_cfg, &client)) {
+        socket99_fprintf(stderr, &client);
+        close(server.fd);
+        return -1;
+    }
+    *server_fd = server.fd;
+    *client_fd = client.fd;
+    return 0;
+}
+
+/* Requests are written as a header and then a body, as many RPC
+ * libraries do, which is where Nagle's algorithm and delayed ACKs
+ * interact badly. */
+static bool run_profile_latency(const char *name,
+        enum socket99_profile profile, double secs, size_t msg_size) {
+    int server_fd, client_fd;
+    if (open_profile_pair(profile, &server_fd, &client_fd) == -1) {
+        return false;
+    }
+
+    size_t max_samples = 1000000;
+    double *samples = malloc(max_samples * sizeof(double));
+    char *buf = calloc(1, msg_size);
+    bool ok = samples != NULL && buf != NULL;
+
+    /* Send the first request before accepting, for TCP_DEFER_ACCEPT. */
+    double t0 = now_sec();
+    ok = ok && send(client_fd, buf, PROFILE_HEADER, 0) == PROFILE_HEADER
+        && send(client_fd, buf + PROFILE_HEADER, msg_size - PROFILE_HEADER, 0)
+            == (ssize_t)(msg_size - PROFILE_HEADER);
+    int conn_fd = ok ? accept(server_fd, NULL, NULL) : -1;
+    pthread_t echoer;
+    if (conn_fd == -1 || pthread_create(&echoer, NULL, echo_loop, &conn_fd)) {
+        if (conn_fd != -1) { close(conn_fd); }
+        close(client_fd);
+        close(server_fd);
+        free(samples);
+        free(buf);
+        return false;
+    }
+
+    size_t count = 0;
+    double start = t0;
+    for (;;) {
+        ok = recv_all(client_fd, buf, msg_size);
+        if (!ok) { break; }
+        double t = now_sec();
+        if (count < max_samples) { samples[count++] = t - t0; }
+        if (t - start >= secs) { break; }
+        t0 = t;
+        ok = send(client_fd, buf, PROFILE_HEADER, 0) == PROFILE_HEADER
+            && send(client_fd, buf + PROFILE_HEADER,
+                msg_size - PROFILE_HEADER, 0)
+                == (ssize_t)(msg_size - PROFILE_HEADER);
+        if (!ok) { break; }
+    }
+    double elapsed = now_sec() - start;
+
+    shutdown(client_fd, SHUT_WR);
+    pthread_join(echoer, NULL);
+    close(conn_fd);
+    close(client_fd);
+    close(server_fd);
+
+    if (ok && count > 0) {
+        qsort(samples, count, sizeof(double), cmp_double);
+        printf("bench=profiles kind=latency profile=%s msg_size=%zu"
+            " secs=%.3f rpcs=%zu rpcs_per_sec=%.0f p50_usec=%.1f"
+            " p99_usec=%.1f\n",
+            name, msg_size, elapsed, count, count / elapsed,
+            samples[count / 2] * 1e6, samples[count * 99 / 100] * 1e6);
+    }
+    free(samples);
+    free(buf);
+    return ok;
+}
+
+static bool run_profile_bulk(const char *name,
+        enum socket99_profile profile, double secs) {
+    int server_fd, client_fd;
+    if (open_profile_pair(profile, &server_fd, &client_fd) == -1) {
+        return false;
+    }
+
+    /* Send something before accepting, for TCP_DEFER_ACCEPT. */
+    static char buf[256 * 1024];
+    memset(buf, 'x', sizeof(buf));
+    bool ok = send(client_fd, buf, 1, 0) == 1;
+    drain_info di = { .fd = ok ? accept(server_fd, NULL, NULL) : -1 };
+    pthread_t drainer;
+    if (di.fd == -1 || pthread_create(&drainer, NULL, drain_loop, &di)) {
+        if (di.fd != -1) { close(di.fd); }
+        close(client_fd);
+        close(server_fd);
+        return false;
+    }
+
+    double start = now_sec(), elapsed = 0;
+    while (ok && elapsed < secs) {
+        ok = send(client_fd, buf, sizeof(buf), 0) != -1;
+        elapsed = now_sec() - start;
+    }
+    shutdown(client_fd, SHUT_WR);
+    pthread_join(drainer, NULL);
+    elapsed = now_sec() - start;
+
+    printf("bench=profiles kind=bulk profile=%s secs=%.3f bytes=%lld"
+        " mb_per_sec=%.1f\n",
+        name, elapsed, di.received, di.received / elapsed / (1024 * 1024));
+    close(di.fd);
+    close(client_fd);
+    close(server_fd);
+    return ok;
+}
+
+bool profiles(int argc, char **argv) {
+    double secs = (double)arg_or(argc, argv, 0, 1);
+    long msg_size = arg_or(argc, argv, 1, 256);
+    if (secs <= 0 || msg_size <= PROFILE_HEADER) { return false; }
+
+    struct {
+        const char *name;
+        enum socket99_profile profile;
+    } cases[] = {
+        { "default", SOCKET99_PROFILE_DEFAULT },
+        { "low_latency", SOCKET99_PROFILE_LOW_LATENCY },
+        { "bulk", SOCKET99_PROFILE_BULK },
+        { "fan_in", SOCKET99_PROFILE_FAN_IN },
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (!run_profile_latency(cases[i].name, cases[i].profile, secs,
+                (size_t)msg_size)) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (!run_profile_bulk(cases[i].name, cases[i].profile, secs)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/* One-request connections: connect, then send vs. TCP Fast Open */
+
+#define FASTOPEN_MSG_SIZE 64
+
+typedef struct {
+    int fd;
+    long conns;
+} fastopen_server_info;
+
+/* Answer one request on each of CONNS connections. */
+static void *fastopen_server(void *arg) {
+    fastopen_server_info *si = (fastopen_server_info *)arg;
+    char buf[FASTOPEN_MSG_SIZE];
+    for (long i = 0; i < si->conns; i++) {
+        int fd = accept(si->fd, NULL, NULL);
+        if (fd == -1) { break; }
+        if (recv_all(fd, buf, sizeof(buf))) {
+            (void)send(fd, buf, sizeof(buf), 0);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+static bool run_fastopen(const char *mode, long conns) {
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .server = true,
+        .fastopen_qlen = 128,
+    };
+    socket99_result server;
+    if (!socket99_open(&cfg, &server)) {
+        socket99_fprintf(stderr, &server);
+        return false;
+    }
+    fastopen_server_info si = { .fd = server.fd, .conns = conns };
+    pthread_t server_thread;
+    if (pthread_create(&server_thread, NULL, fastopen_server, &si)) {
+        close(server.fd);
+        return false;
+    }
+
+    bool use_fastopen = 0 == strcmp(mode, "fastopen");
+    char buf[FASTOPEN_MSG_SIZE];
+    memset(buf, 'x', sizeof(buf));
+    long done = 0, accepted = 0;
+    double start = now_sec();
+    for (; done < conns; done++) {
+        socket99_config client_cfg = {
+            .host = "127.0.0.1",
+            .port = local_port(server.fd),
+        };
+        socket99_result client;
+        ssize_t sent = 0;
+        bool ok;
+        if (use_fastopen) {
+            ok = socket99_open_send(&client_cfg, buf, sizeof(buf), &sent,
+                &client);
+        } else {
+            ok = socket99_open(&client_cfg, &client);
+            if (ok) { sent = send(client.fd, buf, sizeof(buf), 0); }
+        }
+        if (!ok) {
+            socket99_fprintf(stderr, &client);
+            break;
+        }
+        if (socket99_fastopen_accepted(client.fd)) { accepted++; }
+        ok = sent == (ssize_t)sizeof(buf)
+            && recv_all(client.fd, buf, sizeof(buf));
+        close(client.fd);
+        if (!ok) { break; }
+    }
+    double elapsed = now_sec() - start;
+
+    /* Unblock the server thread if we stopped early. */
+    shutdown(server.fd, SHUT_RDWR);
+    pthread_join(server_thread, NULL);
+    close(server.fd);
+
+    printf("bench=fastopen mode=%s conns=%ld secs=%.3f conns_per_sec=%.0f"
+        " usec_per_conn=%.1f syn_data_accepted=%ld\n",
+        mode, done, elapsed, done / elapsed, elapsed * 1e6 / done, accepted);
+    return done == conns;
+}
+
+bool fastopen(int argc, char **argv) {
+    long conns = arg_or(argc, argv, 0, 10000);
+    if (conns < 1) { return false; }
+    raise_fd_limit();
+
+    /* Note: on Linux, servers only accept Fast Open data if the
+     * net.ipv4.tcp_fastopen sysctl has bit 2 set. */
+    return run_fastopen("connect", conns) && run_fastopen("fastopen", conns);
+}
+
+
+/* UDP ping-pong latency: interrupt-driven vs. busy poll */
+
+typedef struct {
+    int fd;
+    bool track_cpu;             /* move to the CPU packets arrive on */
+    int cpu;                    /* -1 if the OS didn't say */
+    bool pinned;
+} udp_echo_info;
+
+/* Echo datagrams until an empty one arrives. If tracking the CPU,
+ * connect to the first sender, since Linux only records the CPU
+ * packets arrive on for a connected UDP socket, then move to that CPU
+ * once the next datagram says which it is. */
+static void *udp_echo_loop(void *arg) {
+    udp_echo_info *ei = (udp_echo_info *)arg;
+    char buf[64 * 1024];
+    for (long n = 0; ; n++) {
+        struct sockaddr_storage ss;
+        socklen_t len = sizeof(ss);
+        ssize_t got = recvfrom(ei->fd, buf, sizeof(buf), 0,
+            (struct sockaddr *)&ss, &len);
+        if (got <= 0) { break; }
+        if (ei->track_cpu && n == 0) {
+            (void)connect(ei->fd, (struct sockaddr *)&ss, len);
+        } else if (ei->track_cpu && n == 1) {
+            ei->cpu = socket99_incoming_cpu(ei->fd);
+            ei->pinned = ei->cpu != -1 && socket99_pin_thread(ei->cpu);
+        }
+        (void)sendto(ei->fd, buf, (size_t)got, 0, (struct sockaddr *)&ss, len);
+    }
+    return NULL;
+}
+
+static bool run_busy_poll(const char *mode, double secs, size_t msg_size,
+        int usec) {
+    bool busy = 0 == strcmp(mode, "busy_poll");
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .server = true,
+        .datagram = true,
+        .busy_poll_usec = busy ? usec : 0,
+        .prefer_busy_poll = busy,
+    };
+    socket99_result server;
+    if (!socket99_open(&cfg, &server)) {
+        if (server.status == SOCKET99_ERROR_SETSOCKOPT
+            && server.saved_errno == EPERM) {
+            printf("bench=busy_poll mode=%s skipped=not_permitted\n", mode);
+            return true;
+        }
+        socket99_fprintf(stderr, &server);
+        return false;
+    }
+    socket99_config client_cfg = {
+        .host = "127.0.0.1",
+        .port = local_port(server.fd),
+        .datagram = true,
+        .busy_poll_usec = busy ? usec : 0,
+    };
+    socket99_result client;
+    if (!socket99_open(&client_cfg, &client)) {
+        socket99_fprintf(stderr, &client);
+        close(server.fd);
+        return false;
+    }
+
+    struct sockaddr_storage ss;
+    socklen_t ss_len = sizeof(ss);
+    getsockname(server.fd, (struct sockaddr *)&ss, &ss_len);
+
+    udp_echo_info ei = { .fd = server.fd, .track_cpu = true, .cpu = -1 };
+    pthread_t echoer;
+    if (pthread_create(&echoer, NULL, udp_echo_loop, &ei)) {
+        close(client.fd);
+        close(server.fd);
+        return false;
+    }
+
+    size_t max_samples = 1000000;
+    double *samples = malloc(max_samples * sizeof(double));
+    char *buf = calloc(1, msg_size);
+    bool ok = samples != NULL && buf != NULL;
+    size_t count = 0;
+    double start = now_sec();
+    while (ok && now_sec() - start < secs) {
+        double t0 = now_sec();
+        ok = sendto(client.fd, buf, msg_size, 0, (struct sockaddr *)&ss,
+                ss_len) == (ssize_t)msg_size
+            && recv(client.fd, buf, msg_size, 0) == (ssize_t)msg_size;
+        if (ok && count < max_samples) { samples[count++] = now_sec() - t0; }
+    }
+    double elapsed = now_sec() - start;
+
+    /* An empty datagram stops the echo thread. */
+    (void)sendto(client.fd, buf, 0, 0, (struct sockaddr *)&ss, ss_len);
+    pthread_join(echoer, NULL);
+    close(client.fd);
+    close(server.fd);
+
+    if (ok && count > 0) {
+        qsort(samples, count, sizeof(double), cmp_double);
+        printf("bench=busy_poll mode=%s msg_size=%zu secs=%.3f rtts=%zu"
+            " p50_usec=%.1f p99_usec=%.1f server_cpu=%d pinned=%d\n",
+            mode, msg_size, elapsed, count, samples[count / 2] * 1e6,
+            samples[count * 99 / 100] * 1e6, ei.cpu, ei.pinned);
+    }
+    free(samples);
+    free(buf);
+    return ok;
+}
+
+bool busy_poll(int argc, char **argv) {
+    double secs = (double)arg_or(argc, argv, 0, 1);
+    long msg_size = arg_or(argc, argv, 1, 64);
+    long usec = arg_or(argc, argv, 2, 50);
+    if (secs <= 0 || msg_size < 1 || msg_size > 65507 || usec < 1) {
+        return false;
+    }
+
+    return run_busy_poll("interrupt", secs, (size_t)msg_size, (int)usec)
+        && run_busy_poll("busy_poll", secs, (size_t)msg_size, (int)usec);
+}
+
+
+/* Accept rate by burst size */
+
+#define BURST_CLIENT_THREADS 4
+
+static bool run_accept_burst(int server_fd, socket99_config *cfg,
+        long conns, size_t burst, int threads) {
+    socket99_accepted *accepted = calloc(burst, sizeof(*accepted));
+    if (accepted == NULL) { return false; }
+
+    accept_thread_info clients[threads];
+    pthread_t client_ids[threads];
+    for (int i = 0; i < threads; i++) {
+        clients[i] = (accept_thread_info){
+            .port = local_port(server_fd),
+            .conns = conns / threads + (i < conns % threads ? 1 : 0),
+        };
+    }
+
+    double start = now_sec();
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&client_ids[i], NULL, connect_loop, &clients[i]);
+    }
+
+    /* Accept one burst per wakeup, as a loop serving other sockets
+     * would; a burst of 1 is the classic poll-then-accept loop. */
+    struct pollfd pfd = { server_fd, POLLIN, 0 };
+    long total = 0, wakeups = 0;
+    bool ok = true;
+    while (ok && total < conns) {
+        int ready = poll(&pfd, 1, 1000);
+        if (ready == -1 && errno == EINTR) { continue; }
+        if (ready != 1) {
+            ok = false;
+            break;
+        }
+        wakeups++;
+        int got = socket99_accept_burst(cfg, server_fd, accepted, burst);
+        if (got == -1) { ok = false; }
+        for (int i = 0; i < got; i++) { close(accepted[i].fd); }
+        if (got > 0) { total += got; }
+    }
+    double elapsed = now_sec() - start;
+    for (int i = 0; i < threads; i++) { pthread_join(client_ids[i], NULL); }
+    free(accepted);
+
+    printf("bench=accept_burst burst=%zu threads=%d conns=%ld secs=%.3f"
+        " conns_per_sec=%.0f wakeups=%ld conns_per_wakeup=%.2f\n",
+        burst, threads, total, elapsed, total / elapsed, wakeups,
+        wakeups ? (double)total / wakeups : 0);
+    return ok;
+}
+
+bool accept_burst(int argc, char **argv) {
+    long conns = arg_or(argc, argv, 0, 20000);
+    long max_burst = arg_or(argc, argv, 1, 64);
+    long threads = arg_or(argc, argv, 2, BURST_CLIENT_THREADS);
+    if (conns < 1 || max_burst < 1 || threads < 1) { return false; }
+    raise_fd_limit();
+
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .server = true,
+        .nonblocking = true,
+    };
+    socket99_result server;
+    if (!socket99_open(&cfg, &server)) {
+        socket99_fprintf(stderr, &server);
+        return false;
+    }
+
+    bool ok = true;
+    for (long burst = 1; ok && burst <= max_burst; burst *= 2) {
+        ok = run_accept_burst(server.fd, &cfg, conns, (size_t)burst,
+            (int)threads);
+    }
+    close(server.fd);
+    return ok;
+}
+
+
+/* Hot path: open latency, connect/accept, round trips, and throughput */
+
+static double percentile(double *sorted, size_t count, double p) {
+    size_t i = (size_t)(count * p);
+    return sorted[i < count ? i : count - 1];
+}
+
+/* Print "p50_usec=... p90_usec=... p99_usec=... p999_usec=...". */
+static void print_percentiles(double *samples, size_t count) {
+    qsort(samples, count, sizeof(double), cmp_double);
+    printf(" p50_usec=%.1f p90_usec=%.1f p99_usec=%.1f p999_usec=%.1f",
+        percentile(samples, count, 0.5) * 1e6,
+        percentile(samples, count, 0.9) * 1e6,
+        percentile(samples, count, 0.99) * 1e6,
+        percentile(samples, count, 0.999) * 1e6);
+}
+
+/* Accept and close any connections waiting on the nonblocking FD. */
+static void reap_accepted(int fd) {
+    int client_fd;
+    while ((client_fd = accept(fd, NULL, NULL)) != -1) { close(client_fd); }
+}
+
+bool open_latency(int argc, char **argv) {
+    long iters = arg_or(argc, argv, 0, 2000);
+    if (iters < 1) { return false; }
+
+    /* Listeners for the client variants to connect to. */
+    socket99_config tcp_cfg = {
+        .host = "127.0.0.1",
+        .server = true,
+        .nonblocking = true,
+    };
+    socket99_config unix_cfg = {
+        .path = BENCH_PATH,
+        .server = true,
+        .nonblocking = true,
+    };
+    socket99_result tcp_server, unix_server;
+    unlink(BENCH_PATH);
+    if (!socket99_open(&tcp_cfg, &tcp_server)) {
+        socket99_fprintf(stderr, &tcp_server);
+        return false;
+    }
+    if (!socket99_open(&unix_cfg, &unix_server)) {
+        socket99_fprintf(stderr, &unix_server);
+        close(tcp_server.fd);
+        return false;
+    }
+    int port = local_port(tcp_server.fd);
+
+    struct {
+        const char *variant;
+        socket99_config cfg;
+        int listener;           /* to accept from, or -1 */
+    } variants[] = {
+        { "tcp_server", { .host = "127.0.0.1", .server = true }, -1 },
+        { "tcp_client", { .host = "127.0.0.1", .port = port },
+          tcp_server.fd },
+        { "udp_server", { .host = "127.0.0.1", .server = true,
+              .datagram = true }, -1 },
+        { "udp_client", { .host = "127.0.0.1", .port = port,
+              .datagram = true }, -1 },
+        { "unix_server", { .path = BENCH_PATH "2", .server = true }, -1 },
+        { "unix_client", { .path = BENCH_PATH }, unix_server.fd },
+        { "unix_datagram_server", { .path = BENCH_PATH "2",
+              .server = true, .datagram = true }, -1 },
+    };
+
+    double *samples = malloc((size_t)iters * sizeof(double));
+    bool ok = samples != NULL;
+    for (size_t v = 0; ok && v < sizeof(variants) / sizeof(variants[0]); v++) {
+        socket99_config *cfg = &variants[v].cfg;
+        for (long i = 0; ok && i < iters; i++) {
+            unlink(BENCH_PATH "2");
+            socket99_result res;
+            double t0 = now_sec();
+            ok = socket99_open(cfg, &res);
+            samples[i] = now_sec() - t0;
+            if (!ok) {
+                socket99_fprintf(stderr, &res);
+                break;
+            }
+            close(res.fd);
+            if (variants[v].listener != -1) {
+                reap_accepted(variants[v].listener);
+            }
+        }
+        if (!ok) { break; }
+
+        double total = 0;
+        for (long i = 0; i < iters; i++) { total += samples[i]; }
+        printf("bench=open_latency variant=%s iters=%ld opens_per_sec=%.0f"
+            " mean_usec=%.1f", variants[v].variant, iters, iters / total,
+            total * 1e6 / iters);
+        print_percentiles(samples, (size_t)iters);
+        printf("\n");
+    }
+
+    free(samples);
+    unlink(BENCH_PATH "2");
+    unlink(BENCH_PATH);
+    close(unix_server.fd);
+    close(tcp_server.fd);
+    return ok;
+}
+
+/* Each connection: a blocking connect, which completes once the
+ * handshake does, then an accept, then both ends closed. */
+bool connect_accept(int argc, char **argv) {
+    long conns = arg_or(argc, argv, 0, 10000);
+    if (conns < 1) { return false; }
+
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .server = true,
+    };
+    socket99_result server;
+    if (!socket99_open(&cfg, &server)) {
+        socket99_fprintf(stderr, &server);
+        return false;
+    }
+    socket99_config client_cfg = {
+        .host = "127.0.0.1",
+        .port = local_port(server.fd),
+    };
+
+    double *samples = malloc((size_t)conns * sizeof(double));
+    bool ok = samples != NULL;
+    long done = 0;
+    double start = now_sec();
+    for (; ok && done < conns; done++) {
+        socket99_result client;
+        double t0 = now_sec();
+        ok = socket99_open(&client_cfg, &client);
+        if (!ok) {
+            socket99_fprintf(stderr, &client);
+            break;
+        }
+        int conn_fd = socket99_accept(&cfg, server.fd, NULL, NULL);
+        samples[done] = now_sec() - t0;
+        ok = conn_fd != -1;
+        /* Server closes first, keeping TIME_WAIT off client ports. */
+        if (conn_fd != -1) { close(conn_fd); }
+        close(client.fd);
+    }
+    double elapsed = now_sec() - start;
+
+    if (ok) {
+        printf("bench=connect_accept conns=%ld secs=%.3f conns_per_sec=%.0f",
+            done, elapsed, done / elapsed);
+        print_percentiles(samples, (size_t)done);
+        printf("\n");
+    }
+    free(samples);
+    close(server.fd);
+    return ok;
+}
+
+/* Time round trips of MSG_SIZE bytes on the connected stream FD, which
+ * something is echoing, for SECS. */
+static bool stream_rtts(const char *transport, int fd, double secs,
+        size_t msg_size) {
+    size_t max_samples = 1000000;
+    double *samples = malloc(max_samples * sizeof(double));
+    char *buf = calloc(1, msg_size);
+    bool ok = samples != NULL && buf != NULL;
+    size_t count = 0;
+    double start = now_sec();
+    while (ok && now_sec() - start < secs) {
+        double t0 = now_sec();
+        ok = send(fd, buf, msg_size, 0) == (ssize_t)msg_size
+            && recv_all(fd, buf, msg_size);
+        if (ok && count < max_samples) { samples[count++] = now_sec() - t0; }
+    }
+    double elapsed = now_sec() - start;
+    if (ok && count > 0) {
+        printf("bench=rtt transport=%s msg_size=%zu secs=%.3f rtts=%zu"
+            " rtts_per_sec=%.0f", transport, msg_size, elapsed, count,
+            count / elapsed);
+        print_percentiles(samples, count);
+        printf("\n");
+    }
+    free(samples);
+    free(buf);
+    return ok;
+}
+
+static bool run_stream_rtt(const char *transport, socket99_config *cfg,
+        double secs, size_t msg_size) {
+    socket99_result server, client;
+    if (!socket99_open(cfg, &server)) {
+        socket99_fprintf(stderr, &server);
+        return false;
+    }
+    socket99_config client_cfg = {
+        .host = cfg->host,
+        .path = cfg->path,
+        .port = cfg->path ? 0 : local_port(server.fd),
+    };
+    if (!socket99_open(&client_cfg, &client)) {
+        socket99_fprintf(stderr, &client);
+        close(server.fd);
+        return false;
+    }
+    int conn_fd = accept(server.fd, NULL, NULL);
+    pthread_t echoer;
+    if (conn_fd == -1 || pthread_create(&echoer, NULL, echo_loop, &conn_fd)) {
+        if (conn_fd != -1) { close(conn_fd); }
+        close(client.fd);
+        close(server.fd);
+        return false;
+    }
+
+    bool ok = stream_rtts(transport, client.fd, secs, msg_size);
+    shutdown(client.fd, SHUT_WR);
+    pthread_join(echoer, NULL);
+    close(conn_fd);
+    close(client.fd);
+    close(server.fd);
+    return ok;
+}
+
+static bool run_udp_rtt(double secs, size_t msg_size) {
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .server = true,
+        .datagram = true,
+    };
+    socket99_result server, client;
+    if (!socket99_open(&cfg, &server)) {
+        socket99_fprintf(stderr, &server);
+        return false;
+    }
+    /* Connect the client, so it can use send and recv. */
+    socket99_config client_cfg = {
+        .host = "127.0.0.1",
+        .port = local_port(server.fd),
+        .datagram = true,
+    };
+    if (!socket99_open(&client_cfg, &client)) {
+        socket99_fprintf(stderr, &client);
+        close(server.fd);
+        return false;
+    }
+    struct sockaddr_storage ss;
+    socklen_t ss_len = sizeof(ss);
+    getsockname(server.fd, (struct sockaddr *)&ss, &ss_len);
+    udp_echo_info ei = { .fd = server.fd, .cpu = -1 };
+    pthread_t echoer;
+    bool ok = connect(client.fd, (struct sockaddr *)&ss, ss_len) == 0
+        && 0 == pthread_create(&echoer, NULL, udp_echo_loop, &ei);
+    if (ok) {
+        /* Datagrams arrive whole, so recv_all is one recv. */
+        ok = stream_rtts("udp", client.fd, secs, msg_size);
+        (void)send(client.fd, "", 0, 0);
+        pthread_join(echoer, NULL);
+    }
+    close(client.fd);
+    close(server.fd);
+    return ok;
+}
+
+bool rtt(int argc, char **argv) {
+    double secs = (double)arg_or(argc, argv, 0, 1);
+    long msg_size = arg_or(argc, argv, 1, 64);
+    if (secs <= 0 || msg_size < 1 || msg_size > 65507) { return false; }
+
+    int v_true = 1;
+    socket99_config tcp_cfg = {
+        .host = "127.0.0.1",
+        .server = true,
+        .sockopt_list = &(socket99_sockopt){
+            TCP_NODELAY, &v_true, sizeof(v_true), IPPROTO_TCP },
+        .sockopt_count = 1,
+    };
+    socket99_config unix_cfg = {
+        .path = BENCH_PATH,
+        .server = true,
+    };
+    unlink(BENCH_PATH);
+    bool ok = run_stream_rtt("tcp", &tcp_cfg, secs, (size_t)msg_size)
+        && run_udp_rtt(secs, (size_t)msg_size)
+        && run_stream_rtt("unix", &unix_cfg, secs, (size_t)msg_size);
+    unlink(BENCH_PATH);
+    return ok;
+}
+
+static bool run_throughput(const char *transport, socket99_config *cfg,
+        double secs, size_t chunk) {
+    socket99_result server, client;
+    if (!socket99_open(cfg, &server)) {
+        socket99_fprintf(stderr, &server);
+        return false;
+    }
+    socket99_config client_cfg = {
+        .host = cfg->host,
+        .path = cfg->path,
+        .port = cfg->path ? 0 : local_port(server.fd),
+    };
+    if (!socket99_open(&client_cfg, &client)) {
+        socket99_fprintf(stderr, &client);
+        close(server.fd);
+        return false;
+    }
+    drain_info di = { .fd = accept(server.fd, NULL, NULL) };
+    pthread_t drainer;
+    char *buf = malloc(chunk);
+    if (buf == NULL || di.fd == -1
+        || pthread_create(&drainer, NULL, drain_loop, &di)) {
+        if (di.fd != -1) { close(di.fd); }
+        free(buf);
+        close(client.fd);
+        close(server.fd);
+        return false;
+    }
+    memset(buf, 'x', chunk);
+
+    bool ok = true;
+    double start = now_sec();
+    while (ok && now_sec() - start < secs) {
+        ok = send(client.fd, buf, chunk, 0) != -1;
+    }
+    shutdown(client.fd, SHUT_WR);
+    pthread_join(drainer, NULL);
+    double elapsed = now_sec() - start;
+
+    printf("bench=throughput transport=%s chunk=%zu secs=%.3f bytes=%lld"
+        " mb_per_sec=%.1f\n", transport, chunk, elapsed, di.received,
+        di.received / elapsed / (1024 * 1024));
+    free(buf);
+    close(di.fd);
+    close(client.fd);
+    close(server.fd);
+    return ok;
+}
+
+bool throughput(int argc, char **argv) {
+    double secs = (double)arg_or(argc, argv, 0, 1);
+    long chunk_kb = arg_or(argc, argv, 1, 64);
+    if (secs <= 0 || chunk_kb < 1) { return false; }
+
+    socket99_config tcp_cfg = {
+        .host = "127.0.0.1",
+        .server = true,
+    };
+    socket99_config unix_cfg = {
+        .path = BENCH_PATH,
+        .server = true,
+    };
+    size_t chunk = (size_t)chunk_kb * 1024;
+    unlink(BENCH_PATH);
+    bool ok = run_throughput("tcp", &tcp_cfg, secs, chunk)
+        && run_throughput("unix", &unix_cfg, secs, chunk);
+    unlink(BENCH_PATH);
+    return ok;
+}
+
+
+/* Receive buffers for many connections: one per connection, malloc
+ * per read, or a buffer pool. Connections are simulated, since there
+ * may not be enough fds for 100k sockets; each round, ACTIVE_PCT of
+ * them become readable, get a buffer, and have MSG_SIZE bytes copied
+ * in. One read in 8 leaves a partial message, so its buffer is held
+ * until that connection is next readable. */
+
+#define BUFPOOL_BUF_SIZE (16 * 1024)
+
+enum buf_mode { BUF_PER_CONN, BUF_MALLOC, BUF_POOL };
+
+static bool run_bufpool(const char *name, enum buf_mode mode, long conns,
+        long rounds, long active_pct, size_t msg_size) {
+    void **held = calloc((size_t)conns, sizeof(void *));
+    char *msg = malloc(msg_size);
+    socket99_bufpool *bp = NULL;
+    if (mode == BUF_POOL) {
+        socket99_bufpool_config cfg = { .buf_size = BUFPOOL_BUF_SIZE };
+        bp = socket99_bufpool_new(&cfg);
+    }
+    if (held == NULL || msg == NULL || (mode == BUF_POOL && bp == NULL)) {
+        free(held);
+        free(msg);
+        return false;
+    }
+    memset(msg, 'x', msg_size);
+
+    /* Without a pool, every connection gets a buffer up front. */
+    if (mode == BUF_PER_CONN) {
+        for (long i = 0; i < conns; i++) {
+            held[i] = malloc(BUFPOOL_BUF_SIZE);
+            if (held[i] == NULL) { break; }
+            memset(held[i], 0, BUFPOOL_BUF_SIZE);
+        }
+    }
+
+    long active = conns * active_pct / 100;
+    if (active < 1) { active = 1; }
+    uint32_t seed = 12345;
+    long allocs = 0;
+    size_t live = mode == BUF_PER_CONN ? (size_t)conns : 0;
+    size_t peak = live;
+    bool ok = true;
+
+    double start = now_sec();
+    for (long r = 0; ok && r < rounds; r++) {
+        for (long a = 0; a < active; a++) {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            long c = (long)(seed % (uint32_t)conns);
+            void *buf = held[c];
+            if (buf == NULL) {
+                buf = mode == BUF_POOL ? socket99_bufpool_get(bp)
+                    : malloc(BUFPOOL_BUF_SIZE);
+                if (buf == NULL) {
+                    ok = false;
+                    break;
+                }
+                allocs++;
+                if (++live > peak) { peak = live; }
+            }
+            memcpy(buf, msg, msg_size);
+
+            /* Drained, unless a partial message is left. */
+            bool partial = (seed & 7) == 0;
+            if (mode == BUF_PER_CONN || partial) {
+                held[c] = buf;
+            } else {
+                if (mode == BUF_POOL) {
+                    socket99_bufpool_put(bp, buf);
+                } else {
+                    free(buf);
+                }
+                held[c] = NULL;
+                live--;
+            }
+        }
+    }
+    double elapsed = now_sec() - start;
+
+    size_t footprint = peak * BUFPOOL_BUF_SIZE;
+    if (bp) {
+        socket99_bufpool_stats stats;
+        socket99_bufpool_get_stats(bp, &stats);
+        footprint = stats.reserved_bytes;
+    }
+    long reads = rounds * active;
+    printf("bench=bufpool mode=%s conns=%ld reads=%ld secs=%.3f"
+        " allocs=%ld allocs_per_sec=%.0f nsec_per_read=%.1f"
+        " peak_bufs=%zu footprint_kb=%zu\n",
+        name, conns, reads, elapsed, allocs, allocs / elapsed,
+        1e9 * elapsed / reads, peak, footprint / 1024);
+
+    for (long i = 0; i < conns; i++) {
+        if (held[i] == NULL) { continue; }
+        if (mode == BUF_POOL) {
+            socket99_bufpool_put(bp, held[i]);
+        } else {
+            free(held[i]);
+        }
+    }
+    socket99_bufpool_free(bp);
+    free(held);
+    free(msg);
+    return ok;
+}
+
+bool bufpool(int argc, char **argv) {
+    long rounds = arg_or(argc, argv, 0, 1000);
+    long active_pct = arg_or(argc, argv, 1, 1);
+    long msg_size = arg_or(argc, argv, 2, 1024);
+    if (rounds < 1 || active_pct < 1 || active_pct > 100
+        || msg_size < 1 || msg_size > BUFPOOL_BUF_SIZE) {
+        return false;
+    }
+
+    static const long conn_counts[] = { 10000, 100000 };
+    bool ok = true;
+    for (size_t i = 0; ok && i < 2; i++) {
+        long conns = conn_counts[i];
+        ok = run_bufpool("per_conn", BUF_PER_CONN, conns, rounds,
+                active_pct, (size_t)msg_size)
+            && run_bufpool("malloc_per_read", BUF_MALLOC, conns, rounds,
+                active_pct, (size_t)msg_size)
+            && run_bufpool("pool", BUF_POOL, conns, rounds,
+                active_pct, (size_t)msg_size);
+    }
+    return ok;
+}
+
+
+/* Framing a stream: reading into a flat buffer and moving the partial
+ * frame left at the end back to the front, vs. socket99_framer. The
+ * stream is a run of whole frames, sent over and over. */
+
+#define FRAME_STREAM_SIZE (1024 * 1024)
+#define FRAME_BUFSZ (64 * 1024)
+
+typedef struct {
+    int fd;
+    const char *stream;
+    size_t len;
+    double secs;
+} frame_source_info;
+
+static void *frame_source_loop(void *arg) {
+    frame_source_info *fi = (frame_source_info *)arg;
+    double start = now_sec();
+    while (now_sec() - start < fi->secs) {
+        size_t sent = 0;
+        while (sent < fi->len) {
+            ssize_t res = write(fi->fd, fi->stream + sent, fi->len - sent);
+            if (res == -1) { goto done; }
+            sent += (size_t)res;
+        }
+    }
+done:
+    shutdown(fi->fd, SHUT_WR);
+    return NULL;
+}
+
+/* Build a stream of frames with bodies of SIZES[i % COUNT] bytes. */
+static size_t build_frames(char *stream, enum socket99_frame_mode mode,
+        const size_t *sizes, size_t count) {
+    size_t len = 0;
+    for (size_t i = 0; ; i++) {
+        size_t body = sizes[i % count];
+        if (len + body + 4 > FRAME_STREAM_SIZE) { break; }
+        if (mode == SOCKET99_FRAME_LENGTH) {
+            for (int b = 3; b >= 0; b--) {
+                stream[len++] = (char)((body >> (8 * b)) & 0xff);
+            }
+        }
+        memset(stream + len, 'x', body);
+        len += body;
+        if (mode == SOCKET99_FRAME_DELIMITED) { stream[len++] = '\n'; }
+    }
+    return len;
+}
+
+/* Find a frame in BUF[0..LEN), as a hand-written framer would. Returns
+ * the bytes it takes up, or 0 if it's incomplete. */
+static size_t flat_frame(const char *buf, size_t len,
+        enum socket99_frame_mode mode, size_t *body) {
+    if (mode == SOCKET99_FRAME_DELIMITED) {
+        const char *nl = memchr(buf, '\n', len);
+        if (nl == NULL) { return 0; }
+        *body = (size_t)(nl - buf);
+        return *body + 1;
+    }
+    if (len < 4) { return 0; }
+    const unsigned char *p = (const unsigned char *)buf;
+    *body = ((size_t)p[0] << 24) | ((size_t)p[1] << 16)
+        | ((size_t)p[2] << 8) | p[3];
+    return len - 4 < *body ? 0 : *body + 4;
+}
+
+static bool frame_flat(int fd, enum socket99_frame_mode mode,
+        long *frames, long long *bytes) {
+    char *buf = malloc(FRAME_BUFSZ);
+    if (buf == NULL) { return false; }
+    size_t have = 0;
+    for (;;) {
+        ssize_t got = read(fd, buf + have, FRAME_BUFSZ - have);
+        if (got <= 0) { break; }
+        have += (size_t)got;
+
+        size_t off = 0, used, body;
+        while ((used = flat_frame(buf + off, have - off, mode, &body)) > 0) {
+            (*frames)++;
+            *bytes += (long long)body;
+            off += used;
+        }
+        memmove(buf, buf + off, have - off);
+        have -= off;
+    }
+    free(buf);
+    return true;
+}
+
+static bool frame_ring(int fd, enum socket99_frame_mode mode,
+        long *frames, long long *bytes) {
+    socket99_framer_config cfg = {
+        .mode = mode,
+        .ring_size = FRAME_BUFSZ,
+    };
+    socket99_framer *f = socket99_framer_new(&cfg);
+    if (f == NULL) { return false; }
+    while (socket99_framer_fill(f, fd) > 0) {
+        socket99_span span;
+        while (socket99_framer_next(f, &span) == 1) {
+            (*frames)++;
+            *bytes += (long long)span.len;
+        }
+    }
+    socket99_framer_free(f);
+    return true;
+}
+
+static bool run_framer(const char *framer_name, const char *sizes_name,
+        enum socket99_frame_mode mode, const char *stream, size_t len,
+        double secs) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) { return false; }
+    frame_source_info fi = { sv[0], stream, len, secs };
+    pthread_t source;
+    if (pthread_create(&source, NULL, frame_source_loop, &fi)) {
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+
+    long frames = 0;
+    long long bytes = 0;
+    double start = now_sec();
+    bool ok = 0 == strcmp(framer_name, "ring")
+        ? frame_ring(sv[1], mode, &frames, &bytes)
+        : frame_flat(sv[1], mode, &frames, &bytes);
+    double elapsed = now_sec() - start;
+    pthread_join(source, NULL);
+
+    printf("bench=framer framer=%s mode=%s sizes=%s secs=%.3f frames=%ld"
+        " frames_per_sec=%.0f mb_per_sec=%.1f\n", framer_name,
+        mode == SOCKET99_FRAME_LENGTH ? "length" : "delimited", sizes_name,
+        elapsed, frames, frames / elapsed, bytes / elapsed / (1024 * 1024));
+    close(sv[0]);
+    close(sv[1]);
+    return ok;
+}
+
+bool framer(int argc, char **argv) {
+    double secs = (double)arg_or(argc, argv, 0, 1);
+    if (secs <= 0) { return false; }
+
+    static const size_t small[] = { 16 };
+    static const size_t mixed[] = { 16, 300, 64, 4000, 16, 1200, 32, 9000 };
+    static const struct {
+        const char *name;
+        const size_t *sizes;
+        size_t count;
+    } sets[] = {
+        { "small", small, sizeof(small) / sizeof(small[0]) },
+        { "mixed", mixed, sizeof(mixed) / sizeof(mixed[0]) },
+    };
+    static const enum socket99_frame_mode modes[] = {
+        SOCKET99_FRAME_DELIMITED, SOCKET99_FRAME_LENGTH,
+    };
+
+    char *stream = malloc(FRAME_STREAM_SIZE);
+    if (stream == NULL) { return false; }
+    bool ok = true;
+    for (size_t m = 0; ok && m < 2; m++) {
+        for (size_t i = 0; ok && i < 2; i++) {
+            size_t len = build_frames(stream, modes[m], sets[i].sizes,
+                sets[i].count);
+            ok = run_framer("memmove", sets[i].name, modes[m], stream, len,
+                    secs)
+                && run_framer("ring", sets[i].name, modes[m], stream, len,
+                    secs);
+        }
+    }
+    free(stream);
+    return ok;
+}
+
+
+/* Responses made of many small pieces: one send(2) per piece with
+ * TCP_NODELAY, vs. socket99_outq with MSG_MORE or TCP_CORK. Each
+ * response is a header, flushed with more to come (as if a file body
+ * followed), then PIECES body pieces, sent when the client asks. */
+
+#define OUTQ_HEADER 128
+#define OUTQ_PIECE 100
+
+#ifdef __linux__
+/* struct tcp_info as far as tcpi_segs_in (Linux 4.2); libc's copy
+ * stops short of the segment counts. */
+struct seg_info {
+    uint8_t state[8];
+    uint32_t counters[24];
+    uint64_t rates_and_bytes[4];
+    uint32_t segs_out;
+    uint32_t segs_in;
+};
+#endif
+
+/* Get the number of segments FD has sent, or -1 if unknown. */
+static long segs_out(int fd) {
+#ifdef __linux__
+    struct seg_info si;
+    socklen_t len = sizeof(si);
+    memset(&si, 0, sizeof(si));
+    if (getsockopt(fd, IPPROTO_TCP, 11 /* TCP_INFO */, &si, &len) == 0
+            && len == sizeof(si)) {
+        return (long)si.segs_out;
+    }
+#else
+    (void)fd;
+#endif
+    return -1;
+}
+
+typedef struct {
+    int fd;
+    size_t response_size;
+    long responses;
+} outq_client_info;
+
+/* Ask for a response and read all of it, until the server hangs up. */
+static void *outq_client_loop(void *arg) {
+    outq_client_info *ci = (outq_client_info *)arg;
+    char buf[64 * 1024];
+    for (;;) {
+        if (send(ci->fd, "?", 1, 0) != 1) { break; }
+        size_t got = 0;
+        while (got < ci->response_size) {
+            ssize_t res = recv(ci->fd, buf, sizeof(buf), 0);
+            if (res <= 0) { return NULL; }
+            got += (size_t)res;
+        }
+        ci->responses++;
+    }
+    return NULL;
+}
+
+static bool run_outq(const char *mode, int server_fd, int pieces,
+        double secs) {
+    int v_true = 1;
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .port = local_port(server_fd),
+    };
+    socket99_result res;
+    if (!socket99_open(&cfg, &res)) {
+        socket99_fprintf(stderr, &res);
+        return false;
+    }
+    int fd = accept(server_fd, NULL, NULL);
+    outq_client_info ci = {
+        .fd = res.fd,
+        .response_size = OUTQ_HEADER + (size_t)pieces * OUTQ_PIECE,
+    };
+    pthread_t client;
+    if (fd == -1 || pthread_create(&client, NULL, outq_client_loop, &ci)) {
+        if (fd != -1) { close(fd); }
+        close(res.fd);
+        return false;
+    }
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &v_true, sizeof(v_true));
+
+    bool per_piece = 0 == strcmp(mode, "per_piece");
+    socket99_outq_config q_cfg = { .cork = 0 == strcmp(mode, "outq_cork") };
+    socket99_outq *q = per_piece ? NULL : socket99_outq_new(fd, &q_cfg);
+    char header[OUTQ_HEADER];
+    char piece[OUTQ_PIECE];
+    memset(header, 'h', sizeof(header));
+    memset(piece, 'p', sizeof(piece));
+
+    bool ok = per_piece || q != NULL;
+    long responses = 0;
+    long long syscalls = 0;
+    long segs_before = segs_out(fd);
+    double start = now_sec();
+    double elapsed = 0;
+    char req;
+    while (ok && elapsed < secs && recv(fd, &req, 1, 0) == 1) {
+        if (per_piece) {
+            ok = send(fd, header, sizeof(header), 0) == sizeof(header);
+            for (int i = 0; ok && i < pieces; i++) {
+                ok = send(fd, piece, sizeof(piece), 0) == sizeof(piece);
+            }
+            syscalls += 1 + pieces;
+        } else {
+            ok = socket99_outq_write(q, header, sizeof(header))
+                && socket99_outq_flush(q, true) >= 0;
+            for (int i = 0; ok && i < pieces; i++) {
+                ok = socket99_outq_write(q, piece, sizeof(piece));
+            }
+            ok = ok && socket99_outq_flush(q, false) >= 0
+                && socket99_outq_pending(q) == 0;
+        }
+        responses++;
+        elapsed = now_sec() - start;
+    }
+    long segs = segs_out(fd);
+    if (segs != -1 && segs_before != -1) { segs -= segs_before; }
+    if (q) {
+        socket99_outq_stats stats;
+        socket99_outq_get_stats(q, &stats);
+        syscalls = (long long)stats.syscalls;
+        socket99_outq_free(q);
+    }
+
+    shutdown(fd, SHUT_RDWR);
+    pthread_join(client, NULL);
+    close(fd);
+    close(res.fd);
+
+    printf("bench=outq mode=%s pieces=%d secs=%.3f responses=%ld"
+        " responses_per_sec=%.0f syscalls_per_response=%.2f"
+        " segs_per_response=%.2f\n",
+        mode, pieces, elapsed, responses, responses / elapsed,
+        responses ? (double)syscalls / responses : 0,
+        responses && segs >= 0 ? (double)segs / responses : -1.0);
+    return ok;
+}
+
+bool outq(int argc, char **argv) {
+    double secs = (double)arg_or(argc, argv, 0, 1);
+    int pieces = (int)arg_or(argc, argv, 1, 8);
+    if (secs <= 0 || pieces < 0) { return false; }
+
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .server = true,
+    };
+    socket99_result server;
+    if (!socket99_open(&cfg, &server)) {
+        socket99_fprintf(stderr, &server);
+        return false;
+    }
+    bool ok = run_outq("per_piece", server.fd, pieces, secs)
+        && run_outq("outq", server.fd, pieces, secs)
+        && run_outq("outq_cork", server.fd, pieces, secs);
+    close(server.fd);
+    return ok;
+}
+
+
+/* The multi-threaded server: echo requests per second and latency for
+ * 1 to MAX_WORKERS workers (doubling), with a shared listener vs. a
+ * listener per worker. Client threads keep one request in flight on
+ * each of their connections. */
+
+#define SERVER_CLIENT_THREADS 4
+#define SERVER_MSG_SIZE 32
+#define SERVER_MAX_SAMPLES 200000
+
+static void server_bench_echo(socket99_server *s, int fd, const char *buf,
+        size_t len, void *udata) {
+    (void)s;
+    (void)udata;
+    if (send(fd, buf, len, 0) != (ssize_t)len) { shutdown(fd, SHUT_RDWR); }
+}
+
+typedef struct {
+    int port;
+    int conns;
+    double secs;
+    long requests;
+    double *samples;
+    size_t sample_count;
+    bool ok;
+} server_client_info;
+
+static void *server_client_loop(void *arg) {
+    server_client_info *ci = (server_client_info *)arg;
+    socket99_config cfg = { .host = "127.0.0.1", .port = ci->port };
+    int fds[ci->conns];
+    double sent_at[ci->conns];
+    int opened = 0;
+    for (; opened < ci->conns; opened++) {
+        socket99_result res;
+        if (!socket99_open(&cfg, &res)) { break; }
+        fds[opened] = res.fd;
+    }
+    ci->ok = opened == ci->conns;
+
+    char msg[SERVER_MSG_SIZE];
+    memset(msg, 'r', sizeof(msg));
+    double start = now_sec();
+    while (ci->ok && now_sec() - start < ci->secs) {
+        for (int i = 0; ci->ok && i < opened; i++) {
+            sent_at[i] = now_sec();
+            ci->ok = send(fds[i], msg, sizeof(msg), 0) == sizeof(msg);
+        }
+        for (int i = 0; ci->ok && i < opened; i++) {
+            char buf[SERVER_MSG_SIZE];
+            size_t got = 0;
+            while (ci->ok && got < sizeof(buf)) {
+                ssize_t res = recv(fds[i], buf + got, sizeof(buf) - got, 0);
+                ci->ok = res > 0;
+                if (res > 0) { got += (size_t)res; }
+            }
+            if (ci->ok && ci->sample_count < SERVER_MAX_SAMPLES) {
+                ci->samples[ci->sample_count++] = now_sec() - sent_at[i];
+            }
+            ci->requests++;
+        }
+    }
+    for (int i = 0; i < opened; i++) { close(fds[i]); }
+    return NULL;
+}
+
+static bool run_server_bench(const char *mode_name,
+        enum socket99_listen_mode mode, size_t workers, int conns,
+        double secs, long cpus) {
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .server = true,
+    };
+    socket99_server_config scfg = { .workers = workers, .listen = mode };
+    socket99_server_handlers h = { .on_read = server_bench_echo };
+    socket99_result res;
+    socket99_server *s = socket99_server_new(&cfg, &scfg, &h, NULL, &res);
+    if (s == NULL) {
+        socket99_fprintf(stderr, &res);
+        return false;
+    }
+
+    server_client_info ci[SERVER_CLIENT_THREADS];
+    pthread_t threads[SERVER_CLIENT_THREADS];
+    int started = 0;
+    bool ok = true;
+    for (; started < SERVER_CLIENT_THREADS; started++) {
+        server_client_info *c = &ci[started];
+        memset(c, 0, sizeof(*c));
+        c->port = socket99_server_port(s);
+        c->conns = conns / SERVER_CLIENT_THREADS;
+        if (started < conns % SERVER_CLIENT_THREADS) { c->conns++; }
+        c->secs = secs;
+        c->samples = malloc(SERVER_MAX_SAMPLES * sizeof(double));
+        if (c->samples == NULL
+            || pthread_create(&threads[started], NULL,
+                server_client_loop, c)) {
+            free(c->samples);
+            ok = false;
+            break;
+        }
+    }
+
+    long requests = 0;
+    size_t sample_count = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        ok = ok && ci[i].ok;
+        requests += ci[i].requests;
+        sample_count += ci[i].sample_count;
+    }
+    socket99_server_stats stats;
+    socket99_server_get_stats(s, &stats);
+    socket99_server_free(s);
+
+    double *samples = malloc((sample_count ? sample_count : 1)
+        * sizeof(double));
+    size_t n = 0;
+    for (int i = 0; i < started; i++) {
+        if (samples) {
+            memcpy(samples + n, ci[i].samples,
+                ci[i].sample_count * sizeof(double));
+            n += ci[i].sample_count;
+        }
+        free(ci[i].samples);
+    }
+    if (ok && samples && n > 0) {
+        printf("bench=server listen=%s cpus=%ld workers=%zu conns=%d"
+            " secs=%.3f requests=%ld req_per_sec=%.0f stolen=%llu",
+            mode_name, cpus, workers, conns, secs, requests, requests / secs,
+            (unsigned long long)stats.stolen);
+        print_percentiles(samples, n);
+        printf("\n");
+    }
+    free(samples);
+    return ok && n > 0;
+}
+
+/* Bursts of short connections, each with one request costing
+ * SERVER_BURST_WORK_USEC of handler time: the worker that accepts a
+ * burst queues it all, and with stealing, idle workers take some. */
+
+#define SERVER_BURST_SIZE 64
+#define SERVER_BURST_WORK_USEC 20
+
+static void server_bench_work(socket99_server *s, int fd, const char *buf,
+        size_t len, void *udata) {
+    (void)udata;
+    double until = now_sec() + SERVER_BURST_WORK_USEC / 1e6;
+    while (now_sec() < until) {}
+    server_bench_echo(s, fd, buf, len, NULL);
+}
+
+static bool run_server_burst(size_t workers, bool no_steal, double secs,
+        long cpus) {
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .server = true,
+    };
+    socket99_server_config scfg = {
+        .workers = workers,
+        .listen = SOCKET99_LISTEN_SHARED,
+        .no_steal = no_steal,
+    };
+    socket99_server_handlers h = { .on_read = server_bench_work };
+    socket99_result res;
+    socket99_server *s = socket99_server_new(&cfg, &scfg, &h, NULL, &res);
+    if (s == NULL) {
+        socket99_fprintf(stderr, &res);
+        return false;
+    }
+
+    socket99_config cfgs[SERVER_BURST_SIZE];
+    socket99_result results[SERVER_BURST_SIZE];
+    for (int i = 0; i < SERVER_BURST_SIZE; i++) {
+        socket99_config c = {
+            .host = "127.0.0.1",
+            .port = socket99_server_port(s),
+        };
+        cfgs[i] = c;
+    }
+    size_t max_samples = 100000;
+    double *samples = malloc(max_samples * sizeof(double));
+    bool ok = samples != NULL;
+    size_t bursts = 0;
+    char msg[SERVER_MSG_SIZE];
+    memset(msg, 'b', sizeof(msg));
+    double start = now_sec();
+    while (ok && now_sec() - start < secs && bursts < max_samples) {
+        double t0 = now_sec();
+        ok = socket99_open_many(cfgs, results, SERVER_BURST_SIZE, NULL)
+            == SERVER_BURST_SIZE;
+        for (int i = 0; ok && i < SERVER_BURST_SIZE; i++) {
+            ok = send(results[i].fd, msg, sizeof(msg), 0) == sizeof(msg);
+        }
+        for (int i = 0; ok && i < SERVER_BURST_SIZE; i++) {
+            char buf[SERVER_MSG_SIZE];
+            size_t got = 0;
+            while (ok && got < sizeof(buf)) {
+                ssize_t n = recv(results[i].fd, buf + got,
+                    sizeof(buf) - got, 0);
+                ok = n > 0;
+                if (n > 0) { got += (size_t)n; }
+            }
+        }
+        for (int i = 0; i < SERVER_BURST_SIZE; i++) {
+            if (results[i].status == SOCKET99_OK) { close(results[i].fd); }
+        }
+        if (ok) { samples[bursts++] = now_sec() - t0; }
+    }
+    double elapsed = now_sec() - start;
+    socket99_server_stats stats;
+    socket99_server_get_stats(s, &stats);
+    socket99_server_free(s);
+
+    if (ok && bursts > 0) {
+        printf("bench=server test=burst cpus=%ld workers=%zu steal=%s"
+            " burst=%d work_usec=%d secs=%.3f bursts_per_sec=%.0f"
+            " stolen_pct=%.1f", cpus, workers, no_steal ? "off" : "on",
+            SERVER_BURST_SIZE, SERVER_BURST_WORK_USEC, elapsed,
+            bursts / elapsed,
+            stats.accepted ? 100.0 * stats.stolen / stats.accepted : 0);
+        print_percentiles(samples, bursts);
+        printf("\n");
+    }
+    free(samples);
+    return ok && bursts > 0;
+}
+
+/* Double the worker count, but end on MAX: 1, 2, 4, 6 for 6 CPUs. */
+static size_t next_worker_count(size_t w, size_t max) {
+    return w < max && 2 * w > max ? max : 2 * w;
+}
+
+bool server(int argc, char **argv) {
+    double secs = (double)arg_or(argc, argv, 0, 1);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    long max_workers = arg_or(argc, argv, 1, cpus > 1 ? cpus : 2);
+    int conns = (int)arg_or(argc, argv, 2, 64);
+    if (secs <= 0 || max_workers < 1 || conns < SERVER_CLIENT_THREADS) {
+        return false;
+    }
+    raise_fd_limit();
+    bool ok = true;
+    for (size_t w = 1; ok && w <= (size_t)max_workers;
+            w = next_worker_count(w, (size_t)max_workers)) {
+        ok = run_server_bench("shared", SOCKET99_LISTEN_SHARED, w, conns,
+                secs, cpus)
+            && run_server_bench("per_worker", SOCKET99_LISTEN_PER_WORKER,
+                w, conns, secs, cpus);
+    }
+    size_t w = max_workers > 1 ? (size_t)max_workers : 2;
+    return ok && run_server_burst(w, true, secs, cpus)
+        && run_server_burst(w, false, secs, cpus);
+}
+
+
+/* Opening many connections: one socket99_open at a time vs.
+ * socket99_open_many, against a stub server that accepts and closes.
+ * The last run adds STUCK connections to a listener whose accept queue
+ * is full, so their SYNs are dropped, as for a shard that is down. */
+
+static bool run_open_many(const char *mode, size_t in_flight,
+        int server_fd, long conns, int stuck_port, long stuck,
+        int deadline_msec) {
+    accept_state st;
+    pthread_mutex_init(&st.lock, NULL);
+    st.accepted = 0;
+    st.total = conns;
+    accept_thread_info ti = { &st, server_fd, 0, conns };
+    pthread_t acceptor;
+    if (pthread_create(&acceptor, NULL, accept_loop, &ti)) { return false; }
+
+    size_t count = (size_t)(conns + stuck);
+    socket99_config *cfgs = calloc(count, sizeof(*cfgs));
+    socket99_result *res = calloc(count, sizeof(*res));
+    bool ok = cfgs != NULL && res != NULL;
+    for (size_t i = 0; ok && i < count; i++) {
+        cfgs[i].host = "127.0.0.1";
+        cfgs[i].port = i < (size_t)conns ? local_port(server_fd) : stuck_port;
+    }
+
+    size_t opened = 0;
+    double start = now_sec();
+    if (ok && in_flight == 0) {
+        for (size_t i = 0; i < count; i++) {
+            if (socket99_open(&cfgs[i], &res[i])) { opened++; }
+        }
+    } else if (ok) {
+        socket99_open_many_config mcfg = {
+            .deadline_msec = deadline_msec,
+            .max_in_flight = in_flight,
+        };
+        opened = socket99_open_many(cfgs, res, count, &mcfg);
+    }
+    double elapsed = now_sec() - start;
+
+    for (size_t i = 0; ok && i < count; i++) {
+        if (res[i].status == SOCKET99_OK) { close(res[i].fd); }
+    }
+    free(cfgs);
+    free(res);
+
+    /* Unblock the acceptor if some never connected. */
+    pthread_mutex_lock(&st.lock);
+    st.total = 0;
+    pthread_mutex_unlock(&st.lock);
+    pthread_join(acceptor, NULL);
+    pthread_mutex_destroy(&st.lock);
+
+    printf("bench=open_many mode=%s in_flight=%zu conns=%ld stuck=%ld"
+        " opened=%zu secs=%.3f conns_per_sec=%.0f\n", mode, in_flight,
+        conns, stuck, opened, elapsed, opened / elapsed);
+    return ok && opened == (size_t)conns;
+}
+
+bool open_many(int argc, char **argv) {
+    long conns = arg_or(argc, argv, 0, 500);
+    long stuck = arg_or(argc, argv, 1, 5);
+    int deadline_msec = (int)arg_or(argc, argv, 2, 500);
+    if (conns < 1 || stuck < 0 || deadline_msec < 1) { return false; }
+    raise_fd_limit();
+
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .server = true,
+        .nonblocking = true,
+    };
+    socket99_result server, stuck_server;
+    if (!socket99_open(&cfg, &server)) {
+        socket99_fprintf(stderr, &server);
+        return false;
+    }
+
+    /* Fill the stuck listener's accept queue (backlog + 1). */
+    cfg.backlog_size = 1;
+    if (!socket99_open(&cfg, &stuck_server)) {
+        socket99_fprintf(stderr, &stuck_server);
+        close(server.fd);
+        return false;
+    }
+    socket99_config filler_cfg = {
+        .host = "127.0.0.1",
+        .port = local_port(stuck_server.fd),
+    };
+    socket99_result fillers[2];
+    bool ok = socket99_open(&filler_cfg, &fillers[0])
+        && socket99_open(&filler_cfg, &fillers[1]);
+
+    ok = ok && run_open_many("sequential", 0, server.fd, conns, 0, 0, 0);
+    static const size_t in_flights[] = { 16, 64, 256 };
+    for (size_t i = 0; ok && i < sizeof(in_flights) / sizeof(in_flights[0]);
+            i++) {
+        ok = run_open_many("many", in_flights[i], server.fd, conns, 0, 0, 0);
+    }
+    ok = ok && run_open_many("many_with_stuck", 64, server.fd, conns,
+        filler_cfg.port, stuck, deadline_msec);
+
+    if (fillers[0].fd != -1) { close(fillers[0].fd); }
+    if (fillers[1].fd != -1) { close(fillers[1].fd); }
+    close(stuck_server.fd);
+    close(server.fd);
+    return ok;
+}
+
+
+/* Same-host transport: a Unix stream socket pair vs. a socket99_shm
+ * channel set up over one, for 64-byte ping-pong latency and 64 KB
+ * bulk throughput. */
+
+#define SHM_PING_SIZE 64
+#define SHM_BULK_SIZE (64 * 1024)
+
+/* One end of a transport: the socket, or a channel over it. */
+typedef struct {
+    int fd;
+    socket99_shm *shm;
+} shm_end;
+
+static ssize_t end_send(shm_end *e, const void *buf, size_t len) {
+    return e->shm ? socket99_shm_send(e->shm, buf, len)
+        : send(e->fd, buf, len, 0);
+}
+
+static ssize_t end_recv(shm_end *e, void *buf, size_t len) {
+    return e->shm ? socket99_shm_recv(e->shm, buf, len)
+        : recv(e->fd, buf, len, 0);
+}
+
+static bool end_recv_all(shm_end *e, void *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t res = end_recv(e, (char *)buf + got, len - got);
+        if (res <= 0) { return false; }
+        got += (size_t)res;
+    }
+    return true;
+}
+
+typedef struct {
+    shm_end end;
+    bool use_shm;
+    bool echo;                  /* echo pings, or just count bytes */
+    long long received;
+} shm_peer_info;
+
+static void *shm_peer_loop(void *arg) {
+    shm_peer_info *pi = (shm_peer_info *)arg;
+    if (pi->use_shm) {
+        pi->end.shm = socket99_shm_accept(pi->end.fd, NULL);
+        if (pi->end.shm == NULL) { return NULL; }
+    }
+    static char buf[SHM_BULK_SIZE];
+    for (;;) {
+        ssize_t got = end_recv(&pi->end, buf, sizeof(buf));
+        if (got <= 0) { break; }
+        pi->received += got;
+        if (pi->echo && end_send(&pi->end, buf, (size_t)got) != got) {
+            break;
+        }
+    }
+    socket99_shm_free(pi->end.shm);
+    return NULL;
+}
+
+static bool run_shm(const char *transport, bool echo, long iters,
+        double secs) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) { return false; }
+    bool use_shm = 0 == strcmp(transport, "shm");
+    shm_peer_info pi = { { sv[1], NULL }, use_shm, echo, 0 };
+    pthread_t peer;
+    if (pthread_create(&peer, NULL, shm_peer_loop, &pi)) {
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+
+    shm_end e = { sv[0], NULL };
+    if (use_shm) { e.shm = socket99_shm_offer(sv[0], NULL); }
+    bool ok = !use_shm || e.shm != NULL;
+    double *samples = echo ? calloc((size_t)iters, sizeof(double)) : NULL;
+    ok = ok && (!echo || samples != NULL);
+
+    char *buf = malloc(SHM_BULK_SIZE);
+    ok = ok && buf != NULL;
+    if (ok) { memset(buf, 'x', SHM_BULK_SIZE); }
+    long long sent = 0;
+    long done = 0;
+    double start = now_sec();
+    if (echo) {
+        for (; ok && done < iters; done++) {
+            double t0 = now_sec();
+            ok = end_send(&e, buf, SHM_PING_SIZE) == SHM_PING_SIZE
+                && end_recv_all(&e, buf, SHM_PING_SIZE);
+            samples[done] = now_sec() - t0;
+        }
+    } else {
+        while (ok && now_sec() - start < secs) {
+            ok = end_send(&e, buf, SHM_BULK_SIZE) == SHM_BULK_SIZE;
+            sent += SHM_BULK_SIZE;
+        }
+    }
+    double elapsed = now_sec() - start;
+
+    socket99_shm_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    socket99_shm_get_stats(e.shm, &stats);
+    socket99_shm_free(e.shm);
+    shutdown(sv[0], SHUT_RDWR);
+    pthread_join(peer, NULL);
+    close(sv[0]);
+    close(sv[1]);
+
+    if (ok && echo) {
+        printf("bench=shm test=latency transport=%s iters=%ld secs=%.3f"
+            " round_trips_per_sec=%.0f sleeps=%llu", transport, done,
+            elapsed, done / elapsed, (unsigned long long)stats.sleeps);
+        print_percentiles(samples, (size_t)done);
+        printf("\n");
+    } else if (ok) {
+        printf("bench=shm test=throughput transport=%s chunk=%d secs=%.3f"
+            " mb_per_sec=%.1f received_mb=%.1f sleeps=%llu\n", transport,
+            SHM_BULK_SIZE, elapsed, sent / elapsed / (1024 * 1024),
+            pi.received / (1024.0 * 1024), (unsigned long long)stats.sleeps);
+    }
+    free(samples);
+    free(buf);
+    return ok && (echo || pi.received == sent);
+}
+
+bool shm(int argc, char **argv) {
+    long iters = arg_or(argc, argv, 0, 20000);
+    double secs = (double)arg_or(argc, argv, 1, 1);
+    if (iters < 1 || secs <= 0) { return false; }
+    return run_shm("unix", true, iters, secs)
+        && run_shm("shm", true, iters, secs)
+        && run_shm("unix", false, iters, secs)
+        && run_shm("shm", false, iters, secs);
+}
@@ -14,6 +14,12 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+/* Linux-specific socket options (SO_REUSEPORT, etc.) are hidden by a
+ * strict _POSIX_C_SOURCE; each one is still checked with #ifdef. */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -24,20 +30,102 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
 
 #include "socket99.h"
+#include "socket99_internal.h"
 
 /* Built-in default backlog size. */
 #define DEF_BACKLOG_SIZE SOMAXCONN   // very backlog. wow.
 
+/* Linux-only socket options, -1 where not defined. */
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU (-1)
+#endif
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL (-1)
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET (-1)
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL (-1)
+#endif
+
+/* Count system calls made by an open in its result, if enabled. */
+#ifdef SOCKET99_COUNT_SYSCALLS
+#define COUNT_SYSCALL(OUT) ((OUT)->syscalls++)
+#else
+#define COUNT_SYSCALL(OUT) ((void)0)
+#endif
+
+/* Time phases of an open, and count opens, if enabled:
+ *     uint64_t t0 = PHASE_BEGIN();
+ *     ...
+ *     PHASE_END(out, SOCKET99_PHASE_BIND, t0); */
+#ifdef SOCKET99_INSTRUMENT
+static uint64_t phase_now(void);
+static void record_open(socket99_config *cfg, socket99_result *res);
+#define PHASE_BEGIN() phase_now()
+#define PHASE_END(OUT, PHASE, T0) \
+    ((OUT)->phase_nsec[PHASE] += phase_now() - (T0))
+#define COUNT_ADDR_TRIED(OUT) ((OUT)->addrs_tried++)
+#define RECORD_OPEN(CFG, RES) record_open(CFG, RES)
+#else
+#define PHASE_BEGIN() ((uint64_t)0)
+#define PHASE_END(OUT, PHASE, T0) ((void)(T0))
+#define COUNT_ADDR_TRIED(OUT) ((void)0)
+#define RECORD_OPEN(CFG, RES) ((void)0)
+#endif
+
+/* Data to send while connecting, for socket99_open_send. */
+typedef struct {
+    const void *buf;
+    size_t len;
+    ssize_t sent;
+} first_send;
+
 static bool set_defaults_and_check_cfg(socket99_config *cfg);
-static bool make_tcp_udp(socket99_config *cfg, socket99_result *out);
+static bool open_any(socket99_config *cfg, socket99_result *res);
+static bool open_any_send(socket99_config *cfg, first_send *fs,
+    socket99_result *res);
+static bool make_tcp_udp(socket99_config *cfg, socket99_result *out,
+    first_send *fs);
+static bool connect_first(socket99_result *out, int fd,
+    struct addrinfo *ai, first_send *fs);
+static bool bind_and_listen(socket99_config *cfg, socket99_result *out,
+    int fd, struct sockaddr *addr, socklen_t addr_len);
 static bool make_unixdomain(socket99_config *cfg, socket99_result *out);
+static int adopt_inherited(socket99_config *cfg, socket99_result *out);
+static bool resolve(socket99_config *cfg, socket99_result *out,
+    struct addrinfo **res);
+static void free_addrs(socket99_config *cfg, struct addrinfo *res);
+static int open_socket(socket99_config *cfg, socket99_result *out,
+    int domain, int type, int protocol, bool nonblocking);
+static int create_socket(socket99_config *cfg, socket99_result *out,
+    int domain, int type, int protocol, bool nonblocking);
+static bool nonblocking_at_socket(socket99_config *cfg);
 static bool set_nonblocking(socket99_result *out);
+static bool fail_with_errno(socket99_result *out,
+    enum socket99_status status);
 static bool set_socket_options(socket99_config *cfg,
-    socket99_result *out, int fd);
+    socket99_result *out, int fd, int family);
+static bool apply_socket_options(socket99_config *cfg,
+    socket99_result *out, int fd, int family);
+static bool attach_cpu_steering(socket99_result *out, size_t count);
+static int bound_port(int fd);
 static const char *status_key(enum socket99_status s);
 
 /* Attempt to open a socket, according to the configuration stored in
@@ -47,21 +135,399 @@ bool socket99_open(socket99_config *cfg, socket99_result *res) {
     if (cfg == NULL || res == NULL) { return false; }
     memset(res, 0, sizeof(*res));
 
+    bool ok = open_any(cfg, res);
+    RECORD_OPEN(cfg, res);
+    return ok;
+}
+
+static bool open_any(socket99_config *cfg, socket99_result *res) {
     if (!set_defaults_and_check_cfg(cfg)) {
         res->status = SOCKET99_ERROR_CONFIGURATION;
         return false;
     }
 
+    if (cfg->inherit) {
+        int adopted = adopt_inherited(cfg, res);
+        if (adopted != 0) { return adopted == 1; }
+    }
+
     if (cfg->path) {
         if (!make_unixdomain(cfg, res)) { return false; }
     } else {
-        if (!make_tcp_udp(cfg, res)) { return false; }
+        if (!make_tcp_udp(cfg, res, NULL)) { return false; }
+    }
+
+    if (cfg->nonblocking && !nonblocking_at_socket(cfg)) {
+        if (!set_nonblocking(res)) {
+            close(res->fd);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Open a TCP client, sending the start of BUF with the handshake. */
+bool socket99_open_send(socket99_config *cfg, const void *buf, size_t len,
+        ssize_t *sent, socket99_result *res) {
+    if (cfg == NULL || res == NULL) { return false; }
+    memset(res, 0, sizeof(*res));
+    if (sent) { *sent = 0; }
+
+    first_send fs = { .buf = buf, .len = len };
+    bool ok = open_any_send(cfg, &fs, res);
+    RECORD_OPEN(cfg, res);
+    if (ok && sent) { *sent = fs.sent; }
+    return ok;
+}
+
+static bool open_any_send(socket99_config *cfg, first_send *fs,
+        socket99_result *res) {
+    if (!set_defaults_and_check_cfg(cfg) || cfg->path || cfg->server
+        || cfg->datagram || (fs->buf == NULL && fs->len > 0)) {
+        res->status = SOCKET99_ERROR_CONFIGURATION;
+        return false;
     }
 
-    if (cfg->nonblocking) {
-        if (!set_nonblocking(res)) { return false; }
+    if (!make_tcp_udp(cfg, res, fs)) { return false; }
+
+    if (cfg->nonblocking && !set_nonblocking(res)) {
+        close(res->fd);
+        return false;
     }
+    return true;
+}
 
+bool socket99_fastopen_accepted(int fd) {
+#if defined(TCP_INFO) && defined(TCPI_OPT_SYN_DATA)
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1) {
+        return false;
+    }
+    return (info.tcpi_options & TCPI_OPT_SYN_DATA) != 0;
+#else
+    (void)fd;
+    return false;
+#endif
+}
+
+int socket99_incoming_cpu(int fd) {
+    if (SO_INCOMING_CPU == -1) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == -1) {
+        return -1;
+    }
+    return cpu;
+}
+
+bool socket99_pin_thread(int cpu) {
+#ifdef CPU_SET
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        errno = EINVAL;
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int res = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (res != 0) {
+        errno = res;
+        return false;
+    }
+    return true;
+#else
+    (void)cpu;
+    errno = ENOTSUP;
+    return false;
+#endif
+}
+
+/* Map a socket99_sockopt's level to a setsockopt(2) level. */
+static int sockopt_level(socket99_sockopt *opt) {
+    return opt->level == 0 ? SOL_SOCKET
+        : opt->level == SOCKET99_LEVEL_IP ? IPPROTO_IP : opt->level;
+}
+
+/* Accept a connection on FD, applying CFG's nonblocking and
+ * cloexec settings and accept_sockopts to the new connection. If
+ * setting it up fails, the connection is closed and *DROPPED is set,
+ * so the caller can tell it apart from an error accepting. */
+static int accept_conn(socket99_config *cfg, int fd,
+        struct sockaddr *addr, socklen_t *addr_len, bool *dropped) {
+    *dropped = false;
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+    int flags = (cfg->nonblocking ? SOCK_NONBLOCK : 0)
+        | (cfg->cloexec ? SOCK_CLOEXEC : 0);
+    int client_fd = accept4(fd, addr, addr_len, flags);
+    if (client_fd == -1) { return -1; }
+    bool ok = true;
+#else
+    int client_fd = accept(fd, addr, addr_len);
+    if (client_fd == -1) { return -1; }
+
+    bool ok = !(cfg->nonblocking
+            && fcntl(client_fd, F_SETFL, O_NONBLOCK) == -1)
+        && !(cfg->cloexec && fcntl(client_fd, F_SETFD, FD_CLOEXEC) == -1);
+#endif
+
+    for (size_t i = 0; ok && i < cfg->accept_sockopt_count; i++) {
+        socket99_sockopt *opt = &cfg->accept_sockopts[i];
+        ok = setsockopt(client_fd, sockopt_level(opt), opt->option_id,
+            opt->value, opt->value_len) == 0;
+    }
+
+    if (!ok) {
+        int saved_errno = errno;
+        close(client_fd);
+        errno = saved_errno;
+        *dropped = true;
+        return -1;
+    }
+    return client_fd;
+}
+
+int socket99_accept(socket99_config *cfg, int fd,
+        struct sockaddr *addr, socklen_t *addr_len) {
+    if (cfg == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    bool dropped;
+    return accept_conn(cfg, fd, addr, addr_len, &dropped);
+}
+
+int socket99_accept_burst(socket99_config *cfg, int fd,
+        socket99_accepted *conns, size_t max) {
+    if (cfg == NULL || (conns == NULL && max > 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t count = 0;
+    int drop_errno = 0;
+    while (count < max) {
+        socket99_accepted *c = &conns[count];
+        c->addr_len = sizeof(c->addr);
+        bool dropped;
+        c->fd = accept_conn(cfg, fd, (struct sockaddr *)&c->addr,
+            &c->addr_len, &dropped);
+        if (c->fd != -1) {
+            count++;
+            continue;
+        }
+
+        /* Setting up that connection failed and it was closed, but
+         * others may still be waiting. */
+        if (dropped) {
+            drop_errno = errno;
+            continue;
+        }
+        /* A client gave up while waiting; try the next one. */
+        if (errno == EINTR || errno == ECONNABORTED) { continue; }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) { break; }
+        /* Otherwise (EMFILE, etc.), report what was accepted; the
+         * error will recur on the next call. */
+        if (count > 0) { break; }
+        return -1;
+    }
+
+    /* Don't hide a setup error that dropped every connection. */
+    if (count == 0 && drop_errno != 0) {
+        errno = drop_errno;
+        return -1;
+    }
+    errno = 0;
+    return (int)count;
+}
+
+/* Open a group of COUNT server sockets sharing one address via
+ * SO_REUSEPORT. See the comment in socket99.h for details. */
+bool socket99_open_group(socket99_config *cfg, socket99_result *res,
+        size_t count, bool steer_by_cpu) {
+    if (cfg == NULL || res == NULL || count == 0) { return false; }
+    memset(res, 0, count * sizeof(*res));
+
+    /* Only IP servers can share a port. */
+    if (!cfg->server || cfg->path) {
+        res[0].status = SOCKET99_ERROR_CONFIGURATION;
+        return false;
+    }
+
+    socket99_config gcfg = *cfg;
+    gcfg.reuseport = true;
+
+    size_t opened;
+    for (opened = 0; opened < count; opened++) {
+        if (!socket99_open(&gcfg, &res[opened])) { break; }
+
+        /* Let the OS pick a port once, then bind the rest to it. */
+        if (opened == 0 && gcfg.port == 0) {
+            gcfg.port = bound_port(res[0].fd);
+            if (gcfg.port == -1) {
+                close(res[0].fd);
+                res[0].fd = -1;
+                return fail_with_errno(&res[0], SOCKET99_ERROR_UNKNOWN);
+            }
+        }
+    }
+
+    bool ok = (opened == count);
+    if (ok && steer_by_cpu) { ok = attach_cpu_steering(&res[0], count); }
+
+    if (!ok) {
+        for (size_t i = 0; i < opened; i++) {
+            close(res[i].fd);
+            res[i].fd = -1;
+        }
+        return false;
+    }
+    return true;
+}
+
+/* Open one listener on ADDR, into OUT. With V6ONLY, an IPv6 socket
+ * only takes IPv6 connections. */
+static bool open_listener(socket99_config *cfg, socket99_result *out,
+        struct addrinfo *ai, struct sockaddr *addr, bool v6only) {
+    int fd = open_socket(cfg, out, ai->ai_family, ai->ai_socktype,
+        ai->ai_protocol, nonblocking_at_socket(cfg));
+    if (fd == -1) { return false; }
+
+    bool ok = set_socket_options(cfg, out, fd, ai->ai_family);
+#ifdef IPV6_V6ONLY
+    if (ok && v6only && ai->ai_family == AF_INET6) {
+        int v_true = 1;
+        COUNT_SYSCALL(out);
+        if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY,
+                &v_true, sizeof(v_true)) < 0) {
+            ok = fail_with_errno(out, SOCKET99_ERROR_SETSOCKOPT);
+        }
+    }
+#else
+    (void)v6only;
+#endif
+    if (ok) {
+        uint64_t t0 = PHASE_BEGIN();
+        ok = bind_and_listen(cfg, out, fd, addr, ai->ai_addrlen);
+        PHASE_END(out, SOCKET99_PHASE_BIND, t0);
+    }
+    if (!ok) {
+        close(fd);
+        return false;
+    }
+    out->status = SOCKET99_OK;
+    out->fd = fd;
+    return true;
+}
+
+/* Set the port in an IPv4 or IPv6 address. */
+static void set_port(struct sockaddr *addr, int port) {
+    if (addr->sa_family == AF_INET) {
+        ((struct sockaddr_in *)addr)->sin_port = htons((uint16_t)port);
+    } else if (addr->sa_family == AF_INET6) {
+        ((struct sockaddr_in6 *)addr)->sin6_port = htons((uint16_t)port);
+    }
+}
+
+bool socket99_open_listeners(socket99_config *cfg,
+        const char * const *hosts, size_t host_count,
+        socket99_result *res, size_t *count) {
+    if (cfg == NULL || res == NULL || count == NULL || *count == 0) {
+        return false;
+    }
+    size_t max = *count;
+    memset(res, 0, max * sizeof(*res));
+    *count = 0;
+
+    if (!set_defaults_and_check_cfg(cfg) || !cfg->server || cfg->path
+        || (hosts == NULL && host_count > 0)) {
+        res[0].status = SOCKET99_ERROR_CONFIGURATION;
+        return false;
+    }
+
+    socket99_config hcfg = *cfg;
+    socket99_result err;
+    memset(&err, 0, sizeof(err));
+    size_t opened = 0;
+    bool ok = true;
+
+    /* With no list of hosts, use CFG's own address once. */
+    size_t lookups = hosts ? host_count : 1;
+    for (size_t h = 0; ok && h < lookups; h++) {
+        if (hosts) {
+            hcfg.host = (char *)hosts[h];
+            hcfg.IPv4 = hcfg.IPv6 = NULL;
+        }
+        struct addrinfo *addrs = NULL;
+        if (!resolve(&hcfg, &err, &addrs)) {
+            ok = false;
+            break;
+        }
+
+        for (struct addrinfo *ai = addrs; ok && ai != NULL; ai = ai->ai_next) {
+            if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6) {
+                continue;
+            }
+            struct sockaddr_storage ss;
+            if (ai->ai_addrlen > sizeof(ss)) { continue; }
+            memcpy(&ss, ai->ai_addr, ai->ai_addrlen);
+            set_port((struct sockaddr *)&ss, hcfg.port);
+
+            /* getaddrinfo can list an address more than once. */
+            bool dup = false;
+            for (size_t i = 0; i < opened && !dup; i++) {
+                struct sockaddr_storage bound;
+                socklen_t len = sizeof(bound);
+                dup = getsockname(res[i].fd, (struct sockaddr *)&bound,
+                    &len) == 0 && len == ai->ai_addrlen
+                    && 0 == memcmp(&bound, &ss, len);
+            }
+            if (dup) { continue; }
+
+            if (opened == max) {
+                errno = ENOBUFS;
+                fail_with_errno(&err, SOCKET99_ERROR_CONFIGURATION);
+                ok = false;
+                break;
+            }
+            if (!open_listener(&hcfg, &res[opened], ai,
+                    (struct sockaddr *)&ss, true)) {
+                err = res[opened];
+                ok = false;
+                break;
+            }
+            opened++;
+
+            /* Let the OS pick a port once, then bind the rest to it. */
+            if (hcfg.port == 0) {
+                hcfg.port = bound_port(res[0].fd);
+                if (hcfg.port == -1) {
+                    fail_with_errno(&err, SOCKET99_ERROR_UNKNOWN);
+                    ok = false;
+                }
+            }
+        }
+        free_addrs(&hcfg, addrs);
+    }
+
+    if (ok && opened == 0) {
+        errno = EADDRNOTAVAIL;
+        fail_with_errno(&err, SOCKET99_ERROR_BIND);
+        ok = false;
+    }
+    if (!ok) {
+        for (size_t i = 0; i < opened; i++) { close(res[i].fd); }
+        memset(res, 0, max * sizeof(*res));
+        res[0] = err;
+        res[0].fd = -1;
+        return false;
+    }
+    *count = opened;
     return true;
 }
 
@@ -124,9 +590,146 @@ static bool set_defaults_and_check_cfg(socket99_config *cfg) {
 
     /* Screen out contradictory settings */
     if (cfg->IPv6 && cfg->IPv4) { return false; }
+    if (cfg->sockopt_count > 0 && cfg->sockopt_list == NULL) { return false; }
+    if ((unsigned)cfg->profile > SOCKET99_PROFILE_FAN_IN) { return false; }
+    if (cfg->fastopen_qlen < 0) { return false; }
+    if (cfg->busy_poll_usec < 0 || cfg->busy_poll_budget < 0) { return false; }
+    if (cfg->accept_sockopt_count > 0 && cfg->accept_sockopts == NULL) {
+        return false;
+    }
+    if (cfg->inherit && !cfg->server) { return false; }
+    return true;
+}
+
+/* First fd passed by socket activation, and the most tracked. */
+#define LISTEN_FDS_START 3
+#define MAX_INHERITED_FDS 256
+
+/* Inherited fds already adopted, by index from LISTEN_FDS_START. */
+static pthread_mutex_t inherit_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool inherit_claimed[MAX_INHERITED_FDS];
+
+/* Get the number of fds passed to this process by LISTEN_FDS. */
+static int inherited_count(void) {
+    const char *pid_str = getenv("LISTEN_PID");
+    const char *fds_str = getenv("LISTEN_FDS");
+    if (pid_str == NULL || fds_str == NULL) { return 0; }
+
+    char *end = NULL;
+    long pid = strtol(pid_str, &end, 10);
+    if (*end != '\0' || pid != (long)getpid()) { return 0; }
+    long count = strtol(fds_str, &end, 10);
+    if (*end != '\0' || count < 0) { return 0; }
+    return count > MAX_INHERITED_FDS ? MAX_INHERITED_FDS : (int)count;
+}
+
+/* Does the bound address SA match AI (ignoring AI's port if 0)? */
+static bool same_address(struct addrinfo *ai, struct sockaddr_storage *sa,
+        bool any_port) {
+    if (ai->ai_family != sa->ss_family) { return false; }
+    if (sa->ss_family == AF_INET) {
+        struct sockaddr_in *a = (struct sockaddr_in *)ai->ai_addr;
+        struct sockaddr_in *b = (struct sockaddr_in *)sa;
+        return a->sin_addr.s_addr == b->sin_addr.s_addr
+            && (any_port || a->sin_port == b->sin_port);
+    } else if (sa->ss_family == AF_INET6) {
+        struct sockaddr_in6 *a = (struct sockaddr_in6 *)ai->ai_addr;
+        struct sockaddr_in6 *b = (struct sockaddr_in6 *)sa;
+        return 0 == memcmp(&a->sin6_addr, &b->sin6_addr,
+            sizeof(a->sin6_addr))
+            && (any_port || a->sin6_port == b->sin6_port);
+    }
+    return false;
+}
+
+/* Is FD a socket CFG would have opened? ADDRS are CFG's resolved
+ * addresses, unless it has a path. Sets *FAMILY. */
+static bool inherited_matches(socket99_config *cfg, int fd,
+        struct addrinfo *addrs, int *family) {
+    int type = 0;
+    socklen_t len = sizeof(type);
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == -1
+        || type != (cfg->datagram ? SOCK_DGRAM : SOCK_STREAM)) {
+        return false;
+    }
+
+    struct sockaddr_storage sa;
+    len = sizeof(sa);
+    memset(&sa, 0, sizeof(sa));
+    if (getsockname(fd, (struct sockaddr *)&sa, &len) == -1) {
+        return false;
+    }
+    *family = sa.ss_family;
+
+    bool match = false;
+    if (cfg->path) {
+        struct sockaddr_un *sun = (struct sockaddr_un *)&sa;
+        match = sa.ss_family == AF_UNIX
+            && 0 == strncmp(sun->sun_path, cfg->path, sizeof(sun->sun_path));
+    } else {
+        for (struct addrinfo *ai = addrs; ai != NULL; ai = ai->ai_next) {
+            if (same_address(ai, &sa, cfg->port == 0)) {
+                match = true;
+                break;
+            }
+        }
+    }
+    if (!match) { return false; }
+
+#ifdef SO_ACCEPTCONN
+    if (!cfg->datagram) {
+        int listening = 0;
+        len = sizeof(listening);
+        if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN,
+                &listening, &len) == -1 || !listening) {
+            return false;
+        }
+    }
+#endif
     return true;
 }
 
+/* Adopt a socket inherited through socket activation, if one matches
+ * CFG. Returns 1 if one was adopted, 0 if none matched, or -1 on
+ * error, with details in OUT. An fd that fails to adopt is left open,
+ * since it belongs to the supervisor, and unclaimed. */
+static int adopt_inherited(socket99_config *cfg, socket99_result *out) {
+    int count = inherited_count();
+    if (count == 0) { return 0; }
+
+    struct addrinfo *addrs = NULL;
+    if (cfg->path == NULL && !resolve(cfg, out, &addrs)) { return -1; }
+
+    int slot = -1;
+    int family = AF_UNSPEC;
+    pthread_mutex_lock(&inherit_lock);
+    for (int i = 0; i < count; i++) {
+        if (inherit_claimed[i]) { continue; }
+        if (inherited_matches(cfg, LISTEN_FDS_START + i, addrs, &family)) {
+            inherit_claimed[i] = true;
+            slot = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&inherit_lock);
+    if (addrs) { free_addrs(cfg, addrs); }
+    if (slot == -1) { return 0; }
+
+    int fd = LISTEN_FDS_START + slot;
+    out->fd = fd;
+    out->inherited = true;
+    if (!set_socket_options(cfg, out, fd, family)
+        || !socket99__set_fd_flags(cfg, out)) {
+        pthread_mutex_lock(&inherit_lock);
+        inherit_claimed[slot] = false;
+        pthread_mutex_unlock(&inherit_lock);
+        out->fd = -1;
+        out->inherited = false;
+        return -1;
+    }
+    return 1;
+}
+
 static bool fail_with_errno(socket99_result *out, enum socket99_status status) {
     out->status = status;
     out->saved_errno = errno;
@@ -135,12 +738,13 @@ static bool fail_with_errno(socket99_result *out, enum socket99_status status) {
 }
 
 static bool make_unixdomain(socket99_config *cfg, socket99_result *out) {
-    int fd = socket(AF_UNIX, cfg->datagram ? SOCK_DGRAM : SOCK_STREAM, 0);
-    if (fd == -1) {
-        return fail_with_errno(out, SOCKET99_ERROR_SOCKET);
-    }
+    int fd = open_socket(cfg, out, AF_UNIX,
+        cfg->datagram ? SOCK_DGRAM : SOCK_STREAM, 0,
+        nonblocking_at_socket(cfg));
+    if (fd == -1) { return false; }
 
-    if (!set_socket_options(cfg, out, fd)) {
+    if (!set_socket_options(cfg, out, fd, AF_UNIX)) {
+        close(fd);
         return false;
     }
 
@@ -151,24 +755,37 @@ static bool make_unixdomain(socket99_config *cfg, socket99_result *out) {
 
     int snprintf_res = snprintf(sun.sun_path, name_max, "%s", cfg->path);
     if ((int)name_max < snprintf_res) {
+        close(fd);
         return fail_with_errno(out, SOCKET99_ERROR_SNPRINTF);
     }
 
+    enum socket99_status status = SOCKET99_OK;
+    uint64_t t0 = PHASE_BEGIN();
     if (cfg->server) {
         /* Note: intentionally NOT unlinking the path here. */
+        COUNT_SYSCALL(out);
         if (0 != bind(fd, (struct sockaddr *) &sun, sizeof(sun))) {
-            return fail_with_errno(out, SOCKET99_ERROR_BIND);
-        }
-
-        if (!cfg->datagram) {
+            status = SOCKET99_ERROR_BIND;
+        } else if (!cfg->datagram) {
+            COUNT_SYSCALL(out);
             if (listen(fd, cfg->backlog_size) != 0) {
-                return fail_with_errno(out, SOCKET99_ERROR_LISTEN);
+                status = SOCKET99_ERROR_LISTEN;
             }
         }
+        PHASE_END(out, SOCKET99_PHASE_BIND, t0);
     } else /* client */ {
+        COUNT_SYSCALL(out);
+        COUNT_ADDR_TRIED(out);
         if (0 != connect(fd, (struct sockaddr *) &sun, sizeof(sun))) {
-            return fail_with_errno(out, SOCKET99_ERROR_CONNECT);
+            status = SOCKET99_ERROR_CONNECT;
         }
+        PHASE_END(out, SOCKET99_PHASE_CONNECT, t0);
+    }
+
+    if (status != SOCKET99_OK) {
+        fail_with_errno(out, status);
+        close(fd);
+        return false;
     }
     
     out->status = SOCKET99_OK;
@@ -178,13 +795,15 @@ static bool make_unixdomain(socket99_config *cfg, socket99_result *out) {
 
 #define PORT_STR_BUFSZ 6
 
-static bool make_tcp_udp(socket99_config *cfg, socket99_result *out) {
+/* Look up the address(es) for CFG's host and port, through CFG's
+ * resolver if it has one. On success, the caller must free *RES with
+ * free_addrs. */
+static bool resolve(socket99_config *cfg, socket99_result *out,
+        struct addrinfo **res) {
     struct addrinfo hints;
-    struct addrinfo *res = NULL;
-
-    int fd = -1;
     char port_str[PORT_STR_BUFSZ];
     memset(port_str, 0, PORT_STR_BUFSZ);
+    *res = NULL;
 
     socket99_set_hints(cfg, &hints);
 
@@ -193,54 +812,84 @@ static bool make_tcp_udp(socket99_config *cfg, socket99_result *out) {
         return fail_with_errno(out, SOCKET99_ERROR_SNPRINTF);
     }
 
-    struct addrinfo *ai = NULL;
-    int addr_res = getaddrinfo(cfg->host, port_str, &hints, &res);
+    const char *node = cfg->IPv4 ? cfg->IPv4
+        : cfg->IPv6 ? cfg->IPv6 : cfg->host;
+    uint64_t t0 = PHASE_BEGIN();
+    int addr_res = cfg->resolver
+        ? socket99_resolver_getaddrinfo(cfg->resolver,
+            node, port_str, &hints, res)
+        : getaddrinfo(node, port_str, &hints, res);
+    PHASE_END(out, SOCKET99_PHASE_RESOLVE, t0);
     if (addr_res != 0) {
         out->getaddrinfo_error = addr_res;
-        freeaddrinfo(res);
+        if (*res != NULL) {
+            free_addrs(cfg, *res);
+            *res = NULL;
+        }
         return fail_with_errno(out, SOCKET99_ERROR_GETADDRINFO);
     }
-    
+    return true;
+}
+
+static void free_addrs(socket99_config *cfg, struct addrinfo *res) {
+    if (cfg->resolver) {
+        socket99_resolver_freeaddrinfo(cfg->resolver, res);
+    } else {
+        freeaddrinfo(res);
+    }
+}
+
+static bool make_tcp_udp(socket99_config *cfg, socket99_result *out,
+        first_send *fs) {
+    struct addrinfo *res = NULL;
+    struct addrinfo *ai = NULL;
+    int fd = -1;
+
+    if (!resolve(cfg, out, &res)) { return false; }
+
     for (ai = res; ai != NULL; ai=ai->ai_next) {
-        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-        if (fd == -1) {
-            /* Save errno, but will be clobbered if others succeed. */
-            out->status = SOCKET99_ERROR_SOCKET;
-            out->saved_errno = errno;
-            errno = 0;
-            continue;
-        }
+        /* Save errno on failure, but will be clobbered if others succeed. */
+        fd = open_socket(cfg, out, ai->ai_family, ai->ai_socktype,
+            ai->ai_protocol, nonblocking_at_socket(cfg));
+        if (fd == -1) { continue; }
 
-        if (!set_socket_options(cfg, out, fd)) {
-            freeaddrinfo(res);
+        if (!set_socket_options(cfg, out, fd, ai->ai_family)) {
+            close(fd);
+            free_addrs(cfg, res);
             return false;
         }
 
         if (cfg->server) {
-            int bind_res = bind(fd, res->ai_addr, res->ai_addrlen);
-            if (bind_res == -1) {
-                freeaddrinfo(res);
-                return fail_with_errno(out, SOCKET99_ERROR_BIND);
-            }
-
-            if (!cfg->datagram) {
-                int listen_res = listen(fd, cfg->backlog_size);
-                if (listen_res == -1) {
-                    freeaddrinfo(res);
-                    return fail_with_errno(out, SOCKET99_ERROR_LISTEN);
-                }
+            uint64_t t0 = PHASE_BEGIN();
+            bool bound = bind_and_listen(cfg, out, fd,
+                ai->ai_addr, ai->ai_addrlen);
+            PHASE_END(out, SOCKET99_PHASE_BIND, t0);
+            if (!bound) {
+                close(fd);
+                free_addrs(cfg, res);
+                return false;
             }
             break;
         } else /* client */ {
             if (cfg->datagram) { break; }
 
-            int connect_res = connect(fd, ai->ai_addr, ai->ai_addrlen);
-            if (connect_res == 0) {
+            bool connected;
+            uint64_t t0 = PHASE_BEGIN();
+            COUNT_ADDR_TRIED(out);
+            if (fs) {
+                connected = connect_first(out, fd, ai, fs);
+            } else {
+                COUNT_SYSCALL(out);
+                connected = connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+            }
+            PHASE_END(out, SOCKET99_PHASE_CONNECT, t0);
+            if (connected) {
                 break;
             } else {
+                out->status = SOCKET99_ERROR_CONNECT;
+                out->saved_errno = errno;
                 close(fd);
                 fd = -1;
-                out->status = SOCKET99_ERROR_CONNECT;
                 continue;
             }
         }
@@ -248,49 +897,706 @@ static bool make_tcp_udp(socket99_config *cfg, socket99_result *out) {
 
     if (fd == -1) {
         if (out->status == SOCKET99_OK) {
-            freeaddrinfo(res);
+            free_addrs(cfg, res);
             return fail_with_errno(out, SOCKET99_ERROR_UNKNOWN);
         } else {
-            out->saved_errno = errno;
             errno = 0;
-            freeaddrinfo(res);
+            free_addrs(cfg, res);
             return false;
         }
     }
 
     out->status = SOCKET99_OK;
-    freeaddrinfo(res);
+    free_addrs(cfg, res);
     out->saved_errno = 0;
     out->fd = fd;
     return true;
 }
 
+/* Bind a server socket to ADDR and (unless it's a datagram socket)
+ * listen, enabling TCP Fast Open first if configured. */
+static bool bind_and_listen(socket99_config *cfg, socket99_result *out,
+        int fd, struct sockaddr *addr, socklen_t addr_len) {
+    COUNT_SYSCALL(out);
+    if (bind(fd, addr, addr_len) == -1) {
+        return fail_with_errno(out, SOCKET99_ERROR_BIND);
+    }
+    if (cfg->datagram) { return true; }
+
+    if (cfg->fastopen_qlen > 0) {
+#ifdef TCP_FASTOPEN
+        COUNT_SYSCALL(out);
+        if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN,
+                &cfg->fastopen_qlen, sizeof(cfg->fastopen_qlen)) < 0) {
+            return fail_with_errno(out, SOCKET99_ERROR_SETSOCKOPT);
+        }
+#else
+        errno = ENOTSUP;
+        return fail_with_errno(out, SOCKET99_ERROR_UNSUPPORTED);
+#endif
+    }
+
+    COUNT_SYSCALL(out);
+    if (listen(fd, cfg->backlog_size) == -1) {
+        return fail_with_errno(out, SOCKET99_ERROR_LISTEN);
+    }
+    return true;
+}
+
+/* Connect FD to AI, sending FS's data along with the SYN using TCP
+ * Fast Open where supported. If the server hasn't given us a cookie
+ * yet, the kernel asks for one and sends the data once connected.
+ * Returns whether it connected; on failure, errno is set. */
+static bool connect_first(socket99_result *out, int fd,
+        struct addrinfo *ai, first_send *fs) {
+    (void)out;                  /* only used to count system calls */
+    ssize_t res;
+#ifdef MSG_FASTOPEN
+    COUNT_SYSCALL(out);
+    do {
+        res = sendto(fd, fs->buf, fs->len, MSG_FASTOPEN | MSG_NOSIGNAL,
+            ai->ai_addr, ai->ai_addrlen);
+    } while (res == -1 && errno == EINTR);
+    /* EOPNOTSUPP: Fast Open is disabled for clients by sysctl. */
+    if (res != -1 || errno != EOPNOTSUPP) {
+        fs->sent = res;
+        return res != -1;
+    }
+#endif
+    COUNT_SYSCALL(out);
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == -1) { return false; }
+    if (fs->len == 0) {
+        fs->sent = 0;
+        return true;
+    }
+    COUNT_SYSCALL(out);
+    do {
+        res = send(fd, fs->buf, fs->len, 0);
+    } while (res == -1 && errno == EINTR);
+    fs->sent = res;
+    return res != -1;
+}
+
+/* Create a socket, setting close-on-exec (per CFG) and NONBLOCKING
+ * atomically where socket(2) supports it, or with fcntl(2) otherwise.
+ * Returns the fd, or -1 on error. */
+static int open_socket(socket99_config *cfg, socket99_result *out,
+        int domain, int type, int protocol, bool nonblocking) {
+    uint64_t t0 = PHASE_BEGIN();
+    int fd = create_socket(cfg, out, domain, type, protocol, nonblocking);
+    PHASE_END(out, SOCKET99_PHASE_SOCKET, t0);
+    return fd;
+}
+
+static int create_socket(socket99_config *cfg, socket99_result *out,
+        int domain, int type, int protocol, bool nonblocking) {
+#ifdef SOCK_CLOEXEC
+    if (cfg->cloexec) { type |= SOCK_CLOEXEC; }
+#endif
+#ifdef SOCK_NONBLOCK
+    if (nonblocking) { type |= SOCK_NONBLOCK; }
+#endif
+
+    COUNT_SYSCALL(out);
+    int fd = socket(domain, type, protocol);
+    if (fd == -1) {
+        fail_with_errno(out, SOCKET99_ERROR_SOCKET);
+        return -1;
+    }
+
+#ifndef SOCK_CLOEXEC
+    if (cfg->cloexec) {
+        COUNT_SYSCALL(out);
+        if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+            fail_with_errno(out, SOCKET99_ERROR_FCNTL);
+            close(fd);
+            return -1;
+        }
+    }
+#endif
+#ifndef SOCK_NONBLOCK
+    if (nonblocking) {
+        COUNT_SYSCALL(out);
+        if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+            fail_with_errno(out, SOCKET99_ERROR_FCNTL);
+            close(fd);
+            return -1;
+        }
+    }
+#endif
+    return fd;
+}
+
+/* Can CFG's socket be made nonblocking as soon as it is created?
+ * Stream clients connect while blocking, then switch afterward. */
+static bool nonblocking_at_socket(socket99_config *cfg) {
+    return cfg->nonblocking && (cfg->server || cfg->datagram);
+}
+
 static bool set_nonblocking(socket99_result *out) {
-    int flags = fcntl(out->fd, F_GETFL, 0);
-    if (flags == -1) {
+    /* A newly created socket has no other status flags set,
+     * so there's no need to F_GETFL first. */
+    COUNT_SYSCALL(out);
+    uint64_t t0 = PHASE_BEGIN();
+    int res = fcntl(out->fd, F_SETFL, O_NONBLOCK);
+    PHASE_END(out, SOCKET99_PHASE_FCNTL, t0);
+    if (res < 0) {
         return fail_with_errno(out, SOCKET99_ERROR_FCNTL);
     }
-    if (fcntl(out->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
-        return fail_with_errno(out, SOCKET99_ERROR_FCNTL);
+    return true;
+}
+
+bool socket99__set_fd_flags(const socket99_config *cfg,
+        socket99_result *out) {
+    int fd = out->fd;
+    COUNT_SYSCALL(out);
+    uint64_t t0 = PHASE_BEGIN();
+    int flags = fcntl(fd, F_GETFL);
+    int want = cfg->nonblocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    bool ok = flags != -1;
+    if (ok && want != flags) {
+        COUNT_SYSCALL(out);
+        ok = fcntl(fd, F_SETFL, want) != -1;
+    }
+
+    if (ok) { COUNT_SYSCALL(out); }
+    int fd_flags = ok ? fcntl(fd, F_GETFD) : -1;
+    int want_fd = cfg->cloexec ? (fd_flags | FD_CLOEXEC)
+        : (fd_flags & ~FD_CLOEXEC);
+    ok = ok && fd_flags != -1;
+    if (ok && want_fd != fd_flags) {
+        COUNT_SYSCALL(out);
+        ok = fcntl(fd, F_SETFD, want_fd) != -1;
     }
+    PHASE_END(out, SOCKET99_PHASE_FCNTL, t0);
+    if (!ok) { return fail_with_errno(out, SOCKET99_ERROR_FCNTL); }
     return true;
 }
 
-static bool set_socket_options(socket99_config *cfg,
+/* One option set by a tuning profile. */
+typedef struct {
+    enum socket99_profile profile;
+    int level;                  /* SOL_SOCKET, IPPROTO_TCP, or IPPROTO_IP */
+    int option_id;
+    int value;
+    bool server_only;
+} profile_opt;
+
+static const profile_opt profile_opts[] = {
+#ifdef TCP_NOTSENT_LOWAT
+    { SOCKET99_PROFILE_LOW_LATENCY, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+      16 * 1024, false },
+#endif
+    { SOCKET99_PROFILE_LOW_LATENCY, IPPROTO_TCP, TCP_NODELAY, 1, false },
+    { SOCKET99_PROFILE_LOW_LATENCY, IPPROTO_IP, IP_TOS,
+      IPTOS_LOWDELAY, false },
+
+    { SOCKET99_PROFILE_BULK, SOL_SOCKET, SO_SNDBUF, 4 * 1024 * 1024, false },
+    { SOCKET99_PROFILE_BULK, SOL_SOCKET, SO_RCVBUF, 4 * 1024 * 1024, false },
+    { SOCKET99_PROFILE_BULK, IPPROTO_IP, IP_TOS, IPTOS_THROUGHPUT, false },
+
+    { SOCKET99_PROFILE_FAN_IN, SOL_SOCKET, SO_SNDBUF, 64 * 1024, false },
+    { SOCKET99_PROFILE_FAN_IN, SOL_SOCKET, SO_RCVBUF, 64 * 1024, false },
+    { SOCKET99_PROFILE_FAN_IN, SOL_SOCKET, SO_REUSEADDR, 1, true },
+    { SOCKET99_PROFILE_FAN_IN, IPPROTO_TCP, TCP_NODELAY, 1, false },
+#ifdef TCP_DEFER_ACCEPT
+    { SOCKET99_PROFILE_FAN_IN, IPPROTO_TCP, TCP_DEFER_ACCEPT, 1, true },
+#endif
+};
+#define PROFILE_OPT_COUNT (sizeof(profile_opts) / sizeof(profile_opts[0]))
+
+/* Set the options for CFG's profile that apply to a socket of FAMILY. */
+static bool set_profile_options(socket99_config *cfg,
+        socket99_result *out, int fd, int family) {
+    bool inet = family == AF_INET || family == AF_INET6;
+    bool tcp = inet && !cfg->datagram;
+
+    for (size_t i = 0; i < PROFILE_OPT_COUNT; i++) {
+        const profile_opt *po = &profile_opts[i];
+        if (po->profile != cfg->profile) { continue; }
+        if (po->server_only && !cfg->server) { continue; }
+        if (po->level == IPPROTO_TCP && !tcp) { continue; }
+
+        int level = po->level, option_id = po->option_id;
+        if (level == IPPROTO_IP) {
+            if (!inet) { continue; }
+#ifdef IPV6_TCLASS
+            /* IPv6 calls the TOS byte the traffic class. */
+            if (family == AF_INET6 && option_id == IP_TOS) {
+                level = IPPROTO_IPV6;
+                option_id = IPV6_TCLASS;
+            }
+#else
+            if (family == AF_INET6) { continue; }
+#endif
+        }
+
+        COUNT_SYSCALL(out);
+        if (setsockopt(fd, level, option_id,
+                &po->value, sizeof(po->value)) < 0) {
+            return fail_with_errno(out, SOCKET99_ERROR_SETSOCKOPT);
+        }
+    }
+    return true;
+}
+
+/* Set an int SOL_SOCKET option, or fail as unsupported if OPTION_ID
+ * is -1 (not defined on this platform). */
+static bool set_int_sockopt(socket99_result *out, int fd,
+        int option_id, int value) {
+    if (option_id == -1) {
+        errno = ENOTSUP;
+        return fail_with_errno(out, SOCKET99_ERROR_UNSUPPORTED);
+    }
+    COUNT_SYSCALL(out);
+    if (setsockopt(fd, SOL_SOCKET, option_id, &value, sizeof(value)) < 0) {
+        return fail_with_errno(out, SOCKET99_ERROR_SETSOCKOPT);
+    }
+    return true;
+}
+
+static bool set_affinity_options(socket99_config *cfg,
         socket99_result *out, int fd) {
+    if (cfg->set_incoming_cpu && !set_int_sockopt(out, fd,
+            SO_INCOMING_CPU, cfg->incoming_cpu)) {
+        return false;
+    }
+    if (cfg->busy_poll_usec > 0 && !set_int_sockopt(out, fd,
+            SO_BUSY_POLL, cfg->busy_poll_usec)) {
+        return false;
+    }
+    if (cfg->busy_poll_budget > 0 && !set_int_sockopt(out, fd,
+            SO_BUSY_POLL_BUDGET, cfg->busy_poll_budget)) {
+        return false;
+    }
+    if (cfg->prefer_busy_poll && !set_int_sockopt(out, fd,
+            SO_PREFER_BUSY_POLL, 1)) {
+        return false;
+    }
+    return true;
+}
+
+static bool set_sockopt(socket99_result *out, int fd,
+        socket99_sockopt *opt) {
+    COUNT_SYSCALL(out);
+    if (setsockopt(fd, sockopt_level(opt), opt->option_id,
+            opt->value, opt->value_len) < 0) {
+        return fail_with_errno(out, SOCKET99_ERROR_SETSOCKOPT);
+    }
+    return true;
+}
+
+static bool set_socket_options(socket99_config *cfg,
+        socket99_result *out, int fd, int family) {
+    uint64_t t0 = PHASE_BEGIN();
+    bool ok = apply_socket_options(cfg, out, fd, family);
+    PHASE_END(out, SOCKET99_PHASE_SETSOCKOPT, t0);
+    return ok;
+}
+
+static bool apply_socket_options(socket99_config *cfg,
+        socket99_result *out, int fd, int family) {
+    if (cfg->reuseport) {
+#ifdef SO_REUSEPORT
+        int v_true = 1;
+        COUNT_SYSCALL(out);
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+                &v_true, sizeof(v_true)) < 0) {
+            return fail_with_errno(out, SOCKET99_ERROR_SETSOCKOPT);
+        }
+#else
+        errno = ENOTSUP;
+        return fail_with_errno(out, SOCKET99_ERROR_UNSUPPORTED);
+#endif
+    }
+
+    if (cfg->zerocopy) {
+#ifdef SO_ZEROCOPY
+        int v_true = 1;
+        COUNT_SYSCALL(out);
+        if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY,
+                &v_true, sizeof(v_true)) < 0) {
+            return fail_with_errno(out, SOCKET99_ERROR_SETSOCKOPT);
+        }
+#else
+        errno = ENOTSUP;
+        return fail_with_errno(out, SOCKET99_ERROR_UNSUPPORTED);
+#endif
+    }
+
+    if (!set_affinity_options(cfg, out, fd)) { return false; }
+
+    if (cfg->profile != SOCKET99_PROFILE_DEFAULT
+        && !set_profile_options(cfg, out, fd, family)) {
+        return false;
+    }
+
     for (int i = 0; i < SOCKET99_MAX_SOCK_OPTS; i++) {
         socket99_sockopt *opt = &cfg->sockopts[i];
         if (opt->option_id == 0) { break; }
+        if (!set_sockopt(out, fd, opt)) { return false; }
+    }
 
-        if (setsockopt(fd, SOL_SOCKET, opt->option_id,
-                opt->value, opt->value_len) < 0) {
-            return fail_with_errno(out, SOCKET99_ERROR_SETSOCKOPT);
-        }
+    for (size_t i = 0; i < cfg->sockopt_count; i++) {
+        if (!set_sockopt(out, fd, &cfg->sockopt_list[i])) { return false; }
     }
     
     return true;
 }
 
+/* Attach a classic BPF program to a SO_REUSEPORT group that picks the
+ * socket at index (current CPU % COUNT) for each incoming packet. */
+static bool attach_cpu_steering(socket99_result *out, size_t count) {
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+    struct sock_filter code[] = {
+        /* A = CPU handling this packet */
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+        /* A = A % count */
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)count },
+        /* Use A as the index into the group. */
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog = {
+        .len = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+
+    COUNT_SYSCALL(out);
+    if (setsockopt(out->fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+            &prog, sizeof(prog)) < 0) {
+        return fail_with_errno(out, SOCKET99_ERROR_SETSOCKOPT);
+    }
+    return true;
+#else
+    (void)count;
+    errno = ENOTSUP;
+    return fail_with_errno(out, SOCKET99_ERROR_UNSUPPORTED);
+#endif
+}
+
+/* Get the local port a socket is bound to, or -1 on error. */
+static int bound_port(int fd) {
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    if (getsockname(fd, (struct sockaddr *)&ss, &len) == -1) { return -1; }
+
+    switch (ss.ss_family) {
+    case AF_INET:
+        return ntohs(((struct sockaddr_in *)&ss)->sin_port);
+    case AF_INET6:
+        return ntohs(((struct sockaddr_in6 *)&ss)->sin6_port);
+    default:
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+}
+
+/* Asynchronous TCP client connections ("Happy Eyeballs", RFC 8305) */
+
+struct socket99_pending {
+    socket99_config cfg;
+    struct addrinfo *addrs;     /* from getaddrinfo */
+    struct addrinfo **order;    /* addresses, interleaved by family */
+    int *fds;                   /* fd for each started attempt, or -1 */
+    size_t addr_count;
+    size_t started;             /* number of attempts started */
+    uint64_t next_start_msec;   /* when to start the next attempt */
+    bool finished;
+    socket99_result result;     /* last failure, or the final result */
+};
+
+static uint64_t now_msec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/* Order addresses so attempts alternate between the first address's
+ * family and the others, keeping getaddrinfo's order within each. */
+static void interleave_families(socket99_pending *p) {
+    int family = p->addrs->ai_family;
+    struct addrinfo *same = p->addrs;
+    struct addrinfo *other = p->addrs;
+    bool want_same = true;
+
+    for (size_t i = 0; i < p->addr_count; i++) {
+        while (same && same->ai_family != family) { same = same->ai_next; }
+        while (other && other->ai_family == family) { other = other->ai_next; }
+
+        struct addrinfo **pick = ((want_same && same) || other == NULL)
+            ? &same : &other;
+        p->order[i] = *pick;
+        *pick = (*pick)->ai_next;
+        want_same = !want_same;
+    }
+}
+
+socket99_pending *socket99_open_async(socket99_config *cfg,
+        socket99_result *res) {
+    if (cfg == NULL || res == NULL) { return NULL; }
+    memset(res, 0, sizeof(*res));
+
+    if (!set_defaults_and_check_cfg(cfg)
+        || cfg->path || cfg->server || cfg->datagram) {
+        res->status = SOCKET99_ERROR_CONFIGURATION;
+        return NULL;
+    }
+
+    struct addrinfo *addrs = NULL;
+    if (!resolve(cfg, res, &addrs)) { return NULL; }
+
+    size_t count = 0;
+    for (struct addrinfo *ai = addrs; ai != NULL; ai = ai->ai_next) {
+        count++;
+    }
+
+    socket99_pending *p = calloc(1, sizeof(*p));
+    if (p != NULL) {
+        p->order = calloc(count, sizeof(*p->order));
+        p->fds = calloc(count, sizeof(*p->fds));
+    }
+    if (p == NULL || p->order == NULL || p->fds == NULL) {
+        if (p != NULL) {
+            free(p->order);
+            free(p->fds);
+            free(p);
+        }
+        free_addrs(cfg, addrs);
+        errno = ENOMEM;
+        fail_with_errno(res, SOCKET99_ERROR_UNKNOWN);
+        return NULL;
+    }
+
+    p->cfg = *cfg;
+    if (p->cfg.connect_stagger_msec <= 0) {
+        p->cfg.connect_stagger_msec = SOCKET99_DEF_STAGGER_MSEC;
+    }
+    p->addrs = addrs;
+    p->addr_count = count;
+    for (size_t i = 0; i < count; i++) { p->fds[i] = -1; }
+    interleave_families(p);
+    p->next_start_msec = now_msec();
+    return p;
+}
+
+static size_t active_attempts(socket99_pending *p) {
+    size_t active = 0;
+    for (size_t i = 0; i < p->started; i++) {
+        if (p->fds[i] != -1) { active++; }
+    }
+    return active;
+}
+
+static void start_attempt(socket99_pending *p) {
+    struct addrinfo *ai = p->order[p->started];
+    int *fdp = &p->fds[p->started];
+    p->started++;
+    p->next_start_msec = now_msec() + (uint64_t)p->cfg.connect_stagger_msec;
+
+    /* Attempts are always nonblocking, regardless of the config. */
+    int fd = open_socket(&p->cfg, &p->result, ai->ai_family,
+        ai->ai_socktype, ai->ai_protocol, true);
+    if (fd == -1) { return; }
+
+    if (!set_socket_options(&p->cfg, &p->result, fd,
+            ai->ai_family)) {
+        close(fd);
+        return;
+    }
+
+    /* An immediate success is picked up by the next check. */
+    COUNT_SYSCALL(&p->result);
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0
+        || errno == EINPROGRESS) {
+        errno = 0;
+        *fdp = fd;
+    } else {
+        fail_with_errno(&p->result, SOCKET99_ERROR_CONNECT);
+        close(fd);
+    }
+}
+
+/* Check the attempts in progress without blocking, closing any that
+ * failed. Returns the index of a connected attempt, or -1. */
+static int check_attempts(socket99_pending *p) {
+    for (size_t i = 0; i < p->started; i++) {
+        if (p->fds[i] == -1) { continue; }
+
+        struct pollfd pfd = { p->fds[i], POLLOUT, 0 };
+        COUNT_SYSCALL(&p->result);
+        if (poll(&pfd, 1, 0) != 1) { continue; }
+
+        int err = 0;
+        socklen_t len = sizeof(err);
+        COUNT_SYSCALL(&p->result);
+        if (getsockopt(p->fds[i], SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+            err = errno;
+        }
+        if (err == 0) { return (int)i; }
+
+        errno = err;
+        fail_with_errno(&p->result, SOCKET99_ERROR_CONNECT);
+        close(p->fds[i]);
+        p->fds[i] = -1;
+    }
+    return -1;
+}
+
+static void finish_pending(socket99_pending *p, int winner) {
+    int fd = p->fds[winner];
+    p->fds[winner] = -1;
+
+    /* Cancel the losers. */
+    for (size_t i = 0; i < p->started; i++) {
+        if (p->fds[i] != -1) {
+            close(p->fds[i]);
+            p->fds[i] = -1;
+        }
+    }
+    p->started = p->addr_count;
+
+    int syscalls = p->result.syscalls;
+    memset(&p->result, 0, sizeof(p->result));
+    p->result.syscalls = syscalls;
+
+    /* The attempt's only status flag is O_NONBLOCK, so clear it
+     * without an F_GETFL first. */
+    if (!p->cfg.nonblocking) {
+        COUNT_SYSCALL(&p->result);
+        if (fcntl(fd, F_SETFL, 0) == -1) {
+            fail_with_errno(&p->result, SOCKET99_ERROR_FCNTL);
+            close(fd);
+            return;
+        }
+    }
+    p->result.status = SOCKET99_OK;
+    p->result.fd = fd;
+}
+
+size_t socket99_pending_pollfds(socket99_pending *p,
+        struct pollfd *fds, size_t count) {
+    if (p == NULL || fds == NULL) { return 0; }
+    size_t n = 0;
+    for (size_t i = 0; i < p->started && n < count; i++) {
+        if (p->fds[i] == -1) { continue; }
+        fds[n].fd = p->fds[i];
+        fds[n].events = POLLOUT;
+        fds[n].revents = 0;
+        n++;
+    }
+    return n;
+}
+
+int socket99_pending_timeout(socket99_pending *p) {
+    if (p == NULL || p->finished || p->started == p->addr_count) {
+        return -1;
+    }
+    uint64_t now = now_msec();
+    if (now >= p->next_start_msec) { return 0; }
+    return (int)(p->next_start_msec - now);
+}
+
+bool socket99_pending_step(socket99_pending *p, socket99_result *res) {
+    if (p == NULL || res == NULL) { return true; }
+
+    while (!p->finished) {
+        int winner = check_attempts(p);
+        if (winner != -1) {
+            finish_pending(p, winner);
+            p->finished = true;
+            break;
+        }
+
+        /* Start the next attempt when it's due, or right away if
+         * every earlier attempt has already failed. */
+        size_t active = active_attempts(p);
+        if (p->started < p->addr_count
+            && (active == 0 || now_msec() >= p->next_start_msec)) {
+            start_attempt(p);
+            continue;
+        }
+
+        if (active == 0) { p->finished = true; }
+        break;
+    }
+
+    if (p->finished) {
+        *res = p->result;
+    } else {
+        memset(res, 0, sizeof(*res));
+        res->fd = -1;
+    }
+    return p->finished;
+}
+
+void socket99_pending_free(socket99_pending *p) {
+    if (p == NULL) { return; }
+    for (size_t i = 0; i < p->started; i++) {
+        if (p->fds[i] != -1) { close(p->fds[i]); }
+    }
+    free_addrs(&p->cfg, p->addrs);
+    free(p->order);
+    free(p->fds);
+    free(p);
+}
+
+#ifdef SOCKET99_INSTRUMENT
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static socket99_open_stats stats;
+static socket99_open_hook *open_hook;
+static void *open_hook_udata;
+
+static uint64_t phase_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void record_open(socket99_config *cfg, socket99_result *res) {
+    pthread_mutex_lock(&stats_lock);
+    stats.opens++;
+    int idx = -(int)res->status;
+    if (idx > 0 && idx < SOCKET99_STATUS_COUNT) { stats.failures[idx]++; }
+    stats.addrs_tried += (uint64_t)res->addrs_tried;
+    for (int i = 0; i < SOCKET99_PHASE_COUNT; i++) {
+        stats.phase_nsec[i] += res->phase_nsec[i];
+    }
+    socket99_open_hook *hook = open_hook;
+    void *udata = open_hook_udata;
+    pthread_mutex_unlock(&stats_lock);
+
+    if (hook) {
+        int saved_errno = errno;
+        hook(cfg, res, udata);
+        errno = saved_errno;
+    }
+}
+#endif
+
+void socket99_get_open_stats(socket99_open_stats *out) {
+    if (out == NULL) { return; }
+#ifdef SOCKET99_INSTRUMENT
+    pthread_mutex_lock(&stats_lock);
+    *out = stats;
+    pthread_mutex_unlock(&stats_lock);
+#else
+    memset(out, 0, sizeof(*out));
+#endif
+}
+
+bool socket99_set_open_hook(socket99_open_hook *hook, void *udata) {
+#ifdef SOCKET99_INSTRUMENT
+    pthread_mutex_lock(&stats_lock);
+    open_hook = hook;
+    open_hook_udata = udata;
+    pthread_mutex_unlock(&stats_lock);
+    return true;
+#else
+    (void)hook;
+    (void)udata;
+    return false;
+#endif
+}
 
 static const char *status_key(enum socket99_status s) {
     switch (s) {
@@ -314,6 +1620,8 @@ static const char *status_key(enum socket99_status s) {
         return "configuration";
     case SOCKET99_ERROR_SETSOCKOPT:
         return "setsockopt";
+    case SOCKET99_ERROR_UNSUPPORTED:
+        return "unsupported";
     case SOCKET99_ERROR_UNKNOWN:
     default:
         return "unknown";
@@ -7,19 +7,61 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <netdb.h>
+#include <poll.h>
+
+/* Default delay between staggered connection attempts, in msec.
+ * (RFC 8305 recommends 250.) */
+#define SOCKET99_DEF_STAGGER_MSEC 250
 
 /* Max number of socket options to allow in the config struct.
- * (The first option_id of 0 will be treated as end-of-options.) */
+ * (The first option_id of 0 will be treated as end-of-options.)
+ * For more, use the config's sockopt_list. */
 #define SOCKET99_MAX_SOCK_OPTS 4
 
-/* An option ID, value, sizeof(value) tuple for setsockopt(2). */
+/* Level for IPPROTO_IP options (such as IP_TOS) in a socket99_sockopt,
+ * since a level of 0 means SOL_SOCKET. */
+#define SOCKET99_LEVEL_IP (-1)
+
+/* A caching name resolver; see socket99_resolver_new below. */
+typedef struct socket99_resolver socket99_resolver;
+
+/* An option ID, value, sizeof(value), level tuple for setsockopt(2).
+ * A level of 0 (the default) means SOL_SOCKET; otherwise use the
+ * protocol level, e.g. IPPROTO_TCP for TCP_NODELAY. */
 typedef struct socket99_sockopt {
     int option_id;
     void *value;
     socklen_t value_len;
+    int level;
 } socket99_sockopt;
 
+/* Named sets of socket and TCP options, for the config's profile.
+ * Options that the platform or socket's type doesn't support are
+ * skipped, and options in sockopts or sockopt_list take precedence. */
+enum socket99_profile {
+    SOCKET99_PROFILE_DEFAULT = 0,   /* the OS defaults */
+
+    /* Small request/response messages: TCP_NODELAY, TCP_NOTSENT_LOWAT
+     * of 16 KB so little data waits in the send buffer, and a
+     * low-delay TOS. Buffer sizes are left to autotuning. */
+    SOCKET99_PROFILE_LOW_LATENCY,
+
+    /* Large transfers: 4 MB send and receive buffers (set before
+     * connecting or listening, so the window scale fits them; the OS
+     * may cap them) and a throughput TOS. */
+    SOCKET99_PROFILE_BULK,
+
+    /* Servers with many mostly idle connections: 64 KB buffers to
+     * bound memory per connection, TCP_NODELAY, SO_REUSEADDR, and
+     * TCP_DEFER_ACCEPT of 1 second, so connections are only accepted
+     * once the client has sent something. Don't use it for protocols
+     * where the server speaks first. */
+    SOCKET99_PROFILE_FAN_IN,
+};
+
 /* Configuration for a socket. Not all of these fields need to
  * be set, and ones omitted from a C99-style "designated initializer"
  * struct literal will be zeroed out and replaced with defaults. */
@@ -39,10 +81,67 @@ typedef struct {
     bool server;                /* Listen for incoming clients? */
     bool datagram;              /* UDP or datagram Unix domain? */
     bool nonblocking;           /* non-blocking operation? */
+    bool cloexec;               /* set close-on-exec? */
+    bool reuseport;             /* set SO_REUSEPORT before binding? */
+    bool zerocopy;              /* set SO_ZEROCOPY, for socket99_zc? */
+
+    /* For servers: adopt a matching socket passed by a supervisor
+     * through socket activation (LISTEN_FDS and LISTEN_PID, as with
+     * sd_listen_fds(3)) rather than binding a new one, if there is
+     * one. An inherited fd matches when its family, type, and bound
+     * address and port (any port, if port is 0) or path match the
+     * config; it gets the config's sockopts and nonblocking and
+     * cloexec settings, and each one is only adopted once. */
+    bool inherit;
+
+    /* CPU affinity (Linux only). With set_incoming_cpu, SO_INCOMING_CPU
+     * is set to incoming_cpu, so a socket in a SO_REUSEPORT group gets
+     * the connections and packets that arrive on that CPU. */
+    bool set_incoming_cpu;
+    int incoming_cpu;
+
+    /* Busy poll the device queue for up to busy_poll_usec before
+     * sleeping in a blocking receive (SO_BUSY_POLL), taking up to
+     * busy_poll_budget packets per poll (SO_BUSY_POLL_BUDGET; default
+     * set by the OS). prefer_busy_poll (SO_PREFER_BUSY_POLL) keeps
+     * interrupts deferred while the application polls. Raising these
+     * above the net.core.busy_read sysctl needs CAP_NET_ADMIN. */
+    int busy_poll_usec;
+    int busy_poll_budget;
+    bool prefer_busy_poll;
 
     int backlog_size;           /* set a custom backlog size */
 
+    /* For TCP servers, enable TCP Fast Open with a queue of this many
+     * pending Fast Open connections. (On Linux, the server bit of the
+     * net.ipv4.tcp_fastopen sysctl must also be set.) Clients use
+     * socket99_open_send instead. */
+    int fastopen_qlen;
+
+    /* Delay before starting the next connection attempt when
+     * opening with socket99_open_async, in msec. Defaults to
+     * SOCKET99_DEF_STAGGER_MSEC. */
+    int connect_stagger_msec;
+
+    /* Resolver to look up host through, instead of calling
+     * getaddrinfo(3) directly. May be shared by many configs. */
+    socket99_resolver *resolver;
+
+    /* Tuning profile, applied before the options below. */
+    enum socket99_profile profile;
+
     socket99_sockopt sockopts[SOCKET99_MAX_SOCK_OPTS];
+
+    /* Any number of further options, set after sockopts. The list
+     * isn't copied, so it must outlive any open using this config. */
+    socket99_sockopt *sockopt_list;
+    size_t sockopt_count;
+
+    /* Options to set on each connection accepted by socket99_accept
+     * or socket99_accept_burst, for those not inherited from the
+     * listener. Also not copied. */
+    socket99_sockopt *accept_sockopts;
+    size_t accept_sockopt_count;
 } socket99_config;
 
 enum socket99_status {
@@ -68,8 +167,26 @@ enum socket99_status {
 
     /* Other unknown error. */
     SOCKET99_ERROR_UNKNOWN = -10,
+
+    /* Requested feature is not supported on this platform. */
+    SOCKET99_ERROR_UNSUPPORTED = -11,
 };
 
+/* Phases of an open, for socket99_result's phase_nsec. */
+enum socket99_phase {
+    SOCKET99_PHASE_RESOLVE,     /* getaddrinfo, or the resolver */
+    SOCKET99_PHASE_SOCKET,      /* socket(2) */
+    SOCKET99_PHASE_SETSOCKOPT,  /* setsockopt(2), for all options */
+    SOCKET99_PHASE_BIND,        /* bind(2) and listen(2) */
+    SOCKET99_PHASE_CONNECT,     /* connect(2), for every address tried */
+    SOCKET99_PHASE_FCNTL,       /* fcntl(2), setting O_NONBLOCK */
+    SOCKET99_PHASE_COUNT,
+};
+
+/* Number of socket99_status values, from SOCKET99_OK (0) down to the
+ * last error; failures are counted at index -status. */
+#define SOCKET99_STATUS_COUNT 12
+
 /* Result from calling socket99_open with a given socket99_config. */
 typedef struct {
     /* Result code and errno value from failure (if any). */
@@ -84,13 +201,1000 @@ typedef struct {
     /* Error code from getaddrinfo, only set if status is
      * SOCKET99_ERROR_GETADDRINFO. See: gai_strerror(3). */
     int getaddrinfo_error;
+
+    /* Number of system calls made by the open. Only counted when
+     * the library is built with SOCKET99_COUNT_SYSCALLS defined. */
+    int syscalls;
+
+    /* Nanoseconds spent in each phase of the open (CLOCK_MONOTONIC),
+     * and the number of addresses a client tried to connect to. Only
+     * recorded when the library is built with SOCKET99_INSTRUMENT
+     * defined; otherwise they stay 0 and no clocks are read. The
+     * fields are there either way, so the struct's layout doesn't
+     * depend on how the library was built. */
+    uint64_t phase_nsec[SOCKET99_PHASE_COUNT];
+    int addrs_tried;
+
+    /* Set if fd was inherited, rather than opened (see inherit). */
+    bool inherited;
 } socket99_result;
 
+/* Process-wide counters for opens, with SOCKET99_INSTRUMENT. */
+typedef struct {
+    uint64_t opens;             /* successful and failed */
+    uint64_t failures[SOCKET99_STATUS_COUNT];   /* by -status */
+    uint64_t addrs_tried;       /* client connect attempts */
+    uint64_t phase_nsec[SOCKET99_PHASE_COUNT];  /* total time by phase */
+} socket99_open_stats;
+
+/* Called after each open by socket99_open or socket99_open_send (and
+ * so socket99_open_group), successful or not, on the opening thread.
+ * Must not open sockets itself through socket99. */
+typedef void socket99_open_hook(const socket99_config *cfg,
+    const socket99_result *res, void *udata);
+
+/* Get a snapshot of the process-wide counters. All zero unless the
+ * library is built with SOCKET99_INSTRUMENT defined. */
+void socket99_get_open_stats(socket99_open_stats *stats);
+
+/* Set (or, with NULL, clear) a hook for reporting each open to a
+ * metrics system. Returns false if the library was built without
+ * SOCKET99_INSTRUMENT, in which case the hook is never called. */
+bool socket99_set_open_hook(socket99_open_hook *hook, void *udata);
+
 /* Attempt to open a socket, according to the configuration stored in
  * CFG. Returns whether the socket opened; further details will be
  * stored in RES. */
 bool socket99_open(socket99_config *cfg, socket99_result *res);
 
+/* Open a TCP client like socket99_open, sending the first LEN bytes
+ * of BUF with the connection's SYN using TCP Fast Open (MSG_FASTOPEN)
+ * where supported, which saves a round trip once the server has given
+ * this host a cookie. Elsewhere, or if Fast Open is disabled, it
+ * connects and then sends. On success, the number of bytes sent is
+ * stored in *SENT (if non-NULL), which may be less than LEN. */
+bool socket99_open_send(socket99_config *cfg, const void *buf, size_t len,
+    ssize_t *sent, socket99_result *res);
+
+/* Check whether the server accepted the data sent with the SYN on the
+ * TCP connection FD (Linux only; elsewhere this returns false). Only
+ * meaningful once the handshake has finished, as it has after a
+ * blocking socket99_open_send. */
+bool socket99_fastopen_accepted(int fd);
+
+/* Get the CPU that last handled packets for socket FD (SO_INCOMING_CPU),
+ * such as a freshly accepted connection, so it can be handed to a
+ * worker thread pinned to that CPU. Returns -1 if unknown, with errno
+ * set (ENOTSUP where unsupported). */
+int socket99_incoming_cpu(int fd);
+
+/* Pin the calling thread to CPU. Returns whether it was pinned, or
+ * false with errno set (ENOTSUP where unsupported). */
+bool socket99_pin_thread(int cpu);
+
+/* Accept a connection on the listening socket FD, which was opened
+ * with CFG. The new connection gets CFG's nonblocking and cloexec
+ * settings, atomically where accept4(2) is available, and CFG's
+ * accept_sockopts. ADDR and ADDR_LEN may be NULL. Returns the new fd,
+ * or -1 with errno set, like accept(2). */
+int socket99_accept(socket99_config *cfg, int fd,
+    struct sockaddr *addr, socklen_t *addr_len);
+
+/* A connection accepted by socket99_accept_burst. */
+typedef struct {
+    int fd;
+    struct sockaddr_storage addr;   /* peer address */
+    socklen_t addr_len;
+} socket99_accepted;
+
+/* Accept up to MAX connections waiting on the listening socket FD, as
+ * with socket99_accept, storing them in CONNS[0] onward, and stopping
+ * early once no more are waiting. FD should be nonblocking; otherwise,
+ * this blocks until MAX have arrived. A connection whose setup fails
+ * (such as an accept_sockopt) is closed and skipped. Returns the
+ * number accepted (0 if none were waiting), or -1 with errno set if an
+ * error such as EMFILE happened before any were accepted, or if every
+ * connection waiting was dropped by a setup error. */
+int socket99_accept_burst(socket99_config *cfg, int fd,
+    socket99_accepted *conns, size_t max);
+
+/* Open a group of COUNT server sockets, all bound to the same address
+ * with SO_REUSEPORT, so each can be given its own accept loop. Results
+ * for each socket are stored in RES[0] through RES[COUNT - 1]. If
+ * CFG's port is 0, the port chosen for the first socket is used for
+ * the rest of the group.
+ *
+ * If STEER_BY_CPU is set, a classic BPF program is attached to the
+ * group (Linux only) so that incoming connections and datagrams are
+ * handed to the socket at index (CPU % COUNT), where CPU is the core
+ * that handled the packet. Pin the thread serving RES[i] to CPU i to
+ * keep each connection on one core.
+ *
+ * Returns whether all sockets opened. On failure, any sockets that
+ * were already opened are closed, and the entry that failed holds the
+ * error details. */
+bool socket99_open_group(socket99_config *cfg, socket99_result *res,
+    size_t count, bool steer_by_cpu);
+
+/* Open a server socket on every address that CFG's host resolves to,
+ * or, if HOSTS is non-NULL, on every address of each of the HOST_COUNT
+ * names in HOSTS. With neither, that means both the IPv4 and IPv6
+ * wildcard addresses. IPv6 sockets are set IPV6_V6ONLY, so they can
+ * share a port with IPv4 ones and IPv4 clients are never seen as
+ * v4-mapped IPv6 addresses. If CFG's port is 0, the port chosen for
+ * the first socket is used for the rest.
+ *
+ * *COUNT holds the number of entries RES has room for. On success, the
+ * result for each socket is stored in RES[0] through RES[*COUNT - 1]
+ * and *COUNT is set to how many opened. On failure (including there
+ * being more addresses than room in RES), any sockets already opened
+ * are closed, and RES[0] holds the error details. */
+bool socket99_open_listeners(socket99_config *cfg,
+    const char * const *hosts, size_t host_count,
+    socket99_result *res, size_t *count);
+
+/* A TCP client connection still being opened by socket99_open_async. */
+typedef struct socket99_pending socket99_pending;
+
+/* Start opening a TCP client socket, without blocking in connect(2).
+ * Connection attempts race across all addresses from getaddrinfo,
+ * alternating between address families, and a new attempt is started
+ * every CFG->connect_stagger_msec while earlier ones are still in
+ * progress ("Happy Eyeballs", RFC 8305). The first attempt to connect
+ * wins, and the rest are cancelled.
+ *
+ * Returns a pending handle, or NULL on failure (details in RES). Note
+ * that name resolution itself still blocks. */
+socket99_pending *socket99_open_async(socket99_config *cfg,
+    socket99_result *res);
+
+/* Store up to COUNT pollfds for the connection attempts in progress
+ * in FDS, and return how many were stored. The set only changes
+ * during socket99_pending_step, so event loops using epoll(7) or
+ * kqueue(2) should refresh their registrations after each step. */
+size_t socket99_pending_pollfds(socket99_pending *p,
+    struct pollfd *fds, size_t count);
+
+/* Get the number of msec until the next attempt should be started,
+ * for use as a poll timeout, or -1 if there is nothing to wait for. */
+int socket99_pending_timeout(socket99_pending *p);
+
+/* Check attempts in progress, without blocking, and start the next
+ * one when it is due. Call this whenever one of the pollfds is ready
+ * or the timeout has passed. Returns true once the open has finished,
+ * with a status and either the connected fd or error details in RES.
+ * The fd is left nonblocking only if CFG->nonblocking was set. */
+bool socket99_pending_step(socket99_pending *p, socket99_result *res);
+
+/* Free a pending handle, closing any attempts still in progress.
+ * The fd handed out by a successful step is not closed. */
+void socket99_pending_free(socket99_pending *p);
+
+/* Limits for socket99_open_many. Zeroed fields get defaults. */
+typedef struct {
+    int deadline_msec;          /* give up on all opens after this (none) */
+    size_t max_in_flight;       /* opens in progress at once (64) */
+
+    /* Resolver for configs without their own. TCP client names are
+     * looked up through it on open_many's own lookup threads. */
+    socket99_resolver *resolver;
+} socket99_open_many_config;
+
+/* Open the COUNT sockets described by CFGS at once, storing the result
+ * for CFGS[i] in RES[i]. TCP clients are opened with socket99_open_async
+ * (racing each one's addresses), up to max_in_flight at a time, with
+ * all of their attempts waited on together in one epoll(7) set (poll(2)
+ * elsewhere); other configs are opened with socket99_open. Host names
+ * of TCP clients are looked up on a few background threads, so a slow
+ * lookup only holds up its own entry, and lookup time counts against
+ * the deadline. Entries not open by the deadline fail with
+ * SOCKET99_ERROR_CONNECT and ETIMEDOUT. A lookup still running then
+ * finishes on its thread after this returns, so any resolver it uses
+ * must stay alive until that lookup's timeout (see resolv.conf(5)).
+ * MCFG may be NULL for defaults. Returns how many opened. */
+size_t socket99_open_many(socket99_config *cfgs, socket99_result *res,
+    size_t count, const socket99_open_many_config *mcfg);
+
+/* Configuration for a socket99_resolver. Zeroed fields get defaults. */
+typedef struct {
+    size_t max_entries;         /* max names cached (default 256) */
+    int ttl_msec;               /* keep found addresses (default 30 sec) */
+    int negative_ttl_msec;      /* keep names not found (default 5 sec) */
+    int threads;                /* threads for prefetching (default 4) */
+} socket99_resolver_config;
+
+/* Counters for a socket99_resolver. */
+typedef struct {
+    uint64_t hits;              /* found in cache */
+    uint64_t negative_hits;     /* found in cache as not existing */
+    uint64_t misses;            /* looked up with getaddrinfo */
+    uint64_t coalesced;         /* waited on another caller's lookup */
+    uint64_t numeric;           /* numeric addresses, never cached */
+    uint64_t expired;           /* entries dropped after their TTL */
+    uint64_t evictions;         /* entries dropped because cache was full */
+} socket99_resolver_stats;
+
+/* Create a resolver, which caches getaddrinfo(3) results (including
+ * failures) for a bounded time. Numeric addresses bypass the cache,
+ * since converting them never blocks. CFG may be NULL for defaults.
+ * The resolver is thread-safe. Returns NULL on allocation failure. */
+socket99_resolver *socket99_resolver_new(socket99_resolver_config *cfg);
+
+/* Free a resolver, stopping its threads. Address lists from it which
+ * have not been freed yet must not be used afterward. */
+void socket99_resolver_free(socket99_resolver *r);
+
+/* Like getaddrinfo(3), but through the resolver's cache. A caller that
+ * misses while the same lookup is already running waits for it and
+ * shares its result. The result must be freed with
+ * socket99_resolver_freeaddrinfo, not freeaddrinfo, and does not
+ * include canonical names. */
+int socket99_resolver_getaddrinfo(socket99_resolver *r, const char *node,
+    const char *service, const struct addrinfo *hints,
+    struct addrinfo **res);
+
+/* Free an address list from socket99_resolver_getaddrinfo. */
+void socket99_resolver_freeaddrinfo(socket99_resolver *r,
+    struct addrinfo *res);
+
+/* Start looking up the hosts for COUNT configs in the background, so
+ * later opens find them in the cache. Returns how many were queued;
+ * Unix domain, wildcard, and numeric address configs are skipped,
+ * since there is nothing to look up. */
+size_t socket99_resolver_prefetch(socket99_resolver *r,
+    socket99_config *cfgs, size_t count);
+
+/* Block until all queued background lookups have finished. */
+void socket99_resolver_wait(socket99_resolver *r);
+
+/* Get a snapshot of the resolver's counters. */
+void socket99_resolver_get_stats(socket99_resolver *r,
+    socket99_resolver_stats *stats);
+
+/* A pool of idle client connections, kept for reuse. */
+typedef struct socket99_pool socket99_pool;
+
+/* Configuration for a socket99_pool. Zeroed fields get defaults. */
+typedef struct {
+    size_t max_idle_per_key;    /* idle conns per destination (default 8) */
+    size_t max_idle;            /* idle conns in total (default 256) */
+    int max_idle_msec;          /* close conns idle longer (default 60 sec) */
+} socket99_pool_config;
+
+/* Counters for a socket99_pool. Hit rate is hits / checkouts, and
+ * mean checkout latency is checkout_nsec / checkouts. */
+typedef struct {
+    uint64_t checkouts;
+    uint64_t hits;              /* reused an idle connection */
+    uint64_t misses;            /* opened a new connection */
+    uint64_t checkins;
+    uint64_t dead;              /* idle conns found closed or stale */
+    uint64_t evictions;         /* idle conns closed to stay in limits */
+    uint64_t checkout_nsec;     /* total time spent in checkout */
+    size_t idle;                /* idle conns currently held */
+} socket99_pool_stats;
+
+/* Create a connection pool. CFG may be NULL for defaults. The pool
+ * is thread-safe. Returns NULL on allocation failure. */
+socket99_pool *socket99_pool_new(socket99_pool_config *cfg);
+
+/* Free a pool, closing its idle connections. */
+void socket99_pool_free(socket99_pool *pool);
+
+/* Get a client connection for CFG: an idle connection to the same
+ * destination (host/IPv4/IPv6, port, path, and datagram) if the pool
+ * has one that is still alive, or a new one from socket99_open.
+ * Returns whether a connection is available, with details in RES. */
+bool socket99_pool_checkout(socket99_pool *pool, socket99_config *cfg,
+    socket99_result *res);
+
+/* Return FD, checked out with CFG, to the pool. The pool keeps the most
+ * recently returned connections within its limits and closes the
+ * least recently used. Close connections in an unknown state (such
+ * as mid-response) instead of returning them. */
+void socket99_pool_checkin(socket99_pool *pool, socket99_config *cfg,
+    int fd);
+
+/* Get a snapshot of the pool's counters. */
+void socket99_pool_get_stats(socket99_pool *pool,
+    socket99_pool_stats *stats);
+
+/* A thread-safe pool of fixed-size buffers, carved from large slabs
+ * of memory, for reading from and writing to many sockets without
+ * giving each idle connection a buffer of its own. Each thread keeps a
+ * small cache of free buffers, so most gets and puts take no lock. */
+typedef struct socket99_bufpool socket99_bufpool;
+
+/* Configuration for a socket99_bufpool. Zeroed fields get defaults. */
+typedef struct {
+    size_t buf_size;            /* bytes per buffer (default 16 KB) */
+    size_t slab_size;           /* bytes per slab (default 1 MB) */
+    size_t max_bufs;            /* most buffers to create (no limit) */
+    size_t thread_cache;        /* free buffers kept per thread (64) */
+
+    /* Back slabs with huge pages (MAP_HUGETLB, Linux), falling back
+     * to asking for transparent huge pages. Slabs are rounded up to a
+     * whole huge page (2 MB). */
+    bool hugepages;
+} socket99_bufpool_config;
+
+/* Counters for a socket99_bufpool. */
+typedef struct {
+    uint64_t gets;
+    uint64_t puts;
+    uint64_t cache_misses;      /* gets that went to the shared list */
+    uint64_t slabs;             /* slabs mapped */
+    uint64_t hugepage_slabs;    /* ... of those, with MAP_HUGETLB */
+    size_t reserved_bytes;      /* address space in slabs */
+    size_t in_use;              /* buffers lent out */
+} socket99_bufpool_stats;
+
+/* Create a buffer pool. CFG may be NULL for defaults. Slabs are mapped
+ * as they're needed, and their pages are only committed once used.
+ * Returns NULL on failure, with errno set. */
+socket99_bufpool *socket99_bufpool_new(socket99_bufpool_config *cfg);
+
+/* Free a pool and all its slabs. Every buffer must have been returned,
+ * and no other thread may be using the pool. */
+void socket99_bufpool_free(socket99_bufpool *bp);
+
+/* Get the size of the pool's buffers. */
+size_t socket99_bufpool_buf_size(socket99_bufpool *bp);
+
+/* Borrow a buffer. Returns NULL with errno set to ENOBUFS if max_bufs
+ * have been created and none are free (other threads' caches aside),
+ * or ENOMEM if no slab could be mapped. */
+void *socket99_bufpool_get(socket99_bufpool *bp);
+
+/* Return a buffer borrowed from BP. */
+void socket99_bufpool_put(socket99_bufpool *bp, void *buf);
+
+/* Read from FD into a borrowed buffer, so buffers are only held by
+ * sockets with data to process. Returns the number of bytes read,
+ * with the buffer in *BUF (give it back with socket99_bufpool_put
+ * once drained), or 0 at EOF or -1 with errno set (EAGAIN if
+ * nothing is ready), with *BUF set to NULL. */
+ssize_t socket99_bufpool_read(socket99_bufpool *bp, int fd, void **buf);
+
+/* Get a snapshot of the pool's counters. */
+void socket99_bufpool_get_stats(socket99_bufpool *bp,
+    socket99_bufpool_stats *stats);
+
+/* Splits a byte stream (TCP or Unix domain SOCK_STREAM) into frames.
+ * It reads into a ring buffer with readv(2) and hands out each frame in
+ * place, as a span of one or two pieces, so nothing is copied or moved
+ * after the read. */
+typedef struct socket99_framer socket99_framer;
+
+/* How frames are marked. */
+enum socket99_frame_mode {
+    SOCKET99_FRAME_DELIMITED,   /* ended by a delimiter byte */
+    SOCKET99_FRAME_LENGTH,      /* after a big-endian length prefix */
+};
+
+/* For a NUL delimiter, since 0 means the default. */
+#define SOCKET99_FRAME_NUL 256
+
+/* Configuration for a socket99_framer. Zeroed fields get defaults. */
+typedef struct {
+    enum socket99_frame_mode mode;
+    int delimiter;              /* byte ending a frame (default '\n') */
+    size_t prefix_size;         /* length prefix bytes: 1, 2, or 4 (4) */
+    size_t ring_size;           /* rounded up to a power of 2 (64 KB) */
+
+    /* Largest frame body allowed (default, and most, whatever fits in
+     * the ring with its prefix or delimiter). */
+    size_t max_frame;
+} socket99_framer_config;
+
+/* A frame in the ring: its body, without the prefix or delimiter. A
+ * frame that straddles the end of the ring is in two pieces; the
+ * pieces can be passed to writev(2) as they are. */
+typedef struct {
+    struct iovec iov[2];
+    int iovcnt;                 /* 1, or 2 if it wraps */
+    size_t len;                 /* total bytes */
+} socket99_span;
+
+/* Create a framer. CFG may be NULL for newline-delimited frames.
+ * Returns NULL on failure, with errno set (EINVAL for a bad config). */
+socket99_framer *socket99_framer_new(socket99_framer_config *cfg);
+
+/* Free a framer. */
+void socket99_framer_free(socket99_framer *f);
+
+/* Read from FD into the ring's free space with one readv(2). Frames
+ * returned by socket99_framer_next are released first, so their spans
+ * are no longer valid. Returns the number of bytes read, 0 at EOF, or
+ * -1 with errno set (EAGAIN if nothing is ready). */
+ssize_t socket99_framer_fill(socket99_framer *f, int fd);
+
+/* Find the next complete frame in the ring. Returns 1 with the frame
+ * in *SPAN, 0 if more data is needed, or -1 with errno set to EMSGSIZE
+ * if the next frame is larger than max_frame, after which the stream
+ * can't be framed and should be closed. */
+int socket99_framer_next(socket99_framer *f, socket99_span *span);
+
+/* Get the number of bytes read but not yet returned in a frame. */
+size_t socket99_framer_pending(socket99_framer *f);
+
+/* Copy a span's bytes to BUF, which must have room for span->len. */
+void socket99_span_copy(const socket99_span *span, void *buf);
+
+/* An output queue for a stream socket. Small writes are copied into
+ * the queue and sent together with one sendmsg(2) per flush, so a
+ * response made of many pieces costs one system call, and usually
+ * fewer segments. Flush once per event loop turn; the queue also
+ * flushes on its own once it holds flush_bytes, or once flush_writes
+ * writes have been queued since the last flush. Not thread-safe. */
+typedef struct socket99_outq socket99_outq;
+
+/* Configuration for a socket99_outq. Zeroed fields get defaults. */
+typedef struct {
+    size_t flush_bytes;         /* flush from write at this (64 KB) */
+    size_t flush_writes;        /* ... or after this many writes (64) */
+    size_t high_water;          /* not writable at this (1 MB) */
+    size_t low_water;           /* writable again below this (256 KB) */
+
+    /* Hold partial segments with TCP_CORK (Linux; TCP_NOPUSH on BSD)
+     * between flushes of one response, rather than passing MSG_MORE to
+     * each send. Use this when mixing the queue with sendfile(2). */
+    bool cork;
+} socket99_outq_config;
+
+/* Counters for a socket99_outq. */
+typedef struct {
+    uint64_t writes;            /* calls to socket99_outq_write */
+    uint64_t bytes;             /* bytes sent */
+    uint64_t syscalls;          /* sendmsg, writev, and setsockopt */
+    uint64_t flushes;           /* flushes that sent something */
+    uint64_t partial;           /* sends cut short by a full buffer */
+} socket99_outq_stats;
+
+/* Create an output queue for the stream socket (or pipe) FD. CFG may
+ * be NULL for defaults. Returns NULL on failure, with errno set. */
+socket99_outq *socket99_outq_new(int fd, socket99_outq_config *cfg);
+
+/* Free a queue, discarding anything unsent. FD is not closed. */
+void socket99_outq_free(socket99_outq *q);
+
+/* Queue a copy of LEN bytes of BUF, flushing (with more to come) if
+ * the queue is past flush_bytes or flush_writes. Returns whether it
+ * was queued; if a flush failed with an error other than EAGAIN,
+ * returns false with errno set, and the connection should be closed. */
+bool socket99_outq_write(socket99_outq *q, const void *buf, size_t len);
+
+/* Send as much of the queue as the socket takes, with as few calls as
+ * possible. If MORE, more of the same response is coming, so partial
+ * segments are held back (MSG_MORE or TCP_CORK); flush the end of each
+ * response with MORE false, even if the queue is already empty, so
+ * anything held back is pushed out. Returns the bytes sent, or -1 with
+ * errno set -- EAGAIN if a nonblocking socket is full, in which case
+ * wait for it to be writable and flush again. */
+ssize_t socket99_outq_flush(socket99_outq *q, bool more);
+
+/* Get the number of bytes queued but not yet sent. */
+size_t socket99_outq_pending(socket99_outq *q);
+
+/* Backpressure: false once high_water bytes are queued, until the
+ * queue drains below low_water. Stop producing output (for example,
+ * stop reading requests) while it's false. */
+bool socket99_outq_writable(socket99_outq *q);
+
+/* Get a snapshot of the queue's counters. */
+void socket99_outq_get_stats(socket99_outq *q, socket99_outq_stats *stats);
+
+/* A multi-threaded stream server (Linux): a fixed pool of worker
+ * threads, each with its own epoll(7) set, serving connections accepted
+ * from one shared listener or from a SO_REUSEPORT listener per worker.
+ * A worker queues the connections it accepts and takes them on a few at
+ * a time between rounds of events; idle workers steal the oldest queued
+ * connections from the worker with the most, so one busy worker doesn't
+ * keep new connections waiting while others have nothing to do. Once
+ * taken, a connection stays on its worker. */
+typedef struct socket99_server socket99_server;
+
+enum socket99_listen_mode {
+    /* One listener, in every worker's set with EPOLLEXCLUSIVE, so only
+     * one worker wakes per connection. */
+    SOCKET99_LISTEN_SHARED,
+    /* A listener per worker (see socket99_open_group); the kernel
+     * spreads connections across them. */
+    SOCKET99_LISTEN_PER_WORKER,
+};
+
+/* Configuration for a socket99_server. Zeroed fields get defaults. */
+typedef struct {
+    size_t workers;             /* worker threads (online CPUs) */
+    enum socket99_listen_mode listen;
+    size_t read_bufsz;          /* per-worker read buffer (64 KB) */
+    bool no_steal;              /* workers only serve what they accept */
+} socket99_server_config;
+
+/* Handlers for a socket99_server, called on worker threads, so they
+ * must be thread-safe; calls for one connection are always made on the
+ * same worker. UDATA is the server's user data. Only on_read is
+ * required. */
+typedef struct {
+    /* FD was accepted. Return false to close it right away. */
+    bool (*on_accept)(socket99_server *s, int fd, void *udata);
+
+    /* LEN bytes were read from the nonblocking socket FD. BUF is only
+     * valid during the call. To hang up, shutdown(2) FD rather than
+     * closing it; the server closes it once it sees EOF. */
+    void (*on_read)(socket99_server *s, int fd, const char *buf,
+        size_t len, void *udata);
+
+    /* FD reached EOF (ERR is 0) or failed (ERR is the errno). The
+     * server closes it after the call. */
+    void (*on_close)(socket99_server *s, int fd, int err, void *udata);
+
+    /* FD may have room to send again (edge-triggered, so it can come
+     * when nothing is waiting to go out). Without this handler, the
+     * server only waits for connections to be readable, so a send that
+     * would block has to be retried on a later on_read -- or queued
+     * (see socket99_outq) and flushed from here. */
+    void (*on_writable)(socket99_server *s, int fd, void *udata);
+} socket99_server_handlers;
+
+/* Counters for a socket99_server, summed over its workers. */
+typedef struct {
+    uint64_t accepted;
+    uint64_t stolen;            /* connections taken from another worker */
+    uint64_t closed;
+    uint64_t reads;             /* calls to on_read */
+
+    /* Times a worker stopped watching its listener after an accept
+     * error other than EAGAIN (such as EMFILE), until one of its
+     * connections closed or a short backoff passed. */
+    uint64_t accept_pauses;
+
+    /* Workers stopped by an error from epoll_wait(2), and the errno of
+     * one such error. A stopped worker serves nothing more -- with
+     * SOCKET99_LISTEN_PER_WORKER, not even its listener -- so the
+     * server should be restarted. */
+    uint64_t failed_workers;
+    int worker_errno;
+} socket99_server_stats;
+
+/* Open a server with CFG (a stream server config; nonblocking and
+ * cloexec are forced) and start its workers. SCFG may be NULL for
+ * defaults. Returns NULL on failure, with RES holding details as with
+ * socket99_open; on success, RES describes the (first) listener. */
+socket99_server *socket99_server_new(socket99_config *cfg,
+    const socket99_server_config *scfg,
+    const socket99_server_handlers *handlers, void *udata,
+    socket99_result *res);
+
+/* Stop the workers, close the listeners and any open connections, and
+ * free the server. Must not be called from a handler. */
+void socket99_server_free(socket99_server *s);
+
+/* Get the port the server is listening on, or -1 if not IP. */
+int socket99_server_port(socket99_server *s);
+
+/* Get a snapshot of the server's counters. Thread-safe. */
+void socket99_server_get_stats(socket99_server *s,
+    socket99_server_stats *stats);
+
+/* An event loop for sockets, using edge-triggered epoll(7) (Linux). */
+typedef struct socket99_loop socket99_loop;
+
+/* Callbacks for events in a socket99_loop. Any may be NULL. UDATA is
+ * the user data given when the fd was added to the loop. */
+typedef struct {
+    /* CLIENT_FD was accepted from a listener. It can be given its own
+     * user data in *CLIENT_UDATA, which starts out as the listener's.
+     * Return false to close it rather than adding it to the loop. */
+    bool (*on_accept)(socket99_loop *loop, int client_fd, void *udata,
+        void **client_udata);
+
+    /* LEN bytes were read from FD. BUF is only valid during the call. */
+    void (*on_read)(socket99_loop *loop, int fd, const char *buf,
+        size_t len, void *udata);
+
+    /* FD has become writable. */
+    void (*on_writable)(socket99_loop *loop, int fd, void *udata);
+
+    /* FD reached EOF (ERR is 0) or failed (ERR is the errno), and has
+     * been removed from the loop. The callback should close it; if
+     * there is no callback, the loop closes it. */
+    void (*on_close)(socket99_loop *loop, int fd, int err, void *udata);
+} socket99_loop_callbacks;
+
+/* Create an event loop with the given callbacks. Incoming data is read
+ * READ_BUFSZ bytes at a time (default 64 KB if 0). Returns NULL on
+ * failure, with errno set. */
+socket99_loop *socket99_loop_new(const socket99_loop_callbacks *cbs,
+    size_t read_bufsz);
+
+/* Free a loop. Fds still in the loop are not closed. */
+void socket99_loop_free(socket99_loop *loop);
+
+/* Open a stream server socket with CFG (forcing nonblocking and
+ * cloexec) and add it to the loop. Each time it becomes readable, all
+ * pending connections are accepted with socket99_accept and added to
+ * the loop. Returns whether the listener opened, with RES holding
+ * details as with socket99_open. */
+bool socket99_loop_listen(socket99_loop *loop, socket99_config *cfg,
+    socket99_result *res, void *udata);
+
+/* Add a connected socket to the loop, making it nonblocking. */
+bool socket99_loop_add(socket99_loop *loop, int fd, void *udata);
+
+/* Remove FD from the loop, without closing it. */
+bool socket99_loop_remove(socket99_loop *loop, int fd);
+
+/* Wait up to TIMEOUT_MSEC (or forever, if -1) for events, and handle
+ * them. Since events are edge-triggered, readable sockets are read
+ * (and listeners accepted from) until EAGAIN. Returns the number of
+ * events handled, or -1 on error. */
+int socket99_loop_run_once(socket99_loop *loop, int timeout_msec);
+
+/* Handle events until socket99_loop_stop is called. */
+bool socket99_loop_run(socket99_loop *loop);
+
+/* Make socket99_loop_run return after the current events. */
+void socket99_loop_stop(socket99_loop *loop);
+
+/* A completion-based I/O engine for sockets. On Linux it uses
+ * io_uring(7), with multishot accept and multishot receives into a
+ * registered ring of provided buffers, so a busy socket needs no
+ * system call per accept or read. Where io_uring is unavailable (old
+ * kernels, including ones before 6.0 without multishot receives, or
+ * disabled by sysctl or seccomp), it falls back to epoll(7) with the
+ * same API. An engine is not thread-safe, and should only be
+ * used by the thread that created it. */
+typedef struct socket99_io socket99_io;
+
+typedef struct {
+    unsigned entries;           /* submission queue size; default 256 */
+    unsigned buf_count;         /* receive buffers (rounded up to a power
+                                 * of 2, at most 32768); default 256 */
+    size_t buf_size;            /* size of each receive buffer; default 4 KB */
+    bool no_uring;              /* always use the epoll(7) fallback */
+} socket99_io_config;
+
+enum socket99_io_op {
+    SOCKET99_IO_ACCEPT,
+    SOCKET99_IO_RECV,
+    SOCKET99_IO_SEND,
+};
+
+/* A finished operation, or one result of a multishot operation. */
+typedef struct {
+    enum socket99_io_op op;
+    int fd;                     /* fd the operation was queued on */
+    /* ACCEPT: the new connection's fd. RECV: bytes received (0 at
+     * EOF). SEND: bytes sent. On failure, a negated errno value. */
+    int res;
+    void *udata;
+    /* RECV: the received data, in a buffer owned by the engine. Pass
+     * the completion to socket99_io_release when done with it. */
+    const char *buf;
+    int buf_id;                 /* -1 if there is no buffer */
+    /* Whether a multishot operation is still armed. Once this is
+     * false, queue the operation again to keep going. (A RECV ends
+     * with -ENOBUFS when every receive buffer is in use.) */
+    bool more;
+} socket99_io_completion;
+
+/* Create an I/O engine. CFG may be NULL, for defaults. Returns NULL on
+ * failure, with errno set. */
+socket99_io *socket99_io_new(const socket99_io_config *cfg);
+
+/* Free an engine. Fds queued in it are not closed. */
+void socket99_io_free(socket99_io *io);
+
+/* Is the engine using io_uring, rather than the epoll(7) fallback? */
+bool socket99_io_uses_uring(socket99_io *io);
+
+/* Queue a multishot accept on the listener FD. Each connection is a
+ * separate completion; accepted fds are close-on-exec. The epoll(7)
+ * fallback makes FD nonblocking, to accept in bursts. */
+bool socket99_io_accept(socket99_io *io, int fd, void *udata);
+
+/* Queue a multishot receive on FD, into the engine's buffers. */
+bool socket99_io_recv(socket99_io *io, int fd, void *udata);
+
+/* Queue a send of LEN bytes of BUF to FD. BUF must stay valid until
+ * its completion. Sends are submitted together, by the next
+ * socket99_io_submit or socket99_io_reap, and may be partial. */
+bool socket99_io_send(socket99_io *io, int fd, const void *buf,
+    size_t len, void *udata);
+
+/* Cancel every operation queued on FD. Each will complete with
+ * -ECANCELED. Cancel before closing an fd with operations queued. */
+bool socket99_io_cancel(socket99_io *io, int fd);
+
+/* Submit queued operations, without waiting. */
+bool socket99_io_submit(socket99_io *io);
+
+/* Submit queued operations, then wait up to TIMEOUT_MSEC (or forever,
+ * if -1) for completions, and copy up to COUNT of them to OUT.
+ * Returns the number copied, or -1 on error. */
+int socket99_io_reap(socket99_io *io, socket99_io_completion *out,
+    size_t count, int timeout_msec);
+
+/* Return a RECV completion's buffer to the engine. */
+void socket99_io_release(socket99_io *io, const socket99_io_completion *c);
+
+/* A preallocated batch of datagrams, for receiving or sending many
+ * per system call with recvmmsg(2) and sendmmsg(2). Where those are
+ * unavailable, the batch falls back to one call per datagram. */
+typedef struct socket99_batch socket99_batch;
+
+/* One datagram in a batch. */
+typedef struct {
+    /* Data, in the batch's buffers. It may be pointed elsewhere to
+     * send from other memory; receiving points it back. */
+    char *buf;
+    size_t len;                 /* length received, or to send */
+    /* Source address of a received datagram, or destination of one
+     * to send. Set ADDR_LEN to 0 to send to a connected socket's peer. */
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    bool truncated;             /* received datagram didn't fit in buf */
+} socket99_dgram;
+
+/* Allocate a batch of COUNT datagrams with BUF_SIZE bytes of buffer
+ * each. Returns NULL on failure, with errno set. */
+socket99_batch *socket99_batch_new(size_t count, size_t buf_size);
+
+/* Free a batch and its buffers. */
+void socket99_batch_free(socket99_batch *b);
+
+/* Get the batch's array of datagrams, and how many there are. */
+socket99_dgram *socket99_batch_dgrams(socket99_batch *b, size_t *count);
+
+/* Receive up to COUNT datagrams from FD into the start of the batch.
+ * Waits up to TIMEOUT_MSEC (or forever, if -1) for the first one, even
+ * if FD is nonblocking, then takes whatever else is already queued
+ * without blocking. Returns the
+ * number received (0 if the timeout passed), or -1 with errno set. */
+int socket99_batch_recv(socket99_batch *b, int fd, size_t count,
+    int timeout_msec);
+
+/* Send COUNT datagrams from the batch to FD, starting at index FIRST.
+ * Returns the number sent, which may be short if the socket's buffer
+ * fills (nonblocking) or a datagram fails; send the rest by calling
+ * again from FIRST + the result. Returns -1 with errno set if none
+ * were sent. */
+int socket99_batch_send(socket99_batch *b, int fd, size_t first,
+    size_t count);
+
+/* Zero-copy sends for a stream socket opened with the zerocopy option
+ * (Linux, with MSG_ZEROCOPY). The kernel sends straight from the
+ * caller's buffers, so each buffer must be left alone until the kernel
+ * reports it done through the socket's error queue. Sends smaller than
+ * the copy threshold are copied as usual, since pinning pages costs
+ * more than copying small buffers. Without SO_ZEROCOPY set on the
+ * socket, every send is copied. */
+typedef struct socket99_zc socket99_zc;
+
+/* Default size below which sends are copied. */
+#define SOCKET99_DEF_ZC_THRESHOLD (16 * 1024)
+
+/* Counters for a socket99_zc. */
+typedef struct {
+    uint64_t zerocopy_sends;    /* sends made with MSG_ZEROCOPY */
+    uint64_t copied_sends;      /* sends below the threshold, etc. */
+    uint64_t notifications;     /* completions read from the error queue */
+    /* Zero-copy sends the kernel ended up copying anyway (as it does
+     * over loopback). If most are, zero-copy isn't paying off. */
+    uint64_t kernel_copies;
+} socket99_zc_stats;
+
+/* Create a zero-copy sender for FD. Sends of at least COPY_THRESHOLD
+ * bytes (or SOCKET99_DEF_ZC_THRESHOLD, if 0) use MSG_ZEROCOPY. Returns
+ * NULL on failure, with errno set. */
+socket99_zc *socket99_zc_new(int fd, size_t copy_threshold);
+
+/* Free a sender. Buffers still pinned by the kernel stay pinned until
+ * their sends finish; close the socket before freeing their memory. */
+void socket99_zc_free(socket99_zc *zc);
+
+/* Send up to LEN bytes of BUF, like send(2). If zero-copy was used,
+ * *PINNED is set, and BUF must not be changed or freed until TAG is
+ * returned by socket99_zc_reap. Otherwise BUF can be reused at once.
+ * Sending the rest of a partially sent buffer with the same TAG
+ * extends its pin, so TAG is only returned once, after both. */
+ssize_t socket99_zc_send(socket99_zc *zc, const void *buf, size_t len,
+    void *tag, bool *pinned);
+
+/* Read completions from the socket's error queue, without blocking,
+ * and store the tags of up to COUNT buffers that can be reused in
+ * TAGS, in the order they were sent. Returns the number stored, or -1
+ * on error. Completions are pending when poll(2) reports POLLERR. */
+int socket99_zc_reap(socket99_zc *zc, void **tags, size_t count);
+
+/* Get the number of buffers still pinned by zero-copy sends. */
+size_t socket99_zc_pending(socket99_zc *zc);
+
+/* Get a snapshot of the sender's counters. */
+void socket99_zc_get_stats(socket99_zc *zc, socket99_zc_stats *stats);
+
+/* A one-way relay from one fd to another that keeps data in the
+ * kernel: socket to socket, it splice(2)s through a pipe (Linux). Pipes
+ * come from a process-wide pool and are only held while data is in
+ * flight, so idle relays cost nothing. Elsewhere, it copies through a
+ * buffer. */
+typedef struct socket99_relay socket99_relay;
+
+/* Counters for a relay or socket99_sendfile. */
+typedef struct {
+    uint64_t bytes;             /* bytes written to the destination */
+    uint64_t syscalls;          /* splice, sendfile, read, write, etc. */
+} socket99_relay_stats;
+
+/* Create a relay from IN_FD to OUT_FD. Returns NULL on failure, with
+ * errno set. */
+socket99_relay *socket99_relay_new(int in_fd, int out_fd);
+
+/* Free a relay. Neither fd is closed. */
+void socket99_relay_free(socket99_relay *r);
+
+/* Move up to MAX bytes from IN_FD to OUT_FD (SIZE_MAX for no limit),
+ * continuing through partial transfers until IN_FD reaches EOF or a
+ * nonblocking fd would block. Returns the number of bytes written to
+ * OUT_FD, 0 once IN_FD is at EOF and everything read from it has been
+ * written, or -1 with errno set -- EAGAIN if no progress could be
+ * made, EINVAL if MAX is 0. To know which fd to wait for, see
+ * socket99_relay_pending. */
+ssize_t socket99_relay_step(socket99_relay *r, size_t max);
+
+/* Get the number of bytes read but not yet written. If nonzero, wait
+ * for OUT_FD to be writable before the next step; otherwise, wait for
+ * IN_FD to be readable. */
+size_t socket99_relay_pending(socket99_relay *r);
+
+/* Get a snapshot of the relay's counters. */
+void socket99_relay_get_stats(socket99_relay *r,
+    socket99_relay_stats *stats);
+
+/* Send up to COUNT bytes of the file FILE_FD to the socket OUT_FD with
+ * sendfile(2) (Linux; elsewhere, pread(2) and send(2)), continuing
+ * through partial sends. Reads from *OFFSET and advances it, or uses
+ * and advances the file position if OFFSET is NULL. Returns the number
+ * of bytes sent, which is short at the end of the file or if a
+ * nonblocking OUT_FD would block, or -1 with errno set if nothing could
+ * be sent. If STATS is non-NULL, bytes and system calls are added to
+ * it. */
+ssize_t socket99_sendfile(int out_fd, int file_fd, off_t *offset,
+    size_t count, socket99_relay_stats *stats);
+
+/* Roles for fds passed by socket99_handoff_send. Applications may tag
+ * their own fds with values from SOCKET99_ROLE_USER up. */
+enum socket99_role {
+    SOCKET99_ROLE_LISTENER = 1,     /* a server socket */
+    SOCKET99_ROLE_CONNECTION = 2,   /* an established connection */
+    SOCKET99_ROLE_USER = 256,
+};
+
+/* Room for a host, address, or path, with its '\0'. */
+#define SOCKET99_HANDOFF_NAME_SIZE 108
+
+/* An fd passed to another process over a Unix domain socket (using
+ * SCM_RIGHTS), with a record of the config it was opened with. This
+ * lets a new process take over an old one's listeners, so clients
+ * queued or connecting during a restart aren't refused. */
+typedef struct {
+    int fd;
+    int role;                   /* enum socket99_role, or the app's own */
+
+    /* From the originating config. */
+    char name[SOCKET99_HANDOFF_NAME_SIZE];  /* path, host, IPv4, or IPv6 */
+    int port;
+    bool unix_domain;           /* name is a path */
+    bool server;
+    bool datagram;
+} socket99_handoff;
+
+/* Describe FD, opened with CFG, for a handoff. Returns false with errno
+ * set to ENAMETOOLONG if CFG's host or path doesn't fit. */
+bool socket99_handoff_init(socket99_handoff *h, const socket99_config *cfg,
+    int fd, int role);
+
+/* Send COUNT fds and their records over the connected Unix domain
+ * stream socket SOCK (for example, one opened by socket99_open with a
+ * path), which should be blocking. The fds stay open in this process;
+ * an old process can keep accepting or draining until it exits, since
+ * both processes now share each socket. Returns whether all were sent,
+ * or false with errno set. The receiver must be built with the same
+ * version of socket99. */
+bool socket99_handoff_send(int sock, const socket99_handoff *fds,
+    size_t count);
+
+/* Receive a handoff sent by socket99_handoff_send on the blocking
+ * socket SOCK, storing up to MAX records in FDS[0] onward, with the
+ * received fds (close-on-exec, where supported). Returns the number
+ * received, or -1 with errno set, in which case no fds are left open:
+ * ENOBUFS if more than MAX were sent, or EPROTO if the sender isn't
+ * speaking this protocol. */
+int socket99_handoff_recv(int sock, socket99_handoff *fds, size_t max);
+
+/* Take over a server socket for CFG from the COUNT received FDS: the
+ * first listener whose record matches CFG's host or path, port, and
+ * type is checked, given CFG's nonblocking and cloexec settings, and
+ * stored in RES, and its entry's fd is set to -1. Note that O_NONBLOCK
+ * is shared with the process that sent it. If none matches, this opens
+ * a new socket with socket99_open. Returns whether RES holds a socket;
+ * a matching fd that fails the checks is left open in FDS. */
+bool socket99_handoff_adopt(socket99_config *cfg, socket99_handoff *fds,
+    size_t count, socket99_result *res);
+
+/* A shared memory channel between two processes on the same host
+ * (Linux), set up over a connected Unix domain stream socket. One end
+ * offers and the other accepts: a memfd holding a lock-free
+ * single-producer, single-consumer ring for each direction is passed
+ * with SCM_RIGHTS, along with an eventfd for each end, so data is
+ * copied once, into shared memory, rather than twice through the
+ * kernel. A waiting end spins for a while (adapting to how often that
+ * pays off) before it sleeps on its eventfd, and the peer only makes a
+ * system call to wake it when it is asleep. After the handshake the
+ * socket must stay open, since a hangup on it is how each end sees if
+ * the other one goes away; the channel doesn't read from it, so any
+ * other data on it is left for the caller. Each end should be used by
+ * one thread at a time. */
+typedef struct socket99_shm socket99_shm;
+
+/* Configuration for a socket99_shm. Zeroed fields get defaults. */
+typedef struct {
+    size_t ring_size;           /* bytes each way (1 MB), set by the
+                                 * offering end; rounded up to a power
+                                 * of 2 */
+    int spin_usec;              /* most time to spin before sleeping (50;
+                                 * -1 never spins); no spinning with
+                                 * only one CPU online */
+    bool nonblocking;           /* fail with EAGAIN rather than sleep */
+} socket99_shm_config;
+
+/* Counters for one end of a socket99_shm. */
+typedef struct {
+    uint64_t sent;              /* bytes */
+    uint64_t received;          /* bytes */
+    uint64_t spins;             /* waits that ended while spinning */
+    uint64_t sleeps;            /* waits that slept */
+    uint64_t wakeups;           /* times the peer was woken */
+} socket99_shm_stats;
+
+/* Offer a shared memory channel over the connected Unix domain stream
+ * socket SOCK, and wait for the peer to accept it. CFG may be NULL for
+ * defaults. Returns NULL on failure, with errno set (EPROTO if the peer
+ * refused it); the socket can then still be used as usual. */
+socket99_shm *socket99_shm_offer(int sock, const socket99_shm_config *cfg);
+
+/* Accept a channel offered with socket99_shm_offer on SOCK. Returns
+ * NULL on failure, with errno set (EPROTO if the offer was malformed,
+ * including a memfd whose size isn't sealed, in which case the
+ * offering end is told so). */
+socket99_shm *socket99_shm_accept(int sock, const socket99_shm_config *cfg);
+
+/* Copy LEN bytes from BUF into the channel. Blocks until all of it
+ * fits, unless nonblocking, in which case it copies what fits. Returns
+ * the number of bytes copied, or -1 with errno set: EAGAIN if the ring
+ * is full (nonblocking), EPIPE if the peer is gone, or EPROTO if the
+ * peer corrupted the ring, after which the channel is dead. */
+ssize_t socket99_shm_send(socket99_shm *s, const void *buf, size_t len);
+
+/* Copy up to LEN bytes from the channel into BUF, blocking until there
+ * are some, unless nonblocking. Returns the number of bytes copied, 0
+ * once the peer is gone and everything it sent has been read, or -1
+ * with errno set: EAGAIN if nonblocking and there is nothing yet, or
+ * EPROTO (as with send) if the peer corrupted the ring. */
+ssize_t socket99_shm_recv(socket99_shm *s, void *buf, size_t len);
+
+/* Get the eventfd that becomes readable when the peer wakes this end,
+ * for nonblocking use with an event loop, along with the socket. It is
+ * only signalled after a send or recv failed with EAGAIN. */
+int socket99_shm_fd(socket99_shm *s);
+
+/* Get a snapshot of this end's counters. */
+void socket99_shm_get_stats(socket99_shm *s, socket99_shm_stats *stats);
+
+/* Close this end of the channel, waking the peer. SOCK is not closed. */
+void socket99_shm_free(socket99_shm *s);
+
 /* Construct an error message in BUF, based on the status codes
  * in *RES. This has the same return value and general behavior
  * as snprintf -- if the return value is >= buf_size, the string
@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2014-17 Scott Vokes <vokes.s@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* recvmmsg(2) and sendmmsg(2) are hidden by strict _POSIX_C_SOURCE. */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "socket99.h"
+
+#ifdef MSG_WAITFORONE
+#define HAVE_MMSG 1
+#endif
+
+struct socket99_batch {
+    size_t count;
+    socket99_dgram *dgrams;
+    struct iovec *iovs;
+#ifdef HAVE_MMSG
+    struct mmsghdr *hdrs;
+#endif
+    char *bufs;
+    size_t buf_size;
+};
+
+socket99_batch *socket99_batch_new(size_t count, size_t buf_size) {
+    if (count == 0 || buf_size == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    socket99_batch *b = calloc(1, sizeof(*b));
+    if (b == NULL) { return NULL; }
+    b->count = count;
+    b->buf_size = buf_size;
+    b->dgrams = calloc(count, sizeof(*b->dgrams));
+    b->iovs = calloc(count, sizeof(*b->iovs));
+    b->bufs = malloc(count * buf_size);
+#ifdef HAVE_MMSG
+    b->hdrs = calloc(count, sizeof(*b->hdrs));
+    if (b->hdrs == NULL) {
+        socket99_batch_free(b);
+        return NULL;
+    }
+#endif
+    if (b->dgrams == NULL || b->iovs == NULL || b->bufs == NULL) {
+        socket99_batch_free(b);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    /* Wire up the headers once; each call only resets per-message fields. */
+    for (size_t i = 0; i < count; i++) {
+        socket99_dgram *d = &b->dgrams[i];
+        d->buf = b->bufs + i * buf_size;
+        b->iovs[i].iov_base = d->buf;
+#ifdef HAVE_MMSG
+        struct msghdr *h = &b->hdrs[i].msg_hdr;
+        h->msg_iov = &b->iovs[i];
+        h->msg_iovlen = 1;
+#endif
+    }
+    return b;
+}
+
+void socket99_batch_free(socket99_batch *b) {
+    if (b == NULL) { return; }
+#ifdef HAVE_MMSG
+    free(b->hdrs);
+#endif
+    free(b->bufs);
+    free(b->iovs);
+    free(b->dgrams);
+    free(b);
+}
+
+socket99_dgram *socket99_batch_dgrams(socket99_batch *b, size_t *count) {
+    if (b == NULL) { return NULL; }
+    if (count) { *count = b->count; }
+    return b->dgrams;
+}
+
+static uint64_t now_msec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/* Wait for FD to be readable. Returns 1 if it is, 0 on timeout, or -1. */
+static int wait_readable(int fd, int timeout_msec) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    for (;;) {
+        int res = poll(&pfd, 1, timeout_msec);
+        if (res == -1 && errno == EINTR) { continue; }
+        return res;
+    }
+}
+
+/* Wait for FD to be readable until DEADLINE, or forever if TIMEOUT_MSEC
+ * is negative. Returns 1 if it is, 0 on timeout, or -1. */
+static int wait_until(int fd, int timeout_msec, uint64_t deadline) {
+    if (timeout_msec < 0) { return wait_readable(fd, -1); }
+    uint64_t now = now_msec();
+    if (now >= deadline) { return 0; }
+    return wait_readable(fd, (int)(deadline - now));
+}
+
+int socket99_batch_recv(socket99_batch *b, int fd, size_t count,
+        int timeout_msec) {
+    if (b == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (count > b->count) { count = b->count; }
+    if (count == 0) { return 0; }
+
+#ifdef HAVE_MMSG
+    for (size_t i = 0; i < count; i++) {
+        struct msghdr *h = &b->hdrs[i].msg_hdr;
+        b->dgrams[i].buf = b->bufs + i * b->buf_size;
+        b->iovs[i].iov_base = b->dgrams[i].buf;
+        h->msg_name = &b->dgrams[i].addr;
+        h->msg_namelen = sizeof(b->dgrams[i].addr);
+        h->msg_flags = 0;
+        b->iovs[i].iov_len = b->buf_size;
+    }
+
+    /* recvmmsg's own timeout is only checked after each datagram
+     * arrives, so wait for the first one with poll(2) instead -- but
+     * only once a nonblocking attempt finds nothing queued. Polling
+     * also lets a nonblocking FD wait. After a spurious wakeup, keep
+     * waiting for whatever time is left. */
+    uint64_t deadline = now_msec() + (uint64_t)(timeout_msec > 0
+        ? timeout_msec : 0);
+    int got;
+    for (;;) {
+        got = recvmmsg(fd, b->hdrs, (unsigned)count,
+            MSG_WAITFORONE | MSG_DONTWAIT, NULL);
+        if (got != -1) { break; }
+        if (errno == EINTR) { continue; }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) { return -1; }
+        int ready = wait_until(fd, timeout_msec, deadline);
+        if (ready == -1) { return -1; }
+        if (ready == 0) {
+            errno = 0;
+            return 0;
+        }
+    }
+
+    for (int i = 0; i < got; i++) {
+        socket99_dgram *d = &b->dgrams[i];
+        d->len = b->hdrs[i].msg_len;
+        d->addr_len = b->hdrs[i].msg_hdr.msg_namelen;
+        d->truncated = b->hdrs[i].msg_hdr.msg_flags & MSG_TRUNC;
+    }
+    return got;
+#else
+    /* Poll for the first datagram, even on a blocking FD, so the
+     * timeout holds. One recvfrom per datagram, stopping once none
+     * are queued. */
+    uint64_t deadline = now_msec() + (uint64_t)(timeout_msec > 0
+        ? timeout_msec : 0);
+    int got = 0;
+    while ((size_t)got < count) {
+        int ready = got > 0 ? wait_readable(fd, 0)
+            : wait_until(fd, timeout_msec, deadline);
+        if (ready == -1 && got == 0) { return -1; }
+        if (ready != 1) {
+            if (got > 0) { break; }
+            errno = 0;
+            return 0;
+        }
+        socket99_dgram *d = &b->dgrams[got];
+        d->buf = b->bufs + (size_t)got * b->buf_size;
+        d->addr_len = sizeof(d->addr);
+        ssize_t res = recvfrom(fd, d->buf, b->buf_size, 0,
+            (struct sockaddr *)&d->addr, &d->addr_len);
+        if (res == -1) {
+            if (errno == EINTR) { continue; }
+            if (got > 0) { break; }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                continue;               /* spurious wakeup */
+            }
+            return -1;
+        }
+        /* recvfrom(2) can't report truncation. */
+        d->len = (size_t)res;
+        d->truncated = false;
+        got++;
+    }
+    errno = 0;
+    return got;
+#endif
+}
+
+int socket99_batch_send(socket99_batch *b, int fd, size_t first,
+        size_t count) {
+    if (b == NULL || first > b->count) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (count > b->count - first) { count = b->count - first; }
+    if (count == 0) { return 0; }
+
+#ifdef HAVE_MMSG
+    for (size_t i = first; i < first + count; i++) {
+        socket99_dgram *d = &b->dgrams[i];
+        struct msghdr *h = &b->hdrs[i].msg_hdr;
+        h->msg_name = d->addr_len ? &d->addr : NULL;
+        h->msg_namelen = d->addr_len;
+        b->iovs[i].iov_base = d->buf;
+        b->iovs[i].iov_len = d->len;
+    }
+
+    /* sendmmsg stops early on an error after the first datagram, or
+     * when a nonblocking socket's buffer fills; report how far it got. */
+    int sent;
+    do {
+        sent = sendmmsg(fd, &b->hdrs[first], (unsigned)count, 0);
+    } while (sent == -1 && errno == EINTR);
+    return sent;
+#else
+    int sent = 0;
+    while ((size_t)sent < count) {
+        socket99_dgram *d = &b->dgrams[first + sent];
+        ssize_t res = sendto(fd, d->buf, d->len, 0,
+            d->addr_len ? (struct sockaddr *)&d->addr : NULL, d->addr_len);
+        if (res == -1) {
+            if (errno == EINTR) { continue; }
+            if (sent > 0) { break; }
+            return -1;
+        }
+        sent++;
+    }
+    errno = 0;
+    return sent;
+#endif
+}
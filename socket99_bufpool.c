@@ -0,0 +1,344 @@
+/*
+ * Copyright (c) 2014-17 Scott Vokes <vokes.s@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* MAP_ANONYMOUS, MAP_HUGETLB, and madvise(2) are hidden by strict
+ * _POSIX_C_SOURCE. */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "socket99.h"
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define DEF_BUF_SIZE (16 * 1024)
+#define DEF_SLAB_SIZE (1024 * 1024)
+#define DEF_THREAD_CACHE 64
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+/* Keep buffers on separate cache lines. */
+#define BUF_ALIGN 64
+
+/* Counters written only by the owning thread, but read by others. */
+#define BUMP(X) __atomic_store_n(&(X), \
+        __atomic_load_n(&(X), __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED)
+#define PEEK(X) __atomic_load_n(&(X), __ATOMIC_RELAXED)
+
+/* A thread's free buffers. */
+typedef struct cache {
+    socket99_bufpool *bp;
+    struct cache *prev;
+    struct cache *next;
+    uint64_t gets;
+    uint64_t puts;
+    uint64_t misses;
+    size_t count;
+    void *bufs[];
+} cache;
+
+/* Free buffers on the shared list are linked through their first
+ * bytes. */
+typedef struct free_buf {
+    struct free_buf *next;
+} free_buf;
+
+struct socket99_bufpool {
+    socket99_bufpool_config cfg;
+    pthread_key_t key;
+
+    pthread_mutex_t lock;       /* protects the rest */
+    free_buf *free_list;
+    char *carve;                /* next never-used buffer in newest slab */
+    size_t carve_left;
+    size_t carved;              /* buffers ever carved */
+
+    void **slabs;
+    size_t slab_count;
+    size_t slab_ceil;
+    uint64_t hugepage_slabs;
+
+    cache *caches;
+    uint64_t exited_gets;       /* counts from threads that exited */
+    uint64_t exited_puts;
+    uint64_t exited_misses;
+};
+
+static void cache_exit(void *arg);
+
+socket99_bufpool *socket99_bufpool_new(socket99_bufpool_config *cfg) {
+    socket99_bufpool *bp = calloc(1, sizeof(*bp));
+    if (bp == NULL) { return NULL; }
+    if (cfg) { bp->cfg = *cfg; }
+
+    socket99_bufpool_config *c = &bp->cfg;
+    if (c->buf_size == 0) { c->buf_size = DEF_BUF_SIZE; }
+    c->buf_size = (c->buf_size + BUF_ALIGN - 1) & ~(size_t)(BUF_ALIGN - 1);
+    if (c->slab_size == 0) { c->slab_size = DEF_SLAB_SIZE; }
+    if (c->slab_size < c->buf_size) { c->slab_size = c->buf_size; }
+    if (c->hugepages) {
+        c->slab_size = (c->slab_size + HUGEPAGE_SIZE - 1)
+            & ~(size_t)(HUGEPAGE_SIZE - 1);
+    }
+    if (c->thread_cache == 0) { c->thread_cache = DEF_THREAD_CACHE; }
+
+    if (pthread_key_create(&bp->key, cache_exit) != 0) {
+        free(bp);
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (pthread_mutex_init(&bp->lock, NULL) != 0) {
+        pthread_key_delete(bp->key);
+        free(bp);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return bp;
+}
+
+void socket99_bufpool_free(socket99_bufpool *bp) {
+    if (bp == NULL) { return; }
+    /* Once the key is deleted, no thread's exit will touch the pool. */
+    pthread_key_delete(bp->key);
+    cache *c = bp->caches;
+    while (c) {
+        cache *next = c->next;
+        free(c);
+        c = next;
+    }
+    for (size_t i = 0; i < bp->slab_count; i++) {
+        munmap(bp->slabs[i], bp->cfg.slab_size);
+    }
+    free(bp->slabs);
+    pthread_mutex_destroy(&bp->lock);
+    free(bp);
+}
+
+size_t socket99_bufpool_buf_size(socket99_bufpool *bp) {
+    return bp ? bp->cfg.buf_size : 0;
+}
+
+/* Map another slab. Called with the lock held. */
+static bool add_slab(socket99_bufpool *bp) {
+    if (bp->slab_count == bp->slab_ceil) {
+        size_t ceil = bp->slab_ceil ? 2 * bp->slab_ceil : 8;
+        void **slabs = realloc(bp->slabs, ceil * sizeof(*slabs));
+        if (slabs == NULL) { return false; }
+        bp->slabs = slabs;
+        bp->slab_ceil = ceil;
+    }
+
+    size_t size = bp->cfg.slab_size;
+    void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (bp->cfg.hugepages) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) { bp->hugepage_slabs++; }
+    }
+#endif
+    if (p == MAP_FAILED) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) { return false; }
+#ifdef MADV_HUGEPAGE
+        /* No reserved huge pages; settle for transparent ones. */
+        if (bp->cfg.hugepages) { (void)madvise(p, size, MADV_HUGEPAGE); }
+#endif
+    }
+
+    bp->slabs[bp->slab_count++] = p;
+    bp->carve = p;
+    bp->carve_left = size / bp->cfg.buf_size;
+    return true;
+}
+
+/* Take up to WANT free buffers into BUFS: previously used ones first,
+ * then new ones from the newest slab, so untouched memory stays
+ * uncommitted. Returns how many, setting errno if none. */
+static size_t take_bufs(socket99_bufpool *bp, void **bufs, size_t want) {
+    size_t got = 0;
+    int err = 0;
+    pthread_mutex_lock(&bp->lock);
+    while (got < want && bp->free_list) {
+        bufs[got++] = bp->free_list;
+        bp->free_list = bp->free_list->next;
+    }
+    while (got < want) {
+        if (bp->cfg.max_bufs > 0 && bp->carved >= bp->cfg.max_bufs) {
+            err = ENOBUFS;
+            break;
+        }
+        if (bp->carve_left == 0 && !add_slab(bp)) {
+            err = ENOMEM;
+            break;
+        }
+        bufs[got++] = bp->carve;
+        bp->carve += bp->cfg.buf_size;
+        bp->carve_left--;
+        bp->carved++;
+    }
+    pthread_mutex_unlock(&bp->lock);
+    if (got == 0) { errno = err; }
+    return got;
+}
+
+static void give_bufs(socket99_bufpool *bp, void **bufs, size_t count) {
+    pthread_mutex_lock(&bp->lock);
+    for (size_t i = 0; i < count; i++) {
+        free_buf *fb = bufs[i];
+        fb->next = bp->free_list;
+        bp->free_list = fb;
+    }
+    pthread_mutex_unlock(&bp->lock);
+}
+
+/* Get the calling thread's cache, creating it on first use. Returns
+ * NULL if it can't be allocated, in which case the shared list is
+ * used directly. */
+static cache *get_cache(socket99_bufpool *bp) {
+    cache *c = pthread_getspecific(bp->key);
+    if (c) { return c; }
+
+    c = calloc(1, sizeof(*c) + bp->cfg.thread_cache * sizeof(void *));
+    if (c == NULL) { return NULL; }
+    if (pthread_setspecific(bp->key, c) != 0) {
+        free(c);
+        return NULL;
+    }
+    c->bp = bp;
+    pthread_mutex_lock(&bp->lock);
+    c->next = bp->caches;
+    if (bp->caches) { bp->caches->prev = c; }
+    bp->caches = c;
+    pthread_mutex_unlock(&bp->lock);
+    return c;
+}
+
+/* On thread exit, hand its cached buffers back to the shared list. */
+static void cache_exit(void *arg) {
+    cache *c = arg;
+    socket99_bufpool *bp = c->bp;
+    give_bufs(bp, c->bufs, c->count);
+
+    pthread_mutex_lock(&bp->lock);
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        bp->caches = c->next;
+    }
+    if (c->next) { c->next->prev = c->prev; }
+    bp->exited_gets += c->gets;
+    bp->exited_puts += c->puts;
+    bp->exited_misses += c->misses;
+    pthread_mutex_unlock(&bp->lock);
+    free(c);
+}
+
+void *socket99_bufpool_get(socket99_bufpool *bp) {
+    if (bp == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    cache *c = get_cache(bp);
+    if (c == NULL) {
+        void *buf = NULL;
+        return take_bufs(bp, &buf, 1) ? buf : NULL;
+    }
+
+    if (c->count == 0) {
+        /* Refill half the cache, to leave room for puts. */
+        size_t want = (bp->cfg.thread_cache + 1) / 2;
+        c->count = take_bufs(bp, c->bufs, want);
+        if (c->count == 0) { return NULL; }
+        BUMP(c->misses);
+    }
+    BUMP(c->gets);
+    return c->bufs[--c->count];
+}
+
+void socket99_bufpool_put(socket99_bufpool *bp, void *buf) {
+    if (bp == NULL || buf == NULL) { return; }
+    cache *c = get_cache(bp);
+    if (c == NULL) {
+        give_bufs(bp, &buf, 1);
+        return;
+    }
+
+    BUMP(c->puts);
+    if (c->count == bp->cfg.thread_cache) {
+        /* Full: pass the older half on to other threads. */
+        size_t half = (c->count + 1) / 2;
+        give_bufs(bp, c->bufs, half);
+        memmove(c->bufs, c->bufs + half,
+            (c->count - half) * sizeof(void *));
+        c->count -= half;
+    }
+    c->bufs[c->count++] = buf;
+}
+
+ssize_t socket99_bufpool_read(socket99_bufpool *bp, int fd, void **buf) {
+    if (buf == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    *buf = socket99_bufpool_get(bp);
+    if (*buf == NULL) { return -1; }
+
+    ssize_t got;
+    do {
+        got = read(fd, *buf, bp->cfg.buf_size);
+    } while (got == -1 && errno == EINTR);
+
+    if (got <= 0) {
+        int saved_errno = errno;
+        socket99_bufpool_put(bp, *buf);
+        *buf = NULL;
+        errno = saved_errno;
+    }
+    return got;
+}
+
+void socket99_bufpool_get_stats(socket99_bufpool *bp,
+        socket99_bufpool_stats *stats) {
+    if (bp == NULL || stats == NULL) { return; }
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&bp->lock);
+    stats->gets = bp->exited_gets;
+    stats->puts = bp->exited_puts;
+    stats->cache_misses = bp->exited_misses;
+    for (cache *c = bp->caches; c != NULL; c = c->next) {
+        stats->gets += PEEK(c->gets);
+        stats->puts += PEEK(c->puts);
+        stats->cache_misses += PEEK(c->misses);
+    }
+    stats->slabs = bp->slab_count;
+    stats->hugepage_slabs = bp->hugepage_slabs;
+    stats->reserved_bytes = bp->slab_count * bp->cfg.slab_size;
+    pthread_mutex_unlock(&bp->lock);
+    stats->in_use = stats->gets > stats->puts
+        ? (size_t)(stats->gets - stats->puts) : 0;
+}
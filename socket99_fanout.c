@@ -0,0 +1,509 @@
+/*
+ * Copyright (c) 2014-17 Scott Vokes <vokes.s@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include "socket99.h"
+
+#define DEF_MAX_IN_FLIGHT 64
+
+/* Most attempts waited on per open; Happy Eyeballs rarely has more
+ * than a few going at once. */
+#define MAX_ATTEMPT_FDS 16
+
+#define MAX_EVENTS 256
+
+/* Most threads looking up names for one call at once. */
+#define MAX_LOOKUP_THREADS 8
+
+/* Event tag for the lookups' pipe, which no entry index can equal. */
+#define LOOKUP_TAG ((uint64_t)-1)
+
+/* An entry whose name is looked up off the calling thread. Since
+ * socket99_open_async resolves before it returns, the lookup thread
+ * starts the open itself; the calling thread only steps it. */
+typedef struct lookup {
+    struct lookup *next;
+    size_t i;                   /* entry */
+    socket99_config cfg;        /* with its own copy of the name */
+    char *node;
+    socket99_pending *p;        /* NULL if the open failed */
+    socket99_result res;
+} lookup;
+
+/* Lookups shared with their threads, which can outlive the call (when
+ * the deadline passes first, since getaddrinfo(3) can't be cancelled),
+ * so whichever lets go of this last frees it. */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    lookup *todo;               /* in order: head and tail */
+    lookup *todo_tail;
+    size_t todo_count;
+    lookup *done;               /* finished, not yet collected */
+    size_t threads;
+    size_t idle;
+    int refs;                   /* the call, and each thread */
+    bool abandoned;             /* the call has returned */
+    int pipe_fds[2];            /* a byte is written per lookup done */
+} lookups;
+
+typedef struct {
+    socket99_config *cfgs;
+    socket99_result *res;
+    socket99_resolver *resolver;
+    lookups *ls;                /* started on the first name */
+    socket99_pending **pending; /* by entry, once connecting */
+    size_t *active;             /* entries in flight (or resolving) */
+    size_t *pos;                /* each entry's index in active */
+    size_t active_count;
+    size_t opened;
+    int epoll_fd;
+#ifndef __linux__
+    struct pollfd *pfds;
+    size_t *pfd_owner;
+#endif
+} fanout;
+
+static uint64_t now_msec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void set_failure(socket99_result *res, enum socket99_status status,
+        int err) {
+    memset(res, 0, sizeof(*res));
+    res->fd = -1;
+    res->status = status;
+    res->saved_errno = err;
+}
+
+/* Can NODE be used without a lookup? */
+static bool is_numeric(const char *node) {
+    unsigned char buf[sizeof(struct in6_addr)];
+    return node == NULL || inet_pton(AF_INET, node, buf) == 1
+        || inet_pton(AF_INET6, node, buf) == 1;
+}
+
+static void free_lookups(lookup *l) {
+    while (l) {
+        lookup *next = l->next;
+        socket99_pending_free(l->p);
+        free(l->node);
+        free(l);
+        l = next;
+    }
+}
+
+/* Let go of LS, freeing it if nothing else holds it. Its lock must be
+ * held, and is released. */
+static void release(lookups *ls) {
+    bool last = --ls->refs == 0;
+    pthread_mutex_unlock(&ls->lock);
+    if (!last) { return; }
+    free_lookups(ls->todo);
+    free_lookups(ls->done);
+    close(ls->pipe_fds[0]);
+    close(ls->pipe_fds[1]);
+    pthread_cond_destroy(&ls->cond);
+    pthread_mutex_destroy(&ls->lock);
+    free(ls);
+}
+
+static void *lookup_loop(void *arg) {
+    lookups *ls = (lookups *)arg;
+    pthread_mutex_lock(&ls->lock);
+    for (;;) {
+        while (ls->todo == NULL && !ls->abandoned) {
+            ls->idle++;
+            pthread_cond_wait(&ls->cond, &ls->lock);
+            ls->idle--;
+        }
+        if (ls->abandoned) { break; }
+        lookup *l = ls->todo;
+        ls->todo = l->next;
+        if (ls->todo == NULL) { ls->todo_tail = NULL; }
+        ls->todo_count--;
+        pthread_mutex_unlock(&ls->lock);
+
+        l->p = socket99_open_async(&l->cfg, &l->res);
+
+        pthread_mutex_lock(&ls->lock);
+        l->next = ls->done;
+        ls->done = l;
+        ssize_t res = write(ls->pipe_fds[1], "", 1);
+        (void)res;              /* EAGAIN: the pipe is already full */
+    }
+    release(ls);
+    return NULL;
+}
+
+static lookups *new_lookups(void) {
+    lookups *ls = calloc(1, sizeof(*ls));
+    if (ls == NULL) { return NULL; }
+    if (pipe(ls->pipe_fds) == -1) {
+        free(ls);
+        return NULL;
+    }
+    for (int i = 0; i < 2; i++) {
+        (void)fcntl(ls->pipe_fds[i], F_SETFL, O_NONBLOCK);
+        (void)fcntl(ls->pipe_fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    pthread_mutex_init(&ls->lock, NULL);
+    pthread_cond_init(&ls->cond, NULL);
+    ls->refs = 1;
+    return ls;
+}
+
+static bool watch_lookups(fanout *f) {
+#ifdef __linux__
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = LOOKUP_TAG;
+    return epoll_ctl(f->epoll_fd, EPOLL_CTL_ADD, f->ls->pipe_fds[0],
+        &ev) == 0;
+#else
+    (void)f;
+    return true;
+#endif
+}
+
+/* Hand entry I, with config C, to a lookup thread, starting another if
+ * all are busy. Returns false if it can't, so the caller opens it. */
+static bool queue_lookup(fanout *f, size_t i, const socket99_config *c,
+        const char *node) {
+    if (f->ls == NULL) {
+        f->ls = new_lookups();
+        if (f->ls == NULL) { return false; }
+        if (!watch_lookups(f)) {
+            pthread_mutex_lock(&f->ls->lock);
+            release(f->ls);
+            f->ls = NULL;
+            return false;
+        }
+    }
+    lookup *l = calloc(1, sizeof(*l));
+    char *copy = malloc(strlen(node) + 1);
+    if (l == NULL || copy == NULL) {
+        free(l);
+        free(copy);
+        return false;
+    }
+    strcpy(copy, node);
+    l->i = i;
+    l->node = copy;
+    l->cfg = *c;
+    if (c->IPv4) {
+        l->cfg.IPv4 = copy;
+    } else if (c->IPv6) {
+        l->cfg.IPv6 = copy;
+    } else {
+        l->cfg.host = copy;
+    }
+
+    lookups *ls = f->ls;
+    pthread_mutex_lock(&ls->lock);
+    if (ls->todo_count + 1 > ls->idle && ls->threads < MAX_LOOKUP_THREADS) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, lookup_loop, ls) == 0) {
+            pthread_detach(t);
+            ls->threads++;
+            ls->refs++;
+        }
+    }
+    if (ls->threads == 0) {
+        pthread_mutex_unlock(&ls->lock);
+        free(copy);
+        free(l);
+        return false;
+    }
+    if (ls->todo_tail) {
+        ls->todo_tail->next = l;
+    } else {
+        ls->todo = l;
+    }
+    ls->todo_tail = l;
+    ls->todo_count++;
+    pthread_cond_signal(&ls->cond);
+    pthread_mutex_unlock(&ls->lock);
+    return true;
+}
+
+/* Register entry I's attempts. Attempts that were closed have already
+ * left the epoll set. */
+static void watch_attempts(fanout *f, size_t i) {
+#ifdef __linux__
+    struct pollfd fds[MAX_ATTEMPT_FDS];
+    size_t n = socket99_pending_pollfds(f->pending[i], fds, MAX_ATTEMPT_FDS);
+    for (size_t j = 0; j < n; j++) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLOUT;
+        ev.data.u64 = i;
+        if (epoll_ctl(f->epoll_fd, EPOLL_CTL_ADD, fds[j].fd, &ev) == -1
+            && errno == EEXIST) {
+            (void)epoll_ctl(f->epoll_fd, EPOLL_CTL_MOD, fds[j].fd, &ev);
+        }
+    }
+#else
+    (void)f;
+    (void)i;
+#endif
+}
+
+static void retire(fanout *f, size_t i) {
+    socket99_pending_free(f->pending[i]);
+    f->pending[i] = NULL;
+    size_t last = f->active[--f->active_count];
+    f->active[f->pos[i]] = last;
+    f->pos[last] = f->pos[i];
+}
+
+/* Advance entry I, retiring it once it has finished. */
+static void step(fanout *f, size_t i) {
+    if (f->pending[i] == NULL) { return; }
+    if (!socket99_pending_step(f->pending[i], &f->res[i])) {
+        watch_attempts(f, i);
+        return;
+    }
+    if (f->res[i].status == SOCKET99_OK) {
+        f->opened++;
+#ifdef __linux__
+        (void)epoll_ctl(f->epoll_fd, EPOLL_CTL_DEL, f->res[i].fd, NULL);
+#endif
+    }
+    retire(f, i);
+}
+
+/* Take the lookups that have finished, and start connecting. */
+static void collect(fanout *f) {
+    char buf[64];
+    while (read(f->ls->pipe_fds[0], buf, sizeof(buf)) > 0) {}
+
+    pthread_mutex_lock(&f->ls->lock);
+    lookup *l = f->ls->done;
+    f->ls->done = NULL;
+    pthread_mutex_unlock(&f->ls->lock);
+
+    while (l) {
+        lookup *next = l->next;
+        size_t i = l->i;
+        if (l->p) {
+            f->pending[i] = l->p;
+            l->p = NULL;
+            step(f, i);
+        } else {
+            f->res[i] = l->res;
+            retire(f, i);
+        }
+        free(l->node);
+        free(l);
+        l = next;
+    }
+}
+
+static void start(fanout *f, size_t i) {
+    socket99_config *cfg = &f->cfgs[i];
+    if (cfg->server || cfg->datagram || cfg->path) {
+        if (socket99_open(cfg, &f->res[i])) { f->opened++; }
+        return;
+    }
+
+    /* The pending open keeps its own copy of the config. */
+    socket99_config c = *cfg;
+    if (c.resolver == NULL) { c.resolver = f->resolver; }
+    f->pos[i] = f->active_count;
+    f->active[f->active_count++] = i;
+
+    /* Names are looked up on another thread, so one slow lookup
+     * doesn't hold up the rest. */
+    const char *node = c.IPv4 ? c.IPv4 : c.IPv6 ? c.IPv6 : c.host;
+    if (!is_numeric(node) && queue_lookup(f, i, &c, node)) { return; }
+
+    socket99_pending *p = socket99_open_async(&c, &f->res[i]);
+    if (p == NULL) {
+        retire(f, i);
+        return;
+    }
+    f->pending[i] = p;
+    step(f, i);
+}
+
+/* Get the msec until the next attempt is due for any entry, capped by
+ * the time left before DEADLINE (if any). */
+static int next_timeout(fanout *f, uint64_t deadline) {
+    int timeout = -1;
+    for (size_t a = 0; a < f->active_count; a++) {
+        if (f->pending[f->active[a]] == NULL) { continue; }   /* resolving */
+        int t = socket99_pending_timeout(f->pending[f->active[a]]);
+        if (t != -1 && (timeout == -1 || t < timeout)) { timeout = t; }
+    }
+    if (deadline > 0) {
+        uint64_t now = now_msec();
+        int left = now >= deadline ? 0 : (int)(deadline - now);
+        if (timeout == -1 || left < timeout) { timeout = left; }
+    }
+    return timeout;
+}
+
+/* Wait up to TIMEOUT msec, then step every entry with an attempt that
+ * finished. */
+static bool wait_and_step(fanout *f, int timeout) {
+#ifdef __linux__
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(f->epoll_fd, events, MAX_EVENTS, timeout);
+    if (n == -1) { return errno == EINTR; }
+    for (int e = 0; e < n; e++) {
+        if (events[e].data.u64 == LOOKUP_TAG) {
+            collect(f);
+        } else {
+            step(f, (size_t)events[e].data.u64);
+        }
+    }
+#else
+    size_t count = 0;
+    if (f->ls) {
+        f->pfds[0].fd = f->ls->pipe_fds[0];
+        f->pfds[0].events = POLLIN;
+        f->pfd_owner[0] = (size_t)LOOKUP_TAG;
+        count++;
+    }
+    for (size_t a = 0; a < f->active_count; a++) {
+        size_t i = f->active[a];
+        if (f->pending[i] == NULL) { continue; }
+        size_t n = socket99_pending_pollfds(f->pending[i],
+            &f->pfds[count], MAX_ATTEMPT_FDS);
+        for (size_t j = 0; j < n; j++) { f->pfd_owner[count + j] = i; }
+        count += n;
+    }
+    int n = poll(f->pfds, (nfds_t)count, timeout);
+    if (n == -1) { return errno == EINTR; }
+    for (size_t j = 0; n > 0 && j < count; j++) {
+        if (f->pfds[j].revents == 0) { continue; }
+        if (f->pfd_owner[j] == (size_t)LOOKUP_TAG) {
+            collect(f);
+        } else {
+            step(f, f->pfd_owner[j]);
+        }
+    }
+#endif
+
+    /* Start attempts that came due. Stepping may retire entries, so
+     * walk backward. */
+    for (size_t a = f->active_count; a > 0; a--) {
+        size_t i = f->active[a - 1];
+        if (f->pending[i] && socket99_pending_timeout(f->pending[i]) == 0) {
+            step(f, i);
+        }
+    }
+    return true;
+}
+
+size_t socket99_open_many(socket99_config *cfgs, socket99_result *res,
+        size_t count, const socket99_open_many_config *mcfg) {
+    if (cfgs == NULL || res == NULL || count == 0) { return 0; }
+    socket99_open_many_config m;
+    memset(&m, 0, sizeof(m));
+    if (mcfg) { m = *mcfg; }
+    if (m.max_in_flight == 0) { m.max_in_flight = DEF_MAX_IN_FLIGHT; }
+    if (m.max_in_flight > count) { m.max_in_flight = count; }
+
+    uint64_t deadline = m.deadline_msec > 0
+        ? now_msec() + (uint64_t)m.deadline_msec : 0;
+
+    fanout f;
+    memset(&f, 0, sizeof(f));
+    f.cfgs = cfgs;
+    f.res = res;
+    f.resolver = m.resolver;
+    f.pending = calloc(count, sizeof(*f.pending));
+    f.active = calloc(m.max_in_flight, sizeof(*f.active));
+    f.pos = calloc(count, sizeof(*f.pos));
+#ifdef __linux__
+    f.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    bool ok = f.epoll_fd != -1;
+#else
+    f.epoll_fd = -1;
+    /* Room for the lookups' pipe, too. */
+    f.pfds = calloc(m.max_in_flight * MAX_ATTEMPT_FDS + 1, sizeof(*f.pfds));
+    f.pfd_owner = calloc(m.max_in_flight * MAX_ATTEMPT_FDS + 1,
+        sizeof(*f.pfd_owner));
+    bool ok = f.pfds != NULL && f.pfd_owner != NULL;
+#endif
+    ok = ok && f.pending != NULL && f.active != NULL && f.pos != NULL;
+    int saved_errno = errno ? errno : ENOMEM;
+
+    size_t next = 0;
+    while (ok && (next < count || f.active_count > 0)) {
+        if (deadline > 0 && now_msec() >= deadline) { break; }
+        while (next < count && f.active_count < m.max_in_flight) {
+            start(&f, next++);
+        }
+        if (f.active_count == 0) { continue; }
+        if (!wait_and_step(&f, next_timeout(&f, deadline))) {
+            saved_errno = errno;
+            ok = false;
+        }
+    }
+
+    /* Whatever is left ran out of time (or hit an error), including
+     * any names still being looked up. Their threads finish on their
+     * own and then exit. */
+    if (f.ls) {
+        pthread_mutex_lock(&f.ls->lock);
+        f.ls->abandoned = true;
+        pthread_cond_broadcast(&f.ls->cond);
+        release(f.ls);
+    }
+    for (size_t a = f.active_count; a > 0; a--) {
+        size_t i = f.active[a - 1];
+        retire(&f, i);
+        set_failure(&res[i], ok ? SOCKET99_ERROR_CONNECT
+            : SOCKET99_ERROR_UNKNOWN, ok ? ETIMEDOUT : saved_errno);
+    }
+    for (; next < count; next++) {
+        set_failure(&res[next], ok ? SOCKET99_ERROR_CONNECT
+            : SOCKET99_ERROR_UNKNOWN, ok ? ETIMEDOUT : saved_errno);
+    }
+
+    if (f.epoll_fd != -1) { close(f.epoll_fd); }
+#ifndef __linux__
+    free(f.pfds);
+    free(f.pfd_owner);
+#endif
+    free(f.pending);
+    free(f.active);
+    free(f.pos);
+    return f.opened;
+}
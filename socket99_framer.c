@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2014-17 Scott Vokes <vokes.s@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "socket99.h"
+
+#define DEF_RING_SIZE (64 * 1024)
+#define DEF_PREFIX_SIZE 4
+
+/* Positions in the ring only ever increase; masking gives the offset.
+ * The ring holds [head, tail): frames already returned, which stay put
+ * until the next fill, start at head, and the next frame at scan. */
+struct socket99_framer {
+    socket99_framer_config cfg;
+    unsigned char delimiter;
+    char *ring;
+    size_t size;                /* a power of 2 */
+    size_t head;
+    size_t scan;
+    size_t tail;
+    size_t searched;            /* bytes after scan with no delimiter */
+};
+
+socket99_framer *socket99_framer_new(socket99_framer_config *cfg) {
+    socket99_framer_config c;
+    memset(&c, 0, sizeof(c));
+    if (cfg) { c = *cfg; }
+
+    if (c.delimiter == 0) { c.delimiter = '\n'; }
+    if (c.prefix_size == 0) { c.prefix_size = DEF_PREFIX_SIZE; }
+    if (c.ring_size == 0) { c.ring_size = DEF_RING_SIZE; }
+    size_t size = 16;
+    while (size < c.ring_size && size <= SIZE_MAX / 4) { size *= 2; }
+
+    /* Room for the largest frame, with its prefix or delimiter. */
+    size_t overhead = c.mode == SOCKET99_FRAME_LENGTH ? c.prefix_size : 1;
+    if (c.max_frame == 0) { c.max_frame = size - overhead; }
+
+    bool ok = (c.mode == SOCKET99_FRAME_DELIMITED
+            || c.mode == SOCKET99_FRAME_LENGTH)
+        && c.delimiter > 0 && c.delimiter <= SOCKET99_FRAME_NUL
+        && (c.prefix_size == 1 || c.prefix_size == 2 || c.prefix_size == 4)
+        && size >= c.ring_size && c.max_frame <= size - overhead;
+    if (!ok) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    socket99_framer *f = calloc(1, sizeof(*f));
+    if (f == NULL) { return NULL; }
+    f->ring = malloc(size);
+    if (f->ring == NULL) {
+        free(f);
+        return NULL;
+    }
+    f->cfg = c;
+    f->delimiter = (unsigned char)(c.delimiter == SOCKET99_FRAME_NUL
+        ? 0 : c.delimiter);
+    f->size = size;
+    return f;
+}
+
+void socket99_framer_free(socket99_framer *f) {
+    if (f == NULL) { return; }
+    free(f->ring);
+    free(f);
+}
+
+ssize_t socket99_framer_fill(socket99_framer *f, int fd) {
+    if (f == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Release returned frames. Once the ring is empty, start over at
+     * the beginning, so frames rarely wrap. */
+    f->head = f->scan;
+    if (f->head == f->tail) {
+        f->head = f->scan = f->tail = 0;
+        f->searched = 0;
+    }
+
+    size_t space = f->size - (f->tail - f->head);
+    if (space == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    size_t start = f->tail & (f->size - 1);
+    size_t first = f->size - start;
+    if (first > space) { first = space; }
+
+    struct iovec iov[2] = {
+        { .iov_base = f->ring + start, .iov_len = first },
+        { .iov_base = f->ring, .iov_len = space - first },
+    };
+    ssize_t got;
+    do {
+        got = readv(fd, iov, space > first ? 2 : 1);
+    } while (got == -1 && errno == EINTR);
+    if (got > 0) { f->tail += (size_t)got; }
+    return got;
+}
+
+/* Describe LEN bytes starting at position START. */
+static void make_span(socket99_framer *f, size_t start, size_t len,
+        socket99_span *span) {
+    size_t off = start & (f->size - 1);
+    span->iov[0].iov_base = f->ring + off;
+    span->len = len;
+    if (off + len <= f->size) {
+        span->iov[0].iov_len = len;
+        span->iovcnt = 1;
+    } else {
+        size_t first = f->size - off;
+        span->iov[0].iov_len = first;
+        span->iov[1].iov_base = f->ring;
+        span->iov[1].iov_len = len - first;
+        span->iovcnt = 2;
+    }
+}
+
+static int next_delimited(socket99_framer *f, socket99_span *span) {
+    size_t avail = f->tail - f->scan;
+    size_t from = f->scan + f->searched;
+
+    /* Search up to two contiguous pieces. */
+    while (from < f->tail) {
+        size_t off = from & (f->size - 1);
+        size_t len = f->size - off;
+        if (len > f->tail - from) { len = f->tail - from; }
+        const char *hit = memchr(f->ring + off, f->delimiter, len);
+        if (hit) {
+            size_t body = from + (size_t)(hit - (f->ring + off)) - f->scan;
+            if (body > f->cfg.max_frame) { break; }
+            make_span(f, f->scan, body, span);
+            f->scan += body + 1;
+            f->searched = 0;
+            return 1;
+        }
+        from += len;
+    }
+
+    f->searched = avail;
+    if (avail > f->cfg.max_frame) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return 0;
+}
+
+static int next_length(socket99_framer *f, socket99_span *span) {
+    size_t avail = f->tail - f->scan;
+    size_t prefix = f->cfg.prefix_size;
+    if (avail < prefix) { return 0; }
+
+    size_t len = 0;
+    size_t off = f->scan & (f->size - 1);
+    const unsigned char *p = (const unsigned char *)f->ring + off;
+    if (off + prefix <= f->size) {
+        for (size_t i = 0; i < prefix; i++) { len = (len << 8) | p[i]; }
+    } else {
+        for (size_t i = 0; i < prefix; i++) {
+            unsigned char b = (unsigned char)f->ring[(f->scan + i)
+                & (f->size - 1)];
+            len = (len << 8) | b;
+        }
+    }
+    if (len > f->cfg.max_frame) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (avail - prefix < len) { return 0; }
+
+    make_span(f, f->scan + prefix, len, span);
+    f->scan += prefix + len;
+    return 1;
+}
+
+int socket99_framer_next(socket99_framer *f, socket99_span *span) {
+    if (f == NULL || span == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return f->cfg.mode == SOCKET99_FRAME_LENGTH
+        ? next_length(f, span) : next_delimited(f, span);
+}
+
+size_t socket99_framer_pending(socket99_framer *f) {
+    return f ? f->tail - f->scan : 0;
+}
+
+void socket99_span_copy(const socket99_span *span, void *buf) {
+    if (span == NULL || buf == NULL) { return; }
+    memcpy(buf, span->iov[0].iov_base, span->iov[0].iov_len);
+    if (span->iovcnt > 1) {
+        memcpy((char *)buf + span->iov[0].iov_len,
+            span->iov[1].iov_base, span->iov[1].iov_len);
+    }
+}
@@ -0,0 +1,344 @@
+/*
+ * Copyright (c) 2014-17 Scott Vokes <vokes.s@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* MSG_CMSG_CLOEXEC is hidden by strict _POSIX_C_SOURCE. */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "socket99.h"
+#include "socket99_internal.h"
+
+/* Most fds sent in one message; larger handoffs span several. */
+#define BATCH_FDS 64
+
+/* Marks the start of each message, so a stray connection or a peer
+ * built with a different record layout is refused. */
+#define HANDOFF_MAGIC 0x53393948    /* "S99H" */
+#define HANDOFF_VERSION 1
+
+#ifdef MSG_CMSG_CLOEXEC
+#define RECV_FLAGS (MSG_WAITALL | MSG_CMSG_CLOEXEC)
+#else
+#define RECV_FLAGS MSG_WAITALL
+#endif
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint16_t count;             /* records (and fds) in this message */
+    uint16_t last;              /* set on the handoff's final message */
+} header;
+
+static const char *config_name(const socket99_config *cfg) {
+    if (cfg->path) { return cfg->path; }
+    if (cfg->host) { return cfg->host; }
+    if (cfg->IPv4) { return cfg->IPv4; }
+    if (cfg->IPv6) { return cfg->IPv6; }
+    return "";
+}
+
+bool socket99_handoff_init(socket99_handoff *h, const socket99_config *cfg,
+        int fd, int role) {
+    if (h == NULL || cfg == NULL || fd < 0) {
+        errno = EINVAL;
+        return false;
+    }
+    const char *name = config_name(cfg);
+    if (strlen(name) >= sizeof(h->name)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+
+    memset(h, 0, sizeof(*h));
+    h->fd = fd;
+    h->role = role;
+    strcpy(h->name, name);
+    h->port = cfg->port;
+    h->unix_domain = cfg->path != NULL;
+    h->server = cfg->server;
+    h->datagram = cfg->datagram;
+    return true;
+}
+
+static bool send_batch(int sock, const socket99_handoff *fds, size_t count,
+        bool last) {
+    header hdr = {
+        .magic = HANDOFF_MAGIC,
+        .version = HANDOFF_VERSION,
+        .record_size = sizeof(socket99_handoff),
+        .count = (uint16_t)count,
+        .last = last,
+    };
+    struct iovec iov[2] = {
+        { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+        { .iov_base = (void *)fds, .iov_len = count * sizeof(*fds) },
+    };
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(BATCH_FDS * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count > 0 ? 2 : 1;
+    if (count > 0) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(count * sizeof(int));
+        for (size_t i = 0; i < count; i++) {
+            memcpy(CMSG_DATA(cm) + i * sizeof(int), &fds[i].fd, sizeof(int));
+        }
+    }
+
+    size_t want = sizeof(hdr) + count * sizeof(*fds);
+    ssize_t sent;
+    do {
+        sent = sendmsg(sock, &msg, 0);
+    } while (sent == -1 && errno == EINTR);
+    if (sent == -1) { return false; }
+
+    /* The fds went with the first byte; finish any short send. */
+    size_t done = (size_t)sent;
+    while (done < want) {
+        const char *rest = done < sizeof(hdr)
+            ? (const char *)&hdr + done
+            : (const char *)fds + (done - sizeof(hdr));
+        size_t len = done < sizeof(hdr) ? sizeof(hdr) - done : want - done;
+        ssize_t res = send(sock, rest, len, 0);
+        if (res == -1) {
+            if (errno == EINTR) { continue; }
+            return false;
+        }
+        done += (size_t)res;
+    }
+    return true;
+}
+
+bool socket99_handoff_send(int sock, const socket99_handoff *fds,
+        size_t count) {
+    if (fds == NULL && count > 0) {
+        errno = EINVAL;
+        return false;
+    }
+    size_t offset = 0;
+    do {
+        size_t n = count - offset;
+        if (n > BATCH_FDS) { n = BATCH_FDS; }
+        if (!send_batch(sock, &fds[offset], n, offset + n == count)) {
+            return false;
+        }
+        offset += n;
+    } while (offset < count);
+    errno = 0;
+    return true;
+}
+
+static void close_fds(const int *fds, size_t count) {
+    for (size_t i = 0; i < count; i++) { close(fds[i]); }
+}
+
+/* Receive one message's header and fds into HDR and GOT_FDS. Returns
+ * the number of fds, or -1. */
+static int recv_header(int sock, header *hdr, int *got_fds) {
+    struct iovec iov = { .iov_base = hdr, .iov_len = sizeof(*hdr) };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(BATCH_FDS * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t got;
+    do {
+        got = recvmsg(sock, &msg, RECV_FLAGS);
+    } while (got == -1 && errno == EINTR);
+    if (got == -1) { return -1; }
+
+    int nfds = 0;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+         cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        size_t n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < n && nfds < BATCH_FDS; i++) {
+            memcpy(&got_fds[nfds++], CMSG_DATA(cm) + i * sizeof(int),
+                sizeof(int));
+        }
+    }
+
+    if (got == 0) {
+        errno = ECONNRESET;             /* sender went away mid-handoff */
+    } else if ((size_t)got < sizeof(*hdr) || (msg.msg_flags & MSG_CTRUNC)) {
+        errno = EMSGSIZE;
+    } else if (hdr->magic != HANDOFF_MAGIC
+        || hdr->version != HANDOFF_VERSION
+        || hdr->record_size != sizeof(socket99_handoff)
+        || hdr->count > BATCH_FDS || hdr->count != nfds) {
+        errno = EPROTO;
+    } else {
+        return nfds;
+    }
+    close_fds(got_fds, (size_t)nfds);
+    return -1;
+}
+
+int socket99_handoff_recv(int sock, socket99_handoff *fds, size_t max) {
+    if (fds == NULL && max > 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t count = 0;
+    bool overflow = false;
+    header hdr;
+    do {
+        int batch[BATCH_FDS];
+        socket99_handoff records[BATCH_FDS];
+        int nfds = recv_header(sock, &hdr, batch);
+        if (nfds == -1) { goto fail; }
+
+        size_t len = (size_t)nfds * sizeof(records[0]);
+        ssize_t got = len > 0 ? recv(sock, records, len, MSG_WAITALL) : 0;
+        while (got == -1 && errno == EINTR) {
+            got = recv(sock, records, len, MSG_WAITALL);
+        }
+        if (got < 0 || (size_t)got != len) {
+            if (got >= 0) { errno = ECONNRESET; }
+            close_fds(batch, (size_t)nfds);
+            goto fail;
+        }
+
+        /* Keep going to the end on overflow, so nothing is left
+         * half-read on SOCK, but close what doesn't fit. */
+        for (int i = 0; i < nfds; i++) {
+            if (count < max) {
+                fds[count] = records[i];
+                fds[count].fd = batch[i];
+                fds[count].name[sizeof(fds[count].name) - 1] = '\0';
+                count++;
+            } else {
+                close(batch[i]);
+                overflow = true;
+            }
+        }
+    } while (!hdr.last);
+
+    if (overflow) {
+        errno = ENOBUFS;
+        goto fail;
+    }
+    errno = 0;
+    return (int)count;
+
+fail:
+    {
+        int saved_errno = errno;
+        for (size_t i = 0; i < count; i++) { close(fds[i].fd); }
+        errno = saved_errno;
+    }
+    return -1;
+}
+
+static bool matches(const socket99_config *cfg, const socket99_handoff *h) {
+    return h->fd >= 0 && h->role == SOCKET99_ROLE_LISTENER
+        && h->server == cfg->server && h->datagram == cfg->datagram
+        && h->unix_domain == (cfg->path != NULL)
+        && h->port == cfg->port
+        && 0 == strcmp(h->name, config_name(cfg));
+}
+
+/* Check that FD is the kind of socket CFG would open. */
+static bool check_socket(const socket99_config *cfg, int fd) {
+    int type = 0;
+    socklen_t len = sizeof(type);
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == -1) {
+        return false;
+    }
+    if (type != (cfg->datagram ? SOCK_DGRAM : SOCK_STREAM)) {
+        errno = EPROTOTYPE;
+        return false;
+    }
+#ifdef SO_ACCEPTCONN
+    if (!cfg->datagram) {
+        int listening = 0;
+        len = sizeof(listening);
+        if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN,
+                &listening, &len) == -1) {
+            return false;
+        }
+        if (!listening) {
+            errno = EINVAL;
+            return false;
+        }
+    }
+#endif
+    return true;
+}
+
+bool socket99_handoff_adopt(socket99_config *cfg, socket99_handoff *fds,
+        size_t count, socket99_result *res) {
+    if (cfg == NULL || res == NULL || (fds == NULL && count > 0)) {
+        return false;
+    }
+    if (!cfg->server) {
+        memset(res, 0, sizeof(*res));
+        res->status = SOCKET99_ERROR_CONFIGURATION;
+        return false;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        socket99_handoff *h = &fds[i];
+        if (!matches(cfg, h)) { continue; }
+
+        memset(res, 0, sizeof(*res));
+        if (!check_socket(cfg, h->fd)) {
+            res->status = SOCKET99_ERROR_CONFIGURATION;
+            res->saved_errno = errno;
+            return false;
+        }
+        res->fd = h->fd;
+        if (!socket99__set_fd_flags(cfg, res)) {
+            res->fd = -1;
+            return false;
+        }
+        h->fd = -1;                     /* taken */
+        errno = 0;
+        return true;
+    }
+
+    /* Nothing passed for this config (it's new, or the old process
+     * didn't have it), so start cold. */
+    return socket99_open(cfg, res);
+}
@@ -0,0 +1,16 @@
+#ifndef SOCKET99_INTERNAL_H
+#define SOCKET99_INTERNAL_H
+
+/* Helpers shared between the library's modules. Not installed, and
+ * not part of the API. */
+
+#include "socket99.h"
+
+/* Give OUT->fd, which wasn't newly created (and may have other flags
+ * set), CFG's nonblocking and cloexec settings, clearing them if unset.
+ * Counts its syscalls and FCNTL phase time in OUT. Returns false with
+ * OUT's status set to SOCKET99_ERROR_FCNTL on failure. */
+bool socket99__set_fd_flags(const socket99_config *cfg,
+    socket99_result *out);
+
+#endif
@@ -0,0 +1,978 @@
+/*
+ * Copyright (c) 2014-17 Scott Vokes <vokes.s@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* io_uring is used directly through its system calls, rather than
+ * through liburing. Multishot receives need Linux 6.0; headers having
+ * the flag doesn't mean the running kernel does, so uring_init also
+ * checks at run time. */
+#if defined(__NR_io_uring_setup) && defined(IORING_RECV_MULTISHOT)
+#define HAVE_URING 1
+#endif
+#endif
+
+#include "socket99.h"
+
+#ifdef __linux__
+
+/* Built-in defaults for socket99_io_config. */
+#define DEF_ENTRIES 256
+#define DEF_BUF_COUNT 256
+#define DEF_BUF_SIZE 4096
+
+#define MAX_BUF_COUNT 32768     /* buffer IDs are 16 bits */
+#define MAX_EVENTS 64
+#define ACCEPT_BURST 64
+
+/* Buffer group ID for the provided buffer ring. */
+#define BUF_GROUP 0
+
+/* user_data for internal requests, which have no completion. */
+#define CANCEL_TAG UINT64_MAX
+
+/* A queued operation. Multishot operations keep their slot until their
+ * last completion, and io_uring requests carry the slot's index. */
+typedef struct {
+    enum socket99_io_op op;
+    int fd;
+    void *udata;
+    int next;                   /* free list, or the fd's send queue */
+    const char *send_buf;       /* fallback only */
+    size_t send_len;
+} op_slot;
+
+/* Per-fd state for the epoll(7) fallback, indexed by fd. */
+typedef struct {
+    int accept_slot;            /* -1 if none */
+    int recv_slot;
+    int send_head;              /* queued sends, oldest first */
+    int send_tail;
+    uint32_t events;            /* events registered with epoll */
+    bool dirty;                 /* has unsubmitted sends */
+} fd_state;
+
+struct socket99_io {
+    socket99_io_config cfg;
+    bool uring;
+
+    op_slot *slots;
+    size_t slot_count;
+    int free_head;
+
+    char *bufs;                 /* buf_count buffers of buf_size */
+
+#ifdef HAVE_URING
+    int ring_fd;
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;     /* queued, but not yet visible */
+    unsigned to_submit;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    uint16_t buf_tail;
+#endif
+
+    /* epoll(7) fallback */
+    int epoll_fd;
+    fd_state *fds;
+    size_t fd_count;
+    int *free_bufs;
+    size_t free_buf_count;
+    int *dirty_fds;
+    size_t dirty_count;
+    size_t dirty_size;
+    socket99_io_completion *done;   /* completions not yet reaped */
+    size_t done_head;
+    size_t done_count;
+    size_t done_size;
+    struct epoll_event events[MAX_EVENTS];
+};
+
+static int alloc_slot(socket99_io *io, enum socket99_io_op op, int fd,
+        void *udata) {
+    if (io->free_head == -1) {
+        size_t count = io->slot_count ? 2 * io->slot_count : 64;
+        op_slot *ns = realloc(io->slots, count * sizeof(*ns));
+        if (ns == NULL) { return -1; }
+        for (size_t i = io->slot_count; i < count; i++) {
+            ns[i].next = (i + 1 < count) ? (int)(i + 1) : -1;
+        }
+        io->free_head = (int)io->slot_count;
+        io->slots = ns;
+        io->slot_count = count;
+    }
+
+    int id = io->free_head;
+    op_slot *s = &io->slots[id];
+    io->free_head = s->next;
+    s->op = op;
+    s->fd = fd;
+    s->udata = udata;
+    s->next = -1;
+    s->send_buf = NULL;
+    s->send_len = 0;
+    return id;
+}
+
+static void free_slot(socket99_io *io, int id) {
+    io->slots[id].next = io->free_head;
+    io->free_head = id;
+}
+
+static void fill_completion(socket99_io *io, socket99_io_completion *c,
+        int id, int res, bool more) {
+    op_slot *s = &io->slots[id];
+    c->op = s->op;
+    c->fd = s->fd;
+    c->res = res;
+    c->udata = s->udata;
+    c->buf = NULL;
+    c->buf_id = -1;
+    c->more = more;
+}
+
+
+/* io_uring */
+
+#ifdef HAVE_URING
+
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+        unsigned flags, void *arg, size_t arg_size) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+        flags, arg, arg_size);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg,
+        unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Put buffer ID back in the provided buffer ring. It isn't visible to
+ * the kernel until publish_bufs. */
+static void add_buf(socket99_io *io, int id) {
+    struct io_uring_buf *b =
+        &io->buf_ring->bufs[io->buf_tail & (io->cfg.buf_count - 1)];
+    b->addr = (uint64_t)(uintptr_t)(io->bufs + (size_t)id * io->cfg.buf_size);
+    b->len = (uint32_t)io->cfg.buf_size;
+    b->bid = (uint16_t)id;
+    io->buf_tail++;
+}
+
+static void publish_bufs(socket99_io *io) {
+    __atomic_store_n(&io->buf_ring->tail, io->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_cleanup(socket99_io *io) {
+    if (io->buf_ring) { munmap(io->buf_ring, io->buf_ring_size); }
+    if (io->sqes) { munmap(io->sqes, io->sqes_size); }
+    if (io->cq_ptr && io->cq_ptr != io->sq_ptr) {
+        munmap(io->cq_ptr, io->cq_size);
+    }
+    if (io->sq_ptr) { munmap(io->sq_ptr, io->sq_size); }
+    if (io->ring_fd >= 0) { close(io->ring_fd); }
+    io->buf_ring = NULL;
+    io->sqes = NULL;
+    io->cq_ptr = NULL;
+    io->sq_ptr = NULL;
+    io->ring_fd = -1;
+}
+
+static void *map_ring(int fd, size_t size, off_t offset) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, offset);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static bool uring_init(socket99_io *io) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    /* Only this thread submits, so completions can be run when it
+     * waits for them, rather than interrupting it. */
+    p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER
+        | IORING_SETUP_DEFER_TASKRUN;
+    io->ring_fd = uring_setup(io->cfg.entries, &p);
+    if (io->ring_fd == -1 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        io->ring_fd = uring_setup(io->cfg.entries, &p);
+    }
+    if (io->ring_fd == -1) { return false; }
+
+    /* Waiting with a timeout needs IORING_ENTER_EXT_ARG. */
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        errno = ENOTSUP;
+        return false;
+    }
+
+    io->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    io->cq_size = p.cq_off.cqes
+        + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        if (io->cq_size > io->sq_size) { io->sq_size = io->cq_size; }
+        io->cq_size = io->sq_size;
+    }
+
+    io->sq_ptr = map_ring(io->ring_fd, io->sq_size, IORING_OFF_SQ_RING);
+    if (io->sq_ptr == NULL) { return false; }
+    io->cq_ptr = single_mmap ? io->sq_ptr
+        : map_ring(io->ring_fd, io->cq_size, IORING_OFF_CQ_RING);
+    if (io->cq_ptr == NULL) { return false; }
+    io->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    io->sqes = map_ring(io->ring_fd, io->sqes_size, IORING_OFF_SQES);
+    if (io->sqes == NULL) { return false; }
+
+    char *sq = io->sq_ptr;
+    char *cq = io->cq_ptr;
+    io->sq_head = (unsigned *)(sq + p.sq_off.head);
+    io->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    io->sq_array = (unsigned *)(sq + p.sq_off.array);
+    io->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    io->sq_entries = p.sq_entries;
+    io->sq_local_tail = *io->sq_tail;
+    io->cq_head = (unsigned *)(cq + p.cq_off.head);
+    io->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    io->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    /* Register the receive buffers as a provided buffer ring. */
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    io->buf_ring_size = io->cfg.buf_count * sizeof(struct io_uring_buf);
+    io->buf_ring_size = (io->buf_ring_size + page - 1) / page * page;
+    void *ring = mmap(NULL, io->buf_ring_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) { return false; }
+    io->buf_ring = ring;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring;
+    reg.ring_entries = io->cfg.buf_count;
+    reg.bgid = BUF_GROUP;
+    if (uring_register(io->ring_fd, IORING_REGISTER_PBUF_RING,
+            &reg, 1) == -1) {
+        return false;
+    }
+
+    for (unsigned i = 0; i < io->cfg.buf_count; i++) { add_buf(io, (int)i); }
+    publish_bufs(io);
+    return true;
+}
+
+/* Make the submission queue's new entries visible, then enter the
+ * kernel to submit them and (if WAIT_NR > 0) wait for completions. */
+static bool uring_enter_wait(socket99_io *io, unsigned wait_nr,
+        int timeout_msec) {
+    __atomic_store_n(io->sq_tail, io->sq_local_tail, __ATOMIC_RELEASE);
+
+    unsigned flags = IORING_ENTER_GETEVENTS;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    void *argp = NULL;
+    size_t arg_size = 0;
+    if (wait_nr > 0 && timeout_msec > 0) {
+        memset(&arg, 0, sizeof(arg));
+        ts.tv_sec = timeout_msec / 1000;
+        ts.tv_nsec = (long long)(timeout_msec % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        argp = &arg;
+        arg_size = sizeof(arg);
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    int res = uring_enter(io->ring_fd, io->to_submit, wait_nr, flags,
+        argp, arg_size);
+    if (res >= 0) {
+        io->to_submit -= (unsigned)res;
+        return true;
+    }
+    if (errno == ETIME || errno == EINTR || errno == EBUSY) {
+        errno = 0;
+        return true;
+    }
+    return false;
+}
+
+static struct io_uring_sqe *get_sqe(socket99_io *io) {
+    unsigned head = __atomic_load_n(io->sq_head, __ATOMIC_ACQUIRE);
+    if (io->sq_local_tail - head >= io->sq_entries) {
+        /* Full; submit what's there to make room. */
+        if (!uring_enter_wait(io, 0, 0)) { return NULL; }
+        head = __atomic_load_n(io->sq_head, __ATOMIC_ACQUIRE);
+        if (io->sq_local_tail - head >= io->sq_entries) {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+
+    unsigned idx = io->sq_local_tail & io->sq_mask;
+    struct io_uring_sqe *sqe = &io->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    io->sq_array[idx] = idx;
+    io->sq_local_tail++;
+    io->to_submit++;
+    return sqe;
+}
+
+/* Check that the kernel takes every request the engine makes. The
+ * opcodes are in the probe, but IORING_RECV_MULTISHOT isn't: 5.19 has
+ * PBUF_RING and everything else here, but rejects it with EINVAL. So
+ * try a multishot recv on a pipe, which fails with ENOTSOCK instead if
+ * the flag is known, without taking a buffer. */
+static bool uring_probe(socket99_io *io) {
+    size_t size = sizeof(struct io_uring_probe)
+        + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (probe == NULL) { return false; }
+    bool ok = uring_register(io->ring_fd, IORING_REGISTER_PROBE,
+        probe, IORING_OP_LAST) == 0;
+    static const uint8_t ops[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND,
+        IORING_OP_ASYNC_CANCEL,
+    };
+    for (size_t i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); i++) {
+        ok = ops[i] <= probe->last_op
+            && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    if (!ok) {
+        errno = ENOTSUP;
+        return false;
+    }
+
+    int pipe_fds[2];
+    if (pipe(pipe_fds) == -1) { return false; }
+    int res = -EINVAL;
+    struct io_uring_sqe *sqe = get_sqe(io);
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = pipe_fds[0];
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUF_GROUP;
+        sqe->user_data = CANCEL_TAG;
+        unsigned head = *io->cq_head;
+        if (uring_enter_wait(io, 1, 0)
+            && head != __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE)) {
+            res = io->cqes[head & io->cq_mask].res;
+            __atomic_store_n(io->cq_head, head + 1, __ATOMIC_RELEASE);
+        }
+    }
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    if (res != -ENOTSOCK) {
+        errno = ENOTSUP;
+        return false;
+    }
+    return true;
+}
+
+/* Queue a request for a new slot. Returns the sqe, or NULL. */
+static struct io_uring_sqe *uring_queue(socket99_io *io, uint8_t opcode,
+        enum socket99_io_op op, int fd, void *udata) {
+    int id = alloc_slot(io, op, fd, udata);
+    if (id == -1) { return NULL; }
+    struct io_uring_sqe *sqe = get_sqe(io);
+    if (sqe == NULL) {
+        free_slot(io, id);
+        return NULL;
+    }
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = (uint64_t)id;
+    return sqe;
+}
+
+static int uring_reap(socket99_io *io, socket99_io_completion *out,
+        size_t count, int timeout_msec) {
+    unsigned head = *io->cq_head;
+    unsigned ready = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE) - head;
+    if (io->to_submit > 0 || ready == 0) {
+        unsigned wait_nr = (ready == 0 && timeout_msec != 0) ? 1 : 0;
+        if (!uring_enter_wait(io, wait_nr, timeout_msec)) { return -1; }
+    }
+
+    unsigned tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+    size_t n = 0;
+    while (head != tail && n < count) {
+        struct io_uring_cqe *cqe = &io->cqes[head & io->cq_mask];
+        head++;
+        if (cqe->user_data == CANCEL_TAG) { continue; }
+
+        int id = (int)cqe->user_data;
+        bool more = cqe->flags & IORING_CQE_F_MORE;
+        socket99_io_completion *c = &out[n++];
+        fill_completion(io, c, id, cqe->res, more);
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            c->buf_id = (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            c->buf = io->bufs + (size_t)c->buf_id * io->cfg.buf_size;
+        }
+        if (!more) { free_slot(io, id); }
+    }
+    __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+    return (int)n;
+}
+
+#endif
+
+
+/* epoll(7) fallback */
+
+static bool reserve_fd(socket99_io *io, int fd) {
+    if (fd < 0) {
+        errno = EBADF;
+        return false;
+    }
+    if ((size_t)fd < io->fd_count) { return true; }
+
+    size_t count = io->fd_count ? io->fd_count : 64;
+    while (count <= (size_t)fd) { count *= 2; }
+    fd_state *nf = realloc(io->fds, count * sizeof(*nf));
+    if (nf == NULL) { return false; }
+    for (size_t i = io->fd_count; i < count; i++) {
+        nf[i].accept_slot = -1;
+        nf[i].recv_slot = -1;
+        nf[i].send_head = -1;
+        nf[i].send_tail = -1;
+        nf[i].events = 0;
+        nf[i].dirty = false;
+    }
+    io->fds = nf;
+    io->fd_count = count;
+    return true;
+}
+
+/* Register the events FD's operations need, level-triggered. */
+static bool update_events(socket99_io *io, int fd) {
+    fd_state *st = &io->fds[fd];
+    uint32_t want = 0;
+    if (st->accept_slot != -1 || st->recv_slot != -1) { want |= EPOLLIN; }
+    if (st->send_head != -1) { want |= EPOLLOUT; }
+    if (want == st->events) { return true; }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = want;
+    ev.data.fd = fd;
+    int op = st->events == 0 ? EPOLL_CTL_ADD
+        : want == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    if (epoll_ctl(io->epoll_fd, op, fd, &ev) == -1) {
+        /* The fd may have been closed without cancelling. */
+        if (op != EPOLL_CTL_DEL) { return false; }
+    }
+    st->events = want;
+    return true;
+}
+
+static bool push_done(socket99_io *io, int id, int res, bool more) {
+    if (io->done_head == io->done_count) {
+        io->done_head = 0;
+        io->done_count = 0;
+    }
+    if (io->done_count == io->done_size) {
+        size_t size = io->done_size ? 2 * io->done_size : 64;
+        socket99_io_completion *nd = realloc(io->done, size * sizeof(*nd));
+        if (nd == NULL) { return false; }
+        io->done = nd;
+        io->done_size = size;
+    }
+    fill_completion(io, &io->done[io->done_count++], id, res, more);
+    return true;
+}
+
+/* Arm a multishot operation in *SLOT. */
+static bool fallback_arm(socket99_io *io, int *slot,
+        enum socket99_io_op op, int fd, void *udata) {
+    if (*slot != -1) {
+        errno = EBUSY;
+        return false;
+    }
+    int id = alloc_slot(io, op, fd, udata);
+    if (id == -1) { return false; }
+    *slot = id;
+    if (!update_events(io, fd)) {
+        *slot = -1;
+        free_slot(io, id);
+        return false;
+    }
+    return true;
+}
+
+/* End the multishot operation in *SLOT with a last completion. */
+static bool fallback_disarm(socket99_io *io, int *slot, int res) {
+    int id = *slot;
+    *slot = -1;
+    bool ok = push_done(io, id, res, false);
+    free_slot(io, id);
+    return ok;
+}
+
+/* Send as much of FD's queue as it will take without blocking. */
+static bool fallback_flush(socket99_io *io, int fd) {
+    fd_state *st = &io->fds[fd];
+    while (st->send_head != -1) {
+        int id = st->send_head;
+        op_slot *s = &io->slots[id];
+        ssize_t sent = send(fd, s->send_buf, s->send_len,
+            MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { break; }
+            if (errno == EINTR) { continue; }
+        }
+        st->send_head = s->next;
+        if (st->send_head == -1) { st->send_tail = -1; }
+        bool ok = push_done(io, id, sent == -1 ? -errno : (int)sent, false);
+        free_slot(io, id);
+        if (!ok) { return false; }
+    }
+    errno = 0;
+    return update_events(io, fd);
+}
+
+static bool fallback_submit(socket99_io *io) {
+    bool ok = true;
+    for (size_t i = 0; i < io->dirty_count; i++) {
+        int fd = io->dirty_fds[i];
+        io->fds[fd].dirty = false;
+        if (!fallback_flush(io, fd)) { ok = false; }
+    }
+    io->dirty_count = 0;
+    return ok;
+}
+
+static bool fallback_accept(socket99_io *io, int fd) {
+    fd_state *st = &io->fds[fd];
+    for (int i = 0; i < ACCEPT_BURST && st->accept_slot != -1; i++) {
+        int client_fd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { break; }
+            if (errno == EINTR || errno == ECONNABORTED) { continue; }
+            return fallback_disarm(io, &st->accept_slot, -errno);
+        }
+        if (!push_done(io, st->accept_slot, client_fd, true)) {
+            close(client_fd);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool fallback_recv(socket99_io *io, int fd) {
+    fd_state *st = &io->fds[fd];
+    if (io->free_buf_count == 0) {
+        return fallback_disarm(io, &st->recv_slot, -ENOBUFS);
+    }
+
+    int buf_id = io->free_bufs[--io->free_buf_count];
+    char *buf = io->bufs + (size_t)buf_id * io->cfg.buf_size;
+    ssize_t got = recv(fd, buf, io->cfg.buf_size, MSG_DONTWAIT);
+    if (got > 0) {
+        if (!push_done(io, st->recv_slot, (int)got, true)) {
+            io->free_bufs[io->free_buf_count++] = buf_id;
+            return false;
+        }
+        io->done[io->done_count - 1].buf = buf;
+        io->done[io->done_count - 1].buf_id = buf_id;
+        return true;
+    }
+
+    io->free_bufs[io->free_buf_count++] = buf_id;
+    if (got == 0) { return fallback_disarm(io, &st->recv_slot, 0); }
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        return true;
+    }
+    return fallback_disarm(io, &st->recv_slot, -errno);
+}
+
+static int fallback_reap(socket99_io *io, socket99_io_completion *out,
+        size_t count, int timeout_msec) {
+    if (!fallback_submit(io)) { return -1; }
+
+    if (io->done_head == io->done_count) {
+        int nev = epoll_wait(io->epoll_fd, io->events, MAX_EVENTS,
+            timeout_msec);
+        if (nev == -1) {
+            if (errno != EINTR) { return -1; }
+            nev = 0;
+        }
+
+        for (int i = 0; i < nev; i++) {
+            int fd = io->events[i].data.fd;
+            uint32_t ev = io->events[i].events;
+            fd_state *st = &io->fds[fd];
+            bool ok = true;
+            if (ev & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                if (st->accept_slot != -1) { ok = fallback_accept(io, fd); }
+                if (ok && st->recv_slot != -1) { ok = fallback_recv(io, fd); }
+            }
+            if (ok && (ev & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                ok = fallback_flush(io, fd);
+            }
+            if (!ok || !update_events(io, fd)) { return -1; }
+        }
+    }
+
+    size_t n = 0;
+    while (n < count && io->done_head < io->done_count) {
+        out[n++] = io->done[io->done_head++];
+    }
+    errno = 0;
+    return (int)n;
+}
+
+static bool fallback_cancel(socket99_io *io, int fd) {
+    if (fd < 0 || (size_t)fd >= io->fd_count) { return true; }
+    fd_state *st = &io->fds[fd];
+    bool ok = true;
+    if (st->accept_slot != -1) {
+        ok = fallback_disarm(io, &st->accept_slot, -ECANCELED) && ok;
+    }
+    if (st->recv_slot != -1) {
+        ok = fallback_disarm(io, &st->recv_slot, -ECANCELED) && ok;
+    }
+    while (st->send_head != -1) {
+        int id = st->send_head;
+        st->send_head = io->slots[id].next;
+        ok = push_done(io, id, -ECANCELED, false) && ok;
+        free_slot(io, id);
+    }
+    st->send_tail = -1;
+    return update_events(io, fd) && ok;
+}
+
+
+/* API */
+
+static unsigned round_up_pow2(unsigned n) {
+    unsigned p = 1;
+    while (p < n) { p *= 2; }
+    return p;
+}
+
+socket99_io *socket99_io_new(const socket99_io_config *cfg) {
+    socket99_io *io = calloc(1, sizeof(*io));
+    if (io == NULL) { return NULL; }
+    if (cfg) { io->cfg = *cfg; }
+    if (io->cfg.entries == 0) { io->cfg.entries = DEF_ENTRIES; }
+    if (io->cfg.buf_count == 0) { io->cfg.buf_count = DEF_BUF_COUNT; }
+    if (io->cfg.buf_size == 0) { io->cfg.buf_size = DEF_BUF_SIZE; }
+    io->free_head = -1;
+    io->epoll_fd = -1;
+#ifdef HAVE_URING
+    io->ring_fd = -1;
+#endif
+
+    if (io->cfg.buf_count > MAX_BUF_COUNT || io->cfg.buf_size > INT32_MAX) {
+        free(io);
+        errno = EINVAL;
+        return NULL;
+    }
+    io->cfg.buf_count = round_up_pow2(io->cfg.buf_count);
+
+    io->bufs = malloc(io->cfg.buf_count * io->cfg.buf_size);
+    if (io->bufs == NULL) {
+        free(io);
+        return NULL;
+    }
+
+#ifdef HAVE_URING
+    if (!io->cfg.no_uring) {
+        io->uring = uring_init(io) && uring_probe(io);
+        if (!io->uring) { uring_cleanup(io); }
+    }
+#endif
+
+    if (!io->uring) {
+        io->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        io->free_bufs = malloc(io->cfg.buf_count * sizeof(int));
+        if (io->epoll_fd == -1 || io->free_bufs == NULL) {
+            int saved_errno = errno;
+            socket99_io_free(io);
+            errno = saved_errno;
+            return NULL;
+        }
+        /* Hand out low IDs first, as the buffer ring does. */
+        for (unsigned i = 0; i < io->cfg.buf_count; i++) {
+            io->free_bufs[i] = (int)(io->cfg.buf_count - 1 - i);
+        }
+        io->free_buf_count = io->cfg.buf_count;
+    }
+    errno = 0;
+    return io;
+}
+
+void socket99_io_free(socket99_io *io) {
+    if (io == NULL) { return; }
+#ifdef HAVE_URING
+    uring_cleanup(io);
+#endif
+    if (io->epoll_fd >= 0) { close(io->epoll_fd); }
+    free(io->fds);
+    free(io->free_bufs);
+    free(io->dirty_fds);
+    free(io->done);
+    free(io->slots);
+    free(io->bufs);
+    free(io);
+}
+
+bool socket99_io_uses_uring(socket99_io *io) {
+    return io != NULL && io->uring;
+}
+
+bool socket99_io_accept(socket99_io *io, int fd, void *udata) {
+    if (io == NULL) { return false; }
+#ifdef HAVE_URING
+    if (io->uring) {
+        struct io_uring_sqe *sqe = uring_queue(io, IORING_OP_ACCEPT,
+            SOCKET99_IO_ACCEPT, fd, udata);
+        if (sqe == NULL) { return false; }
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        return true;
+    }
+#endif
+    /* Accept in bursts, without blocking once they run out. */
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) { return false; }
+    if (!(flags & O_NONBLOCK)
+        && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        return false;
+    }
+    if (!reserve_fd(io, fd)) { return false; }
+    return fallback_arm(io, &io->fds[fd].accept_slot,
+        SOCKET99_IO_ACCEPT, fd, udata);
+}
+
+bool socket99_io_recv(socket99_io *io, int fd, void *udata) {
+    if (io == NULL) { return false; }
+#ifdef HAVE_URING
+    if (io->uring) {
+        struct io_uring_sqe *sqe = uring_queue(io, IORING_OP_RECV,
+            SOCKET99_IO_RECV, fd, udata);
+        if (sqe == NULL) { return false; }
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUF_GROUP;
+        return true;
+    }
+#endif
+    if (!reserve_fd(io, fd)) { return false; }
+    return fallback_arm(io, &io->fds[fd].recv_slot,
+        SOCKET99_IO_RECV, fd, udata);
+}
+
+bool socket99_io_send(socket99_io *io, int fd, const void *buf,
+        size_t len, void *udata) {
+    if (io == NULL || (buf == NULL && len > 0)) { return false; }
+    if (len > INT32_MAX) { len = INT32_MAX; }
+#ifdef HAVE_URING
+    if (io->uring) {
+        struct io_uring_sqe *sqe = uring_queue(io, IORING_OP_SEND,
+            SOCKET99_IO_SEND, fd, udata);
+        if (sqe == NULL) { return false; }
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = (uint32_t)len;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        return true;
+    }
+#endif
+    if (!reserve_fd(io, fd)) { return false; }
+    fd_state *st = &io->fds[fd];
+    if (!st->dirty && io->dirty_count == io->dirty_size) {
+        size_t size = io->dirty_size ? 2 * io->dirty_size : 64;
+        int *nd = realloc(io->dirty_fds, size * sizeof(*nd));
+        if (nd == NULL) { return false; }
+        io->dirty_fds = nd;
+        io->dirty_size = size;
+    }
+
+    int id = alloc_slot(io, SOCKET99_IO_SEND, fd, udata);
+    if (id == -1) { return false; }
+    io->slots[id].send_buf = buf;
+    io->slots[id].send_len = len;
+    if (st->send_tail == -1) {
+        st->send_head = id;
+    } else {
+        io->slots[st->send_tail].next = id;
+    }
+    st->send_tail = id;
+    if (!st->dirty) {
+        st->dirty = true;
+        io->dirty_fds[io->dirty_count++] = fd;
+    }
+    return true;
+}
+
+bool socket99_io_cancel(socket99_io *io, int fd) {
+    if (io == NULL) { return false; }
+#ifdef HAVE_URING
+    if (io->uring) {
+        struct io_uring_sqe *sqe = get_sqe(io);
+        if (sqe == NULL) { return false; }
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = CANCEL_TAG;
+        return true;
+    }
+#endif
+    return fallback_cancel(io, fd);
+}
+
+bool socket99_io_submit(socket99_io *io) {
+    if (io == NULL) { return false; }
+#ifdef HAVE_URING
+    if (io->uring) {
+        return io->to_submit == 0 || uring_enter_wait(io, 0, 0);
+    }
+#endif
+    return fallback_submit(io);
+}
+
+int socket99_io_reap(socket99_io *io, socket99_io_completion *out,
+        size_t count, int timeout_msec) {
+    if (io == NULL || (out == NULL && count > 0)) { return -1; }
+#ifdef HAVE_URING
+    if (io->uring) { return uring_reap(io, out, count, timeout_msec); }
+#endif
+    return fallback_reap(io, out, count, timeout_msec);
+}
+
+void socket99_io_release(socket99_io *io, const socket99_io_completion *c) {
+    if (io == NULL || c == NULL || c->buf_id < 0
+        || (unsigned)c->buf_id >= io->cfg.buf_count) {
+        return;
+    }
+#ifdef HAVE_URING
+    if (io->uring) {
+        add_buf(io, c->buf_id);
+        publish_bufs(io);
+        return;
+    }
+#endif
+    io->free_bufs[io->free_buf_count++] = c->buf_id;
+}
+
+#else
+
+/* The I/O engine needs io_uring(7) or epoll(7); elsewhere, it reports
+ * ENOTSUP. */
+
+socket99_io *socket99_io_new(const socket99_io_config *cfg) {
+    (void)cfg;
+    errno = ENOTSUP;
+    return NULL;
+}
+
+void socket99_io_free(socket99_io *io) { (void)io; }
+
+bool socket99_io_uses_uring(socket99_io *io) {
+    (void)io;
+    return false;
+}
+
+bool socket99_io_accept(socket99_io *io, int fd, void *udata) {
+    (void)io;
+    (void)fd;
+    (void)udata;
+    errno = ENOTSUP;
+    return false;
+}
+
+bool socket99_io_recv(socket99_io *io, int fd, void *udata) {
+    (void)io;
+    (void)fd;
+    (void)udata;
+    errno = ENOTSUP;
+    return false;
+}
+
+bool socket99_io_send(socket99_io *io, int fd, const void *buf,
+        size_t len, void *udata) {
+    (void)io;
+    (void)fd;
+    (void)buf;
+    (void)len;
+    (void)udata;
+    errno = ENOTSUP;
+    return false;
+}
+
+bool socket99_io_cancel(socket99_io *io, int fd) {
+    (void)io;
+    (void)fd;
+    errno = ENOTSUP;
+    return false;
+}
+
+bool socket99_io_submit(socket99_io *io) {
+    (void)io;
+    errno = ENOTSUP;
+    return false;
+}
+
+int socket99_io_reap(socket99_io *io, socket99_io_completion *out,
+        size_t count, int timeout_msec) {
+    (void)io;
+    (void)out;
+    (void)count;
+    (void)timeout_msec;
+    errno = ENOTSUP;
+    return -1;
+}
+
+void socket99_io_release(socket99_io *io, const socket99_io_completion *c) {
+    (void)io;
+    (void)c;
+}
+
+#endif
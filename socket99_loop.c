@@ -0,0 +1,392 @@
+/*
+ * Copyright (c) 2014-17 Scott Vokes <vokes.s@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include "socket99.h"
+
+#ifdef __linux__
+
+/* Built-in defaults for the loop. */
+#define DEF_READ_BUFSZ (64 * 1024)
+#define DEF_MAX_EVENTS 256
+
+enum watch_kind {
+    WATCH_NONE,
+    WATCH_LISTENER,
+    WATCH_CONN,
+};
+
+/* Per-fd state, indexed by fd. */
+typedef struct {
+    enum watch_kind kind;
+    void *udata;
+    socket99_config *cfg;       /* listener's config, for accepted fds */
+} watch;
+
+struct socket99_loop {
+    socket99_loop_callbacks cbs;
+    int epoll_fd;
+    bool stop;
+
+    watch *watches;
+    size_t watch_count;         /* allocated size */
+
+    struct epoll_event *events;
+    size_t max_events;
+    char *read_buf;
+    size_t read_bufsz;
+
+    /* Configs for listeners opened by socket99_loop_listen. */
+    socket99_config **listen_cfgs;
+    size_t listen_cfg_count;
+};
+
+socket99_loop *socket99_loop_new(const socket99_loop_callbacks *cbs,
+        size_t read_bufsz) {
+    if (cbs == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    socket99_loop *loop = calloc(1, sizeof(*loop));
+    if (loop == NULL) { return NULL; }
+    loop->cbs = *cbs;
+    loop->read_bufsz = read_bufsz ? read_bufsz : DEF_READ_BUFSZ;
+    loop->max_events = DEF_MAX_EVENTS;
+    loop->read_buf = malloc(loop->read_bufsz);
+    loop->events = calloc(loop->max_events, sizeof(*loop->events));
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (loop->read_buf == NULL || loop->events == NULL
+        || loop->epoll_fd == -1) {
+        int saved_errno = errno;
+        socket99_loop_free(loop);
+        errno = saved_errno;
+        return NULL;
+    }
+    return loop;
+}
+
+void socket99_loop_free(socket99_loop *loop) {
+    if (loop == NULL) { return; }
+    if (loop->epoll_fd >= 0) { close(loop->epoll_fd); }
+    for (size_t i = 0; i < loop->listen_cfg_count; i++) {
+        free(loop->listen_cfgs[i]);
+    }
+    free(loop->listen_cfgs);
+    free(loop->watches);
+    free(loop->events);
+    free(loop->read_buf);
+    free(loop);
+}
+
+/* Grow the watch table to cover FD. */
+static bool reserve_watch(socket99_loop *loop, int fd) {
+    if ((size_t)fd < loop->watch_count) { return true; }
+
+    size_t count = loop->watch_count ? loop->watch_count : 64;
+    while (count <= (size_t)fd) { count *= 2; }
+    watch *nw = realloc(loop->watches, count * sizeof(*nw));
+    if (nw == NULL) { return false; }
+    memset(&nw[loop->watch_count], 0,
+        (count - loop->watch_count) * sizeof(*nw));
+    loop->watches = nw;
+    loop->watch_count = count;
+    return true;
+}
+
+static bool add_watch(socket99_loop *loop, int fd, enum watch_kind kind,
+        void *udata, socket99_config *cfg) {
+    if (fd < 0) {
+        errno = EBADF;
+        return false;
+    }
+    if (!reserve_watch(loop, fd)) { return false; }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    if (kind == WATCH_CONN) { ev.events |= EPOLLOUT; }
+    ev.data.fd = fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        return false;
+    }
+
+    watch *w = &loop->watches[fd];
+    w->kind = kind;
+    w->udata = udata;
+    w->cfg = cfg;
+    return true;
+}
+
+bool socket99_loop_listen(socket99_loop *loop, socket99_config *cfg,
+        socket99_result *res, void *udata) {
+    if (loop == NULL || cfg == NULL || res == NULL) { return false; }
+    if (!cfg->server || cfg->datagram) {
+        memset(res, 0, sizeof(*res));
+        res->status = SOCKET99_ERROR_CONFIGURATION;
+        return false;
+    }
+
+    /* Keep a copy of the config for accepting, so the caller's
+     * can be stack-allocated. */
+    socket99_config *lcfg = malloc(sizeof(*lcfg));
+    socket99_config **ncfgs = realloc(loop->listen_cfgs,
+        (loop->listen_cfg_count + 1) * sizeof(*ncfgs));
+    if (ncfgs != NULL) { loop->listen_cfgs = ncfgs; }
+    if (lcfg == NULL || ncfgs == NULL) {
+        free(lcfg);
+        memset(res, 0, sizeof(*res));
+        res->status = SOCKET99_ERROR_UNKNOWN;
+        res->saved_errno = ENOMEM;
+        return false;
+    }
+    *lcfg = *cfg;
+    lcfg->nonblocking = true;
+    lcfg->cloexec = true;
+
+    if (!socket99_open(lcfg, res)) {
+        free(lcfg);
+        return false;
+    }
+
+    if (!add_watch(loop, res->fd, WATCH_LISTENER, udata, lcfg)) {
+        res->status = SOCKET99_ERROR_UNKNOWN;
+        res->saved_errno = errno;
+        errno = 0;
+        close(res->fd);
+        free(lcfg);
+        return false;
+    }
+    loop->listen_cfgs[loop->listen_cfg_count++] = lcfg;
+    return true;
+}
+
+bool socket99_loop_add(socket99_loop *loop, int fd, void *udata) {
+    if (loop == NULL) { return false; }
+
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) { return false; }
+    if (!(flags & O_NONBLOCK)
+        && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        return false;
+    }
+    return add_watch(loop, fd, WATCH_CONN, udata, NULL);
+}
+
+bool socket99_loop_remove(socket99_loop *loop, int fd) {
+    if (loop == NULL || fd < 0 || (size_t)fd >= loop->watch_count
+        || loop->watches[fd].kind == WATCH_NONE) {
+        return false;
+    }
+    loop->watches[fd].kind = WATCH_NONE;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL) == 0;
+}
+
+static bool is_watched(socket99_loop *loop, int fd, enum watch_kind kind) {
+    return (size_t)fd < loop->watch_count
+        && loop->watches[fd].kind == kind;
+}
+
+/* Stop watching FD and tell the caller it's done. */
+static void close_conn(socket99_loop *loop, int fd, int err) {
+    void *udata = loop->watches[fd].udata;
+    socket99_loop_remove(loop, fd);
+    if (loop->cbs.on_close) {
+        loop->cbs.on_close(loop, fd, err, udata);
+    } else {
+        close(fd);
+    }
+}
+
+/* Accept every pending connection, since the edge won't repeat. */
+static void drain_accept(socket99_loop *loop, int fd) {
+    socket99_config *cfg = loop->watches[fd].cfg;
+
+    while (is_watched(loop, fd, WATCH_LISTENER)) {
+        int client_fd = socket99_accept(cfg, fd, NULL, NULL);
+        if (client_fd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { break; }
+            if (errno == EINTR || errno == ECONNABORTED) { continue; }
+            /* e.g. EMFILE; try again on the next edge. */
+            break;
+        }
+
+        void *client_udata = loop->watches[fd].udata;
+        if (loop->cbs.on_accept && !loop->cbs.on_accept(loop,
+                client_fd, loop->watches[fd].udata, &client_udata)) {
+            close(client_fd);
+            continue;
+        }
+        if (!add_watch(loop, client_fd, WATCH_CONN, client_udata, NULL)) {
+            close(client_fd);
+        }
+    }
+    errno = 0;
+}
+
+/* Read until EAGAIN, handing each chunk to the read callback. */
+static void drain_read(socket99_loop *loop, int fd) {
+    while (is_watched(loop, fd, WATCH_CONN)) {
+        ssize_t got = recv(fd, loop->read_buf, loop->read_bufsz, 0);
+        if (got > 0) {
+            if (loop->cbs.on_read) {
+                loop->cbs.on_read(loop, fd, loop->read_buf, (size_t)got,
+                    loop->watches[fd].udata);
+            }
+        } else if (got == 0) {
+            close_conn(loop, fd, 0);
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            close_conn(loop, fd, errno);
+        }
+    }
+    errno = 0;
+}
+
+int socket99_loop_run_once(socket99_loop *loop, int timeout_msec) {
+    if (loop == NULL) { return -1; }
+
+    int count = epoll_wait(loop->epoll_fd, loop->events,
+        (int)loop->max_events, timeout_msec);
+    if (count == -1) {
+        if (errno == EINTR) {
+            errno = 0;
+            return 0;
+        }
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        int fd = loop->events[i].data.fd;
+        uint32_t ev = loop->events[i].events;
+
+        if (is_watched(loop, fd, WATCH_LISTENER)) {
+            drain_accept(loop, fd);
+            continue;
+        }
+
+        if ((ev & EPOLLOUT) && is_watched(loop, fd, WATCH_CONN)
+            && loop->cbs.on_writable) {
+            loop->cbs.on_writable(loop, fd, loop->watches[fd].udata);
+        }
+        if ((ev & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            && is_watched(loop, fd, WATCH_CONN)) {
+            /* Errors and hangups surface through recv. */
+            drain_read(loop, fd);
+        }
+    }
+
+    /* Grow the event array if it filled up, to take in more per wait. */
+    if ((size_t)count == loop->max_events) {
+        struct epoll_event *nev = realloc(loop->events,
+            2 * loop->max_events * sizeof(*nev));
+        if (nev != NULL) {
+            loop->events = nev;
+            loop->max_events *= 2;
+        }
+    }
+    return count;
+}
+
+bool socket99_loop_run(socket99_loop *loop) {
+    if (loop == NULL) { return false; }
+    loop->stop = false;
+    while (!loop->stop) {
+        if (socket99_loop_run_once(loop, -1) == -1) { return false; }
+    }
+    return true;
+}
+
+void socket99_loop_stop(socket99_loop *loop) {
+    if (loop != NULL) { loop->stop = true; }
+}
+
+#else
+
+/* The event loop needs epoll(7); elsewhere, it reports ENOTSUP. */
+
+socket99_loop *socket99_loop_new(const socket99_loop_callbacks *cbs,
+        size_t read_bufsz) {
+    (void)cbs;
+    (void)read_bufsz;
+    errno = ENOTSUP;
+    return NULL;
+}
+
+void socket99_loop_free(socket99_loop *loop) { (void)loop; }
+
+bool socket99_loop_listen(socket99_loop *loop, socket99_config *cfg,
+        socket99_result *res, void *udata) {
+    (void)loop;
+    (void)cfg;
+    (void)udata;
+    if (res != NULL) {
+        memset(res, 0, sizeof(*res));
+        res->status = SOCKET99_ERROR_UNSUPPORTED;
+        res->saved_errno = ENOTSUP;
+    }
+    return false;
+}
+
+bool socket99_loop_add(socket99_loop *loop, int fd, void *udata) {
+    (void)loop;
+    (void)fd;
+    (void)udata;
+    errno = ENOTSUP;
+    return false;
+}
+
+bool socket99_loop_remove(socket99_loop *loop, int fd) {
+    (void)loop;
+    (void)fd;
+    errno = ENOTSUP;
+    return false;
+}
+
+int socket99_loop_run_once(socket99_loop *loop, int timeout_msec) {
+    (void)loop;
+    (void)timeout_msec;
+    errno = ENOTSUP;
+    return -1;
+}
+
+bool socket99_loop_run(socket99_loop *loop) {
+    (void)loop;
+    errno = ENOTSUP;
+    return false;
+}
+
+void socket99_loop_stop(socket99_loop *loop) { (void)loop; }
+
+#endif
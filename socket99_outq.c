@@ -0,0 +1,321 @@
+/*
+ * Copyright (c) 2014-17 Scott Vokes <vokes.s@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* MSG_MORE and TCP_CORK are hidden by strict _POSIX_C_SOURCE. */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "socket99.h"
+
+#define DEF_FLUSH_BYTES (64 * 1024)
+#define DEF_FLUSH_WRITES 64
+#define DEF_HIGH_WATER (1024 * 1024)
+#define DEF_LOW_WATER (256 * 1024)
+
+/* Bytes per block; larger writes get a block of their own size. */
+#define BLOCK_SIZE (16 * 1024)
+
+/* Most pieces per sendmsg(2); well under any IOV_MAX. */
+#define MAX_IOVS 64
+
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#if defined(TCP_CORK)
+#define CORK_OPT TCP_CORK
+#elif defined(TCP_NOPUSH)
+#define CORK_OPT TCP_NOPUSH
+#endif
+
+/* Queued bytes are data[start, end). */
+typedef struct block {
+    struct block *next;
+    size_t cap;
+    size_t start;
+    size_t end;
+    char data[];
+} block;
+
+struct socket99_outq {
+    int fd;
+    socket99_outq_config cfg;
+    block *head;
+    block *tail;
+    block *spare;               /* an empty block, kept for reuse */
+    size_t pending;
+    size_t writes;              /* since the last flush */
+    bool blocked;               /* past high_water, not yet below low */
+    bool corked;
+    bool held;                  /* last send had MSG_MORE */
+    bool not_socket;            /* use writev(2) */
+    socket99_outq_stats stats;
+};
+
+socket99_outq *socket99_outq_new(int fd, socket99_outq_config *cfg) {
+    if (fd < 0) {
+        errno = EBADF;
+        return NULL;
+    }
+    socket99_outq *q = calloc(1, sizeof(*q));
+    if (q == NULL) { return NULL; }
+    q->fd = fd;
+    if (cfg) { q->cfg = *cfg; }
+
+    socket99_outq_config *c = &q->cfg;
+    if (c->flush_bytes == 0) { c->flush_bytes = DEF_FLUSH_BYTES; }
+    if (c->flush_writes == 0) { c->flush_writes = DEF_FLUSH_WRITES; }
+    if (c->high_water == 0) { c->high_water = DEF_HIGH_WATER; }
+    if (c->low_water == 0) { c->low_water = DEF_LOW_WATER; }
+    if (c->low_water > c->high_water) { c->low_water = c->high_water; }
+#ifndef CORK_OPT
+    c->cork = false;
+#endif
+    return q;
+}
+
+static void free_blocks(block *b) {
+    while (b) {
+        block *next = b->next;
+        free(b);
+        b = next;
+    }
+}
+
+void socket99_outq_free(socket99_outq *q) {
+    if (q == NULL) { return; }
+    free_blocks(q->head);
+    free(q->spare);
+    free(q);
+}
+
+static block *new_block(socket99_outq *q, size_t len) {
+    block *b;
+    if (len <= BLOCK_SIZE && q->spare) {
+        b = q->spare;
+        q->spare = NULL;
+    } else {
+        size_t cap = len > BLOCK_SIZE ? len : BLOCK_SIZE;
+        b = malloc(sizeof(*b) + cap);
+        if (b == NULL) { return NULL; }
+        b->cap = cap;
+    }
+    b->next = NULL;
+    b->start = b->end = 0;
+
+    if (q->tail) {
+        q->tail->next = b;
+    } else {
+        q->head = b;
+    }
+    q->tail = b;
+    return b;
+}
+
+bool socket99_outq_write(socket99_outq *q, const void *buf, size_t len) {
+    if (q == NULL || (buf == NULL && len > 0)) {
+        errno = EINVAL;
+        return false;
+    }
+    q->stats.writes++;
+    if (len > 0) { q->writes++; }
+
+    /* Fill the last block, then start another. */
+    const char *p = buf;
+    while (len > 0) {
+        block *b = q->tail;
+        if (b == NULL || b->end == b->cap) {
+            b = new_block(q, len);
+            if (b == NULL) { return false; }
+        }
+        size_t n = b->cap - b->end;
+        if (n > len) { n = len; }
+        memcpy(b->data + b->end, p, n);
+        b->end += n;
+        p += n;
+        len -= n;
+        q->pending += n;
+    }
+    if (q->pending >= q->cfg.high_water) { q->blocked = true; }
+
+    if (q->pending >= q->cfg.flush_bytes || q->writes >= q->cfg.flush_writes) {
+        if (socket99_outq_flush(q, true) == -1 && errno != EAGAIN) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifdef CORK_OPT
+static void set_cork(socket99_outq *q, bool on) {
+    int v = on;
+    q->stats.syscalls++;
+    if (setsockopt(q->fd, IPPROTO_TCP, CORK_OPT, &v, sizeof(v)) == 0) {
+        q->corked = on;
+    } else if (on) {
+        q->cfg.cork = false;            /* not TCP; use MSG_MORE */
+    }
+}
+#endif
+
+/* Push out a partial segment held back by an earlier MSG_MORE, which
+ * would otherwise wait for the kernel's timer (about 200 msec).
+ * Clearing TCP_CORK pushes it even if not corked; for other sockets,
+ * an empty send without MSG_MORE does. */
+static void push_held(socket99_outq *q) {
+    q->held = false;
+#ifdef CORK_OPT
+    int v = 0;
+    q->stats.syscalls++;
+    if (setsockopt(q->fd, IPPROTO_TCP, CORK_OPT, &v, sizeof(v)) == 0) {
+        return;
+    }
+#endif
+    q->stats.syscalls++;
+    (void)send(q->fd, NULL, 0, MSG_NOSIGNAL);
+}
+
+/* Drop the first N queued bytes. */
+static void consume(socket99_outq *q, size_t n) {
+    q->pending -= n;
+    while (n > 0) {
+        block *b = q->head;
+        size_t len = b->end - b->start;
+        if (n < len) {
+            b->start += n;
+            return;
+        }
+        n -= len;
+        q->head = b->next;
+        if (q->head == NULL) { q->tail = NULL; }
+        if (b->cap == BLOCK_SIZE && q->spare == NULL) {
+            q->spare = b;
+        } else {
+            free(b);
+        }
+    }
+}
+
+/* Send the first MAX_IOVS pieces. Returns bytes sent or -1, and sets
+ * *WANTED to the bytes offered. */
+static ssize_t send_some(socket99_outq *q, bool more, size_t *wanted) {
+    struct iovec iov[MAX_IOVS];
+    int count = 0;
+    *wanted = 0;
+    block *b = q->head;
+    for (; b != NULL && count < MAX_IOVS; b = b->next) {
+        iov[count].iov_base = b->data + b->start;
+        iov[count].iov_len = b->end - b->start;
+        *wanted += iov[count].iov_len;
+        count++;
+    }
+
+    /* Hold back a partial segment unless this is the end. */
+    int flags = MSG_NOSIGNAL;
+    if (!q->cfg.cork && (more || b != NULL)) { flags |= MSG_MORE; }
+
+    for (;;) {
+        ssize_t res;
+        q->stats.syscalls++;
+        if (q->not_socket) {
+            res = writev(q->fd, iov, count);
+        } else {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+            res = sendmsg(q->fd, &msg, flags);
+            if (res == -1 && errno == ENOTSOCK) {
+                q->not_socket = true;
+                continue;
+            }
+            if (res > 0) { q->held = (flags & MSG_MORE) != 0; }
+        }
+        if (res == -1 && errno == EINTR) { continue; }
+        return res;
+    }
+}
+
+ssize_t socket99_outq_flush(socket99_outq *q, bool more) {
+    if (q == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+#ifdef CORK_OPT
+    if (q->cfg.cork && more && !q->corked && q->head) { set_cork(q, true); }
+#endif
+
+    size_t total = 0;
+    q->writes = 0;
+    while (q->head) {
+        size_t wanted;
+        ssize_t res = send_some(q, more, &wanted);
+        if (res == -1) {
+            if (total > 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            return -1;
+        }
+        consume(q, (size_t)res);
+        total += (size_t)res;
+        q->stats.bytes += (uint64_t)res;
+        if ((size_t)res < wanted) {
+            /* The socket is full; sending again would just fail. */
+            q->stats.partial++;
+            break;
+        }
+    }
+
+#ifdef CORK_OPT
+    /* Uncorking pushes out the last partial segment. */
+    if (q->corked && !more && q->head == NULL) { set_cork(q, false); }
+#endif
+    /* An earlier flush may have sent everything with MSG_MORE, so
+     * push out what the kernel is holding back. */
+    if (q->held && !more && q->head == NULL) { push_held(q); }
+
+    if (total > 0) { q->stats.flushes++; }
+    if (q->blocked && q->pending < q->cfg.low_water) { q->blocked = false; }
+    return (ssize_t)total;
+}
+
+size_t socket99_outq_pending(socket99_outq *q) {
+    return q ? q->pending : 0;
+}
+
+bool socket99_outq_writable(socket99_outq *q) {
+    return q != NULL && !q->blocked;
+}
+
+void socket99_outq_get_stats(socket99_outq *q, socket99_outq_stats *stats) {
+    if (q == NULL || stats == NULL) { return; }
+    *stats = q->stats;
+}
@@ -0,0 +1,319 @@
+/*
+ * Copyright (c) 2014-17 Scott Vokes <vokes.s@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "socket99.h"
+
+/* Built-in defaults for socket99_pool_config. */
+#define DEF_MAX_IDLE_PER_KEY 8
+#define DEF_MAX_IDLE 256
+#define DEF_MAX_IDLE_MSEC (60 * 1000)
+
+#define BUCKET_COUNT 64
+#define KEY_BUFSZ 320
+
+typedef struct conn conn;
+typedef struct key key;
+
+/* An idle connection. It is on two lists: its key's list, with the
+ * most recently returned first, and the pool-wide LRU list. */
+struct conn {
+    conn *key_prev;
+    conn *key_next;
+    conn *lru_prev;
+    conn *lru_next;
+    key *k;
+    int fd;
+    uint64_t idle_since_nsec;
+};
+
+/* A destination, and the idle connections to it. */
+struct key {
+    key *next;                  /* next in hash bucket */
+    char *name;
+    uint32_t hash;
+    conn *head;
+    conn *tail;
+    size_t count;
+};
+
+struct socket99_pool {
+    socket99_pool_config cfg;
+    pthread_mutex_t lock;
+    key *buckets[BUCKET_COUNT];
+    conn *lru_head;             /* most recently returned */
+    conn *lru_tail;             /* least recently returned */
+    size_t idle_count;
+    socket99_pool_stats stats;
+};
+
+static uint64_t now_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/* FNV-1a */
+static uint32_t hash_name(const char *name) {
+    uint32_t h = 2166136261U;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h = (h ^ *p) * 16777619U;
+    }
+    return h;
+}
+
+/* Build a key from the config fields that choose the destination. */
+static bool make_name(char *buf, socket99_config *cfg) {
+    int res = snprintf(buf, KEY_BUFSZ, "%s|%s|%s|%d|%s|%d",
+        cfg->host ? cfg->host : "", cfg->IPv4 ? cfg->IPv4 : "",
+        cfg->IPv6 ? cfg->IPv6 : "", cfg->port,
+        cfg->path ? cfg->path : "", cfg->datagram);
+    return res > 0 && res < KEY_BUFSZ;
+}
+
+socket99_pool *socket99_pool_new(socket99_pool_config *cfg) {
+    socket99_pool *pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) { return NULL; }
+
+    if (cfg) { pool->cfg = *cfg; }
+    if (pool->cfg.max_idle_per_key == 0) {
+        pool->cfg.max_idle_per_key = DEF_MAX_IDLE_PER_KEY;
+    }
+    if (pool->cfg.max_idle == 0) { pool->cfg.max_idle = DEF_MAX_IDLE; }
+    if (pool->cfg.max_idle_msec <= 0) {
+        pool->cfg.max_idle_msec = DEF_MAX_IDLE_MSEC;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+static key *find_key(socket99_pool *pool, const char *name,
+        uint32_t hash, bool create) {
+    key **bucket = &pool->buckets[hash % BUCKET_COUNT];
+    for (key *k = *bucket; k != NULL; k = k->next) {
+        if (k->hash == hash && 0 == strcmp(k->name, name)) { return k; }
+    }
+    if (!create) { return NULL; }
+
+    key *k = calloc(1, sizeof(*k));
+    if (k == NULL) { return NULL; }
+    k->name = malloc(strlen(name) + 1);
+    if (k->name == NULL) {
+        free(k);
+        return NULL;
+    }
+    strcpy(k->name, name);
+    k->hash = hash;
+    k->next = *bucket;
+    *bucket = k;
+    return k;
+}
+
+static void free_key(socket99_pool *pool, key *k) {
+    key **prev = &pool->buckets[k->hash % BUCKET_COUNT];
+    while (*prev != k) { prev = &(*prev)->next; }
+    *prev = k->next;
+    free(k->name);
+    free(k);
+}
+
+/* Unlink an idle connection from both lists, freeing its key once
+ * it has no idle connections left. Returns the fd. Lock must be held. */
+static int unlink_conn(socket99_pool *pool, conn *c) {
+    key *k = c->k;
+    if (c->key_prev) { c->key_prev->key_next = c->key_next; }
+    else { k->head = c->key_next; }
+    if (c->key_next) { c->key_next->key_prev = c->key_prev; }
+    else { k->tail = c->key_prev; }
+    k->count--;
+
+    if (c->lru_prev) { c->lru_prev->lru_next = c->lru_next; }
+    else { pool->lru_head = c->lru_next; }
+    if (c->lru_next) { c->lru_next->lru_prev = c->lru_prev; }
+    else { pool->lru_tail = c->lru_prev; }
+    pool->idle_count--;
+
+    int fd = c->fd;
+    if (k->count == 0) { free_key(pool, k); }
+    free(c);
+    return fd;
+}
+
+void socket99_pool_free(socket99_pool *pool) {
+    if (pool == NULL) { return; }
+    while (pool->lru_head != NULL) {
+        close(unlink_conn(pool, pool->lru_head));
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+/* Is an idle connection still usable? Pending data or EOF on an idle
+ * connection both mean it's out of sync with its peer. */
+static bool is_alive(int fd) {
+#ifdef MSG_DONTWAIT
+    char c;
+    ssize_t res = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        errno = 0;
+        return true;
+    }
+    return false;
+#else
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    return poll(&pfd, 1, 0) == 0;
+#endif
+}
+
+bool socket99_pool_checkout(socket99_pool *pool, socket99_config *cfg,
+        socket99_result *res) {
+    if (pool == NULL || cfg == NULL || res == NULL) { return false; }
+    uint64_t start = now_nsec();
+
+    char name[KEY_BUFSZ];
+    bool pooled = !cfg->server && make_name(name, cfg);
+    uint32_t hash = pooled ? hash_name(name) : 0;
+    uint64_t max_idle_nsec = (uint64_t)pool->cfg.max_idle_msec * 1000000;
+
+    int fd = -1;
+    while (pooled) {
+        pthread_mutex_lock(&pool->lock);
+        key *k = find_key(pool, name, hash, false);
+        if (k == NULL) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        uint64_t idle_since = k->head->idle_since_nsec;
+        fd = unlink_conn(pool, k->head);
+        pthread_mutex_unlock(&pool->lock);
+
+        if (start - idle_since < max_idle_nsec && is_alive(fd)) { break; }
+
+        close(fd);
+        fd = -1;
+        pthread_mutex_lock(&pool->lock);
+        pool->stats.dead++;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    bool ok = true;
+    if (fd != -1) {
+        memset(res, 0, sizeof(*res));
+        res->status = SOCKET99_OK;
+        res->fd = fd;
+    } else {
+        ok = socket99_open(cfg, res);
+    }
+
+    uint64_t elapsed = now_nsec() - start;
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.checkouts++;
+    if (fd != -1) { pool->stats.hits++; } else { pool->stats.misses++; }
+    pool->stats.checkout_nsec += elapsed;
+    pthread_mutex_unlock(&pool->lock);
+    return ok;
+}
+
+void socket99_pool_checkin(socket99_pool *pool, socket99_config *cfg,
+        int fd) {
+    if (pool == NULL || cfg == NULL || fd < 0) { return; }
+
+    char name[KEY_BUFSZ];
+    if (cfg->server || !make_name(name, cfg)) {
+        close(fd);
+        return;
+    }
+    uint32_t hash = hash_name(name);
+
+    conn *c = calloc(1, sizeof(*c));
+    if (c == NULL) {
+        close(fd);
+        return;
+    }
+    c->fd = fd;
+    c->idle_since_nsec = now_nsec();
+
+    /* Evicted fds are closed after unlocking. */
+    int evicted[2] = { -1, -1 };
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.checkins++;
+    key *k = find_key(pool, name, hash, true);
+    if (k == NULL) {
+        pthread_mutex_unlock(&pool->lock);
+        free(c);
+        close(fd);
+        return;
+    }
+
+    /* Make room, dropping the least recently used connections. */
+    if (k->count >= pool->cfg.max_idle_per_key) {
+        evicted[0] = unlink_conn(pool, k->tail);
+        pool->stats.evictions++;
+        k = find_key(pool, name, hash, true);
+    }
+    if (pool->idle_count >= pool->cfg.max_idle && pool->lru_tail) {
+        evicted[1] = unlink_conn(pool, pool->lru_tail);
+        pool->stats.evictions++;
+        k = find_key(pool, name, hash, true);
+    }
+    if (k == NULL) {
+        pthread_mutex_unlock(&pool->lock);
+        free(c);
+        close(fd);
+    } else {
+        c->k = k;
+        c->key_next = k->head;
+        if (k->head) { k->head->key_prev = c; } else { k->tail = c; }
+        k->head = c;
+        k->count++;
+
+        c->lru_next = pool->lru_head;
+        if (pool->lru_head) { pool->lru_head->lru_prev = c; }
+        else { pool->lru_tail = c; }
+        pool->lru_head = c;
+        pool->idle_count++;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (evicted[i] != -1) { close(evicted[i]); }
+    }
+}
+
+void socket99_pool_get_stats(socket99_pool *pool,
+        socket99_pool_stats *stats) {
+    if (pool == NULL || stats == NULL) { return; }
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    stats->idle = pool->idle_count;
+    pthread_mutex_unlock(&pool->lock);
+}
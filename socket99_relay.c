@@ -0,0 +1,303 @@
+/*
+ * Copyright (c) 2014-17 Scott Vokes <vokes.s@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* splice(2) and pipe2(2) are hidden by strict _POSIX_C_SOURCE. */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "socket99.h"
+
+#if defined(SPLICE_F_MOVE) && defined(SPLICE_F_NONBLOCK)
+#define HAVE_SPLICE 1
+#endif
+
+/* Pipe capacity to ask for; moving more per splice means fewer calls. */
+#define DEF_PIPE_SIZE (256 * 1024)
+
+/* Max idle pipes kept in the pool. */
+#define MAX_POOLED_PIPES 64
+
+/* Buffer size when copying. */
+#define COPY_BUFSZ (64 * 1024)
+
+struct socket99_relay {
+    int in_fd;
+    int out_fd;
+    bool eof;
+    size_t pending;             /* bytes read, not yet written */
+    socket99_relay_stats stats;
+#ifdef HAVE_SPLICE
+    int pipe_fds[2];            /* -1 unless data is in flight */
+    size_t pipe_size;
+#else
+    char *buf;
+    size_t buf_offset;
+#endif
+};
+
+#ifdef HAVE_SPLICE
+
+/* Process-wide pool of empty pipes. */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static int pool[MAX_POOLED_PIPES][2];
+static size_t pool_sizes[MAX_POOLED_PIPES];
+static size_t pool_count;
+
+static bool get_pipe(socket99_relay *r) {
+    pthread_mutex_lock(&pool_lock);
+    if (pool_count > 0) {
+        pool_count--;
+        r->pipe_fds[0] = pool[pool_count][0];
+        r->pipe_fds[1] = pool[pool_count][1];
+        r->pipe_size = pool_sizes[pool_count];
+        pthread_mutex_unlock(&pool_lock);
+        return true;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    r->stats.syscalls++;
+    if (pipe2(r->pipe_fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+        r->pipe_fds[0] = r->pipe_fds[1] = -1;
+        return false;
+    }
+    /* If the larger size is refused, keep the default. */
+    r->stats.syscalls++;
+    int size = fcntl(r->pipe_fds[1], F_SETPIPE_SZ, DEF_PIPE_SIZE);
+    if (size == -1) {
+        r->stats.syscalls++;
+        size = fcntl(r->pipe_fds[1], F_GETPIPE_SZ);
+    }
+    r->pipe_size = size > 0 ? (size_t)size : 4096;
+    errno = 0;
+    return true;
+}
+
+/* Return the relay's pipe to the pool, or close it if it still holds
+ * data or the pool is full. */
+static void put_pipe(socket99_relay *r) {
+    if (r->pipe_fds[0] == -1) { return; }
+    bool pooled = false;
+    if (r->pending == 0) {
+        pthread_mutex_lock(&pool_lock);
+        if (pool_count < MAX_POOLED_PIPES) {
+            pool[pool_count][0] = r->pipe_fds[0];
+            pool[pool_count][1] = r->pipe_fds[1];
+            pool_sizes[pool_count] = r->pipe_size;
+            pool_count++;
+            pooled = true;
+        }
+        pthread_mutex_unlock(&pool_lock);
+    }
+    if (!pooled) {
+        close(r->pipe_fds[0]);
+        close(r->pipe_fds[1]);
+    }
+    r->pipe_fds[0] = r->pipe_fds[1] = -1;
+}
+
+#endif
+
+socket99_relay *socket99_relay_new(int in_fd, int out_fd) {
+    if (in_fd < 0 || out_fd < 0) {
+        errno = EBADF;
+        return NULL;
+    }
+    socket99_relay *r = calloc(1, sizeof(*r));
+    if (r == NULL) { return NULL; }
+    r->in_fd = in_fd;
+    r->out_fd = out_fd;
+#ifdef HAVE_SPLICE
+    r->pipe_fds[0] = r->pipe_fds[1] = -1;
+#else
+    r->buf = malloc(COPY_BUFSZ);
+    if (r->buf == NULL) {
+        free(r);
+        return NULL;
+    }
+#endif
+    return r;
+}
+
+void socket99_relay_free(socket99_relay *r) {
+    if (r == NULL) { return; }
+#ifdef HAVE_SPLICE
+    put_pipe(r);
+#else
+    free(r->buf);
+#endif
+    free(r);
+}
+
+size_t socket99_relay_pending(socket99_relay *r) {
+    return r ? r->pending : 0;
+}
+
+void socket99_relay_get_stats(socket99_relay *r,
+        socket99_relay_stats *stats) {
+    if (r == NULL || stats == NULL) { return; }
+    *stats = r->stats;
+}
+
+/* Fill the pipe (or buffer) from IN_FD. Returns bytes read, 0 at EOF,
+ * or -1. */
+static ssize_t relay_in(socket99_relay *r, size_t max) {
+#ifdef HAVE_SPLICE
+    if (r->pipe_fds[0] == -1 && !get_pipe(r)) { return -1; }
+    size_t want = max < r->pipe_size ? max : r->pipe_size;
+    r->stats.syscalls++;
+    return splice(r->in_fd, NULL, r->pipe_fds[1], NULL, want,
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+    size_t want = max < COPY_BUFSZ ? max : COPY_BUFSZ;
+    r->stats.syscalls++;
+    r->buf_offset = 0;
+    return read(r->in_fd, r->buf, want);
+#endif
+}
+
+/* Drain the pipe (or buffer) to OUT_FD. Returns bytes written, or -1. */
+static ssize_t relay_out(socket99_relay *r) {
+    r->stats.syscalls++;
+#ifdef HAVE_SPLICE
+    return splice(r->pipe_fds[0], NULL, r->out_fd, NULL, r->pending,
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+    ssize_t res = write(r->out_fd, r->buf + r->buf_offset, r->pending);
+    if (res > 0) { r->buf_offset += (size_t)res; }
+    return res;
+#endif
+}
+
+ssize_t socket99_relay_step(socket99_relay *r, size_t max) {
+    /* A 0 result means EOF, so moving nothing isn't a valid request. */
+    if (r == NULL || max == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t moved = 0;
+    int err = 0;
+    while (moved < max) {
+        if (r->pending == 0) {
+            if (r->eof) { break; }
+            ssize_t got = relay_in(r, max - moved);
+            if (got == 0) {
+                r->eof = true;
+                break;
+            } else if (got == -1) {
+                if (errno == EINTR) { continue; }
+                err = errno;
+                break;
+            }
+            r->pending = (size_t)got;
+        }
+
+        ssize_t sent = relay_out(r);
+        if (sent == -1) {
+            if (errno == EINTR) { continue; }
+            err = errno;
+            break;
+        }
+        r->pending -= (size_t)sent;
+        moved += (size_t)sent;
+        r->stats.bytes += (uint64_t)sent;
+    }
+
+#ifdef HAVE_SPLICE
+    /* Don't hold on to an empty pipe between steps. */
+    if (r->pending == 0) { put_pipe(r); }
+#endif
+
+    if (moved > 0 || (err == 0 && r->eof)) {
+        errno = 0;
+        return (ssize_t)moved;
+    }
+    errno = err;
+    return -1;
+}
+
+#ifndef __linux__
+/* Send up to COUNT bytes of FILE_FD by reading it into BUF. Whatever
+ * wasn't sent is left unread, so nothing is lost if OUT_FD would block. */
+static ssize_t copy_file(int out_fd, int file_fd, off_t *offset,
+        size_t count, char *buf, socket99_relay_stats *stats) {
+    if (stats) { stats->syscalls++; }
+    ssize_t got = offset ? pread(file_fd, buf, count, *offset)
+        : read(file_fd, buf, count);
+    if (got <= 0) { return got; }
+
+    if (stats) { stats->syscalls++; }
+    ssize_t res = send(out_fd, buf, (size_t)got, 0);
+    ssize_t sent = res > 0 ? res : 0;
+    if (offset) {
+        *offset += sent;
+    } else if (sent < got) {
+        int saved_errno = errno;
+        if (stats) { stats->syscalls++; }
+        (void)lseek(file_fd, sent - got, SEEK_CUR);
+        errno = saved_errno;
+    }
+    return res;
+}
+#endif
+
+ssize_t socket99_sendfile(int out_fd, int file_fd, off_t *offset,
+        size_t count, socket99_relay_stats *stats) {
+    size_t sent = 0;
+#ifndef __linux__
+    char buf[COPY_BUFSZ];
+#endif
+
+    while (sent < count) {
+        size_t want = count - sent;
+#ifdef __linux__
+        /* Linux moves at most 0x7ffff000 bytes per call. */
+        if (want > 0x7ffff000) { want = 0x7ffff000; }
+        if (stats) { stats->syscalls++; }
+        ssize_t res = sendfile(out_fd, file_fd, offset, want);
+#else
+        if (want > sizeof(buf)) { want = sizeof(buf); }
+        ssize_t res = copy_file(out_fd, file_fd, offset, want, buf, stats);
+#endif
+        if (res > 0) {
+            sent += (size_t)res;
+            if (stats) { stats->bytes += (uint64_t)res; }
+        } else if (res == 0) {
+            break;                      /* end of file */
+        } else if (errno != EINTR) {
+            /* Report what was sent; an error will recur next call. */
+            if (sent > 0) { break; }
+            return -1;
+        }
+    }
+    errno = 0;
+    return (ssize_t)sent;
+}
@@ -0,0 +1,597 @@
+/*
+ * Copyright (c) 2014-17 Scott Vokes <vokes.s@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "socket99.h"
+
+/* Built-in defaults for socket99_resolver_config. */
+#define DEF_MAX_ENTRIES 256
+#define DEF_TTL_MSEC (30 * 1000)
+#define DEF_NEGATIVE_TTL_MSEC (5 * 1000)
+#define DEF_THREADS 4
+#define DEF_QUEUE_SIZE 1024
+
+#define KEY_BUFSZ 320
+
+/* Round up address sizes to keep each copied address aligned. */
+#define ADDR_ALIGN(N) (((N) + 7) & ~(size_t)7)
+
+/* A reference-counted copy of a getaddrinfo result, in one allocation.
+ * The addrinfo structs and their addresses follow the header, so the
+ * header can be found again from the first addrinfo. */
+typedef struct {
+    int refcount;
+    struct addrinfo ai[];
+} addr_block;
+
+typedef struct entry {
+    struct entry *next;         /* next in hash bucket */
+    struct entry *lru_prev;     /* toward least recently used */
+    struct entry *lru_next;
+    char *key;
+    uint32_t hash;
+    addr_block *addrs;          /* NULL for a failed lookup */
+    int gai_error;
+    uint64_t expires_msec;
+} entry;
+
+/* A lookup in progress, so other callers for the same key wait for it
+ * rather than each starting their own. Freed by the last one out. */
+typedef struct inflight {
+    struct inflight *next;
+    const char *key;            /* the looking-up caller's */
+    uint32_t hash;
+    int waiters;
+    bool done;
+    addr_block *addrs;          /* a reference, held until freed */
+    int gai_error;
+} inflight;
+
+typedef struct {
+    char *node;
+    char service[8];
+    struct addrinfo hints;
+} job;
+
+struct socket99_resolver {
+    socket99_resolver_config cfg;
+    pthread_mutex_t lock;
+
+    entry **buckets;
+    size_t bucket_count;
+    size_t entry_count;
+    entry *lru_head;            /* least recently used, evicted first */
+    entry *lru_tail;
+    inflight *inflight;
+    pthread_cond_t lookup_cond; /* an inflight lookup finished */
+    socket99_resolver_stats stats;
+
+    /* Background lookups, started lazily. */
+    pthread_cond_t job_cond;
+    pthread_cond_t idle_cond;
+    pthread_t *threads;
+    int thread_count;
+    job *jobs;                  /* ring buffer */
+    size_t job_head;
+    size_t job_count;
+    size_t busy;                /* jobs being resolved */
+    bool shutdown;
+};
+
+static uint64_t now_msec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/* FNV-1a */
+static uint32_t hash_key(const char *key) {
+    uint32_t h = 2166136261U;
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        h = (h ^ *p) * 16777619U;
+    }
+    return h;
+}
+
+static bool make_key(char *buf, const char *node, const char *service,
+        const struct addrinfo *hints) {
+    int res = snprintf(buf, KEY_BUFSZ, "%s|%s|%d|%d|%d|%d",
+        node ? node : "", service ? service : "",
+        hints ? hints->ai_family : 0, hints ? hints->ai_socktype : 0,
+        hints ? hints->ai_protocol : 0, hints ? hints->ai_flags : 0);
+    return res > 0 && res < KEY_BUFSZ;
+}
+
+/* Is NODE an address, which can be converted without any lookup? */
+static bool is_numeric(const char *node, const struct addrinfo *hints) {
+    unsigned char buf[sizeof(struct in6_addr)];
+    if (node == NULL) { return true; }   /* wildcard or loopback */
+    if (hints && (hints->ai_flags & AI_NUMERICHOST)) { return true; }
+    return inet_pton(AF_INET, node, buf) == 1
+        || inet_pton(AF_INET6, node, buf) == 1;
+}
+
+/* Copy a getaddrinfo result into a single refcounted allocation.
+ * Canonical names are not kept. */
+static addr_block *copy_addrs(const struct addrinfo *res) {
+    size_t count = 0;
+    size_t addr_bytes = 0;
+    for (const struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+        count++;
+        addr_bytes += ADDR_ALIGN(ai->ai_addrlen);
+    }
+
+    addr_block *b = malloc(sizeof(*b)
+        + count * sizeof(struct addrinfo) + addr_bytes);
+    if (b == NULL) { return NULL; }
+    b->refcount = 1;
+
+    unsigned char *addr_buf = (unsigned char *)&b->ai[count];
+    size_t i = 0;
+    for (const struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+        struct addrinfo *dst = &b->ai[i];
+        *dst = *ai;
+        dst->ai_canonname = NULL;
+        dst->ai_addr = (struct sockaddr *)addr_buf;
+        memcpy(addr_buf, ai->ai_addr, ai->ai_addrlen);
+        addr_buf += ADDR_ALIGN(ai->ai_addrlen);
+        dst->ai_next = (i + 1 < count) ? &b->ai[i + 1] : NULL;
+        i++;
+    }
+    return b;
+}
+
+static addr_block *block_of(struct addrinfo *ai) {
+    return (addr_block *)((char *)ai - offsetof(addr_block, ai));
+}
+
+/* Call getaddrinfo and copy the result, so every address list handed
+ * out can be freed the same way. */
+static int lookup(const char *node, const char *service,
+        const struct addrinfo *hints, addr_block **out) {
+    struct addrinfo *res = NULL;
+    int gai_res = getaddrinfo(node, service, hints, &res);
+    if (gai_res != 0) { return gai_res; }
+
+    *out = copy_addrs(res);
+    freeaddrinfo(res);
+    if (*out == NULL) {
+        errno = ENOMEM;
+        return EAI_MEMORY;
+    }
+    return 0;
+}
+
+socket99_resolver *socket99_resolver_new(socket99_resolver_config *cfg) {
+    socket99_resolver *r = calloc(1, sizeof(*r));
+    if (r == NULL) { return NULL; }
+
+    if (cfg) { r->cfg = *cfg; }
+    if (r->cfg.max_entries == 0) { r->cfg.max_entries = DEF_MAX_ENTRIES; }
+    if (r->cfg.ttl_msec <= 0) { r->cfg.ttl_msec = DEF_TTL_MSEC; }
+    if (r->cfg.negative_ttl_msec <= 0) {
+        r->cfg.negative_ttl_msec = DEF_NEGATIVE_TTL_MSEC;
+    }
+    if (r->cfg.threads <= 0) { r->cfg.threads = DEF_THREADS; }
+
+    r->bucket_count = 2 * r->cfg.max_entries;
+    r->buckets = calloc(r->bucket_count, sizeof(*r->buckets));
+    r->jobs = calloc(DEF_QUEUE_SIZE, sizeof(*r->jobs));
+    if (r->buckets == NULL || r->jobs == NULL) {
+        free(r->buckets);
+        free(r->jobs);
+        free(r);
+        return NULL;
+    }
+
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->job_cond, NULL);
+    pthread_cond_init(&r->idle_cond, NULL);
+    pthread_cond_init(&r->lookup_cond, NULL);
+    return r;
+}
+
+static void release_block(addr_block *b) {
+    if (b != NULL && --b->refcount == 0) { free(b); }
+}
+
+static void free_entry(entry *e) {
+    release_block(e->addrs);
+    free(e->key);
+    free(e);
+}
+
+void socket99_resolver_free(socket99_resolver *r) {
+    if (r == NULL) { return; }
+
+    pthread_mutex_lock(&r->lock);
+    r->shutdown = true;
+    pthread_cond_broadcast(&r->job_cond);
+    pthread_mutex_unlock(&r->lock);
+    for (int i = 0; i < r->thread_count; i++) {
+        pthread_join(r->threads[i], NULL);
+    }
+
+    for (size_t i = 0; i < r->job_count; i++) {
+        free(r->jobs[(r->job_head + i) % DEF_QUEUE_SIZE].node);
+    }
+    for (size_t i = 0; i < r->bucket_count; i++) {
+        entry *e = r->buckets[i];
+        while (e != NULL) {
+            entry *next = e->next;
+            free_entry(e);
+            e = next;
+        }
+    }
+
+    pthread_cond_destroy(&r->lookup_cond);
+    pthread_cond_destroy(&r->idle_cond);
+    pthread_cond_destroy(&r->job_cond);
+    pthread_mutex_destroy(&r->lock);
+    free(r->threads);
+    free(r->jobs);
+    free(r->buckets);
+    free(r);
+}
+
+static void lru_unlink(socket99_resolver *r, entry *e) {
+    if (e->lru_prev) {
+        e->lru_prev->lru_next = e->lru_next;
+    } else {
+        r->lru_head = e->lru_next;
+    }
+    if (e->lru_next) {
+        e->lru_next->lru_prev = e->lru_prev;
+    } else {
+        r->lru_tail = e->lru_prev;
+    }
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push(socket99_resolver *r, entry *e) {
+    e->lru_prev = r->lru_tail;
+    e->lru_next = NULL;
+    if (r->lru_tail) {
+        r->lru_tail->lru_next = e;
+    } else {
+        r->lru_head = e;
+    }
+    r->lru_tail = e;
+}
+
+/* Find a live entry for KEY, unlinking expired ones, and mark it most
+ * recently used. Lock must be held. */
+static entry *find_entry(socket99_resolver *r, const char *key,
+        uint32_t hash, uint64_t now) {
+    entry **prev = &r->buckets[hash % r->bucket_count];
+    for (entry *e = *prev; e != NULL; e = *prev) {
+        if (e->hash == hash && 0 == strcmp(e->key, key)) {
+            lru_unlink(r, e);
+            if (e->expires_msec > now) {
+                lru_push(r, e);
+                return e;
+            }
+            *prev = e->next;
+            free_entry(e);
+            r->entry_count--;
+            r->stats.expired++;
+            return NULL;
+        }
+        prev = &e->next;
+    }
+    return NULL;
+}
+
+/* Evict the least recently used entry. Lock must be held. */
+static void evict_one(socket99_resolver *r) {
+    entry *e = r->lru_head;
+    if (e == NULL) { return; }
+    lru_unlink(r, e);
+
+    entry **prev = &r->buckets[e->hash % r->bucket_count];
+    while (*prev != e) { prev = &(*prev)->next; }
+    *prev = e->next;
+    free_entry(e);
+    r->entry_count--;
+    r->stats.evictions++;
+}
+
+/* Cache a lookup result, replacing any existing entry. The cache
+ * takes its own reference to ADDRS. Lock must be held. */
+static void insert_entry(socket99_resolver *r, const char *key,
+        uint32_t hash, addr_block *addrs, int gai_error, uint64_t now) {
+    entry *old = find_entry(r, key, hash, now);
+    if (old != NULL) {
+        release_block(old->addrs);
+        old->addrs = NULL;
+    } else {
+        if (r->entry_count >= r->cfg.max_entries) { evict_one(r); }
+
+        old = calloc(1, sizeof(*old));
+        if (old == NULL) { return; }
+        old->key = malloc(strlen(key) + 1);
+        if (old->key == NULL) {
+            free(old);
+            return;
+        }
+        strcpy(old->key, key);
+        old->hash = hash;
+
+        entry **bucket = &r->buckets[hash % r->bucket_count];
+        old->next = *bucket;
+        *bucket = old;
+        lru_push(r, old);
+        r->entry_count++;
+    }
+
+    if (addrs != NULL) { addrs->refcount++; }
+    old->addrs = addrs;
+    old->gai_error = gai_error;
+    old->expires_msec = now + (uint64_t)(addrs != NULL
+        ? r->cfg.ttl_msec : r->cfg.negative_ttl_msec);
+}
+
+static inflight *find_inflight(socket99_resolver *r, const char *key,
+        uint32_t hash) {
+    for (inflight *f = r->inflight; f != NULL; f = f->next) {
+        if (f->hash == hash && 0 == strcmp(f->key, key)) { return f; }
+    }
+    return NULL;
+}
+
+static void unlink_inflight(socket99_resolver *r, inflight *f) {
+    inflight **prev = &r->inflight;
+    while (*prev != f) { prev = &(*prev)->next; }
+    *prev = f->next;
+}
+
+/* Wait for another caller's lookup of the same key, and share its
+ * result. Lock must be held. */
+static int wait_inflight(socket99_resolver *r, inflight *f,
+        struct addrinfo **res) {
+    f->waiters++;
+    r->stats.coalesced++;
+    while (!f->done) { pthread_cond_wait(&r->lookup_cond, &r->lock); }
+    int gai_res = f->gai_error;
+    if (f->addrs != NULL) {
+        f->addrs->refcount++;
+        *res = f->addrs->ai;
+    }
+    if (--f->waiters == 0) {
+        release_block(f->addrs);
+        free(f);
+    }
+    return gai_res;
+}
+
+/* Only cache failures that say something about the name itself,
+ * not transient or local errors. */
+static bool cacheable_error(int gai_error) {
+    return gai_error == EAI_NONAME
+#ifdef EAI_NODATA
+        || gai_error == EAI_NODATA
+#endif
+        ;
+}
+
+int socket99_resolver_getaddrinfo(socket99_resolver *r, const char *node,
+        const char *service, const struct addrinfo *hints,
+        struct addrinfo **res) {
+    if (r == NULL || res == NULL) { return EAI_FAIL; }
+    *res = NULL;
+
+    addr_block *b = NULL;
+    int gai_res;
+
+    if (is_numeric(node, hints)) {
+        pthread_mutex_lock(&r->lock);
+        r->stats.numeric++;
+        pthread_mutex_unlock(&r->lock);
+
+        gai_res = lookup(node, service, hints, &b);
+        if (gai_res == 0) { *res = b->ai; }
+        return gai_res;
+    }
+
+    /* Names too long for a cache key are looked up every time. */
+    char key[KEY_BUFSZ];
+    if (!make_key(key, node, service, hints)) {
+        gai_res = lookup(node, service, hints, &b);
+        if (gai_res == 0) { *res = b->ai; }
+        return gai_res;
+    }
+    uint32_t hash = hash_key(key);
+
+    pthread_mutex_lock(&r->lock);
+    entry *e = find_entry(r, key, hash, now_msec());
+    if (e != NULL) {
+        gai_res = e->gai_error;
+        if (e->addrs != NULL) {
+            r->stats.hits++;
+            e->addrs->refcount++;
+            *res = e->addrs->ai;
+        } else {
+            r->stats.negative_hits++;
+        }
+        pthread_mutex_unlock(&r->lock);
+        return gai_res;
+    }
+
+    /* Only one caller looks each key up at a time, so an entry that
+     * expires while in heavy use costs one lookup, not one each. */
+    inflight *f = find_inflight(r, key, hash);
+    if (f != NULL) {
+        gai_res = wait_inflight(r, f, res);
+        pthread_mutex_unlock(&r->lock);
+        return gai_res;
+    }
+    f = calloc(1, sizeof(*f));
+    if (f != NULL) {
+        f->key = key;
+        f->hash = hash;
+        f->next = r->inflight;
+        r->inflight = f;
+    }
+    r->stats.misses++;
+    pthread_mutex_unlock(&r->lock);
+
+    /* Resolve without holding the lock. */
+    gai_res = lookup(node, service, hints, &b);
+
+    pthread_mutex_lock(&r->lock);
+    if (gai_res == 0 || cacheable_error(gai_res)) {
+        insert_entry(r, key, hash, b, gai_res, now_msec());
+    }
+    if (f != NULL) {
+        unlink_inflight(r, f);
+        if (f->waiters > 0) {
+            if (b != NULL) { b->refcount++; }
+            f->addrs = b;
+            f->gai_error = gai_res;
+            f->done = true;
+            pthread_cond_broadcast(&r->lookup_cond);
+        } else {
+            free(f);
+        }
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    if (gai_res == 0) { *res = b->ai; }
+    return gai_res;
+}
+
+void socket99_resolver_freeaddrinfo(socket99_resolver *r,
+        struct addrinfo *res) {
+    if (r == NULL || res == NULL) { return; }
+    addr_block *b = block_of(res);
+    pthread_mutex_lock(&r->lock);
+    release_block(b);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static void *worker(void *arg) {
+    socket99_resolver *r = (socket99_resolver *)arg;
+
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        while (r->job_count == 0 && !r->shutdown) {
+            pthread_cond_wait(&r->job_cond, &r->lock);
+        }
+        if (r->shutdown) { break; }
+
+        job j = r->jobs[r->job_head];
+        r->job_head = (r->job_head + 1) % DEF_QUEUE_SIZE;
+        r->job_count--;
+        r->busy++;
+        pthread_mutex_unlock(&r->lock);
+
+        struct addrinfo *res = NULL;
+        if (0 == socket99_resolver_getaddrinfo(r, j.node, j.service,
+                &j.hints, &res)) {
+            socket99_resolver_freeaddrinfo(r, res);
+        }
+        free(j.node);
+
+        pthread_mutex_lock(&r->lock);
+        r->busy--;
+        if (r->busy == 0 && r->job_count == 0) {
+            pthread_cond_broadcast(&r->idle_cond);
+        }
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+/* Start the background threads, if not already running. Lock must
+ * be held. */
+static bool start_workers(socket99_resolver *r) {
+    if (r->threads != NULL) { return true; }
+
+    r->threads = calloc((size_t)r->cfg.threads, sizeof(*r->threads));
+    if (r->threads == NULL) { return false; }
+    for (int i = 0; i < r->cfg.threads; i++) {
+        if (pthread_create(&r->threads[i], NULL, worker, r) != 0) { break; }
+        r->thread_count++;
+    }
+    return r->thread_count > 0;
+}
+
+size_t socket99_resolver_prefetch(socket99_resolver *r,
+        socket99_config *cfgs, size_t count) {
+    if (r == NULL || cfgs == NULL) { return 0; }
+
+    size_t queued = 0;
+    pthread_mutex_lock(&r->lock);
+    if (!start_workers(r)) {
+        pthread_mutex_unlock(&r->lock);
+        return 0;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        socket99_config *cfg = &cfgs[i];
+        const char *node = cfg->IPv4 ? cfg->IPv4
+            : cfg->IPv6 ? cfg->IPv6 : cfg->host;
+        if (cfg->path) { continue; }
+        if (r->job_count == DEF_QUEUE_SIZE) { break; }
+
+        /* Numeric addresses are never cached, so there's nothing to
+         * look up ahead of time. */
+        job *j = &r->jobs[(r->job_head + r->job_count) % DEF_QUEUE_SIZE];
+        socket99_set_hints(cfg, &j->hints);
+        if (is_numeric(node, &j->hints)) { continue; }
+        if ((int)sizeof(j->service) <= snprintf(j->service,
+                sizeof(j->service), "%u", cfg->port)) {
+            continue;
+        }
+        j->node = malloc(strlen(node) + 1);
+        if (j->node == NULL) { break; }
+        strcpy(j->node, node);
+        r->job_count++;
+        queued++;
+    }
+
+    pthread_cond_broadcast(&r->job_cond);
+    pthread_mutex_unlock(&r->lock);
+    return queued;
+}
+
+void socket99_resolver_wait(socket99_resolver *r) {
+    if (r == NULL) { return; }
+    pthread_mutex_lock(&r->lock);
+    while ((r->job_count > 0 || r->busy > 0) && r->thread_count > 0) {
+        pthread_cond_wait(&r->idle_cond, &r->lock);
+    }
+    pthread_mutex_unlock(&r->lock);
+}
+
+void socket99_resolver_get_stats(socket99_resolver *r,
+        socket99_resolver_stats *stats) {
+    if (r == NULL || stats == NULL) { return; }
+    pthread_mutex_lock(&r->lock);
+    *stats = r->stats;
+    pthread_mutex_unlock(&r->lock);
+}
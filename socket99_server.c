@@ -0,0 +1,604 @@
+/*
+ * Copyright (c) 2014-17 Scott Vokes <vokes.s@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#include "socket99.h"
+
+#ifdef __linux__
+
+#define DEF_READ_BUFSZ (64 * 1024)
+#define MAX_EVENTS 256
+
+/* Connections accepted per wakeup, and taken from the queue per turn. */
+#define ACCEPT_BATCH 64
+#define ADOPT_BATCH 8
+
+/* After an accept error such as EMFILE, the listener stays readable,
+ * so stop watching it until a connection closes or this long passes. */
+#define ACCEPT_BACKOFF_MSEC 100
+
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
+/* Counters written only by the owning thread, but read by others. */
+#define BUMP(X, N) __atomic_store_n(&(X), \
+        __atomic_load_n(&(X), __ATOMIC_RELAXED) + (N), __ATOMIC_RELAXED)
+#define PEEK(X) __atomic_load_n(&(X), __ATOMIC_RELAXED)
+
+/* Accepted connections not yet taken by a worker. The owner pushes and
+ * pops the newest at the bottom; thieves take the oldest from the top.
+ * Positions only increase; masking gives the slot. */
+typedef struct {
+    pthread_mutex_t lock;
+    int *fds;
+    size_t size;                /* a power of 2 */
+    size_t top;
+    size_t bottom;
+    size_t count;               /* bottom - top, readable without lock */
+} conn_queue;
+
+typedef struct {
+    socket99_server *s;
+    pthread_t thread;
+    bool started;
+    bool idle;                  /* waiting, with nothing queued */
+    int epoll_fd;
+    int wake_fd;                /* eventfd, to wake an idle worker */
+    int listen_fd;
+    bool listen_paused;         /* unwatched after an accept error */
+    uint64_t resume_msec;       /* when to watch it again anyway */
+    conn_queue queue;
+
+    bool *owned;                /* indexed by fd */
+    size_t owned_count;         /* allocated size */
+
+    char *read_buf;
+    struct epoll_event events[MAX_EVENTS];
+    socket99_accepted accepted[ACCEPT_BATCH];
+
+    uint64_t accept_count;
+    uint64_t steal_count;
+    uint64_t close_count;
+    uint64_t read_count;
+    uint64_t pause_count;
+    int error;                  /* errno that stopped the worker, or 0 */
+} worker;
+
+struct socket99_server {
+    socket99_server_config cfg;
+    socket99_server_handlers h;
+    void *udata;
+    socket99_config lcfg;       /* for accepting */
+    int *listen_fds;
+    size_t listen_count;
+    worker *workers;
+    bool stop;
+    int port;
+};
+
+static void queue_push(conn_queue *q, const int *fds, size_t count) {
+    pthread_mutex_lock(&q->lock);
+    if (q->bottom - q->top + count > q->size) {
+        size_t size = q->size ? q->size : 64;
+        while (q->bottom - q->top + count > size) { size *= 2; }
+        int *nfds = malloc(size * sizeof(*nfds));
+        if (nfds == NULL) {
+            pthread_mutex_unlock(&q->lock);
+            for (size_t i = 0; i < count; i++) { close(fds[i]); }
+            return;
+        }
+        size_t n = 0;
+        for (size_t p = q->top; p != q->bottom; p++) {
+            nfds[n++] = q->fds[p & (q->size - 1)];
+        }
+        free(q->fds);
+        q->fds = nfds;
+        q->size = size;
+        q->top = 0;
+        q->bottom = n;
+    }
+    for (size_t i = 0; i < count; i++) {
+        q->fds[q->bottom++ & (q->size - 1)] = fds[i];
+    }
+    __atomic_store_n(&q->count, q->bottom - q->top, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Take up to MAX connections, the newest (for the owner) or the oldest
+ * (for a thief). Returns how many were taken. */
+static size_t queue_take(conn_queue *q, int *fds, size_t max, bool oldest) {
+    pthread_mutex_lock(&q->lock);
+    size_t n = q->bottom - q->top;
+    if (n > max) { n = max; }
+    for (size_t i = 0; i < n; i++) {
+        size_t p = oldest ? q->top++ : --q->bottom;
+        fds[i] = q->fds[p & (q->size - 1)];
+    }
+    __atomic_store_n(&q->count, q->bottom - q->top, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&q->lock);
+    return n;
+}
+
+static size_t queue_count(conn_queue *q) {
+    return PEEK(q->count);
+}
+
+static void wake(worker *w) {
+    uint64_t one = 1;
+    ssize_t res = write(w->wake_fd, &one, sizeof(one));
+    (void)res;                  /* EAGAIN means it's already awake */
+}
+
+/* Grow the ownership table to cover FD. */
+static bool reserve_owned(worker *w, int fd) {
+    if ((size_t)fd < w->owned_count) { return true; }
+    size_t count = w->owned_count ? w->owned_count : 64;
+    while (count <= (size_t)fd) { count *= 2; }
+    bool *no = realloc(w->owned, count * sizeof(*no));
+    if (no == NULL) { return false; }
+    memset(&no[w->owned_count], 0, (count - w->owned_count) * sizeof(*no));
+    w->owned = no;
+    w->owned_count = count;
+    return true;
+}
+
+static uint64_t now_msec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static bool watch_fd(worker *w, int fd, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    return epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+static bool watch_listener(worker *w) {
+    if (w->s->cfg.listen == SOCKET99_LISTEN_PER_WORKER) {
+        return watch_fd(w, w->listen_fd, EPOLLIN);
+    }
+
+    /* EPOLLEXCLUSIVE needs Linux 4.5; without it, every worker wakes
+     * for each connection, and all but one find nothing to accept. */
+    return watch_fd(w, w->listen_fd, EPOLLIN | EPOLLEXCLUSIVE)
+        || (errno == EINVAL && watch_fd(w, w->listen_fd, EPOLLIN));
+}
+
+static void pause_listener(worker *w) {
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, w->listen_fd, NULL) == -1) {
+        return;
+    }
+    w->listen_paused = true;
+    w->resume_msec = now_msec() + ACCEPT_BACKOFF_MSEC;
+    BUMP(w->pause_count, 1);
+}
+
+static void resume_listener(worker *w) {
+    /* If it can't be watched again, retry after another backoff. */
+    if (watch_listener(w)) {
+        w->listen_paused = false;
+    } else {
+        w->resume_msec = now_msec() + ACCEPT_BACKOFF_MSEC;
+    }
+}
+
+static void close_conn(worker *w, int fd, int err) {
+    socket99_server *s = w->s;
+    (void)epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    w->owned[fd] = false;
+    BUMP(w->close_count, 1);
+    if (s->h.on_close) { s->h.on_close(s, fd, err, s->udata); }
+    close(fd);
+
+    /* That freed an fd, so accepting may work again. */
+    if (w->listen_paused) { resume_listener(w); }
+}
+
+/* Read until EAGAIN, handing each chunk to the read handler. */
+static void drain_read(worker *w, int fd) {
+    socket99_server *s = w->s;
+    for (;;) {
+        ssize_t got = recv(fd, w->read_buf, s->cfg.read_bufsz, 0);
+        if (got > 0) {
+            BUMP(w->read_count, 1);
+            s->h.on_read(s, fd, w->read_buf, (size_t)got, s->udata);
+        } else if (got == 0) {
+            close_conn(w, fd, 0);
+            return;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        } else if (errno != EINTR) {
+            close_conn(w, fd, errno);
+            return;
+        }
+    }
+}
+
+/* Make FDS this worker's. Data that arrived while they were queued
+ * shows up as an event right away. */
+static void adopt(worker *w, const int *fds, size_t count) {
+    socket99_server *s = w->s;
+    for (size_t i = 0; i < count; i++) {
+        int fd = fds[i];
+        if (s->h.on_accept && !s->h.on_accept(s, fd, s->udata)) {
+            close(fd);
+            continue;
+        }
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLET | (s->h.on_writable ? EPOLLOUT : 0);
+        ev.data.fd = fd;
+        if (!reserve_owned(w, fd)
+            || epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            close(fd);
+            continue;
+        }
+        w->owned[fd] = true;
+    }
+}
+
+static void accept_batch(worker *w) {
+    socket99_server *s = w->s;
+    int n = socket99_accept_burst(&s->lcfg, w->listen_fd,
+        w->accepted, ACCEPT_BATCH);
+    if (n <= 0) {
+        /* Anything but EAGAIN (EMFILE, ENOBUFS, ...) leaves the
+         * listener readable, so watching it would only spin. */
+        if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK
+            && errno != EINTR) {
+            pause_listener(w);
+        }
+        return;
+    }
+
+    int fds[ACCEPT_BATCH];
+    for (int i = 0; i < n; i++) { fds[i] = w->accepted[i].fd; }
+    queue_push(&w->queue, fds, (size_t)n);
+    BUMP(w->accept_count, (uint64_t)n);
+
+    /* Wake idle workers for whatever this one won't take next turn. */
+    size_t extra = s->cfg.no_steal ? 0 : queue_count(&w->queue) / ADOPT_BATCH;
+    for (size_t i = 0; extra > 0 && i < s->cfg.workers; i++) {
+        worker *o = &s->workers[i];
+        if (o != w && __atomic_load_n(&o->idle, __ATOMIC_ACQUIRE)) {
+            wake(o);
+            extra--;
+        }
+    }
+}
+
+/* Take half the queue of the worker with the most waiting. */
+static void steal(worker *w) {
+    socket99_server *s = w->s;
+    worker *victim = NULL;
+    size_t most = 0;
+    for (size_t i = 0; i < s->cfg.workers; i++) {
+        worker *o = &s->workers[i];
+        size_t count = queue_count(&o->queue);
+        if (o != w && count > most) {
+            victim = o;
+            most = count;
+        }
+    }
+    if (victim == NULL) { return; }
+
+    int fds[ACCEPT_BATCH];
+    size_t want = (most + 1) / 2;
+    if (want > ACCEPT_BATCH) { want = ACCEPT_BATCH; }
+    size_t n = queue_take(&victim->queue, fds, want, true);
+    BUMP(w->steal_count, n);
+    adopt(w, fds, n);
+}
+
+static void *worker_loop(void *arg) {
+    worker *w = (worker *)arg;
+    socket99_server *s = w->s;
+    int fds[ADOPT_BATCH];
+
+    while (!__atomic_load_n(&s->stop, __ATOMIC_ACQUIRE)) {
+        /* Block only with nothing queued, and say so first, so an
+         * accepting worker knows it can hand some over. */
+        bool queued = queue_count(&w->queue) > 0;
+        int timeout = queued ? 0 : -1;
+        if (w->listen_paused) {
+            uint64_t now = now_msec();
+            if (now >= w->resume_msec) { resume_listener(w); }
+            if (w->listen_paused && !queued) {
+                timeout = now >= w->resume_msec
+                    ? ACCEPT_BACKOFF_MSEC : (int)(w->resume_msec - now);
+            }
+        }
+        if (!queued) { __atomic_store_n(&w->idle, true, __ATOMIC_RELEASE); }
+        int count = epoll_wait(w->epoll_fd, w->events, MAX_EVENTS, timeout);
+        __atomic_store_n(&w->idle, false, __ATOMIC_RELEASE);
+        if (count == -1) {
+            if (errno == EINTR) { continue; }
+            /* Not transient (EBADF, EINVAL, ...), so retrying would
+             * only spin. Leave the error for get_stats to report. */
+            __atomic_store_n(&w->error, errno, __ATOMIC_RELEASE);
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            int fd = w->events[i].data.fd;
+            uint32_t ev = w->events[i].events;
+            if (fd == w->wake_fd) {
+                uint64_t v;
+                ssize_t res = read(fd, &v, sizeof(v));
+                (void)res;
+            } else if (fd == w->listen_fd) {
+                accept_batch(w);
+            } else if ((size_t)fd < w->owned_count && w->owned[fd]) {
+                if ((ev & EPOLLOUT) && s->h.on_writable) {
+                    s->h.on_writable(s, fd, s->udata);
+                }
+                if (ev & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    /* Errors and hangups surface through recv. */
+                    drain_read(w, fd);
+                }
+            }
+        }
+
+        size_t n = queue_take(&w->queue, fds, ADOPT_BATCH, false);
+        adopt(w, fds, n);
+        if (n == 0 && !s->cfg.no_steal) { steal(w); }
+    }
+    return NULL;
+}
+
+static void queue_close_all(conn_queue *q) {
+    for (size_t p = q->top; p != q->bottom; p++) {
+        close(q->fds[p & (q->size - 1)]);
+    }
+    free(q->fds);
+}
+
+void socket99_server_free(socket99_server *s) {
+    if (s == NULL) { return; }
+    __atomic_store_n(&s->stop, true, __ATOMIC_RELEASE);
+    for (size_t i = 0; s->workers && i < s->cfg.workers; i++) {
+        if (s->workers[i].wake_fd != -1) { wake(&s->workers[i]); }
+    }
+    for (size_t i = 0; s->workers && i < s->cfg.workers; i++) {
+        worker *w = &s->workers[i];
+        if (w->started) { pthread_join(w->thread, NULL); }
+        for (size_t fd = 0; fd < w->owned_count; fd++) {
+            if (w->owned[fd]) { close((int)fd); }
+        }
+        queue_close_all(&w->queue);
+        pthread_mutex_destroy(&w->queue.lock);
+        if (w->epoll_fd != -1) { close(w->epoll_fd); }
+        if (w->wake_fd != -1) { close(w->wake_fd); }
+        free(w->owned);
+        free(w->read_buf);
+    }
+    for (size_t i = 0; i < s->listen_count; i++) {
+        close(s->listen_fds[i]);
+    }
+    free(s->listen_fds);
+    free(s->workers);
+    free(s);
+}
+
+static int bound_port(int fd) {
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    if (getsockname(fd, (struct sockaddr *)&ss, &len) == -1) { return -1; }
+    if (ss.ss_family == AF_INET) {
+        return ntohs(((struct sockaddr_in *)&ss)->sin_port);
+    } else if (ss.ss_family == AF_INET6) {
+        return ntohs(((struct sockaddr_in6 *)&ss)->sin6_port);
+    }
+    return -1;
+}
+
+/* Open the listeners, into S->listen_fds. */
+static bool open_listeners(socket99_server *s, socket99_result *res) {
+    size_t count = s->cfg.listen == SOCKET99_LISTEN_PER_WORKER
+        ? s->cfg.workers : 1;
+    socket99_result *results = calloc(count, sizeof(*results));
+    s->listen_fds = calloc(count, sizeof(*s->listen_fds));
+    if (results == NULL || s->listen_fds == NULL) {
+        free(results);
+        res->status = SOCKET99_ERROR_UNKNOWN;
+        res->saved_errno = ENOMEM;
+        return false;
+    }
+
+    bool ok = count == 1
+        ? socket99_open(&s->lcfg, &results[0])
+        : socket99_open_group(&s->lcfg, results, count, false);
+    if (ok) {
+        for (size_t i = 0; i < count; i++) {
+            s->listen_fds[i] = results[i].fd;
+        }
+        s->listen_count = count;
+        *res = results[0];
+    } else {
+        *res = results[0];
+        for (size_t i = 0; i < count; i++) {
+            if (results[i].status != SOCKET99_OK) {
+                *res = results[i];
+                break;
+            }
+        }
+    }
+    free(results);
+    return ok;
+}
+
+static bool init_worker(socket99_server *s, size_t i) {
+    worker *w = &s->workers[i];
+    w->s = s;
+    w->read_buf = malloc(s->cfg.read_bufsz);
+    w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    w->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (w->read_buf == NULL || w->epoll_fd == -1 || w->wake_fd == -1) {
+        return false;
+    }
+    if (!watch_fd(w, w->wake_fd, EPOLLIN)) { return false; }
+
+    w->listen_fd = s->cfg.listen == SOCKET99_LISTEN_PER_WORKER
+        ? s->listen_fds[i] : s->listen_fds[0];
+    return watch_listener(w);
+}
+
+socket99_server *socket99_server_new(socket99_config *cfg,
+        const socket99_server_config *scfg,
+        const socket99_server_handlers *handlers, void *udata,
+        socket99_result *res) {
+    if (res == NULL) { return NULL; }
+    memset(res, 0, sizeof(*res));
+    res->fd = -1;
+    if (cfg == NULL || handlers == NULL || handlers->on_read == NULL
+        || !cfg->server || cfg->datagram
+        || (scfg && scfg->listen != SOCKET99_LISTEN_SHARED
+            && scfg->listen != SOCKET99_LISTEN_PER_WORKER)) {
+        res->status = SOCKET99_ERROR_CONFIGURATION;
+        return NULL;
+    }
+
+    socket99_server *s = calloc(1, sizeof(*s));
+    if (s == NULL) {
+        res->status = SOCKET99_ERROR_UNKNOWN;
+        res->saved_errno = ENOMEM;
+        return NULL;
+    }
+    if (scfg) { s->cfg = *scfg; }
+    if (s->cfg.workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        s->cfg.workers = cpus > 0 ? (size_t)cpus : 1;
+    }
+    if (s->cfg.read_bufsz == 0) { s->cfg.read_bufsz = DEF_READ_BUFSZ; }
+    s->h = *handlers;
+    s->udata = udata;
+    s->lcfg = *cfg;
+    s->lcfg.nonblocking = true;
+    s->lcfg.cloexec = true;
+
+    if (!open_listeners(s, res)) {
+        free(s->listen_fds);
+        free(s);
+        return NULL;
+    }
+    s->port = bound_port(s->listen_fds[0]);
+
+    s->workers = calloc(s->cfg.workers, sizeof(*s->workers));
+    bool ok = s->workers != NULL;
+    for (size_t i = 0; ok && i < s->cfg.workers; i++) {
+        s->workers[i].epoll_fd = s->workers[i].wake_fd = -1;
+        pthread_mutex_init(&s->workers[i].queue.lock, NULL);
+    }
+    for (size_t i = 0; ok && i < s->cfg.workers; i++) {
+        ok = init_worker(s, i);
+    }
+    for (size_t i = 0; ok && i < s->cfg.workers; i++) {
+        worker *w = &s->workers[i];
+        errno = pthread_create(&w->thread, NULL, worker_loop, w);
+        ok = w->started = (errno == 0);
+    }
+    if (!ok) {
+        int saved_errno = errno ? errno : ENOMEM;
+        socket99_server_free(s);
+        res->status = SOCKET99_ERROR_UNKNOWN;
+        res->saved_errno = saved_errno;
+        res->fd = -1;
+        errno = 0;
+        return NULL;
+    }
+    return s;
+}
+
+int socket99_server_port(socket99_server *s) {
+    return s ? s->port : -1;
+}
+
+void socket99_server_get_stats(socket99_server *s,
+        socket99_server_stats *stats) {
+    if (s == NULL || stats == NULL) { return; }
+    memset(stats, 0, sizeof(*stats));
+    for (size_t i = 0; i < s->cfg.workers; i++) {
+        worker *w = &s->workers[i];
+        stats->accepted += PEEK(w->accept_count);
+        stats->stolen += PEEK(w->steal_count);
+        stats->closed += PEEK(w->close_count);
+        stats->reads += PEEK(w->read_count);
+        stats->accept_pauses += PEEK(w->pause_count);
+        int err = __atomic_load_n(&w->error, __ATOMIC_ACQUIRE);
+        if (err != 0) {
+            stats->failed_workers++;
+            stats->worker_errno = err;
+        }
+    }
+}
+
+#else
+
+/* The server needs epoll(7); elsewhere, it reports ENOTSUP. */
+
+socket99_server *socket99_server_new(socket99_config *cfg,
+        const socket99_server_config *scfg,
+        const socket99_server_handlers *handlers, void *udata,
+        socket99_result *res) {
+    (void)cfg;
+    (void)scfg;
+    (void)handlers;
+    (void)udata;
+    if (res != NULL) {
+        memset(res, 0, sizeof(*res));
+        res->status = SOCKET99_ERROR_UNSUPPORTED;
+        res->saved_errno = ENOTSUP;
+    }
+    return NULL;
+}
+
+void socket99_server_free(socket99_server *s) { (void)s; }
+
+int socket99_server_port(socket99_server *s) {
+    (void)s;
+    return -1;
+}
+
+void socket99_server_get_stats(socket99_server *s,
+        socket99_server_stats *stats) {
+    (void)s;
+    if (stats != NULL) { memset(stats, 0, sizeof(*stats)); }
+}
+
+#endif
@@ -0,0 +1,564 @@
+/*
+ * Copyright (c) 2014-17 Scott Vokes <vokes.s@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* memfd_create(2), file seals, POLLRDHUP, and MSG_CMSG_CLOEXEC are
+ * hidden by strict _POSIX_C_SOURCE. */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#endif
+
+#include "socket99.h"
+
+#ifdef __linux__
+
+#define DEF_RING_SIZE (1024 * 1024)
+#define DEF_SPIN_USEC 50
+#define MIN_RING_SIZE 4096
+
+/* Each ring's header gets a page, so its data is page aligned. */
+#define HDR_SIZE 4096
+
+#define SHM_MAGIC 0x53393953        /* "S99S" */
+#define SHM_VERSION 1
+
+/* The memfd's size can't change once offered, so neither end can be
+ * made to fault on its mapping. */
+#define SHM_SEALS (F_SEAL_SHRINK | F_SEAL_GROW)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#else
+#define CPU_RELAX()
+#endif
+
+#define LOAD(X) __atomic_load_n(&(X), __ATOMIC_ACQUIRE)
+#define STORE(X, V) __atomic_store_n(&(X), (V), __ATOMIC_RELEASE)
+
+/* A counter on its own cache line, so the two ends don't contend. */
+typedef struct {
+    uint64_t v;
+    char pad[56];
+} line;
+
+/* Positions only ever increase; masking gives the offset. */
+typedef struct {
+    line head;                  /* bytes written, by the producer */
+    line tail;                  /* bytes read, by the consumer */
+    line reader_waiting;        /* the consumer is (about to be) asleep */
+    line writer_waiting;        /* ... or the producer is */
+    line closed;                /* the producer's end is gone */
+} ring;
+
+/* Sent by the offering end with the fds, and sent back with ok set
+ * (or not) by the accepting end. */
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t ok;
+    uint64_t ring_size;
+} hello;
+
+enum { FD_MEM, FD_OFFERER, FD_ACCEPTER, FD_COUNT };
+
+struct socket99_shm {
+    socket99_shm_config cfg;
+    int sock;
+    int memfd;
+    int doorbell;               /* eventfd the peer rings to wake us */
+    int peer_doorbell;
+    char *map;
+    size_t map_size;
+    size_t size;                /* of each ring's data */
+    ring *out;
+    ring *in;
+    char *out_data;
+    char *in_data;
+    int spin_max;
+    int spin_usec;              /* current spin budget */
+    bool peer_gone;
+    bool broken;                /* the peer corrupted a ring's indices */
+    socket99_shm_stats stats;
+};
+
+static void set_defaults(socket99_shm_config *c,
+        const socket99_shm_config *cfg) {
+    memset(c, 0, sizeof(*c));
+    if (cfg) { *c = *cfg; }
+    if (c->ring_size == 0) { c->ring_size = DEF_RING_SIZE; }
+    if (c->spin_usec == 0) { c->spin_usec = DEF_SPIN_USEC; }
+}
+
+static void close_fds(int *fds, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (fds[i] != -1) { close(fds[i]); }
+    }
+}
+
+void socket99_shm_free(socket99_shm *s) {
+    if (s == NULL) { return; }
+    if (s->map != NULL) {
+        STORE(s->out->closed.v, 1);
+        uint64_t one = 1;
+        ssize_t res = write(s->peer_doorbell, &one, sizeof(one));
+        (void)res;
+        munmap(s->map, s->map_size);
+    }
+    int fds[] = { s->memfd, s->doorbell, s->peer_doorbell };
+    close_fds(fds, 3);
+    free(s);
+}
+
+/* Map the rings; ring 0 carries data from the offering end. */
+static socket99_shm *new_end(int sock, const socket99_shm_config *cfg,
+        size_t ring_size, int *fds, bool offerer) {
+    socket99_shm *s = calloc(1, sizeof(*s));
+    if (s == NULL) { return NULL; }
+    s->cfg = *cfg;
+    s->sock = sock;
+    s->memfd = fds[FD_MEM];
+    s->doorbell = fds[offerer ? FD_OFFERER : FD_ACCEPTER];
+    s->peer_doorbell = fds[offerer ? FD_ACCEPTER : FD_OFFERER];
+    for (int i = 0; i < FD_COUNT; i++) { fds[i] = -1; }
+
+    s->size = ring_size;
+    s->map_size = 2 * (HDR_SIZE + ring_size);
+    void *map = mmap(NULL, s->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+        s->memfd, 0);
+    if (map == MAP_FAILED) {
+        int saved_errno = errno;
+        socket99_shm_free(s);
+        errno = saved_errno;
+        return NULL;
+    }
+    s->map = map;
+    char *rings[2] = { s->map, s->map + HDR_SIZE + ring_size };
+    s->out = (ring *)rings[offerer ? 0 : 1];
+    s->in = (ring *)rings[offerer ? 1 : 0];
+    s->out_data = (char *)s->out + HDR_SIZE;
+    s->in_data = (char *)s->in + HDR_SIZE;
+
+    /* Spinning only helps if the peer can run at the same time. */
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    s->spin_max = cpus > 1 && cfg->spin_usec > 0 ? cfg->spin_usec : 0;
+    s->spin_usec = s->spin_max;
+    return s;
+}
+
+static bool send_hello(int sock, hello *h, int *fds, size_t fd_count) {
+    struct iovec iov = { .iov_base = h, .iov_len = sizeof(*h) };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(FD_COUNT * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd_count > 0) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(fd_count * sizeof(int));
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+        memcpy(CMSG_DATA(cm), fds, fd_count * sizeof(int));
+    }
+    ssize_t sent;
+    do {
+        sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (sent == -1 && errno == EINTR);
+    if (sent == (ssize_t)sizeof(*h)) { return true; }
+    if (sent >= 0) { errno = EPROTO; }
+    return false;
+}
+
+/* Receive a hello, and up to FD_COUNT fds into FDS (the rest -1). */
+static bool recv_hello(int sock, hello *h, int *fds) {
+    struct iovec iov = { .iov_base = h, .iov_len = sizeof(*h) };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(FD_COUNT * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    for (int i = 0; i < FD_COUNT; i++) { fds[i] = -1; }
+
+    int flags = MSG_WAITALL;
+#ifdef MSG_CMSG_CLOEXEC
+    flags |= MSG_CMSG_CLOEXEC;
+#endif
+    ssize_t got;
+    do {
+        got = recvmsg(sock, &msg, flags);
+    } while (got == -1 && errno == EINTR);
+    if (got == -1) { return false; }
+
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (cm != NULL && cm->cmsg_level == SOL_SOCKET
+        && cm->cmsg_type == SCM_RIGHTS) {
+        size_t n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (n > FD_COUNT) { n = FD_COUNT; }
+        memcpy(fds, CMSG_DATA(cm), n * sizeof(int));
+    }
+    if (got != (ssize_t)sizeof(*h) || (msg.msg_flags & MSG_CTRUNC)
+        || h->magic != SHM_MAGIC || h->version != SHM_VERSION) {
+        errno = EPROTO;
+        return false;
+    }
+    return true;
+}
+
+socket99_shm *socket99_shm_offer(int sock, const socket99_shm_config *cfg) {
+    socket99_shm_config c;
+    set_defaults(&c, cfg);
+    size_t size = MIN_RING_SIZE;
+    while (size < c.ring_size && size <= SIZE_MAX / 4) { size *= 2; }
+    if (size < c.ring_size) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    int fds[FD_COUNT];
+    fds[FD_MEM] = memfd_create("socket99_shm",
+        MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    fds[FD_OFFERER] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    fds[FD_ACCEPTER] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    hello h = {
+        .magic = SHM_MAGIC,
+        .version = SHM_VERSION,
+        .ok = 1,
+        .ring_size = size,
+    };
+    hello reply;
+    int none[FD_COUNT] = { -1, -1, -1 };
+    bool ok = fds[FD_MEM] != -1 && fds[FD_OFFERER] != -1
+        && fds[FD_ACCEPTER] != -1
+        && ftruncate(fds[FD_MEM], (off_t)(2 * (HDR_SIZE + size))) == 0
+        && fcntl(fds[FD_MEM], F_ADD_SEALS, SHM_SEALS) == 0
+        && send_hello(sock, &h, fds, FD_COUNT)
+        && recv_hello(sock, &reply, none);
+    close_fds(none, FD_COUNT);
+    if (ok && !reply.ok) {
+        errno = EPROTO;
+        ok = false;
+    }
+    socket99_shm *s = ok ? new_end(sock, &c, size, fds, true) : NULL;
+    if (s == NULL) {
+        int saved_errno = errno;
+        close_fds(fds, FD_COUNT);
+        errno = saved_errno;
+    }
+    return s;
+}
+
+/* Check that FD's size is sealed, so the offering end can't shrink it
+ * under our mapping. Plain files can't be sealed at all. */
+static bool has_seals(int fd) {
+    int seals = fcntl(fd, F_GET_SEALS);
+    return seals != -1 && (seals & SHM_SEALS) == SHM_SEALS;
+}
+
+socket99_shm *socket99_shm_accept(int sock, const socket99_shm_config *cfg) {
+    socket99_shm_config c;
+    set_defaults(&c, cfg);
+
+    hello h;
+    int fds[FD_COUNT];
+    bool valid = recv_hello(sock, &h, fds);
+    if (!valid && errno != EPROTO) {
+        int saved_errno = errno;
+        close_fds(fds, FD_COUNT);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    /* Check the offer before trusting its size. */
+    struct stat st;
+    size_t size = (size_t)h.ring_size;
+    valid = valid && fds[FD_ACCEPTER] != -1 && h.ok
+        && size >= MIN_RING_SIZE && (size & (size - 1)) == 0
+        && size <= SIZE_MAX / 4
+        && has_seals(fds[FD_MEM])
+        && fstat(fds[FD_MEM], &st) == 0
+        && (uint64_t)st.st_size >= 2 * (HDR_SIZE + (uint64_t)size);
+    socket99_shm *s = valid ? new_end(sock, &c, size, fds, false) : NULL;
+    int saved_errno = valid ? errno : EPROTO;
+    close_fds(fds, FD_COUNT);
+
+    hello reply = {
+        .magic = SHM_MAGIC,
+        .version = SHM_VERSION,
+        .ok = s != NULL,
+        .ring_size = h.ring_size,
+    };
+    if (!send_hello(sock, &reply, NULL, 0) && s != NULL) {
+        saved_errno = errno;
+        socket99_shm_free(s);
+        s = NULL;
+    }
+    if (s == NULL) { errno = saved_errno; }
+    return s;
+}
+
+/* Ready unless the ring is exactly full, so bad indices are noticed. */
+static bool can_send(socket99_shm *s) {
+    return s->out->head.v - LOAD(s->out->tail.v) != s->size
+        || LOAD(s->in->closed.v) || s->peer_gone;
+}
+
+static bool can_recv(socket99_shm *s) {
+    return LOAD(s->in->head.v) != s->in->tail.v
+        || LOAD(s->in->closed.v) || s->peer_gone;
+}
+
+static uint64_t now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/* Spin until READY, for up to the current budget. The budget doubles
+ * after a spin pays off and halves after one doesn't. */
+static bool spin(socket99_shm *s, bool (*ready)(socket99_shm *)) {
+    if (s->spin_usec <= 0) { return false; }
+    uint64_t until = now_usec() + (uint64_t)s->spin_usec;
+    for (unsigned i = 1; ; i++) {
+        if (ready(s)) {
+            s->stats.spins++;
+            s->spin_usec = s->spin_usec * 2 > s->spin_max
+                ? s->spin_max : s->spin_usec * 2;
+            return true;
+        }
+        CPU_RELAX();
+        if (i % 64 == 0 && now_usec() >= until) { break; }
+    }
+    if (s->spin_usec > 1) { s->spin_usec /= 2; }
+    return false;
+}
+
+/* Wait until READY, spinning and then sleeping with WAITING set so the
+ * peer wakes us. Returns false with errno set to EAGAIN if nonblocking,
+ * or to a poll(2) error. */
+static bool wait_for(socket99_shm *s, bool (*ready)(socket99_shm *),
+        line *waiting) {
+    if (ready(s) || spin(s, ready)) { return true; }
+
+    for (;;) {
+        /* Clear old wakeups, say we're going to sleep, then check once
+         * more, so a peer that missed the flag has already made us
+         * ready. */
+        uint64_t v;
+        ssize_t res = read(s->doorbell, &v, sizeof(v));
+        (void)res;
+        __atomic_store_n(&waiting->v, 1, __ATOMIC_SEQ_CST);
+        if (ready(s)) {
+            __atomic_store_n(&waiting->v, 0, __ATOMIC_RELAXED);
+            return true;
+        }
+        if (s->cfg.nonblocking) {
+            errno = EAGAIN;
+            return false;
+        }
+
+        /* Only a hangup on the socket means the peer is gone; any data
+         * on it is left for the caller. */
+        s->stats.sleeps++;
+        struct pollfd pfds[2] = {
+            { s->doorbell, POLLIN, 0 },
+            { s->sock, POLLRDHUP, 0 },
+        };
+        if (poll(pfds, 2, -1) == -1 && errno != EINTR) { return false; }
+        if (pfds[1].revents & (POLLRDHUP | POLLHUP | POLLERR | POLLNVAL)) {
+            s->peer_gone = true;
+        }
+        __atomic_store_n(&waiting->v, 0, __ATOMIC_RELAXED);
+        if (ready(s)) { return true; }
+    }
+}
+
+/* The ring's indices live in memory the peer can write, so a used
+ * count beyond its size means the peer is broken (or hostile). Stop
+ * using the channel, and tell the peer it's closed. */
+static bool check_used(socket99_shm *s, uint64_t used) {
+    if (used <= s->size && !s->broken) { return true; }
+    if (!s->broken) {
+        s->broken = true;
+        STORE(s->out->closed.v, 1);
+        uint64_t one = 1;
+        ssize_t res = write(s->peer_doorbell, &one, sizeof(one));
+        (void)res;
+    }
+    errno = EPROTO;
+    return false;
+}
+
+/* Wake the peer if it's asleep waiting on WAITING. */
+static void wake_peer(socket99_shm *s, line *waiting) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&waiting->v, __ATOMIC_RELAXED)
+        && __atomic_exchange_n(&waiting->v, 0, __ATOMIC_RELAXED)) {
+        uint64_t one = 1;
+        ssize_t res = write(s->peer_doorbell, &one, sizeof(one));
+        (void)res;
+        s->stats.wakeups++;
+    }
+}
+
+ssize_t socket99_shm_send(socket99_shm *s, const void *buf, size_t len) {
+    if (s == NULL || (buf == NULL && len > 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    const char *p = buf;
+    size_t done = 0;
+    while (done < len) {
+        if (LOAD(s->in->closed.v) || s->peer_gone) {
+            if (done > 0) { break; }
+            errno = EPIPE;
+            return -1;
+        }
+        uint64_t head = s->out->head.v;
+        uint64_t used = head - LOAD(s->out->tail.v);
+        if (!check_used(s, used)) { return done > 0 ? (ssize_t)done : -1; }
+        size_t space = s->size - (size_t)used;
+        if (space == 0) {
+            if (s->cfg.nonblocking && done > 0) { break; }
+            if (!wait_for(s, can_send, &s->out->writer_waiting)) {
+                return done > 0 ? (ssize_t)done : -1;
+            }
+            continue;
+        }
+
+        size_t n = len - done < space ? len - done : space;
+        size_t off = (size_t)head & (s->size - 1);
+        size_t first = s->size - off < n ? s->size - off : n;
+        memcpy(s->out_data + off, p + done, first);
+        memcpy(s->out_data, p + done + first, n - first);
+        STORE(s->out->head.v, head + n);
+        done += n;
+        s->stats.sent += n;
+        wake_peer(s, &s->out->reader_waiting);
+    }
+    return (ssize_t)done;
+}
+
+ssize_t socket99_shm_recv(socket99_shm *s, void *buf, size_t len) {
+    if (s == NULL || (buf == NULL && len > 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (;;) {
+        /* Check closed before head: the peer sets it last. */
+        bool closed = LOAD(s->in->closed.v) || s->peer_gone;
+        uint64_t tail = s->in->tail.v;
+        uint64_t used = LOAD(s->in->head.v) - tail;
+        if (!check_used(s, used)) { return -1; }
+        size_t avail = (size_t)used;
+        if (avail > 0) {
+            size_t n = len < avail ? len : avail;
+            size_t off = (size_t)tail & (s->size - 1);
+            size_t first = s->size - off < n ? s->size - off : n;
+            memcpy(buf, s->in_data + off, first);
+            memcpy((char *)buf + first, s->in_data, n - first);
+            STORE(s->in->tail.v, tail + n);
+            s->stats.received += n;
+            wake_peer(s, &s->in->writer_waiting);
+            return (ssize_t)n;
+        }
+        if (closed || len == 0) { return 0; }
+        if (!wait_for(s, can_recv, &s->in->reader_waiting)) { return -1; }
+    }
+}
+
+int socket99_shm_fd(socket99_shm *s) {
+    return s ? s->doorbell : -1;
+}
+
+void socket99_shm_get_stats(socket99_shm *s, socket99_shm_stats *stats) {
+    if (s == NULL || stats == NULL) { return; }
+    *stats = s->stats;
+}
+
+#else
+
+/* The channel needs memfd_create(2) and eventfd(2); elsewhere, it
+ * reports ENOTSUP. */
+
+socket99_shm *socket99_shm_offer(int sock, const socket99_shm_config *cfg) {
+    (void)sock;
+    (void)cfg;
+    errno = ENOTSUP;
+    return NULL;
+}
+
+socket99_shm *socket99_shm_accept(int sock, const socket99_shm_config *cfg) {
+    (void)sock;
+    (void)cfg;
+    errno = ENOTSUP;
+    return NULL;
+}
+
+ssize_t socket99_shm_send(socket99_shm *s, const void *buf, size_t len) {
+    (void)s;
+    (void)buf;
+    (void)len;
+    errno = ENOTSUP;
+    return -1;
+}
+
+ssize_t socket99_shm_recv(socket99_shm *s, void *buf, size_t len) {
+    (void)s;
+    (void)buf;
+    (void)len;
+    errno = ENOTSUP;
+    return -1;
+}
+
+int socket99_shm_fd(socket99_shm *s) {
+    (void)s;
+    return -1;
+}
+
+void socket99_shm_get_stats(socket99_shm *s, socket99_shm_stats *stats) {
+    (void)s;
+    if (stats != NULL) { memset(stats, 0, sizeof(*stats)); }
+}
+
+void socket99_shm_free(socket99_shm *s) { (void)s; }
+
+#endif
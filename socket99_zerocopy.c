@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2014-17 Scott Vokes <vokes.s@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
+
+#include "socket99.h"
+
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) \
+    && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define HAVE_ZEROCOPY 1
+#endif
+
+#define DEF_INFLIGHT 64
+
+/* Sends pinning one buffer. The kernel numbers each successful
+ * MSG_ZEROCOPY send on a socket, starting from 0, and reports finished
+ * sends as ranges of those numbers. */
+typedef struct {
+    void *tag;
+    uint32_t lo;                /* first send's number */
+    uint32_t hi;                /* last send's number */
+    uint32_t remaining;         /* sends not yet reported */
+} inflight;
+
+struct socket99_zc {
+    int fd;
+    size_t copy_threshold;
+    bool enabled;               /* SO_ZEROCOPY is set on fd */
+    uint32_t next_seq;
+
+    /* Ring of pinned buffers, oldest first. */
+    inflight *ring;
+    size_t ring_size;           /* a power of 2 */
+    size_t head;
+    size_t count;
+
+    socket99_zc_stats stats;
+};
+
+socket99_zc *socket99_zc_new(int fd, size_t copy_threshold) {
+    if (fd < 0) {
+        errno = EBADF;
+        return NULL;
+    }
+    socket99_zc *zc = calloc(1, sizeof(*zc));
+    if (zc == NULL) { return NULL; }
+    zc->fd = fd;
+    zc->copy_threshold = copy_threshold ? copy_threshold
+        : SOCKET99_DEF_ZC_THRESHOLD;
+    zc->ring_size = DEF_INFLIGHT;
+    zc->ring = calloc(zc->ring_size, sizeof(*zc->ring));
+    if (zc->ring == NULL) {
+        free(zc);
+        return NULL;
+    }
+
+#ifdef HAVE_ZEROCOPY
+    int enabled = 0;
+    socklen_t len = sizeof(enabled);
+    if (getsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &enabled, &len) == 0) {
+        zc->enabled = enabled != 0;
+    }
+#endif
+    errno = 0;
+    return zc;
+}
+
+void socket99_zc_free(socket99_zc *zc) {
+    if (zc == NULL) { return; }
+    free(zc->ring);
+    free(zc);
+}
+
+static inflight *ring_at(socket99_zc *zc, size_t i) {
+    return &zc->ring[(zc->head + i) & (zc->ring_size - 1)];
+}
+
+#ifdef HAVE_ZEROCOPY
+/* Make room to track one more pinned buffer. */
+static bool reserve(socket99_zc *zc) {
+    if (zc->count < zc->ring_size) { return true; }
+    size_t size = 2 * zc->ring_size;
+    inflight *nr = malloc(size * sizeof(*nr));
+    if (nr == NULL) { return false; }
+    for (size_t i = 0; i < zc->count; i++) { nr[i] = *ring_at(zc, i); }
+    free(zc->ring);
+    zc->ring = nr;
+    zc->ring_size = size;
+    zc->head = 0;
+    return true;
+}
+
+/* Note send number SEQ as pinning TAG. There must be room reserved. */
+static void track(socket99_zc *zc, void *tag, uint32_t seq) {
+    if (zc->count > 0) {
+        inflight *last = ring_at(zc, zc->count - 1);
+        if (last->tag == tag) {
+            last->hi = seq;
+            last->remaining++;
+            return;
+        }
+    }
+
+    inflight *f = ring_at(zc, zc->count++);
+    f->tag = tag;
+    f->lo = seq;
+    f->hi = seq;
+    f->remaining = 1;
+}
+#endif
+
+ssize_t socket99_zc_send(socket99_zc *zc, const void *buf, size_t len,
+        void *tag, bool *pinned) {
+    if (pinned) { *pinned = false; }
+    if (zc == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+#ifdef HAVE_ZEROCOPY
+    if (zc->enabled && len >= zc->copy_threshold) {
+        if (!reserve(zc)) { return -1; }
+        ssize_t sent = send(zc->fd, buf, len, MSG_ZEROCOPY | MSG_NOSIGNAL);
+        if (sent >= 0) {
+            /* Even a send that only queued part of BUF takes a number. */
+            zc->stats.zerocopy_sends++;
+            track(zc, tag, zc->next_seq++);
+            if (pinned) { *pinned = true; }
+            return sent;
+        }
+        /* ENOBUFS means the socket's limit on pinned memory was hit;
+         * send this one the ordinary way. */
+        if (errno != ENOBUFS) { return -1; }
+    }
+    ssize_t sent = send(zc->fd, buf, len, MSG_NOSIGNAL);
+#else
+    ssize_t sent = send(zc->fd, buf, len, 0);
+#endif
+    if (sent >= 0) { zc->stats.copied_sends++; }
+    return sent;
+}
+
+#ifdef HAVE_ZEROCOPY
+/* Mark the sends numbered LO through HI (inclusive) as finished. */
+static void complete_range(socket99_zc *zc, uint32_t lo, uint32_t hi) {
+    /* Compare relative to the oldest send, so wrapping is fine. */
+    uint32_t base = zc->count > 0 ? ring_at(zc, 0)->lo : 0;
+    uint32_t a = lo - base, b = hi - base;
+    for (size_t i = 0; i < zc->count; i++) {
+        inflight *f = ring_at(zc, i);
+        uint32_t flo = f->lo - base, fhi = f->hi - base;
+        if (flo > b) { break; }
+        if (fhi < a) { continue; }
+        uint32_t from = flo > a ? flo : a;
+        uint32_t to = fhi < b ? fhi : b;
+        f->remaining -= (to - from) + 1;
+    }
+}
+#endif
+
+int socket99_zc_reap(socket99_zc *zc, void **tags, size_t count) {
+    if (zc == NULL || (tags == NULL && count > 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+#ifdef HAVE_ZEROCOPY
+    /* Drain the error queue; reading it never blocks. */
+    while (zc->count > 0) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err))
+            + CMSG_SPACE(sizeof(struct sockaddr_in6))];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(zc->fd, &msg, MSG_ERRQUEUE) == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { break; }
+            if (errno == EINTR) { continue; }
+            return -1;
+        }
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+             cm = CMSG_NXTHDR(&msg, cm)) {
+            bool recverr = (cm->cmsg_level == SOL_IP
+                    && cm->cmsg_type == IP_RECVERR)
+                || (cm->cmsg_level == SOL_IPV6
+                    && cm->cmsg_type == IPV6_RECVERR);
+            if (!recverr) { continue; }
+
+            struct sock_extended_err ee;
+            memcpy(&ee, CMSG_DATA(cm), sizeof(ee));
+            if (ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY || ee.ee_errno != 0) {
+                continue;
+            }
+            /* One notification covers a range of sends. */
+            uint32_t n = ee.ee_data - ee.ee_info + 1;
+            zc->stats.notifications++;
+            if (ee.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                zc->stats.kernel_copies += n;
+            }
+            complete_range(zc, ee.ee_info, ee.ee_data);
+        }
+    }
+#endif
+
+    /* Hand back buffers in order, stopping at the first still pinned. */
+    size_t n = 0;
+    while (n < count && zc->count > 0 && ring_at(zc, 0)->remaining == 0) {
+        tags[n++] = ring_at(zc, 0)->tag;
+        zc->head = (zc->head + 1) & (zc->ring_size - 1);
+        zc->count--;
+    }
+    errno = 0;
+    return (int)n;
+}
+
+size_t socket99_zc_pending(socket99_zc *zc) {
+    return zc ? zc->count : 0;
+}
+
+void socket99_zc_get_stats(socket99_zc *zc, socket99_zc_stats *stats) {
+    if (zc == NULL || stats == NULL) { return; }
+    *stats = zc->stats;
+}
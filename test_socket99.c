@@ -6,7 +6,14 @@
 #include <err.h>
 #include <errno.h>
 #include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
 
 #include "socket99.h"
 
@@ -26,6 +33,7 @@ typedef struct {
 
 bool tcp_client(void);
 bool tcp_client_nonblocking(void);
+bool tcp_client_async(void);
 bool tcp_server(void);
 bool tcp_server_nonblocking(void);
 bool udp_client(void);
@@ -34,6 +42,30 @@ bool unix_client_stream(void);
 bool unix_client_datagram(void);
 bool unix_server_stream(void);
 bool unix_server_datagram(void);
+bool listener_group(void);
+bool accept_flags(void);
+bool resolver_cache(void);
+bool pool_reuse(void);
+bool loop_echo(void);
+bool io_echo(void);
+bool udp_batch(void);
+bool zerocopy_send(void);
+bool relay_splice(void);
+bool sockopt_levels(void);
+bool tcp_profiles(void);
+bool tcp_fastopen(void);
+bool dual_stack(void);
+bool cpu_affinity(void);
+bool accept_burst(void);
+bool open_stats(void);
+bool restart_handoff(void);
+bool inherit_fds(void);
+bool bufpool_read(void);
+bool framer_split(void);
+bool outq_coalesce(void);
+bool server_workers(void);
+bool open_many(void);
+bool shm_channel(void);
 
 ssize_t read_and_print(int fd);
 
@@ -45,6 +77,8 @@ static test_case_info info[] = {
       "connect to 127.0.0.1:PORT via TCP and send \"hello\\n\"" },
     { F(tcp_client_nonblocking),
       "connect to 127.0.0.1:PORT via TCP and send \"hello\\n\" (nonblocking)" },
+    { F(tcp_client_async),
+      "connect to localhost:PORT via TCP, racing all addresses, and send \"hello\\n\"" },
     { F(tcp_server),
       "listen on 127.0.0.1:PORT via TCP and print client's message" },
     //{ tcp_server_def_port, "listen on 127.0.0.1 via TCP and print port and client's messages" },
@@ -62,6 +96,54 @@ static test_case_info info[] = {
       "listen on 'test_foo' socket and print clients' message (stream)" },
     { F(unix_server_datagram),
       "listen on 'test_foo' socket and print clients' message (datagram)" },
+    { F(listener_group),
+      "open a SO_REUSEPORT group on 127.0.0.1:PORT and accept a client" },
+    { F(accept_flags),
+      "check nonblocking and cloexec flags on a listener and accepted client" },
+    { F(resolver_cache),
+      "connect to localhost:PORT twice through a caching resolver" },
+    { F(pool_reuse),
+      "check out, return, and reuse pooled connections to 127.0.0.1:PORT" },
+    { F(loop_echo),
+      "echo a client's message from an event loop on 127.0.0.1:PORT" },
+    { F(io_echo),
+      "echo a client's message through each I/O engine on 127.0.0.1:PORT" },
+    { F(udp_batch),
+      "send and echo a batch of datagrams via UDP on 127.0.0.1:PORT" },
+    { F(zerocopy_send),
+      "send a large buffer with MSG_ZEROCOPY to 127.0.0.1:PORT and reap it" },
+    { F(relay_splice),
+      "relay a stream and then a file between connections on 127.0.0.1:PORT" },
+    { F(sockopt_levels),
+      "set socket, TCP, and IP level options on a connection to 127.0.0.1:PORT" },
+    { F(tcp_profiles),
+      "check the options set by each tuning profile on 127.0.0.1:PORT" },
+    { F(tcp_fastopen),
+      "connect to 127.0.0.1:PORT twice, sending \"hello\\n\" with TCP Fast Open" },
+    { F(dual_stack),
+      "listen on all addresses at PORT and accept IPv4 and IPv6 clients" },
+    { F(cpu_affinity),
+      "set CPU affinity and busy poll options on 127.0.0.1:PORT and pin a thread" },
+    { F(accept_burst),
+      "accept several waiting clients on 127.0.0.1:PORT in bursts" },
+    { F(open_stats),
+      "check phase timings and counters for opens on 127.0.0.1:PORT" },
+    { F(restart_handoff),
+      "hand a listener on 127.0.0.1:PORT to a new owner while clients connect" },
+    { F(inherit_fds),
+      "adopt TCP, UDP, and Unix domain sockets passed with LISTEN_FDS" },
+    { F(bufpool_read),
+      "read from 127.0.0.1:PORT into pooled buffers, from several threads" },
+    { F(framer_split),
+      "split delimited and length-prefixed streams into frames in a ring" },
+    { F(outq_coalesce),
+      "coalesce small writes to 127.0.0.1:PORT, with backpressure" },
+    { F(server_workers),
+      "echo on 127.0.0.1:PORT from a pool of workers, shared and per-worker listeners" },
+    { F(open_many),
+      "open many connections to 127.0.0.1:PORT at once, with a deadline" },
+    { F(shm_channel),
+      "echo through a shared memory channel set up over a Unix socket" },
 };
 #undef F
 
@@ -191,6 +273,47 @@ bool tcp_client_nonblocking(void) {
     return pass;
 }
 
+bool tcp_client_async(void) {
+    /* "localhost" usually resolves to both ::1 and 127.0.0.1, but
+     * the server only listens on the latter. */
+    socket99_config cfg = {
+        .host = "localhost",
+        .port = port,
+        .connect_stagger_msec = 50,
+    };
+
+    socket99_result res;
+    socket99_pending *p = socket99_open_async(&cfg, &res);
+    if (p == NULL) {
+        socket99_fprintf(stderr, &res);
+        return false;
+    }
+
+    const int TIMEOUT_MSEC = 10 * 1000;
+    struct pollfd fds[8];
+    int waited = 0;
+    while (!socket99_pending_step(p, &res) && waited < TIMEOUT_MSEC) {
+        size_t count = socket99_pending_pollfds(p, fds, 8);
+        int timeout = socket99_pending_timeout(p);
+        if (timeout == -1 || timeout > 100) { timeout = 100; }
+        (void)poll(fds, count, timeout);
+        waited += timeout;
+    }
+    socket99_pending_free(p);
+
+    if (res.status != SOCKET99_OK || res.fd == -1) {
+        socket99_fprintf(stderr, &res);
+        return false;
+    }
+
+    const char *msg = "hello\n";
+    size_t msg_size = strlen(msg);
+    ssize_t sent = send(res.fd, msg, msg_size, 0);
+    bool pass = ((size_t)sent == msg_size);
+    close(res.fd);
+    return pass;
+}
+
 bool tcp_server(void) {
     int v_true = 1;
 
@@ -521,3 +644,2481 @@ bool unix_server_datagram(void) {
 
     return received > 0;
 }
+
+#define GROUP_SIZE 4
+
+bool listener_group(void) {
+    int v_true = 1;
+
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .server = true,
+        .nonblocking = true,
+        .sockopts = {
+            {SO_REUSEADDR, &v_true, sizeof(v_true)},
+        },
+    };
+
+    socket99_result res[GROUP_SIZE];
+#ifdef __linux__
+    bool steer = true;
+#else
+    bool steer = false;
+#endif
+    bool ok = socket99_open_group(&cfg, res, GROUP_SIZE, steer);
+    if (!ok) {
+        for (int i = 0; i < GROUP_SIZE; i++) {
+            if (res[i].status != SOCKET99_OK) {
+                socket99_fprintf(stderr, &res[i]);
+                break;
+            }
+        }
+        return false;
+    }
+
+    socket99_config client_cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+    };
+    socket99_result client_res;
+    ok = socket99_open(&client_cfg, &client_res);
+    if (!ok) {
+        socket99_fprintf(stderr, &client_res);
+        for (int i = 0; i < GROUP_SIZE; i++) { close(res[i].fd); }
+        return false;
+    }
+    send(client_res.fd, "hello\n", 6, 0);
+
+    struct pollfd fds[GROUP_SIZE];
+    for (int i = 0; i < GROUP_SIZE; i++) {
+        fds[i].fd = res[i].fd;
+        fds[i].events = POLLIN;
+    }
+
+    ssize_t received = 0;
+    if (poll(fds, GROUP_SIZE, 1000 /* msec */) > 0) {
+        for (int i = 0; i < GROUP_SIZE; i++) {
+            if (fds[i].revents & POLLIN) {
+                int client_fd = accept(fds[i].fd, NULL, NULL);
+                if (client_fd == -1) { break; }
+                printf("accepted on listener %d\n", i);
+                received = read_and_print(client_fd);
+                close(client_fd);
+                break;
+            }
+        }
+    }
+
+    close(client_res.fd);
+    for (int i = 0; i < GROUP_SIZE; i++) { close(res[i].fd); }
+    return received > 0;
+}
+
+static bool has_flags(int fd) {
+    int fl = fcntl(fd, F_GETFL, 0);
+    int fd_fl = fcntl(fd, F_GETFD, 0);
+    return fl != -1 && (fl & O_NONBLOCK)
+        && fd_fl != -1 && (fd_fl & FD_CLOEXEC);
+}
+
+bool accept_flags(void) {
+    int v_true = 1;
+
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .server = true,
+        .nonblocking = true,
+        .cloexec = true,
+        .sockopts = {
+            {SO_REUSEADDR, &v_true, sizeof(v_true)},
+        },
+    };
+
+    socket99_result res;
+    bool ok = socket99_open(&cfg, &res);
+    if (!ok) {
+        socket99_fprintf(stderr, &res);
+        return false;
+    }
+    bool pass = has_flags(res.fd);
+    printf("listener flags: %s\n", pass ? "ok" : "missing");
+
+    socket99_config client_cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .nonblocking = true,
+        .cloexec = true,
+    };
+    socket99_result client_res;
+    ok = socket99_open(&client_cfg, &client_res);
+    if (!ok) {
+        socket99_fprintf(stderr, &client_res);
+        close(res.fd);
+        return false;
+    }
+    pass = pass && has_flags(client_res.fd);
+
+    struct pollfd fds[1] = {
+        {res.fd, POLLIN, 0},
+    };
+    int client_fd = -1;
+    if (poll(fds, 1, 1000 /* msec */) == 1) {
+        client_fd = socket99_accept(&cfg, res.fd, NULL, NULL);
+    }
+    if (client_fd == -1) {
+        printf("accept: %s\n", strerror(errno));
+        pass = false;
+    } else {
+        bool accepted_ok = has_flags(client_fd);
+        printf("accepted flags: %s\n", accepted_ok ? "ok" : "missing");
+        pass = pass && accepted_ok;
+        close(client_fd);
+    }
+
+    close(client_res.fd);
+    close(res.fd);
+    return pass;
+}
+
+/* With room for two entries, looking up a third evicts whichever
+ * was used least recently. */
+static bool resolver_evicts_lru(void) {
+    socket99_resolver_config rcfg = { .max_entries = 2 };
+    socket99_resolver *r = socket99_resolver_new(&rcfg);
+    if (r == NULL) { return false; }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    const char *services[] = { "1", "2", "1", "3", "1", "2" };
+    bool pass = true;
+    for (size_t i = 0; i < sizeof(services)/sizeof(services[0]); i++) {
+        struct addrinfo *ai = NULL;
+        if (socket99_resolver_getaddrinfo(r, "localhost", services[i],
+                &hints, &ai) != 0) {
+            pass = false;
+            continue;
+        }
+        socket99_resolver_freeaddrinfo(r, ai);
+    }
+
+    /* "2" was evicted for "3", then "3" for "2"; "1" stayed. */
+    socket99_resolver_stats stats;
+    socket99_resolver_get_stats(r, &stats);
+    printf("LRU: hits %llu, misses %llu, evictions %llu\n",
+        (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+        (unsigned long long)stats.evictions);
+    socket99_resolver_free(r);
+    return pass && stats.hits == 2 && stats.misses == 4
+        && stats.evictions == 2;
+}
+
+#define RESOLVER_CALLERS 8
+
+static void *resolve_localhost(void *arg) {
+    socket99_resolver *r = (socket99_resolver *)arg;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *ai = NULL;
+    if (socket99_resolver_getaddrinfo(r, "localhost", "80", &hints, &ai)) {
+        return NULL;
+    }
+    socket99_resolver_freeaddrinfo(r, ai);
+    return arg;
+}
+
+/* Callers that miss at once share one lookup: whenever there's no
+ * entry, one is on its way, so only the first caller misses. */
+static bool resolver_coalesces(void) {
+    socket99_resolver *r = socket99_resolver_new(NULL);
+    if (r == NULL) { return false; }
+
+    pthread_t threads[RESOLVER_CALLERS];
+    int started = 0;
+    for (; started < RESOLVER_CALLERS; started++) {
+        if (pthread_create(&threads[started], NULL, resolve_localhost, r)) {
+            break;
+        }
+    }
+    bool pass = started == RESOLVER_CALLERS;
+    for (int i = 0; i < started; i++) {
+        void *res = NULL;
+        pthread_join(threads[i], &res);
+        pass = pass && res == r;
+    }
+
+    socket99_resolver_stats stats;
+    socket99_resolver_get_stats(r, &stats);
+    printf("concurrent: hits %llu, misses %llu, coalesced %llu\n",
+        (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+        (unsigned long long)stats.coalesced);
+    socket99_resolver_free(r);
+    return pass && stats.misses == 1
+        && stats.hits + stats.coalesced == RESOLVER_CALLERS - 1;
+}
+
+bool resolver_cache(void) {
+    int v_true = 1;
+
+    socket99_resolver *r = socket99_resolver_new(NULL);
+    if (r == NULL) { return false; }
+
+    socket99_config cfg = {
+        .IPv4 = "127.0.0.1",
+        .port = port,
+        .server = true,
+        .resolver = r,
+        .sockopts = {
+            {SO_REUSEADDR, &v_true, sizeof(v_true)},
+        },
+    };
+
+    socket99_result res;
+    bool ok = socket99_open(&cfg, &res);
+    if (!ok) {
+        socket99_fprintf(stderr, &res);
+        socket99_resolver_free(r);
+        return false;
+    }
+
+    socket99_config client_cfg = {
+        .host = "localhost",
+        .port = port,
+        .resolver = r,
+    };
+
+    /* Warm the cache in the background, then connect twice. The
+     * server's numeric address has nothing to prefetch. */
+    bool pass = socket99_resolver_prefetch(r, &cfg, 1) == 0
+        && socket99_resolver_prefetch(r, &client_cfg, 1) == 1;
+    socket99_resolver_wait(r);
+
+    for (int i = 0; i < 2; i++) {
+        socket99_result client_res;
+        ok = socket99_open(&client_cfg, &client_res);
+        if (!ok) {
+            socket99_fprintf(stderr, &client_res);
+            pass = false;
+            break;
+        }
+        int client_fd = accept(res.fd, NULL, NULL);
+        if (client_fd != -1) { close(client_fd); }
+        close(client_res.fd);
+    }
+
+    socket99_resolver_stats stats;
+    socket99_resolver_get_stats(r, &stats);
+    printf("hits %llu, misses %llu, numeric %llu\n",
+        (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+        (unsigned long long)stats.numeric);
+    pass = pass && stats.misses == 1 && stats.hits == 2 && stats.numeric == 1;
+
+    close(res.fd);
+    socket99_resolver_free(r);
+    return pass && resolver_evicts_lru() && resolver_coalesces();
+}
+
+bool pool_reuse(void) {
+    int v_true = 1;
+
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .server = true,
+        .sockopts = {
+            {SO_REUSEADDR, &v_true, sizeof(v_true)},
+        },
+    };
+
+    socket99_result res;
+    bool ok = socket99_open(&cfg, &res);
+    if (!ok) {
+        socket99_fprintf(stderr, &res);
+        return false;
+    }
+
+    socket99_pool *pool = socket99_pool_new(NULL);
+    if (pool == NULL) {
+        close(res.fd);
+        return false;
+    }
+
+    socket99_config client_cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+    };
+
+    /* A miss opens a new connection... */
+    socket99_result first;
+    bool pass = socket99_pool_checkout(pool, &client_cfg, &first);
+    int server_fd = accept(res.fd, NULL, NULL);
+    socket99_pool_checkin(pool, &client_cfg, first.fd);
+
+    /* ...which is reused by the next checkout... */
+    socket99_result second;
+    pass = pass && socket99_pool_checkout(pool, &client_cfg, &second);
+    pass = pass && second.fd == first.fd;
+    socket99_pool_checkin(pool, &client_cfg, second.fd);
+
+    /* ...until the server closes it. */
+    close(server_fd);
+    poll(NULL, 0, 10 /* msec */);
+    socket99_result third;
+    pass = pass && socket99_pool_checkout(pool, &client_cfg, &third);
+    server_fd = accept(res.fd, NULL, NULL);
+    if (server_fd != -1) { close(server_fd); }
+    if (third.status == SOCKET99_OK) { close(third.fd); }
+
+    socket99_pool_stats stats;
+    socket99_pool_get_stats(pool, &stats);
+    printf("checkouts %llu, hits %llu, misses %llu, dead %llu\n",
+        (unsigned long long)stats.checkouts, (unsigned long long)stats.hits,
+        (unsigned long long)stats.misses, (unsigned long long)stats.dead);
+    pass = pass && stats.hits == 1 && stats.misses == 2 && stats.dead == 1;
+
+    socket99_pool_free(pool);
+    close(res.fd);
+    return pass;
+}
+
+typedef struct {
+    int accepted;
+    int closed;
+} loop_echo_state;
+
+static bool loop_echo_accept(socket99_loop *loop, int client_fd,
+        void *udata, void **client_udata) {
+    (void)loop;
+    (void)client_fd;
+    (void)client_udata;
+    ((loop_echo_state *)udata)->accepted++;
+    return true;
+}
+
+static void loop_echo_read(socket99_loop *loop, int fd, const char *buf,
+        size_t len, void *udata) {
+    (void)loop;
+    (void)udata;
+    send(fd, buf, len, 0);
+}
+
+static void loop_echo_close(socket99_loop *loop, int fd, int err,
+        void *udata) {
+    (void)loop;
+    (void)err;
+    ((loop_echo_state *)udata)->closed++;
+    close(fd);
+}
+
+bool loop_echo(void) {
+    int v_true = 1;
+    loop_echo_state state = { 0, 0 };
+
+    socket99_loop_callbacks cbs = {
+        .on_accept = loop_echo_accept,
+        .on_read = loop_echo_read,
+        .on_close = loop_echo_close,
+    };
+    socket99_loop *loop = socket99_loop_new(&cbs, 0);
+    if (loop == NULL) {
+        printf("socket99_loop_new: %s\n", strerror(errno));
+        return false;
+    }
+
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .server = true,
+        .sockopts = {
+            {SO_REUSEADDR, &v_true, sizeof(v_true)},
+        },
+    };
+    socket99_result res;
+    if (!socket99_loop_listen(loop, &cfg, &res, &state)) {
+        socket99_fprintf(stderr, &res);
+        socket99_loop_free(loop);
+        return false;
+    }
+
+    socket99_config client_cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+    };
+    socket99_result client_res;
+    if (!socket99_open(&client_cfg, &client_res)) {
+        socket99_fprintf(stderr, &client_res);
+        close(res.fd);
+        socket99_loop_free(loop);
+        return false;
+    }
+    send(client_res.fd, "hello\n", 6, 0);
+
+    /* Accept, then read and echo. */
+    for (int i = 0; i < 10 && state.accepted == 0; i++) {
+        socket99_loop_run_once(loop, 100);
+    }
+    socket99_loop_run_once(loop, 100);
+    ssize_t received = read_and_print(client_res.fd);
+
+    close(client_res.fd);
+    for (int i = 0; i < 10 && state.closed == 0; i++) {
+        socket99_loop_run_once(loop, 100);
+    }
+
+    close(res.fd);
+    socket99_loop_free(loop);
+    return received == 6 && state.accepted == 1 && state.closed == 1;
+}
+
+/* Echo one message through an I/O engine, then cancel its accept. */
+static bool io_echo_run(bool no_uring) {
+    int v_true = 1;
+    socket99_io_config io_cfg = { .no_uring = no_uring };
+    socket99_io *io = socket99_io_new(&io_cfg);
+    if (io == NULL) {
+        printf("socket99_io_new: %s\n", strerror(errno));
+        return false;
+    }
+    printf("engine: %s\n", socket99_io_uses_uring(io) ? "io_uring" : "epoll");
+
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .server = true,
+        .sockopts = {
+            {SO_REUSEADDR, &v_true, sizeof(v_true)},
+        },
+    };
+    socket99_result res;
+    if (!socket99_open(&cfg, &res)) {
+        socket99_fprintf(stderr, &res);
+        socket99_io_free(io);
+        return false;
+    }
+    socket99_io_accept(io, res.fd, NULL);
+
+    socket99_config client_cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+    };
+    socket99_result client_res;
+    if (!socket99_open(&client_cfg, &client_res)) {
+        socket99_fprintf(stderr, &client_res);
+        close(res.fd);
+        socket99_io_free(io);
+        return false;
+    }
+    send(client_res.fd, "hello\n", 6, 0);
+
+    char echo_buf[64];
+    int accepted = 0, echoed = 0, closed = 0, cancelled = 0;
+    bool client_open = true;
+    for (int i = 0; i < 50 && (closed == 0 || cancelled == 0); i++) {
+        socket99_io_completion done[8];
+        int count = socket99_io_reap(io, done, 8, 100);
+        for (int j = 0; j < count; j++) {
+            socket99_io_completion *c = &done[j];
+            if (c->op == SOCKET99_IO_ACCEPT && c->res >= 0) {
+                accepted++;
+                socket99_io_recv(io, c->res, NULL);
+            } else if (c->op == SOCKET99_IO_ACCEPT) {
+                if (c->res == -ECANCELED) { cancelled++; }
+            } else if (c->op == SOCKET99_IO_RECV && c->res > 0) {
+                size_t len = (size_t)c->res < sizeof(echo_buf)
+                    ? (size_t)c->res : sizeof(echo_buf);
+                memcpy(echo_buf, c->buf, len);
+                socket99_io_release(io, c);
+                socket99_io_send(io, c->fd, echo_buf, len, NULL);
+            } else if (c->op == SOCKET99_IO_RECV && !c->more) {
+                /* EOF; done with the connection and the listener. */
+                closed++;
+                close(c->fd);
+                socket99_io_cancel(io, res.fd);
+            } else if (c->op == SOCKET99_IO_SEND && c->res == 6) {
+                echoed++;
+            }
+        }
+
+        if (echoed == 1 && client_open) {
+            read_and_print(client_res.fd);
+            close(client_res.fd);
+            client_open = false;
+        }
+    }
+    if (client_open) { close(client_res.fd); }
+
+    close(res.fd);
+    socket99_io_free(io);
+    return accepted == 1 && echoed == 1 && closed == 1 && cancelled == 1;
+}
+
+bool io_echo(void) {
+    return io_echo_run(false) && io_echo_run(true);
+}
+
+#define UDP_BATCH_COUNT 8
+
+typedef struct {
+    int fd;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+} udp_late_send_info;
+
+/* Send one datagram, after the receiver has started waiting. */
+static void *udp_late_send(void *arg) {
+    udp_late_send_info *ls = (udp_late_send_info *)arg;
+    poll(NULL, 0, 50);
+    (void)sendto(ls->fd, "late", 4, 0, (struct sockaddr *)&ls->addr,
+        ls->addr_len);
+    return NULL;
+}
+
+bool udp_batch(void) {
+    int v_true = 1;
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .server = true,
+        .datagram = true,
+        .sockopts = {
+            {SO_REUSEADDR, &v_true, sizeof(v_true)},
+        },
+    };
+    socket99_result server;
+    if (!socket99_open(&cfg, &server)) {
+        socket99_fprintf(stderr, &server);
+        return false;
+    }
+
+    socket99_config client_cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .datagram = true,
+    };
+    socket99_result client;
+    if (!socket99_open(&client_cfg, &client)) {
+        socket99_fprintf(stderr, &client);
+        close(server.fd);
+        return false;
+    }
+
+    socket99_batch *out = socket99_batch_new(UDP_BATCH_COUNT, 64);
+    socket99_batch *in = socket99_batch_new(UDP_BATCH_COUNT, 64);
+    bool pass = out != NULL && in != NULL;
+
+    /* UDP clients aren't connected, so address each datagram. */
+    struct sockaddr_storage server_addr;
+    socklen_t server_addr_len = sizeof(server_addr);
+    pass = pass && 0 == getsockname(server.fd,
+        (struct sockaddr *)&server_addr, &server_addr_len);
+
+    socket99_dgram *od = socket99_batch_dgrams(out, NULL);
+    for (int i = 0; pass && i < UDP_BATCH_COUNT; i++) {
+        od[i].len = (size_t)sprintf(od[i].buf, "hello %d", i);
+        od[i].addr = server_addr;
+        od[i].addr_len = server_addr_len;
+    }
+    pass = pass && socket99_batch_send(out, client.fd, 0,
+        UDP_BATCH_COUNT) == UDP_BATCH_COUNT;
+
+    /* Receive them, maybe in parts, and echo them back to the source
+     * address that came with each. */
+    int got = 0;
+    while (pass && got < UDP_BATCH_COUNT) {
+        int count = socket99_batch_recv(in, server.fd,
+            UDP_BATCH_COUNT, 1000);
+        if (count <= 0) {
+            printf("batch recv: %d, %s\n", count, strerror(errno));
+            pass = false;
+            break;
+        }
+        socket99_dgram *id = socket99_batch_dgrams(in, NULL);
+        for (int i = 0; i < count; i++, got++) {
+            char expected[32];
+            sprintf(expected, "hello %d", got);
+            if (id[i].len != strlen(expected) || id[i].addr_len == 0
+                || id[i].truncated
+                || 0 != memcmp(id[i].buf, expected, id[i].len)) {
+                pass = false;
+            }
+        }
+        pass = pass && socket99_batch_send(in, server.fd, 0,
+            (size_t)count) == count;
+    }
+    printf("server got %d datagrams\n", got);
+
+    int echoed = 0;
+    while (pass && echoed < UDP_BATCH_COUNT) {
+        int count = socket99_batch_recv(out, client.fd,
+            UDP_BATCH_COUNT, 1000);
+        if (count <= 0) {
+            pass = false;
+            break;
+        }
+        echoed += count;
+    }
+    printf("client got %d echoed datagrams\n", echoed);
+
+    /* Nothing else is queued, so this times out. */
+    pass = pass && socket99_batch_recv(in, server.fd, 1, 50) == 0;
+
+    /* A nonblocking socket still waits, when asked to wait forever. */
+    int flags = fcntl(server.fd, F_GETFL, 0);
+    pass = pass && flags != -1
+        && fcntl(server.fd, F_SETFL, flags | O_NONBLOCK) == 0;
+    udp_late_send_info ls = { client.fd, server_addr, server_addr_len };
+    pthread_t sender;
+    if (pass && 0 == pthread_create(&sender, NULL, udp_late_send, &ls)) {
+        int count = socket99_batch_recv(in, server.fd, 1, -1);
+        pthread_join(sender, NULL);
+        printf("nonblocking recv, no timeout: %d\n", count);
+        pass = count == 1;
+    } else {
+        pass = false;
+    }
+
+    socket99_batch_free(out);
+    socket99_batch_free(in);
+    close(client.fd);
+    close(server.fd);
+    return pass;
+}
+
+#define ZC_BUF_SIZE (256 * 1024)
+
+bool zerocopy_send(void) {
+    int v_true = 1;
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .server = true,
+        .sockopts = {
+            {SO_REUSEADDR, &v_true, sizeof(v_true)},
+        },
+    };
+    socket99_result server;
+    if (!socket99_open(&cfg, &server)) {
+        socket99_fprintf(stderr, &server);
+        return false;
+    }
+
+    socket99_config client_cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .zerocopy = true,
+    };
+    socket99_result client;
+    if (!socket99_open(&client_cfg, &client)) {
+        socket99_fprintf(stderr, &client);
+        close(server.fd);
+        return false;
+    }
+    int peer_fd = accept(server.fd, NULL, NULL);
+
+    char *buf = calloc(1, ZC_BUF_SIZE);
+    char *rbuf = malloc(ZC_BUF_SIZE);
+    socket99_zc *zc = socket99_zc_new(client.fd, 0);
+    bool pass = peer_fd != -1 && buf && rbuf && zc;
+
+    /* Small sends are copied, so the buffer is free right away. */
+    bool pinned = true;
+    pass = pass && socket99_zc_send(zc, "hello\n", 6, NULL, &pinned) == 6
+        && !pinned;
+
+    /* Send the large buffer, alternating with reading it on the other
+     * end. Every part of it has the same tag. */
+    size_t sent = 0, received = 0;
+    while (pass && received < ZC_BUF_SIZE + 6) {
+        if (sent < ZC_BUF_SIZE) {
+            ssize_t res = socket99_zc_send(zc, buf + sent,
+                ZC_BUF_SIZE - sent, buf, &pinned);
+            if (res == -1) { pass = false; }
+            if (res > 0) { sent += (size_t)res; }
+        }
+        ssize_t got = recv(peer_fd, rbuf, ZC_BUF_SIZE, 0);
+        if (got <= 0) { pass = false; }
+        if (got > 0) { received += (size_t)got; }
+    }
+
+    /* Wait for the kernel to let go of the buffer. */
+    void *tag = NULL;
+    for (int i = 0; pass && i < 100 && tag == NULL; i++) {
+        struct pollfd pfd = { client.fd, 0, 0 };
+        poll(&pfd, 1, 10);
+        if (socket99_zc_reap(zc, &tag, 1) == -1) { pass = false; }
+    }
+
+    socket99_zc_stats stats;
+    socket99_zc_get_stats(zc, &stats);
+    printf("zerocopy sends %llu, copied sends %llu, notifications %llu,"
+        " kernel copies %llu\n",
+        (unsigned long long)stats.zerocopy_sends,
+        (unsigned long long)stats.copied_sends,
+        (unsigned long long)stats.notifications,
+        (unsigned long long)stats.kernel_copies);
+    pass = pass && tag == buf && socket99_zc_pending(zc) == 0
+        && stats.zerocopy_sends > 0 && stats.copied_sends == 1;
+
+    socket99_zc_free(zc);
+    free(buf);
+    free(rbuf);
+    if (peer_fd != -1) { close(peer_fd); }
+    close(client.fd);
+    close(server.fd);
+    return pass;
+}
+
+#define RELAY_SIZE (1024 * 1024)
+
+/* Read whatever is available from FD, checking it against the
+ * pattern (offset % 251). Returns the byte count, 0 if nothing was
+ * ready, or -1 on a mismatch or error. */
+static ssize_t relay_check(int fd, size_t *received) {
+    char buf[64 * 1024];
+    ssize_t got = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (got == -1) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    for (ssize_t i = 0; i < got; i++) {
+        if (buf[i] != (char)((*received + (size_t)i) % 251)) { return -1; }
+    }
+    *received += (size_t)got;
+    return got;
+}
+
+/* Drain FD, checking its contents. */
+static bool relay_drain(int fd, size_t *received) {
+    ssize_t got;
+    while ((got = relay_check(fd, received)) > 0) {}
+    return got == 0;
+}
+
+bool relay_splice(void) {
+    int v_true = 1;
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .server = true,
+        .sockopts = {
+            {SO_REUSEADDR, &v_true, sizeof(v_true)},
+        },
+    };
+    socket99_result server;
+    if (!socket99_open(&cfg, &server)) {
+        socket99_fprintf(stderr, &server);
+        return false;
+    }
+
+    /* SRC -> SRC_PEER, relayed to DST -> DST_PEER. */
+    socket99_config client_cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .nonblocking = true,
+    };
+    socket99_result src, dst;
+    if (!socket99_open(&client_cfg, &src)) {
+        socket99_fprintf(stderr, &src);
+        close(server.fd);
+        return false;
+    }
+    int src_peer = accept(server.fd, NULL, NULL);
+    if (!socket99_open(&client_cfg, &dst)) {
+        socket99_fprintf(stderr, &dst);
+        close(src.fd);
+        close(server.fd);
+        return false;
+    }
+    int dst_peer = accept(server.fd, NULL, NULL);
+    fcntl(src_peer, F_SETFL, O_NONBLOCK);
+
+    char *data = malloc(RELAY_SIZE);
+    socket99_relay *relay = socket99_relay_new(src_peer, dst.fd);
+    bool pass = data && relay && src_peer != -1 && dst_peer != -1;
+    for (size_t i = 0; pass && i < RELAY_SIZE; i++) {
+        data[i] = (char)(i % 251);
+    }
+
+    /* Asking to move nothing is rejected, not mistaken for EOF. */
+    pass = pass && socket99_relay_step(relay, 0) == -1 && errno == EINVAL;
+
+    /* Everything is nonblocking, so take turns until it's through. */
+    size_t sent = 0, received = 0;
+    bool eof = false;
+    for (int i = 0; pass && i < 100000 && !eof; i++) {
+        if (sent < RELAY_SIZE) {
+            ssize_t res = send(src.fd, data + sent, RELAY_SIZE - sent, 0);
+            if (res > 0) { sent += (size_t)res; }
+            if (sent == RELAY_SIZE) { shutdown(src.fd, SHUT_WR); }
+        }
+        ssize_t moved = socket99_relay_step(relay, SIZE_MAX);
+        if (moved == 0) { eof = true; }
+        if (moved == -1 && errno != EAGAIN) { pass = false; }
+        if (!relay_drain(dst_peer, &received)) { pass = false; }
+    }
+
+    socket99_relay_stats stats;
+    socket99_relay_get_stats(relay, &stats);
+    printf("relayed %llu bytes in %llu syscalls\n",
+        (unsigned long long)stats.bytes, (unsigned long long)stats.syscalls);
+    pass = pass && eof && received == RELAY_SIZE
+        && stats.bytes == RELAY_SIZE && socket99_relay_pending(relay) == 0;
+
+    /* Then send the same data from a file. */
+    FILE *f = tmpfile();
+    pass = pass && f && fwrite(data, 1, RELAY_SIZE, f) == RELAY_SIZE
+        && fflush(f) == 0;
+    off_t offset = 0;
+    received = 0;
+    memset(&stats, 0, sizeof(stats));
+    for (int i = 0; pass && i < 100000 && received < RELAY_SIZE; i++) {
+        if ((size_t)offset < RELAY_SIZE) {
+            ssize_t res = socket99_sendfile(dst.fd, fileno(f), &offset,
+                RELAY_SIZE - (size_t)offset, &stats);
+            if (res == -1 && errno != EAGAIN) { pass = false; }
+        }
+        if (!relay_drain(dst_peer, &received)) { pass = false; }
+    }
+    printf("sent file of %llu bytes in %llu syscalls\n",
+        (unsigned long long)stats.bytes, (unsigned long long)stats.syscalls);
+    pass = pass && received == RELAY_SIZE && offset == RELAY_SIZE;
+
+    if (f) { fclose(f); }
+    socket99_relay_free(relay);
+    free(data);
+    if (src_peer != -1) { close(src_peer); }
+    if (dst_peer != -1) { close(dst_peer); }
+    close(src.fd);
+    close(dst.fd);
+    close(server.fd);
+    return pass;
+}
+
+static int get_int_opt(int fd, int level, int option_id) {
+    int value = -1;
+    socklen_t len = sizeof(value);
+    if (getsockopt(fd, level, option_id, &value, &len) == -1) { return -1; }
+    return value;
+}
+
+bool sockopt_levels(void) {
+    int v_true = 1;
+    int tos = IPTOS_LOWDELAY;
+    int keepalive_idle = 30;
+    int buf_size = 128 * 1024;
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .server = true,
+        .sockopts = {
+            {SO_REUSEADDR, &v_true, sizeof(v_true)},
+        },
+    };
+    socket99_result server;
+    if (!socket99_open(&cfg, &server)) {
+        socket99_fprintf(stderr, &server);
+        return false;
+    }
+
+    /* More options than fit in sockopts, at several levels. */
+    socket99_sockopt opts[] = {
+        {SO_KEEPALIVE, &v_true, sizeof(v_true), SOL_SOCKET},
+        {SO_SNDBUF, &buf_size, sizeof(buf_size), SOL_SOCKET},
+        {TCP_NODELAY, &v_true, sizeof(v_true), IPPROTO_TCP},
+        {TCP_KEEPIDLE, &keepalive_idle, sizeof(keepalive_idle), IPPROTO_TCP},
+        {IP_TOS, &tos, sizeof(tos), SOCKET99_LEVEL_IP},
+    };
+    socket99_config client_cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .sockopt_list = opts,
+        .sockopt_count = sizeof(opts) / sizeof(opts[0]),
+    };
+    socket99_result client;
+    if (!socket99_open(&client_cfg, &client)) {
+        socket99_fprintf(stderr, &client);
+        close(server.fd);
+        return false;
+    }
+
+    bool pass = get_int_opt(client.fd, SOL_SOCKET, SO_KEEPALIVE) == 1
+        && get_int_opt(client.fd, SOL_SOCKET, SO_SNDBUF) >= buf_size
+        && get_int_opt(client.fd, IPPROTO_TCP, TCP_NODELAY) == 1
+        && get_int_opt(client.fd, IPPROTO_TCP, TCP_KEEPIDLE) == 30
+        && get_int_opt(client.fd, IPPROTO_IP, IP_TOS) == IPTOS_LOWDELAY;
+
+    /* A TCP option on a UDP socket should fail the open. */
+    socket99_config bad_cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .datagram = true,
+        .sockopt_list = &opts[3],
+        .sockopt_count = 1,
+    };
+    socket99_result bad;
+    if (socket99_open(&bad_cfg, &bad)) {
+        close(bad.fd);
+        pass = false;
+    } else if (bad.status != SOCKET99_ERROR_SETSOCKOPT) {
+        pass = false;
+    }
+
+    close(client.fd);
+    close(server.fd);
+    return pass;
+}
+
+bool tcp_profiles(void) {
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .server = true,
+        .profile = SOCKET99_PROFILE_FAN_IN,
+    };
+    socket99_result server;
+    if (!socket99_open(&cfg, &server)) {
+        socket99_fprintf(stderr, &server);
+        return false;
+    }
+    bool pass = get_int_opt(server.fd, SOL_SOCKET, SO_REUSEADDR) == 1
+        && get_int_opt(server.fd, IPPROTO_TCP, TCP_NODELAY) == 1;
+#ifdef TCP_DEFER_ACCEPT
+    pass = pass && get_int_opt(server.fd, IPPROTO_TCP, TCP_DEFER_ACCEPT) > 0;
+#endif
+
+    socket99_config plain_cfg = { .host = "127.0.0.1", .port = port };
+    socket99_config latency_cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .profile = SOCKET99_PROFILE_LOW_LATENCY,
+    };
+    socket99_config bulk_cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .profile = SOCKET99_PROFILE_BULK,
+    };
+    socket99_result plain, latency, bulk;
+    if (!socket99_open(&plain_cfg, &plain)) {
+        socket99_fprintf(stderr, &plain);
+        close(server.fd);
+        return false;
+    }
+    if (!socket99_open(&latency_cfg, &latency)) {
+        socket99_fprintf(stderr, &latency);
+        close(plain.fd);
+        close(server.fd);
+        return false;
+    }
+    if (!socket99_open(&bulk_cfg, &bulk)) {
+        socket99_fprintf(stderr, &bulk);
+        close(latency.fd);
+        close(plain.fd);
+        close(server.fd);
+        return false;
+    }
+
+    int plain_sndbuf = get_int_opt(plain.fd, SOL_SOCKET, SO_SNDBUF);
+    int bulk_sndbuf = get_int_opt(bulk.fd, SOL_SOCKET, SO_SNDBUF);
+    printf("send buffer: default %d, bulk %d\n", plain_sndbuf, bulk_sndbuf);
+    pass = pass
+        && get_int_opt(plain.fd, IPPROTO_TCP, TCP_NODELAY) == 0
+        && get_int_opt(latency.fd, IPPROTO_TCP, TCP_NODELAY) == 1
+        && get_int_opt(latency.fd, IPPROTO_IP, IP_TOS) == IPTOS_LOWDELAY
+        && get_int_opt(bulk.fd, IPPROTO_IP, IP_TOS) == IPTOS_THROUGHPUT
+        && bulk_sndbuf > plain_sndbuf;
+
+    close(bulk.fd);
+    close(latency.fd);
+    close(plain.fd);
+    close(server.fd);
+    return pass;
+}
+
+/* Is TCP Fast Open enabled for both clients and servers? */
+static bool fastopen_enabled(void) {
+    int mode = 0;
+    FILE *f = fopen("/proc/sys/net/ipv4/tcp_fastopen", "r");
+    if (f == NULL) { return false; }
+    if (fscanf(f, "%d", &mode) != 1) { mode = 0; }
+    fclose(f);
+    return (mode & 3) == 3;
+}
+
+bool tcp_fastopen(void) {
+    int v_true = 1;
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .server = true,
+        .fastopen_qlen = 16,
+        .sockopts = {
+            {SO_REUSEADDR, &v_true, sizeof(v_true)},
+        },
+    };
+    socket99_result server;
+    if (!socket99_open(&cfg, &server)) {
+        socket99_fprintf(stderr, &server);
+        return false;
+    }
+
+    /* The first connection gets a cookie (unless one is already
+     * cached), which lets the second send its data with the SYN. */
+    const char *msg = "hello\n";
+    bool pass = true, accepted = false;
+    for (int i = 0; pass && i < 2; i++) {
+        socket99_config client_cfg = {
+            .host = "127.0.0.1",
+            .port = port,
+        };
+        socket99_result client;
+        ssize_t sent = 0;
+        if (!socket99_open_send(&client_cfg, msg, strlen(msg), &sent,
+                &client)) {
+            socket99_fprintf(stderr, &client);
+            pass = false;
+            break;
+        }
+        accepted = socket99_fastopen_accepted(client.fd);
+
+        char buf[16];
+        int conn_fd = accept(server.fd, NULL, NULL);
+        ssize_t got = conn_fd == -1 ? -1 : recv(conn_fd, buf, sizeof(buf), 0);
+        pass = sent == (ssize_t)strlen(msg) && got == sent
+            && 0 == memcmp(buf, msg, strlen(msg));
+        printf("connection %d: sent %zd bytes, SYN data %s\n",
+            i, sent, accepted ? "accepted" : "not accepted");
+        if (conn_fd != -1) { close(conn_fd); }
+        close(client.fd);
+    }
+
+    if (fastopen_enabled() && !accepted) {
+        printf("Fast Open is enabled, but the cookie wasn't used\n");
+        pass = false;
+    }
+    close(server.fd);
+    return pass;
+}
+
+static int sock_family(int fd, bool peer) {
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    int res = peer ? getpeername(fd, (struct sockaddr *)&ss, &len)
+        : getsockname(fd, (struct sockaddr *)&ss, &len);
+    return res == -1 ? -1 : ss.ss_family;
+}
+
+/* Connect to ADDR (of FAMILY) and check that the connection arrives
+ * on the listener of the same family, unmapped. */
+static bool dual_stack_connect(socket99_result *listeners, size_t count,
+        int family, char *addr, int listen_port) {
+    socket99_config cfg = {
+        .port = listen_port,
+        .IPv4 = family == AF_INET ? addr : NULL,
+        .IPv6 = family == AF_INET6 ? addr : NULL,
+    };
+    socket99_result client;
+    if (!socket99_open(&cfg, &client)) {
+        socket99_fprintf(stderr, &client);
+        return false;
+    }
+
+    struct pollfd fds[4];
+    for (size_t i = 0; i < count; i++) {
+        fds[i].fd = listeners[i].fd;
+        fds[i].events = POLLIN;
+    }
+    bool pass = false;
+    if (poll(fds, count, 1000) > 0) {
+        for (size_t i = 0; i < count; i++) {
+            if (!(fds[i].revents & POLLIN)) { continue; }
+            int conn_fd = accept(fds[i].fd, NULL, NULL);
+            if (conn_fd == -1) { continue; }
+            int lfam = sock_family(fds[i].fd, false);
+            int pfam = sock_family(conn_fd, true);
+            printf("%s client accepted on %s listener\n", addr,
+                lfam == AF_INET ? "IPv4" : "IPv6");
+            pass = lfam == family && pfam == family;
+            close(conn_fd);
+        }
+    }
+    close(client.fd);
+    return pass;
+}
+
+bool dual_stack(void) {
+    int v_true = 1;
+    socket99_config cfg = {
+        .port = port,
+        .server = true,
+        .sockopts = {
+            {SO_REUSEADDR, &v_true, sizeof(v_true)},
+        },
+    };
+    socket99_result listeners[4];
+    size_t count = 4;
+    if (!socket99_open_listeners(&cfg, NULL, 0, listeners, &count)) {
+        socket99_fprintf(stderr, &listeners[0]);
+        return false;
+    }
+    printf("opened %zu wildcard listeners\n", count);
+
+    bool pass = count >= 1;
+    bool have_v6 = false;
+    for (size_t i = 0; i < count; i++) {
+        if (sock_family(listeners[i].fd, false) == AF_INET6) {
+            have_v6 = true;
+        }
+    }
+    pass = pass && dual_stack_connect(listeners, count, AF_INET,
+        "127.0.0.1", port);
+    if (have_v6) {
+        pass = pass && dual_stack_connect(listeners, count, AF_INET6,
+            "::1", port);
+    }
+    for (size_t i = 0; i < count; i++) { close(listeners[i].fd); }
+
+    /* An explicit list, on a port chosen by the OS. */
+    const char *hosts[] = { "127.0.0.1", "::1" };
+    socket99_config list_cfg = { .server = true };
+    count = 4;
+    if (!socket99_open_listeners(&list_cfg, hosts, have_v6 ? 2 : 1,
+            listeners, &count)) {
+        socket99_fprintf(stderr, &listeners[0]);
+        return false;
+    }
+    int list_port = -1;
+    for (size_t i = 0; i < count; i++) {
+        struct sockaddr_storage ss;
+        socklen_t len = sizeof(ss);
+        getsockname(listeners[i].fd, (struct sockaddr *)&ss, &len);
+        int p = ntohs(ss.ss_family == AF_INET
+            ? ((struct sockaddr_in *)&ss)->sin_port
+            : ((struct sockaddr_in6 *)&ss)->sin6_port);
+        if (list_port == -1) { list_port = p; }
+        if (p != list_port) { pass = false; }
+    }
+    pass = pass && count == (have_v6 ? 2u : 1u)
+        && dual_stack_connect(listeners, count, AF_INET,
+            "127.0.0.1", list_port);
+    if (have_v6) {
+        pass = pass && dual_stack_connect(listeners, count, AF_INET6,
+            "::1", list_port);
+    }
+    for (size_t i = 0; i < count; i++) { close(listeners[i].fd); }
+
+    /* Too little room fails cleanly. */
+    count = 1;
+    if (have_v6 && socket99_open_listeners(&list_cfg, hosts, 2,
+            listeners, &count)) {
+        close(listeners[0].fd);
+        pass = false;
+    }
+    return pass;
+}
+
+bool cpu_affinity(void) {
+    int v_true = 1;
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .server = true,
+        .set_incoming_cpu = true,
+        .incoming_cpu = 0,
+        .sockopts = {
+            {SO_REUSEADDR, &v_true, sizeof(v_true)},
+        },
+    };
+    socket99_result server;
+    if (!socket99_open(&cfg, &server)) {
+        socket99_fprintf(stderr, &server);
+        return false;
+    }
+    bool pass = socket99_incoming_cpu(server.fd) == 0;
+
+    socket99_config client_cfg = { .host = "127.0.0.1", .port = port };
+    socket99_result client;
+    if (!socket99_open(&client_cfg, &client)) {
+        socket99_fprintf(stderr, &client);
+        close(server.fd);
+        return false;
+    }
+    int conn_fd = accept(server.fd, NULL, NULL);
+    char buf[8];
+    pass = pass && conn_fd != -1 && send(client.fd, "hello\n", 6, 0) == 6
+        && recv(conn_fd, buf, sizeof(buf), 0) == 6;
+
+    /* The accepted socket now knows where its packets arrive. */
+    int cpu = socket99_incoming_cpu(conn_fd);
+    printf("connection arrived on CPU %d\n", cpu);
+    pass = pass && cpu >= 0 && socket99_pin_thread(cpu);
+    if (conn_fd != -1) { close(conn_fd); }
+    close(client.fd);
+    close(server.fd);
+
+    /* Raising the busy poll time above the sysctl needs privileges. */
+    socket99_config poll_cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .server = true,
+        .datagram = true,
+        .busy_poll_usec = 50,
+        .busy_poll_budget = 8,
+        .prefer_busy_poll = true,
+        .sockopts = {
+            {SO_REUSEADDR, &v_true, sizeof(v_true)},
+        },
+    };
+    socket99_result udp;
+    if (!socket99_open(&poll_cfg, &udp)) {
+        if (udp.status == SOCKET99_ERROR_SETSOCKOPT
+            && udp.saved_errno == EPERM) {
+            printf("skipping busy poll options: not permitted\n");
+            return pass;
+        }
+        socket99_fprintf(stderr, &udp);
+        return false;
+    }
+#ifdef SO_BUSY_POLL
+    pass = pass && get_int_opt(udp.fd, SOL_SOCKET, SO_BUSY_POLL) == 50;
+#endif
+    close(udp.fd);
+    return pass;
+}
+
+#define BURST_CLIENTS 5
+
+bool accept_burst(void) {
+    int v_true = 1;
+    socket99_sockopt conn_opts[] = {
+        {TCP_NODELAY, &v_true, sizeof(v_true), IPPROTO_TCP},
+    };
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .server = true,
+        .nonblocking = true,
+        .cloexec = true,
+        .sockopts = {
+            {SO_REUSEADDR, &v_true, sizeof(v_true)},
+        },
+        .accept_sockopts = conn_opts,
+        .accept_sockopt_count = 1,
+    };
+    socket99_result server;
+    if (!socket99_open(&cfg, &server)) {
+        socket99_fprintf(stderr, &server);
+        return false;
+    }
+
+    socket99_config client_cfg = { .host = "127.0.0.1", .port = port };
+    int clients[BURST_CLIENTS];
+    int opened = 0;
+    for (; opened < BURST_CLIENTS; opened++) {
+        socket99_result res;
+        if (!socket99_open(&client_cfg, &res)) {
+            socket99_fprintf(stderr, &res);
+            break;
+        }
+        clients[opened] = res.fd;
+    }
+
+    /* Three, then the other two, then nothing left. */
+    socket99_accepted conns[BURST_CLIENTS], spare[BURST_CLIENTS];
+    struct pollfd pfd = { server.fd, POLLIN, 0 };
+    bool pass = opened == BURST_CLIENTS && poll(&pfd, 1, 1000) == 1;
+    int first = pass ? socket99_accept_burst(&cfg, server.fd, conns, 3) : 0;
+    int second = first == 3 ? socket99_accept_burst(&cfg, server.fd,
+        conns + 3, BURST_CLIENTS - 3) : 0;
+    int third = pass ? socket99_accept_burst(&cfg, server.fd,
+        spare, BURST_CLIENTS) : -1;
+    printf("accepted %d, %d, %d\n", first, second, third);
+    pass = pass && first == 3 && second == 2 && third == 0;
+
+    for (int i = 0; pass && i < BURST_CLIENTS; i++) {
+        socket99_accepted *c = &conns[i];
+        int flags = fcntl(c->fd, F_GETFL);
+        int fd_flags = fcntl(c->fd, F_GETFD);
+        pass = c->addr.ss_family == AF_INET
+            && c->addr_len == sizeof(struct sockaddr_in)
+            && (flags & O_NONBLOCK) && (fd_flags & FD_CLOEXEC)
+            && get_int_opt(c->fd, IPPROTO_TCP, TCP_NODELAY) == 1;
+    }
+    int accepted = (first > 0 ? first : 0) + (second > 0 ? second : 0);
+    for (int i = 0; i < accepted; i++) {
+        close(conns[i].fd);
+    }
+    for (int i = 0; i < opened; i++) { close(clients[i]); }
+
+    /* A connection that can't be set up is skipped, not left to stall
+     * the rest of the burst. Here every one fails, so that's an error,
+     * but none are left waiting. */
+    socket99_sockopt bad_opts[] = {
+        {-1, &v_true, sizeof(v_true), IPPROTO_TCP},
+    };
+    socket99_config bad_cfg = cfg;
+    bad_cfg.accept_sockopts = bad_opts;
+    opened = 0;
+    for (; pass && opened < 2; opened++) {
+        socket99_result res;
+        if (!socket99_open(&client_cfg, &res)) { break; }
+        clients[opened] = res.fd;
+    }
+    pass = pass && opened == 2 && poll(&pfd, 1, 1000) == 1;
+    int bad = pass ? socket99_accept_burst(&bad_cfg, server.fd,
+        conns, BURST_CLIENTS) : 0;
+    int bad_errno = errno;
+    int left = pass ? socket99_accept_burst(&cfg, server.fd,
+        spare, BURST_CLIENTS) : -1;
+    printf("with bad accept_sockopts: %d (%s), then %d\n",
+        bad, strerror(bad_errno), left);
+    pass = pass && bad == -1 && bad_errno != 0 && left == 0;
+    for (int i = 0; i < opened; i++) { close(clients[i]); }
+
+    close(server.fd);
+    return pass;
+}
+
+static void count_open(const socket99_config *cfg,
+        const socket99_result *res, void *udata) {
+    (void)cfg;
+    (void)res;
+    (*(int *)udata)++;
+}
+
+bool open_stats(void) {
+    int calls = 0;
+    bool instrumented = socket99_set_open_hook(count_open, &calls);
+    socket99_open_stats before, after;
+    socket99_get_open_stats(&before);
+
+    int v_true = 1;
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .server = true,
+        .sockopts = {
+            {SO_REUSEADDR, &v_true, sizeof(v_true)},
+        },
+    };
+    socket99_result server, client, refused;
+    if (!socket99_open(&cfg, &server)) {
+        socket99_fprintf(stderr, &server);
+        socket99_set_open_hook(NULL, NULL);
+        return false;
+    }
+    socket99_config client_cfg = { .host = "127.0.0.1", .port = port };
+    bool connected = socket99_open(&client_cfg, &client);
+    if (connected) { close(client.fd); }
+    close(server.fd);
+
+    /* Nothing is listening now. */
+    bool refused_ok = !socket99_open(&client_cfg, &refused)
+        && refused.status == SOCKET99_ERROR_CONNECT;
+
+    socket99_set_open_hook(NULL, NULL);
+    socket99_get_open_stats(&after);
+
+    uint64_t opens = after.opens - before.opens;
+    uint64_t connect_failures = after.failures[-SOCKET99_ERROR_CONNECT]
+        - before.failures[-SOCKET99_ERROR_CONNECT];
+    printf("instrumented %d, hook calls %d, opens %llu, "
+        "refused %llu, connect %llu nsec\n",
+        instrumented, calls, (unsigned long long)opens,
+        (unsigned long long)connect_failures,
+        (unsigned long long)client.phase_nsec[SOCKET99_PHASE_CONNECT]);
+    if (!connected || !refused_ok) { return false; }
+
+    if (!instrumented) {
+        /* Compiled out: nothing recorded, and the hook is never called. */
+        return calls == 0 && after.opens == 0
+            && client.phase_nsec[SOCKET99_PHASE_CONNECT] == 0
+            && client.addrs_tried == 0;
+    }
+    return calls == 3 && opens == 3 && connect_failures == 1
+        && client.addrs_tried == 1 && refused.addrs_tried == 1
+        && after.addrs_tried - before.addrs_tried == 2
+        && server.phase_nsec[SOCKET99_PHASE_BIND] > 0
+        && client.phase_nsec[SOCKET99_PHASE_SOCKET] > 0
+        && client.phase_nsec[SOCKET99_PHASE_CONNECT] > 0;
+}
+
+#define RESTART_CLIENTS 8
+
+/* Connect COUNT clients to 127.0.0.1:PORT, storing them in FDS. Returns
+ * how many connected. */
+static int connect_clients(int *fds, int count) {
+    socket99_config cfg = { .host = "127.0.0.1", .port = port };
+    int connected = 0;
+    for (int i = 0; i < count; i++) {
+        socket99_result res;
+        if (socket99_open(&cfg, &res)) { fds[connected++] = res.fd; }
+    }
+    return connected;
+}
+
+/* Accept every connection waiting on the nonblocking listener FD,
+ * closing them. Returns how many there were. */
+static int accept_waiting(socket99_config *cfg, int fd) {
+    int accepted = 0;
+    socket99_accepted conns[2 * RESTART_CLIENTS];
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    while (poll(&pfd, 1, 100) == 1) {
+        int got = socket99_accept_burst(cfg, fd, conns,
+            2 * RESTART_CLIENTS);
+        if (got <= 0) { break; }
+        for (int i = 0; i < got; i++) { close(conns[i].fd); }
+        accepted += got;
+    }
+    return accepted;
+}
+
+bool restart_handoff(void) {
+    int v_true = 1;
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .server = true,
+        .backlog_size = 4 * RESTART_CLIENTS,
+        .sockopts = {
+            {SO_REUSEADDR, &v_true, sizeof(v_true)},
+        },
+    };
+    socket99_result old;
+    if (!socket99_open(&cfg, &old)) {
+        socket99_fprintf(stderr, &old);
+        return false;
+    }
+
+    /* The old process's control socket, and the new one's end of it. */
+    socket99_config ctl_cfg = { .path = "test_handoff", .server = true };
+    if (!delete_or_ignore("test_handoff")) { return false; }
+    socket99_result ctl, new_ctl;
+    if (!socket99_open(&ctl_cfg, &ctl)) {
+        socket99_fprintf(stderr, &ctl);
+        return false;
+    }
+    socket99_config new_ctl_cfg = { .path = "test_handoff" };
+    if (!socket99_open(&new_ctl_cfg, &new_ctl)) {
+        socket99_fprintf(stderr, &new_ctl);
+        return false;
+    }
+    int old_ctl = accept(ctl.fd, NULL, NULL);
+    close(ctl.fd);
+    unlink("test_handoff");
+
+    /* Clients arrive before the restart; the old process is serving
+     * one of them, and the rest are queued. */
+    int clients[2 * RESTART_CLIENTS];
+    int connected = connect_clients(clients, RESTART_CLIENTS);
+    int serving = accept(old.fd, NULL, NULL);
+
+    socket99_handoff out[2];
+    bool pass = old_ctl != -1 && serving != -1
+        && socket99_handoff_init(&out[0], &cfg, old.fd,
+            SOCKET99_ROLE_LISTENER)
+        && socket99_handoff_init(&out[1], &cfg, serving,
+            SOCKET99_ROLE_CONNECTION)
+        && socket99_handoff_send(old_ctl, out, 2);
+
+    /* The old process exits. */
+    close(old.fd);
+    if (serving != -1) { close(serving); }
+    if (old_ctl != -1) { close(old_ctl); }
+
+    socket99_handoff in[4];
+    int received = pass ? socket99_handoff_recv(new_ctl.fd, in, 4) : -1;
+    close(new_ctl.fd);
+    pass = received == 2 && in[0].role == SOCKET99_ROLE_LISTENER
+        && in[1].role == SOCKET99_ROLE_CONNECTION
+        && 0 == strcmp(in[0].name, "127.0.0.1") && in[0].port == port;
+
+    /* The new process takes over, and more clients arrive. */
+    socket99_config new_cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .server = true,
+        .nonblocking = true,
+        .sockopts = {
+            {SO_REUSEADDR, &v_true, sizeof(v_true)},
+        },
+    };
+    socket99_result adopted = { .fd = -1 };
+    int listener_fd = pass ? in[0].fd : -1;
+    pass = pass && socket99_handoff_adopt(&new_cfg, in, 2, &adopted)
+        && adopted.fd == listener_fd && in[0].fd == -1;
+    if (pass) {
+        connected += connect_clients(&clients[connected], RESTART_CLIENTS);
+    }
+
+    /* The passed connection still reaches its client. */
+    char buf[8] = { 0 };
+    if (pass) {
+        pass = write(in[1].fd, "handoff", 7) == 7;
+        struct pollfd pfd = { clients[0], POLLIN, 0 };
+        pass = pass && poll(&pfd, 1, 1000) == 1
+            && read(clients[0], buf, sizeof(buf) - 1) == 7
+            && 0 == strcmp(buf, "handoff");
+    }
+    if (received > 1 && in[1].fd != -1) { close(in[1].fd); }
+
+    int accepted = pass ? accept_waiting(&new_cfg, adopted.fd) : 0;
+    int lost = 2 * RESTART_CLIENTS - 1 - accepted;
+    printf("handoff: %d of %d clients lost\n", lost,
+        2 * RESTART_CLIENTS - 1);
+    pass = pass && connected == 2 * RESTART_CLIENTS && lost == 0;
+    for (int i = 0; i < connected; i++) { close(clients[i]); }
+    if (adopted.fd != -1) { close(adopted.fd); }
+    if (!pass) { return false; }
+
+    /* For comparison, a cold restart: queued clients are reset. */
+    socket99_result cold;
+    if (!socket99_open(&new_cfg, &cold)) {
+        socket99_fprintf(stderr, &cold);
+        return false;
+    }
+    connected = connect_clients(clients, RESTART_CLIENTS);
+    close(cold.fd);
+    if (!socket99_open(&new_cfg, &cold)) {
+        socket99_fprintf(stderr, &cold);
+        return false;
+    }
+    connected += connect_clients(&clients[connected], RESTART_CLIENTS);
+    accepted = accept_waiting(&new_cfg, cold.fd);
+    printf("cold restart: %d of %d clients lost\n",
+        2 * RESTART_CLIENTS - accepted, 2 * RESTART_CLIENTS);
+    for (int i = 0; i < connected; i++) { close(clients[i]); }
+    close(cold.fd);
+    return true;
+}
+
+bool inherit_fds(void) {
+    /* As a supervisor would: bind the sockets, then pass them as fds
+     * 3 through 5. */
+    for (int fd = 3; fd <= 5; fd++) {
+        if (fcntl(fd, F_GETFD) != -1) {
+            printf("fd %d already open, skipping\n", fd);
+            return true;
+        }
+    }
+    int v_true = 1;
+    socket99_config cfgs[] = {
+        { .host = "127.0.0.1", .port = port, .server = true,
+          .sockopts = { {SO_REUSEADDR, &v_true, sizeof(v_true)} } },
+        { .host = "127.0.0.1", .port = port, .server = true,
+          .datagram = true },
+        { .path = "test_inherit", .server = true },
+    };
+    if (!delete_or_ignore("test_inherit")) { return false; }
+    for (int i = 0; i < 3; i++) {
+        socket99_result res;
+        if (!socket99_open(&cfgs[i], &res)) {
+            socket99_fprintf(stderr, &res);
+            return false;
+        }
+        /* Move it out of the way first, since it may be at 3. */
+        int high = fcntl(res.fd, F_DUPFD, 10);
+        close(res.fd);
+        dup2(high, 3 + i);
+        close(high);
+    }
+    /* Flags the supervisor set: the UDP socket's O_NONBLOCK should be
+     * cleared, and the TCP listener's O_APPEND kept. */
+    fcntl(3, F_SETFL, O_APPEND);
+    fcntl(4, F_SETFL, O_NONBLOCK);
+
+    char pid[16];
+    snprintf(pid, sizeof(pid), "%ld", (long)getpid());
+    setenv("LISTEN_PID", pid, 1);
+    setenv("LISTEN_FDS", "3", 1);
+
+    /* Asked for out of order, to check they're matched by address. */
+    socket99_config unix_cfg = {
+        .path = "test_inherit", .server = true, .inherit = true,
+    };
+    socket99_config udp_cfg = {
+        .host = "127.0.0.1", .port = port, .server = true,
+        .datagram = true, .inherit = true,
+    };
+    socket99_config tcp_cfg = {
+        .host = "127.0.0.1", .port = port, .server = true,
+        .nonblocking = true, .cloexec = true, .inherit = true,
+        .sockopts = { {SO_RCVBUF, &v_true, sizeof(v_true)} },
+    };
+    socket99_result unix_res, udp_res, tcp_res, again;
+
+    /* A listener whose setup fails is left open and unclaimed, so a
+     * later open can still adopt it. */
+    socket99_config bad_cfg = tcp_cfg;
+    socket99_sockopt bad_opt = { -1, &v_true, sizeof(v_true), 0 };
+    bad_cfg.sockopts[0] = bad_opt;
+    bool pass = !socket99_open(&bad_cfg, &again) && again.fd == -1
+        && !again.inherited && fcntl(3, F_GETFD) != -1;
+
+    pass = pass && socket99_open(&unix_cfg, &unix_res)
+        && socket99_open(&udp_cfg, &udp_res)
+        && socket99_open(&tcp_cfg, &tcp_res);
+    printf("adopted fds %d, %d, %d\n", pass ? tcp_res.fd : -1,
+        pass ? udp_res.fd : -1, pass ? unix_res.fd : -1);
+    pass = pass && tcp_res.fd == 3 && tcp_res.inherited
+        && udp_res.fd == 4 && udp_res.inherited
+        && unix_res.fd == 5 && unix_res.inherited
+        && (fcntl(3, F_GETFL) & O_NONBLOCK)
+        && (fcntl(3, F_GETFL) & O_APPEND)
+        && (fcntl(3, F_GETFD) & FD_CLOEXEC)
+        && !(fcntl(4, F_GETFL) & O_NONBLOCK);
+
+    /* A listener is only adopted once; this falls back to opening a
+     * new socket, which can't bind to the same address. */
+    pass = pass && !socket99_open(&tcp_cfg, &again)
+        && again.status == SOCKET99_ERROR_BIND && !again.inherited;
+
+    /* With no match, it opens a new socket. */
+    socket99_config other_cfg = {
+        .host = "127.0.0.1", .port = port + 1, .server = true,
+        .inherit = true,
+        .sockopts = { {SO_REUSEADDR, &v_true, sizeof(v_true)} },
+    };
+    if (pass) {
+        pass = socket99_open(&other_cfg, &again) && !again.inherited
+            && again.fd > 5;
+        if (pass) { close(again.fd); }
+    }
+
+    /* The adopted listener works. */
+    if (pass) {
+        socket99_config client_cfg = { .host = "127.0.0.1", .port = port };
+        socket99_result client;
+        pass = socket99_open(&client_cfg, &client);
+        struct pollfd pfd = { 3, POLLIN, 0 };
+        pass = pass && poll(&pfd, 1, 1000) == 1;
+        int conn = pass ? accept(3, NULL, NULL) : -1;
+        pass = pass && conn != -1;
+        if (conn != -1) { close(conn); }
+        if (client.fd > 0) { close(client.fd); }
+    }
+
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    for (int fd = 3; fd <= 5; fd++) { close(fd); }
+    unlink("test_inherit");
+    return pass;
+}
+
+#define BUFPOOL_THREADS 4
+#define BUFPOOL_ROUNDS 10000
+
+static void *bufpool_churn(void *arg) {
+    socket99_bufpool *bp = arg;
+    void *bufs[8];
+    for (int r = 0; r < BUFPOOL_ROUNDS; r++) {
+        size_t n = (size_t)(r % 8) + 1;
+        for (size_t i = 0; i < n; i++) {
+            bufs[i] = socket99_bufpool_get(bp);
+            if (bufs[i] == NULL) { return NULL; }
+            memset(bufs[i], (int)i, 64);
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (((char *)bufs[i])[63] != (char)i) { return NULL; }
+            socket99_bufpool_put(bp, bufs[i]);
+        }
+    }
+    return bp;
+}
+
+bool bufpool_read(void) {
+    socket99_bufpool_config pool_cfg = {
+        .buf_size = 1000,
+        .slab_size = 4096,
+        .thread_cache = 4,
+    };
+    socket99_bufpool *bp = socket99_bufpool_new(&pool_cfg);
+    if (bp == NULL) { return false; }
+
+    int v_true = 1;
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .server = true,
+        .sockopts = {
+            {SO_REUSEADDR, &v_true, sizeof(v_true)},
+        },
+    };
+    socket99_config client_cfg = { .host = "127.0.0.1", .port = port };
+    socket99_result server, client;
+    if (!socket99_open(&cfg, &server)) {
+        socket99_fprintf(stderr, &server);
+        socket99_bufpool_free(bp);
+        return false;
+    }
+    socket99_config conn_cfg = { .nonblocking = true };
+    bool pass = socket99_open(&client_cfg, &client);
+    int conn = pass ? socket99_accept(&conn_cfg, server.fd, NULL, NULL) : -1;
+    pass = pass && conn != -1;
+
+    /* Nothing to read, so no buffer is held. */
+    void *buf = &buf;
+    socket99_bufpool_stats stats;
+    pass = pass && socket99_bufpool_read(bp, conn, &buf) == -1
+        && (errno == EAGAIN || errno == EWOULDBLOCK) && buf == NULL;
+    socket99_bufpool_get_stats(bp, &stats);
+    pass = pass && stats.in_use == 0
+        && socket99_bufpool_buf_size(bp) == 1024;
+
+    /* Now there is. */
+    ssize_t got = -1;
+    if (pass) {
+        pass = write(client.fd, "hello\n", 6) == 6;
+        struct pollfd pfd = { conn, POLLIN, 0 };
+        pass = pass && poll(&pfd, 1, 1000) == 1;
+        got = pass ? socket99_bufpool_read(bp, conn, &buf) : -1;
+        socket99_bufpool_get_stats(bp, &stats);
+        pass = got == 6 && buf != NULL && 0 == memcmp(buf, "hello\n", 6)
+            && stats.in_use == 1;
+        if (buf != NULL) { socket99_bufpool_put(bp, buf); }
+    }
+    if (conn != -1) { close(conn); }
+    close(client.fd);
+    close(server.fd);
+
+    /* Several threads getting and putting, with small caches. */
+    pthread_t threads[BUFPOOL_THREADS];
+    int started = 0;
+    for (; pass && started < BUFPOOL_THREADS; started++) {
+        if (pthread_create(&threads[started], NULL, bufpool_churn, bp)) {
+            pass = false;
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        void *res = NULL;
+        pthread_join(threads[i], &res);
+        pass = pass && res == bp;
+    }
+    socket99_bufpool_get_stats(bp, &stats);
+    printf("gets %llu, puts %llu, misses %llu, slabs %llu\n",
+        (unsigned long long)stats.gets, (unsigned long long)stats.puts,
+        (unsigned long long)stats.cache_misses,
+        (unsigned long long)stats.slabs);
+    pass = pass && stats.in_use == 0 && stats.gets == stats.puts
+        && stats.gets > (uint64_t)BUFPOOL_THREADS * BUFPOOL_ROUNDS;
+
+    /* With a limit, a get fails once it's reached. */
+    socket99_bufpool_free(bp);
+    pool_cfg.max_bufs = 2;
+    bp = socket99_bufpool_new(&pool_cfg);
+    void *a = bp ? socket99_bufpool_get(bp) : NULL;
+    void *b = bp ? socket99_bufpool_get(bp) : NULL;
+    void *c = bp ? socket99_bufpool_get(bp) : NULL;
+    pass = pass && a != NULL && b != NULL && c == NULL && errno == ENOBUFS;
+    socket99_bufpool_put(bp, a);
+    socket99_bufpool_put(bp, b);
+    socket99_bufpool_free(bp);
+    return pass;
+}
+
+#define FRAMES 200
+
+/* Send DATA through a socket pair and check that it splits into FRAMES
+ * frames, the Nth being N % 40 bytes of 'a' + N % 26. Returns the
+ * number of frames that wrapped around the ring, or -1. */
+static int check_frames(socket99_framer_config *cfg, const char *data,
+        size_t len) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) { return -1; }
+    socket99_framer *f = socket99_framer_new(cfg);
+    if (f == NULL) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+
+    int wrapped = 0;
+    int n = 0;
+    size_t sent = 0;
+    bool ok = true;
+    while (ok && n < FRAMES) {
+        /* Dribble it in, so frames arrive in pieces. */
+        if (sent < len) {
+            size_t chunk = len - sent < 23 ? len - sent : 23;
+            ok = write(sv[0], data + sent, chunk) == (ssize_t)chunk;
+            sent += chunk;
+        }
+        ok = ok && socket99_framer_fill(f, sv[1]) > 0;
+
+        socket99_span span;
+        int res;
+        while (ok && (res = socket99_framer_next(f, &span)) == 1) {
+            char body[64];
+            char want[64];
+            size_t want_len = (size_t)(n % 40);
+            memset(want, 'a' + n % 26, want_len);
+            socket99_span_copy(&span, body);
+            ok = span.len == want_len && 0 == memcmp(body, want, want_len);
+            if (span.iovcnt == 2) { wrapped++; }
+            n++;
+        }
+        ok = ok && res == 0;
+    }
+    ok = ok && socket99_framer_pending(f) == 0;
+    socket99_framer_free(f);
+    close(sv[0]);
+    close(sv[1]);
+    return ok ? wrapped : -1;
+}
+
+bool framer_split(void) {
+    char data[FRAMES * 48];
+    size_t len = 0;
+    for (int n = 0; n < FRAMES; n++) {
+        size_t body = (size_t)(n % 40);
+        memset(data + len, 'a' + n % 26, body);
+        len += body;
+        data[len++] = '\n';
+    }
+    socket99_framer_config delimited = { .ring_size = 64 };
+    int delimited_wraps = check_frames(&delimited, data, len);
+
+    len = 0;
+    for (int n = 0; n < FRAMES; n++) {
+        size_t body = (size_t)(n % 40);
+        data[len++] = (char)(body >> 8);
+        data[len++] = (char)(body & 0xff);
+        memset(data + len, 'a' + n % 26, body);
+        len += body;
+    }
+    socket99_framer_config length = {
+        .mode = SOCKET99_FRAME_LENGTH,
+        .prefix_size = 2,
+        .ring_size = 64,
+    };
+    int length_wraps = check_frames(&length, data, len);
+    printf("frames wrapped: %d delimited, %d length-prefixed\n",
+        delimited_wraps, length_wraps);
+    if (delimited_wraps <= 0 || length_wraps <= 0) { return false; }
+
+    /* A frame longer than max_frame can't be framed. */
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) { return false; }
+    socket99_framer_config small = { .ring_size = 64, .max_frame = 8 };
+    socket99_framer *f = socket99_framer_new(&small);
+    socket99_span span;
+    bool pass = f != NULL && write(sv[0], "short\nmuch too long\n", 20) == 20
+        && socket99_framer_fill(f, sv[1]) == 20
+        && socket99_framer_next(f, &span) == 1 && span.len == 5
+        && socket99_framer_next(f, &span) == -1 && errno == EMSGSIZE;
+    socket99_framer_free(f);
+    close(sv[0]);
+    close(sv[1]);
+
+    /* Bad configs are refused. */
+    socket99_framer_config bad = {
+        .mode = SOCKET99_FRAME_LENGTH,
+        .prefix_size = 3,
+    };
+    return pass && socket99_framer_new(&bad) == NULL && errno == EINVAL;
+}
+
+#define OUTQ_PIECES 100
+#define OUTQ_BYTES (1024 * 1024)
+
+/* Read whatever is ready from FD, checking it against the pattern
+ * (byte N is N % 251), and add it to *RECEIVED. */
+static bool outq_drain(int fd, size_t *received) {
+    char buf[16 * 1024];
+    for (;;) {
+        ssize_t got = read(fd, buf, sizeof(buf));
+        if (got == -1) { return errno == EAGAIN || errno == EWOULDBLOCK; }
+        if (got == 0) { return false; }
+        for (ssize_t i = 0; i < got; i++) {
+            if ((unsigned char)buf[i] != (*received + i) % 251) {
+                return false;
+            }
+        }
+        *received += (size_t)got;
+    }
+}
+
+bool outq_coalesce(void) {
+    int v_true = 1;
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .server = true,
+        .sockopts = {
+            {SO_REUSEADDR, &v_true, sizeof(v_true)},
+        },
+    };
+    /* A small send buffer, so it fills up. */
+    int sndbuf = 16 * 1024;
+    socket99_config client_cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .nonblocking = true,
+        .sockopts = {
+            {SO_SNDBUF, &sndbuf, sizeof(sndbuf)},
+        },
+    };
+    socket99_result server, client;
+    if (!socket99_open(&cfg, &server)) {
+        socket99_fprintf(stderr, &server);
+        return false;
+    }
+    socket99_config conn_cfg = { .nonblocking = true };
+    bool pass = socket99_open(&client_cfg, &client);
+    if (pass && client.fd != -1) {
+        struct pollfd pfd = { client.fd, POLLOUT, 0 };
+        pass = poll(&pfd, 1, 1000) == 1;
+    }
+    int conn = pass ? socket99_accept(&conn_cfg, server.fd, NULL, NULL) : -1;
+    pass = pass && conn != -1;
+    close(server.fd);
+    if (!pass) {
+        if (client.fd != -1) { close(client.fd); }
+        return false;
+    }
+
+    /* Many small writes go out in one call. */
+    socket99_outq_config q_cfg = {
+        .flush_bytes = 16 * 1024,
+        .flush_writes = 2 * OUTQ_PIECES,
+        .high_water = 256 * 1024,
+        .low_water = 64 * 1024,
+    };
+    socket99_outq *q = socket99_outq_new(client.fd, &q_cfg);
+    pass = q != NULL;
+    unsigned char piece[OUTQ_BYTES / 256];
+    size_t queued = 0;
+    for (int i = 0; pass && i < OUTQ_PIECES; i++) {
+        size_t len = 1 + i % 10;
+        for (size_t b = 0; b < len; b++) {
+            piece[b] = (unsigned char)((queued + b) % 251);
+        }
+        pass = socket99_outq_write(q, piece, len);
+        queued += len;
+    }
+    socket99_outq_stats stats;
+    pass = pass && socket99_outq_pending(q) == queued
+        && socket99_outq_flush(q, false) == (ssize_t)queued;
+    socket99_outq_get_stats(q, &stats);
+    printf("%llu writes, %llu syscalls\n",
+        (unsigned long long)stats.writes, (unsigned long long)stats.syscalls);
+    pass = pass && stats.writes == OUTQ_PIECES && stats.syscalls == 1;
+
+    size_t received = 0;
+    for (int tries = 0; pass && received < queued && tries < 100; tries++) {
+        struct pollfd pfd = { conn, POLLIN, 0 };
+        pass = poll(&pfd, 1, 1000) == 1 && outq_drain(conn, &received);
+    }
+    pass = pass && received == queued;
+
+    /* With nobody reading, the queue backs up past high_water... */
+    bool backed_up = false;
+    while (pass && queued < OUTQ_BYTES) {
+        for (size_t b = 0; b < sizeof(piece); b++) {
+            piece[b] = (unsigned char)((queued + b) % 251);
+        }
+        pass = socket99_outq_write(q, piece, sizeof(piece));
+        queued += sizeof(piece);
+        if (!socket99_outq_writable(q)) { backed_up = true; }
+    }
+    pass = pass && backed_up && socket99_outq_pending(q) > 0;
+
+    /* ... and drains as the other end reads, flushing whenever the
+     * socket is writable again. */
+    for (int tries = 0; pass && received < queued && tries < 1000; tries++) {
+        ssize_t sent = socket99_outq_flush(q, false);
+        pass = sent >= 0 || errno == EAGAIN || errno == EWOULDBLOCK;
+        struct pollfd pfds[2] = {
+            { conn, POLLIN, 0 },
+            { client.fd, socket99_outq_pending(q) > 0 ? POLLOUT : 0, 0 },
+        };
+        pass = pass && poll(pfds, 2, 1000) > 0
+            && outq_drain(conn, &received);
+    }
+    socket99_outq_get_stats(q, &stats);
+    printf("%llu flushes, %llu cut short\n",
+        (unsigned long long)stats.flushes, (unsigned long long)stats.partial);
+    pass = pass && received == queued && socket99_outq_pending(q) == 0
+        && socket99_outq_writable(q) && stats.partial > 0
+        && stats.bytes == queued;
+    socket99_outq_free(q);
+
+    /* A queue flushes on its own after flush_writes writes, however
+     * small they are. */
+    socket99_outq_config few_cfg = { .flush_writes = 8 };
+    socket99_outq *few = pass ? socket99_outq_new(client.fd, &few_cfg) : NULL;
+    pass = few != NULL;
+    for (int i = 0; pass && i < 8; i++) {
+        piece[0] = (unsigned char)(queued % 251);
+        pass = socket99_outq_write(few, piece, 1)
+            && socket99_outq_pending(few) == (i < 7 ? (size_t)i + 1 : 0);
+        queued++;
+    }
+    pass = pass && socket99_outq_flush(few, false) == 0;
+    socket99_outq_free(few);
+
+    /* A write past flush_bytes sends everything with MSG_MORE, so the
+     * closing flush has nothing left to send, but it still has to
+     * push out the tail rather than leave it for the kernel's timer
+     * (about 200 msec). */
+    socket99_outq_config tail_cfg = { .flush_bytes = 100 };
+    q = socket99_outq_new(client.fd, &tail_cfg);
+    pass = pass && q != NULL;
+    int stalls = 0;
+    for (int round = 0; pass && round < 3; round++) {
+        for (size_t b = 0; b < 1000; b++) {
+            piece[b] = (unsigned char)((queued + b) % 251);
+        }
+        pass = socket99_outq_write(q, piece, 1000)
+            && socket99_outq_pending(q) == 0
+            && socket99_outq_flush(q, false) == 0;
+        queued += 1000;
+        while (pass && received < queued) {
+            struct pollfd pfd = { conn, POLLIN, 0 };
+            if (poll(&pfd, 1, 100) != 1) {
+                stalls++;
+                pfd.revents = 0;
+                pass = poll(&pfd, 1, 1000) == 1;
+            }
+            pass = pass && outq_drain(conn, &received);
+        }
+    }
+    printf("tail segments stalled: %d\n", stalls);
+    pass = pass && stalls == 0 && received == queued;
+    socket99_outq_free(q);
+    close(conn);
+    close(client.fd);
+
+    /* Pipes get writev(2). */
+    int pfds[2];
+    if (pipe(pfds) == -1) { return false; }
+    q = socket99_outq_new(pfds[1], NULL);
+    char buf[8];
+    pass = pass && q != NULL
+        && socket99_outq_write(q, "ab", 2) && socket99_outq_write(q, "cd", 2)
+        && socket99_outq_flush(q, false) == 4
+        && read(pfds[0], buf, sizeof(buf)) == 4 && 0 == memcmp(buf, "abcd", 4);
+    socket99_outq_free(q);
+    close(pfds[0]);
+    close(pfds[1]);
+    return pass;
+}
+
+#define SERVER_CLIENTS 32
+
+static void server_echo(socket99_server *s, int fd, const char *buf,
+        size_t len, void *udata) {
+    (void)s;
+    (void)udata;
+    if (send(fd, buf, len, 0) != (ssize_t)len) { shutdown(fd, SHUT_RDWR); }
+}
+
+static void server_writable(socket99_server *s, int fd, void *udata) {
+    (void)s;
+    (void)fd;
+    __atomic_fetch_add((int *)udata, 1, __ATOMIC_RELAXED);
+}
+
+/* Connect all the clients at once, so they queue up behind the first
+ * worker to accept, then check each gets its own message back. */
+static bool run_server(enum socket99_listen_mode mode, size_t workers) {
+    int v_true = 1;
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .server = true,
+        .sockopts = {
+            {SO_REUSEADDR, &v_true, sizeof(v_true)},
+        },
+    };
+    socket99_server_config scfg = { .workers = workers, .listen = mode };
+    socket99_server_handlers h = {
+        .on_read = server_echo,
+        .on_writable = server_writable,
+    };
+    int writable = 0;
+    socket99_result res;
+    socket99_server *s = socket99_server_new(&cfg, &scfg, &h, &writable,
+        &res);
+    if (s == NULL) {
+        socket99_fprintf(stderr, &res);
+        return false;
+    }
+    bool pass = socket99_server_port(s) == port;
+
+    socket99_config client_cfg = { .host = "127.0.0.1", .port = port };
+    int fds[SERVER_CLIENTS];
+    int opened = 0;
+    for (; pass && opened < SERVER_CLIENTS; opened++) {
+        socket99_result client;
+        pass = socket99_open(&client_cfg, &client);
+        fds[opened] = client.fd;
+    }
+    if (!pass) { opened--; }
+
+    for (int i = 0; pass && i < opened; i++) {
+        char msg[16], buf[16];
+        int len = snprintf(msg, sizeof(msg), "ping %d", i);
+        struct pollfd pfd = { fds[i], POLLIN, 0 };
+        pass = write(fds[i], msg, (size_t)len) == len
+            && poll(&pfd, 1, 1000) == 1
+            && read(fds[i], buf, sizeof(buf)) == len
+            && 0 == memcmp(buf, msg, (size_t)len);
+    }
+    for (int i = 0; i < opened; i++) { close(fds[i]); }
+
+    /* Closing the clients closes the connections. */
+    socket99_server_stats stats;
+    for (int tries = 0; tries < 100; tries++) {
+        socket99_server_get_stats(s, &stats);
+        if (stats.closed == SERVER_CLIENTS) { break; }
+        poll(NULL, 0, 10);
+    }
+    printf("%s, %zu workers: accepted %llu, stolen %llu, closed %llu\n",
+        mode == SOCKET99_LISTEN_SHARED ? "shared" : "per-worker", workers,
+        (unsigned long long)stats.accepted, (unsigned long long)stats.stolen,
+        (unsigned long long)stats.closed);
+    socket99_server_free(s);
+    return pass && stats.accepted == SERVER_CLIENTS
+        && stats.closed == SERVER_CLIENTS && stats.reads >= SERVER_CLIENTS
+        && stats.failed_workers == 0
+        && __atomic_load_n(&writable, __ATOMIC_RELAXED) >= SERVER_CLIENTS;
+}
+
+#define LIMIT_CLIENTS 4
+
+static double cpu_secs(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+        + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/* With room for just one more fd, the server accepts one client, then
+ * gets EMFILE; it should back off rather than spin on the listener,
+ * and accept the rest once the limit is raised again. */
+static bool server_out_of_fds(void) {
+    int v_true = 1;
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .server = true,
+        .sockopts = {
+            {SO_REUSEADDR, &v_true, sizeof(v_true)},
+        },
+    };
+    socket99_server_config scfg = { .workers = 1 };
+    socket99_server_handlers h = { .on_read = server_echo };
+    socket99_result res;
+    socket99_server *s = socket99_server_new(&cfg, &scfg, &h, NULL, &res);
+    if (s == NULL) {
+        socket99_fprintf(stderr, &res);
+        return false;
+    }
+
+    /* Make the client sockets first; connecting takes no more fds. */
+    int fds[LIMIT_CLIENTS];
+    bool pass = true;
+    for (int i = 0; i < LIMIT_CLIENTS; i++) {
+        fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+        pass = pass && fds[i] != -1;
+    }
+    struct rlimit old, low;
+    int spare = dup(0);
+    pass = pass && spare != -1 && getrlimit(RLIMIT_NOFILE, &old) == 0;
+    if (spare != -1) { close(spare); }
+    low = old;
+    low.rlim_cur = (rlim_t)spare + 1;
+    pass = pass && setrlimit(RLIMIT_NOFILE, &low) == 0;
+
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (int i = 0; pass && i < LIMIT_CLIENTS; i++) {
+        pass = connect(fds[i], (struct sockaddr *)&sin, sizeof(sin)) == 0;
+    }
+
+    double before = cpu_secs();
+    poll(NULL, 0, 300);
+    double used = cpu_secs() - before;
+    socket99_server_stats first;
+    socket99_server_get_stats(s, &first);
+    if (pass) { setrlimit(RLIMIT_NOFILE, &old); }
+
+    socket99_server_stats stats;
+    for (int tries = 0; tries < 100; tries++) {
+        socket99_server_get_stats(s, &stats);
+        if (stats.accepted == LIMIT_CLIENTS) { break; }
+        poll(NULL, 0, 10);
+    }
+    printf("out of fds: accepted %llu, then %llu; %llu pauses, %.0f ms cpu\n",
+        (unsigned long long)first.accepted,
+        (unsigned long long)stats.accepted,
+        (unsigned long long)first.accept_pauses, used * 1000);
+    for (int i = 0; i < LIMIT_CLIENTS; i++) {
+        if (fds[i] != -1) { close(fds[i]); }
+    }
+    socket99_server_free(s);
+    return pass && first.accepted == 1 && first.accept_pauses >= 1
+        && used < 0.15 && stats.accepted == LIMIT_CLIENTS;
+}
+
+bool server_workers(void) {
+    if (!run_server(SOCKET99_LISTEN_SHARED, 3)
+        || !run_server(SOCKET99_LISTEN_PER_WORKER, 2)
+        || !server_out_of_fds()) {
+        return false;
+    }
+
+    /* Datagram servers are refused. */
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .server = true,
+        .datagram = true,
+    };
+    socket99_server_handlers h = { .on_read = server_echo };
+    socket99_result res;
+    return socket99_server_new(&cfg, NULL, &h, NULL, &res) == NULL
+        && res.status == SOCKET99_ERROR_CONFIGURATION;
+}
+
+#define MANY_CONNS 40
+
+bool open_many(void) {
+    int v_true = 1;
+    socket99_config cfg = {
+        .host = "127.0.0.1",
+        .port = port,
+        .server = true,
+        .sockopts = {
+            {SO_REUSEADDR, &v_true, sizeof(v_true)},
+        },
+    };
+    socket99_result server;
+    if (!socket99_open(&cfg, &server)) {
+        socket99_fprintf(stderr, &server);
+        return false;
+    }
+
+    /* TCP clients, one to a port with nothing listening, and a UDP
+     * client, which opens right away. */
+    socket99_config cfgs[MANY_CONNS + 2];
+    socket99_result res[MANY_CONNS + 2];
+    for (int i = 0; i < MANY_CONNS; i++) {
+        socket99_config c = { .host = "127.0.0.1", .port = port };
+        cfgs[i] = c;
+    }
+    socket99_config refused = { .host = "127.0.0.1", .port = port + 1 };
+    socket99_config udp = {
+        .host = "127.0.0.1",
+        .port = port,
+        .datagram = true,
+    };
+    cfgs[MANY_CONNS] = refused;
+    cfgs[MANY_CONNS + 1] = udp;
+
+    socket99_open_many_config mcfg = { .max_in_flight = 8 };
+    size_t opened = socket99_open_many(cfgs, res, MANY_CONNS + 2, &mcfg);
+    bool pass = opened == MANY_CONNS + 1
+        && res[MANY_CONNS].status == SOCKET99_ERROR_CONNECT
+        && res[MANY_CONNS].saved_errno == ECONNREFUSED
+        && res[MANY_CONNS + 1].status == SOCKET99_OK;
+    for (int i = 0; i < MANY_CONNS + 2; i++) {
+        if (i != MANY_CONNS) {
+            pass = pass && res[i].status == SOCKET99_OK && res[i].fd != -1;
+        }
+        if (res[i].status == SOCKET99_OK) { close(res[i].fd); }
+    }
+    printf("opened %zu of %d\n", opened, MANY_CONNS + 2);
+
+    /* Names are looked up off the calling thread; one that doesn't
+     * resolve fails on its own without holding up the rest. */
+    socket99_config named_cfgs[8];
+    socket99_result named_res[8];
+    char *names[] = { "localhost", "nonexistent.invalid" };
+    for (int i = 0; i < 8; i++) {
+        socket99_config c = {
+            .host = names[i == 3],
+            .port = port,
+            .IPv4 = i == 5 ? "127.0.0.1" : NULL,
+        };
+        named_cfgs[i] = c;
+    }
+    mcfg.deadline_msec = 5000;
+    size_t named = pass ? socket99_open_many(named_cfgs, named_res, 8, &mcfg) : 0;
+    for (int i = 0; pass && i < 8; i++) {
+        if (i != 3) { pass = named_res[i].status == SOCKET99_OK; }
+        if (named_res[i].status == SOCKET99_OK) { close(named_res[i].fd); }
+    }
+    printf("by name: opened %zu of 8, unresolvable status %d\n", named,
+        named_res[3].status);
+    pass = pass && named == 7 && (named_res[3].status == SOCKET99_ERROR_GETADDRINFO
+        || (named_res[3].status == SOCKET99_ERROR_CONNECT
+            && named_res[3].saved_errno == ETIMEDOUT));
+    mcfg.deadline_msec = 0;
+    close(server.fd);
+    if (!pass) { return false; }
+
+    /* With the accept queue full, SYNs are dropped, so those opens
+     * run out of time. */
+    cfg.backlog_size = 1;
+    if (!socket99_open(&cfg, &server)) {
+        socket99_fprintf(stderr, &server);
+        return false;
+    }
+    mcfg.deadline_msec = 200;
+    opened = socket99_open_many(cfgs, res, 8, &mcfg);
+    int timed_out = 0;
+    for (int i = 0; i < 8; i++) {
+        if (res[i].status == SOCKET99_OK) {
+            close(res[i].fd);
+        } else if (res[i].status == SOCKET99_ERROR_CONNECT
+            && res[i].saved_errno == ETIMEDOUT) {
+            timed_out++;
+        }
+    }
+    close(server.fd);
+    printf("with a full accept queue: opened %zu, timed out %d\n",
+        opened, timed_out);
+    return opened > 0 && timed_out > 0 && (size_t)timed_out + opened == 8;
+}
+
+#define SHM_ROUNDS 200
+#define SHM_CHUNK 1000
+
+/* Accept a channel on the socket in ARG and echo until the peer goes
+ * away. Returns ARG if all went well. */
+static void *shm_echo(void *arg) {
+    int sock = *(int *)arg;
+    socket99_shm *s = socket99_shm_accept(sock, NULL);
+    if (s == NULL) { return NULL; }
+    char buf[SHM_CHUNK];
+    ssize_t got;
+    bool ok = true;
+    while (ok && (got = socket99_shm_recv(s, buf, sizeof(buf))) > 0) {
+        ok = socket99_shm_send(s, buf, (size_t)got) == got;
+    }
+    socket99_shm_free(s);
+    return ok && got == 0 ? arg : NULL;
+}
+
+/* Stand in for the accepting end on PEER, by hand, and overwrite the
+ * offering end's incoming head index with one past the ring's end. The
+ * reply is queued first, so the offer doesn't wait on it. */
+static bool shm_corrupt_peer(int sock, int peer) {
+    struct {                    /* as in socket99_shm.c */
+        uint32_t magic;
+        uint16_t version;
+        uint16_t ok;
+        uint64_t ring_size;
+    } h = { 0x53393953, 1, 1, 4096 };
+    if (write(peer, &h, sizeof(h)) != sizeof(h)) { return false; }
+    socket99_shm_config cfg = { .ring_size = 4096, .nonblocking = true };
+    socket99_shm *s = socket99_shm_offer(sock, &cfg);
+    if (s == NULL) { return false; }
+
+    struct iovec iov = { .iov_base = &h, .iov_len = sizeof(h) };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    int fds[3] = { -1, -1, -1 };
+    bool pass = recvmsg(peer, &msg, 0) == sizeof(h)
+        && CMSG_FIRSTHDR(&msg) != NULL;
+    if (pass) { memcpy(fds, CMSG_DATA(CMSG_FIRSTHDR(&msg)), sizeof(fds)); }
+
+    /* The memfd's size is sealed. */
+    size_t map_size = 2 * (4096 + 4096);
+    pass = pass && ftruncate(fds[0], 0) == -1 && errno == EPERM;
+    char *map = pass ? mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED, fds[0], 0) : MAP_FAILED;
+    pass = map != MAP_FAILED;
+
+    /* Ring 1 carries data to the offering end; head comes first. */
+    char buf[16];
+    if (pass) { *(uint64_t *)(map + 4096 + 4096) = 4097; }
+    pass = pass && socket99_shm_recv(s, buf, sizeof(buf)) == -1
+        && errno == EPROTO;
+    pass = pass && socket99_shm_send(s, "x", 1) == -1 && errno == EPROTO;
+    printf("corrupt ring: recv and send %s with EPROTO\n",
+        pass ? "refused" : "not refused");
+
+    if (map != MAP_FAILED) { munmap(map, map_size); }
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] != -1) { close(fds[i]); }
+    }
+    socket99_shm_free(s);
+    return pass;
+}
+
+bool shm_channel(void) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) { return false; }
+    pthread_t echo;
+    if (pthread_create(&echo, NULL, shm_echo, &sv[1])) {
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+
+    /* A small ring, so chunks wrap around it. */
+    socket99_shm_config cfg = { .ring_size = 4096 };
+    socket99_shm *s = socket99_shm_offer(sv[0], &cfg);
+    bool pass = s != NULL;
+    char out[SHM_CHUNK], in[SHM_CHUNK];
+    for (int r = 0; pass && r < SHM_ROUNDS; r++) {
+        for (int i = 0; i < SHM_CHUNK; i++) { out[i] = (char)(r + i); }
+        pass = socket99_shm_send(s, out, sizeof(out)) == sizeof(out);
+        size_t got = 0;
+        while (pass && got < sizeof(in)) {
+            ssize_t res = socket99_shm_recv(s, in + got, sizeof(in) - got);
+            pass = res > 0;
+            if (res > 0) { got += (size_t)res; }
+        }
+        pass = pass && 0 == memcmp(in, out, sizeof(out));
+    }
+
+    socket99_shm_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    socket99_shm_get_stats(s, &stats);
+    printf("sent %llu, received %llu, spins %llu, sleeps %llu\n",
+        (unsigned long long)stats.sent, (unsigned long long)stats.received,
+        (unsigned long long)stats.spins, (unsigned long long)stats.sleeps);
+    pass = pass && stats.sent == SHM_ROUNDS * SHM_CHUNK
+        && stats.received == SHM_ROUNDS * SHM_CHUNK;
+
+    /* Closing this end ends the echo loop. */
+    socket99_shm_free(s);
+    void *res = NULL;
+    pthread_join(echo, &res);
+    pass = pass && res == &sv[1];
+
+    /* An offer that isn't one is refused. */
+    char junk[16] = "not an offer...";
+    pass = pass && write(sv[0], junk, sizeof(junk)) == sizeof(junk)
+        && socket99_shm_accept(sv[1], NULL) == NULL && errno == EPROTO;
+
+    /* Neither does a ring whose indices are out of range. */
+    close(sv[0]);
+    close(sv[1]);
+    if (pass && socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+        return false;
+    }
+    if (pass) {
+        pass = shm_corrupt_peer(sv[0], sv[1]);
+        close(sv[0]);
+        close(sv[1]);
+    }
+    return pass;
+}